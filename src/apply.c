@@ -0,0 +1,788 @@
+#define _GNU_SOURCE
+
+#include "apply.h"
+#include "pcimage.h"
+#include "rawimage.h"
+#include "pagecache.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+/* Flush the target and update the journal after this much data */
+#define JOURNAL_INTERVAL_BYTES  (1024ULL * 1024 * 1024)
+
+/* Refuse to buffer checksum groups larger than this */
+#define MAX_GROUP_BYTES         (256ULL * 1024 * 1024)
+
+/* Blocks per write batch when the image carries no checksums */
+#define UNCHECKED_BATCH_BLOCKS  256
+
+/* -------------------------------------------------------------
+ * Buffered input over the decompressor's stdout
+ * ------------------------------------------------------------- */
+typedef struct {
+    int fd;
+    unsigned char *buf;
+    size_t size;
+    size_t len;
+    size_t pos;
+    uint64_t offset;     /* stream bytes consumed by the parser */
+} StreamIn;
+
+static bool stream_read(StreamIn *s, void *dst, size_t n)
+{
+    unsigned char *out = dst;
+
+    while (n > 0) {
+        if (s->pos == s->len) {
+            ssize_t r = read(s->fd, s->buf, s->size);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            if (r == 0)
+                return false;   /* truncated stream */
+            s->len = (size_t)r;
+            s->pos = 0;
+        }
+
+        size_t take = s->len - s->pos;
+        if (take > n)
+            take = n;
+
+        memcpy(out, s->buf + s->pos, take);
+        s->pos += take;
+        s->offset += take;
+        out += take;
+        n -= take;
+    }
+
+    return true;
+}
+
+static bool pwrite_all(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        off += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------------------------
+ * Write a batch of blocks, coalescing contiguous block numbers
+ * into single writes.  Blocks before `first` are skipped.
+ * ------------------------------------------------------------- */
+static bool write_batch(int dev_fd, const unsigned char *buf,
+                        const uint64_t *blocks, uint32_t count,
+                        uint32_t first, uint32_t block_size)
+{
+    uint32_t i = first;
+
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run)
+            run++;
+
+        if (!pwrite_all(dev_fd,
+                        buf + (size_t)i * block_size,
+                        (size_t)run * block_size,
+                        (off_t)(blocks[i] * block_size)))
+            return false;
+
+        i += run;
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Continue the stream at `offset` through opt->seek; whatever is
+ * still buffered from the old descriptor is dropped.
+ * ------------------------------------------------------------- */
+static bool stream_seek(StreamIn *s, const ApplyOptions *opt, uint64_t offset)
+{
+    int fd;
+
+    if (!opt->seek || offset <= s->offset || !opt->seek(opt->seek_ctx, offset, &fd))
+        return false;
+
+    fprintf(stderr,
+            YELLOW "Decoding from the frame index at %.1f MB of the stream "
+            "instead of from its start.\n" RESET,
+            (double)offset / (1024.0 * 1024.0));
+
+    s->fd = fd;
+    s->len = 0;
+    s->pos = 0;
+    s->offset = offset;
+    return true;
+}
+
+/* First block at or after the n-th used block (0-based) */
+static uint64_t nth_used_block(const unsigned char *bitmap, uint64_t total_blocks, uint64_t n)
+{
+    uint64_t block = 0;
+    uint64_t seen = 0;
+
+    while (block + 8 <= total_blocks && (block & 7) == 0) {
+        uint64_t bits = (uint64_t)__builtin_popcount(bitmap[block >> 3]);
+        if (seen + bits > n)
+            break;
+        seen += bits;
+        block += 8;
+    }
+
+    for (; block < total_blocks; block++) {
+        if (!pc_test_bit(bitmap, block))
+            continue;
+        if (seen == n)
+            break;
+        seen++;
+    }
+
+    return block;
+}
+
+ApplyResult apply_partclone_stream(int in_fd, const ApplyOptions *opt)
+{
+    StreamIn in = { in_fd, NULL, 4 * 1024 * 1024, 0, 0, 0 };
+    unsigned char *bitmap = NULL;
+    unsigned char *data = NULL;
+    uint64_t *blocks = NULL;
+    int dev_fd = -1;
+    CacheWindow cache;
+    ApplyResult result = APPLY_FAILED;
+
+    in.buf = malloc(in.size);
+    if (!in.buf)
+        return APPLY_FAILED;
+
+    /* ---------------------------------------------------------
+     * 1. Image descriptor
+     * --------------------------------------------------------- */
+    unsigned char raw[PC_HEADER_SIZE];
+    if (!stream_read(&in, raw, sizeof(raw))) {
+        fprintf(stderr, RED "ERROR:" WHITE " image stream ended before the partclone header.\n" RESET);
+        goto out;
+    }
+
+    PcHeader h;
+    char why[128];
+    if (!pc_parse_header(raw, &h, why, sizeof(why))) {
+        fprintf(stderr, YELLOW "Native restore not available (%s).\n" RESET, why);
+        result = APPLY_FALLBACK;
+        goto out;
+    }
+
+    /* ---------------------------------------------------------
+     * 2. Bitmap
+     * --------------------------------------------------------- */
+    uint64_t bitmap_len = pc_bitmap_bytes(h.total_blocks);
+    bitmap = malloc(bitmap_len);
+    if (!bitmap) {
+        fprintf(stderr, YELLOW "Native restore not available (bitmap too large).\n" RESET);
+        result = APPLY_FALLBACK;
+        goto out;
+    }
+
+    unsigned char crc_raw[4];
+    if (!stream_read(&in, bitmap, bitmap_len) || !stream_read(&in, crc_raw, 4)) {
+        fprintf(stderr, RED "ERROR:" WHITE " image stream ended inside the block bitmap.\n" RESET);
+        goto out;
+    }
+
+    uint32_t bitmap_crc = get_le32(crc_raw);
+    if (pc_crc32(0, bitmap, bitmap_len) != bitmap_crc) {
+        fprintf(stderr, RED "ERROR:" WHITE " checksum mismatch in the block bitmap.\n"
+                "       The image is corrupt.\n" RESET);
+        goto out;
+    }
+
+    if (pc_bitmap_count(bitmap, h.total_blocks) != h.used_blocks) {
+        fprintf(stderr, YELLOW "Native restore not available (bitmap does not match used block count).\n" RESET);
+        result = APPLY_FALLBACK;
+        goto out;
+    }
+
+    uint32_t group = pc_group_blocks(&h);
+    uint32_t batch = group ? group : UNCHECKED_BATCH_BLOCKS;
+
+    if ((uint64_t)batch * h.block_size > MAX_GROUP_BYTES) {
+        fprintf(stderr, YELLOW "Native restore not available (checksum groups too large).\n" RESET);
+        result = APPLY_FALLBACK;
+        goto out;
+    }
+
+    /* ---------------------------------------------------------
+     * 3. Resume point
+     *
+     * Restart at the checksum-group boundary at or before the
+     * journaled position: a group is the smallest unit whose
+     * integrity can be checked on its own.
+     * --------------------------------------------------------- */
+    uint64_t skip_used = 0;
+
+    if (opt->resume) {
+        const RestoreJournal *j = opt->resume;
+
+        if (j->total_blocks != h.total_blocks ||
+            j->used_blocks != h.used_blocks ||
+            j->block_size != h.block_size ||
+            j->bitmap_crc != bitmap_crc) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " the restore journal was written for a different image.\n"
+                    "       Remove %s to start over.\n" RESET,
+                    opt->journal_path ? opt->journal_path : "the journal");
+            goto out;
+        }
+
+        skip_used = j->used_blocks_done;
+        if (group)
+            skip_used -= skip_used % group;
+        if (skip_used > h.used_blocks)
+            skip_used = h.used_blocks;
+
+        fprintf(stderr,
+                YELLOW "Resuming restore at used block %" PRIu64 " of %" PRIu64 " (%.1f%%).\n" RESET,
+                skip_used, h.used_blocks,
+                h.used_blocks ? 100.0 * (double)skip_used / (double)h.used_blocks : 100.0);
+    }
+
+    /* ---------------------------------------------------------
+     * 4. Open target
+     * --------------------------------------------------------- */
+    dev_fd = open(opt->device, O_WRONLY | O_CLOEXEC);
+    if (dev_fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open %s for writing: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+    cache_window_init(&cache, dev_fd, 0);
+
+    data = malloc((size_t)batch * h.block_size);
+    blocks = malloc((size_t)batch * sizeof(*blocks));
+    if (!data || !blocks)
+        goto out;
+
+    RestoreJournal jr;
+    memset(&jr, 0, sizeof(jr));
+    snprintf(jr.device, sizeof(jr.device), "%s", opt->device);
+    jr.total_blocks = h.total_blocks;
+    jr.used_blocks = h.used_blocks;
+    jr.block_size = h.block_size;
+    jr.bitmap_crc = bitmap_crc;
+
+    bool journaling = (opt->journal_path != NULL);
+
+    fprintf(stderr,
+            YELLOW "Native restore: %s, %" PRIu64 " of %" PRIu64 " blocks used, %u bytes per block\n" RESET,
+            h.fs, h.used_blocks, h.total_blocks, h.block_size);
+
+    /* ---------------------------------------------------------
+     * 5. Block data
+     * --------------------------------------------------------- */
+    uint64_t block = 0;
+    uint64_t used_seen = 0;
+    uint64_t unsynced = 0;
+    uint32_t crc = PC_DATA_CRC_SEED;
+    double t_start = now_sec();
+    double t_report = 0.0;
+
+    /* Groups that stand alone need nothing decoded before the resume
+     * point; chained checksums have to be recomputed from the start */
+    if (skip_used > 0 && (group == 0 || h.reseed_checksum)) {
+        uint64_t group_bytes = group ? (uint64_t)group * h.block_size + 4 : h.block_size;
+        uint64_t groups = group ? skip_used / group : skip_used;
+
+        if (stream_seek(&in, opt, in.offset + groups * group_bytes)) {
+            used_seen = skip_used;
+            block = nth_used_block(bitmap, h.total_blocks, skip_used);
+        }
+    }
+
+    while (used_seen < h.used_blocks) {
+        uint64_t group_start_offset = in.offset;
+        uint32_t n = 0;
+
+        while (n < batch && used_seen + n < h.used_blocks) {
+            while (block < h.total_blocks && !pc_test_bit(bitmap, block))
+                block++;
+
+            if (block >= h.total_blocks) {
+                fprintf(stderr, RED "ERROR:" WHITE " bitmap ended before all used blocks were read.\n" RESET);
+                goto out;
+            }
+
+            blocks[n] = block;
+            if (!stream_read(&in, data + (size_t)n * h.block_size, h.block_size)) {
+                fprintf(stderr, RED "\nERROR:" WHITE " image stream ended at block %" PRIu64 ".\n" RESET, block);
+                goto out;
+            }
+
+            n++;
+            block++;
+        }
+
+        /* Whole batch already on the target from a previous run? */
+        bool skip = (used_seen + n <= skip_used);
+
+        if (group) {
+            unsigned char cs[4];
+            if (!stream_read(&in, cs, 4)) {
+                fprintf(stderr, RED "\nERROR:" WHITE " image stream ended inside a checksum.\n" RESET);
+                goto out;
+            }
+
+            /* With reseeding every group stands alone, so skipped
+             * groups need not be hashed at all. */
+            if (!skip || !h.reseed_checksum) {
+                crc = pc_crc32(crc, data, (size_t)n * h.block_size);
+
+                if (!skip && crc != get_le32(cs)) {
+                    fprintf(stderr,
+                            RED "\nERROR:" WHITE " checksum mismatch in block group at stream offset %" PRIu64 ".\n"
+                            "       The image is corrupt.\n" RESET,
+                            group_start_offset);
+                    goto out;
+                }
+            }
+
+            if (h.reseed_checksum)
+                crc = PC_DATA_CRC_SEED;
+        }
+
+        if (!skip) {
+            uint32_t first = 0;
+            if (skip_used > used_seen)
+                first = (uint32_t)(skip_used - used_seen);
+
+            if (!write_batch(dev_fd, data, blocks, n, first, h.block_size)) {
+                fprintf(stderr, RED "\nERROR:" WHITE " write to %s failed: %s\n" RESET,
+                        opt->device, strerror(errno));
+                goto out;
+            }
+
+            unsynced += (uint64_t)(n - first) * h.block_size;
+
+            if (opt->drop_cache && first < n)
+                cache_window_wrote(&cache, (off_t)((blocks[n - 1] + 1) * h.block_size));
+        }
+
+        used_seen += n;
+
+        /* Flush + journal: only flushed data is recorded as done */
+        if (journaling && unsynced >= JOURNAL_INTERVAL_BYTES) {
+            if (fdatasync(dev_fd) != 0) {
+                fprintf(stderr, RED "\nERROR:" WHITE " flushing %s failed: %s\n" RESET,
+                        opt->device, strerror(errno));
+                goto out;
+            }
+
+            jr.used_blocks_done = used_seen;
+            jr.next_block = block;
+            jr.target_offset = block * h.block_size;
+            jr.stream_offset = in.offset;
+            jr.image_offset = opt->image_position ? opt->image_position(opt->image_ctx) : 0;
+
+            if (!journal_save(opt->journal_path, &jr)) {
+                fprintf(stderr,
+                        YELLOW "\nWARNING: cannot write restore journal %s; this restore cannot be resumed.\n" RESET,
+                        opt->journal_path);
+                journaling = false;
+            }
+            unsynced = 0;
+        }
+
+        double t = now_sec();
+        if (t - t_report >= 1.0 || used_seen == h.used_blocks) {
+            uint64_t fresh = used_seen > skip_used ? used_seen - skip_used : 0;
+            double mb = (double)fresh * h.block_size / (1024.0 * 1024.0);
+            double elapsed = t - t_start;
+            fprintf(stderr, WHITE "\rRestored %.1f%%  (%.2f MB/s) " RESET,
+                    h.used_blocks ? 100.0 * (double)used_seen / (double)h.used_blocks : 100.0,
+                    elapsed > 0.0 ? mb / elapsed : 0.0);
+            t_report = t;
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    if (opt->drop_cache)
+        cache_window_finish(&cache);
+
+    if (fdatasync(dev_fd) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " flushing %s failed: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+
+    if (opt->journal_path)
+        journal_remove(opt->journal_path);
+
+    result = APPLY_OK;
+
+out:
+    if (dev_fd >= 0)
+        close(dev_fd);
+    free(blocks);
+    free(data);
+    free(bitmap);
+    free(in.buf);
+    return result;
+}
+
+/* -------------------------------------------------------------
+ * Raw images
+ * ------------------------------------------------------------- */
+
+/*
+ * Make [off, off + len) read as zeros.  Block devices get
+ * BLKZEROOUT, which unmaps the range where the device supports it;
+ * files get a hole.  Anything else is written out.
+ */
+static bool zero_range(int fd, bool is_blk, uint64_t off, uint64_t len)
+{
+    if (len == 0)
+        return true;
+
+    if (is_blk) {
+        uint64_t range[2] = { off, len };
+        if (ioctl(fd, BLKZEROOUT, range) == 0)
+            return true;
+    } else if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                         (off_t)off, (off_t)len) == 0) {
+        return true;
+    }
+
+    static const unsigned char zeros[64 * 1024];
+
+    while (len > 0) {
+        size_t n = len < sizeof(zeros) ? (size_t)len : sizeof(zeros);
+        if (!pwrite_all(fd, zeros, n, (off_t)off))
+            return false;
+        off += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+ApplyResult apply_raw_stream(int in_fd, const ApplyOptions *opt)
+{
+    StreamIn in = { in_fd, NULL, 4 * 1024 * 1024, 0, 0, 0 };
+    unsigned char *data = NULL;
+    int dev_fd = -1;
+    CacheWindow cache;
+    ApplyResult result = APPLY_FAILED;
+
+    in.buf = malloc(in.size);
+    data = malloc(RAW_MAX_EXTENT_BYTES);
+    if (!in.buf || !data)
+        goto out;
+
+    /* ---------------------------------------------------------
+     * 1. Header
+     * --------------------------------------------------------- */
+    unsigned char raw[RAW_HEADER_SIZE];
+    if (!stream_read(&in, raw, sizeof(raw))) {
+        fprintf(stderr, RED "ERROR:" WHITE " image stream ended before the raw image header.\n" RESET);
+        goto out;
+    }
+
+    RawHeader h;
+    char why[128];
+    if (!raw_parse_header(raw, &h, why, sizeof(why))) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s.\n" RESET, why);
+        goto out;
+    }
+
+    /* ---------------------------------------------------------
+     * 2. Resume point: everything before next_block is on the
+     *    target already
+     * --------------------------------------------------------- */
+    uint64_t resume_block = 0;
+
+    if (opt->resume) {
+        const RestoreJournal *j = opt->resume;
+
+        if (j->total_blocks != h.total_blocks ||
+            j->block_size != h.block_size ||
+            j->bitmap_crc != h.header_crc) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " the restore journal was written for a different image.\n"
+                    "       Remove %s to start over.\n" RESET,
+                    opt->journal_path ? opt->journal_path : "the journal");
+            goto out;
+        }
+
+        resume_block = j->next_block;
+
+        fprintf(stderr,
+                YELLOW "Resuming restore at block %" PRIu64 " of %" PRIu64 " (%.1f%%).\n" RESET,
+                resume_block, h.total_blocks,
+                h.total_blocks ? 100.0 * (double)resume_block / (double)h.total_blocks : 100.0);
+    }
+
+    /* ---------------------------------------------------------
+     * 3. Target
+     * --------------------------------------------------------- */
+    dev_fd = open(opt->device, O_WRONLY | O_CLOEXEC);
+    if (dev_fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open %s for writing: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+    cache_window_init(&cache, dev_fd, 0);
+
+    struct stat st;
+    if (fstat(dev_fd, &st) != 0)
+        goto out;
+
+    bool is_blk = S_ISBLK(st.st_mode);
+    uint64_t target_size = (uint64_t)st.st_size;
+
+    if (is_blk && ioctl(dev_fd, BLKGETSIZE64, &target_size) != 0)
+        target_size = 0;
+
+    if (is_blk && target_size < h.device_size) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s is smaller than the imaged device.\n" RESET,
+                opt->device);
+        goto out;
+    }
+
+    /* File targets get their final size up front so holes can be punched */
+    if (S_ISREG(st.st_mode) && target_size < h.device_size &&
+        ftruncate(dev_fd, (off_t)h.device_size) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot resize %s: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+
+    RestoreJournal jr;
+    memset(&jr, 0, sizeof(jr));
+    snprintf(jr.device, sizeof(jr.device), "%s", opt->device);
+    jr.total_blocks = h.total_blocks;
+    jr.block_size = h.block_size;
+    jr.bitmap_crc = h.header_crc;
+
+    bool journaling = (opt->journal_path != NULL);
+
+    bool delta = (h.flags & RAW_FLAG_DELTA) != 0;
+
+    fprintf(stderr,
+            YELLOW "Native restore: %s, %" PRIu64 " blocks, %u bytes per block\n" RESET,
+            delta ? "incremental raw image" : "raw image",
+            h.total_blocks, h.block_size);
+
+    /* ---------------------------------------------------------
+     * 4. Extents; the gaps between them are zeroed
+     * --------------------------------------------------------- */
+    uint64_t cursor = 0;          /* blocks before this are final */
+    uint64_t extents = 0;
+    uint64_t data_blocks = 0;
+    uint64_t unsynced = 0;
+    double t_start = now_sec();
+    double t_report = 0.0;
+
+    /* The journal points at a record boundary; older journals do not
+     * count extents, which the trailer check needs */
+    if (opt->resume && opt->resume->extents_done > 0 &&
+        stream_seek(&in, opt, opt->resume->stream_offset)) {
+        cursor = opt->resume->next_block;
+        extents = opt->resume->extents_done;
+        data_blocks = opt->resume->used_blocks_done;
+    }
+
+    for (;;) {
+        unsigned char rec[RAW_RECORD_SIZE];
+        if (!stream_read(&in, rec, sizeof(rec))) {
+            fprintf(stderr, RED "\nERROR:" WHITE " image stream ended at block %" PRIu64 ".\n" RESET, cursor);
+            goto out;
+        }
+
+        uint32_t tag = get_le32(rec);
+        uint32_t count = get_le32(rec + 4);
+        uint64_t first = (uint64_t)get_le32(rec + 8) | ((uint64_t)get_le32(rec + 12) << 32);
+
+        uint64_t end;
+
+        if (tag == RAW_TAG_DATA) {
+            if (count == 0 || (uint64_t)count * h.block_size > RAW_MAX_EXTENT_BYTES ||
+                first < cursor || first + count > h.total_blocks) {
+                fprintf(stderr, RED "\nERROR:" WHITE " invalid extent at block %" PRIu64 ".\n" RESET, first);
+                goto out;
+            }
+
+            size_t len = (size_t)count * h.block_size;
+            unsigned char cs[4];
+
+            if (!stream_read(&in, data, len) || !stream_read(&in, cs, 4)) {
+                fprintf(stderr, RED "\nERROR:" WHITE " image stream ended at block %" PRIu64 ".\n" RESET, first);
+                goto out;
+            }
+
+            if (pc_crc32(PC_DATA_CRC_SEED, data, len) != get_le32(cs)) {
+                fprintf(stderr,
+                        RED "\nERROR:" WHITE " checksum mismatch in extent at block %" PRIu64 ".\n"
+                        "       The image is corrupt.\n" RESET,
+                        first);
+                goto out;
+            }
+
+            end = first;
+        } else if (tag == RAW_TAG_END) {
+            unsigned char cs[4];
+            if (!stream_read(&in, cs, 4) || pc_crc32(0, rec, sizeof(rec)) != get_le32(cs) ||
+                count != (uint32_t)extents || first != data_blocks) {
+                fprintf(stderr, RED "\nERROR:" WHITE " raw image trailer is damaged.\n" RESET);
+                goto out;
+            }
+
+            end = h.total_blocks;
+        } else {
+            fprintf(stderr, RED "\nERROR:" WHITE " unknown record in raw image.\n" RESET);
+            goto out;
+        }
+
+        /* Zero the gap before this extent (or up to the end);
+         * a delta image leaves gaps as the parent restore wrote them */
+        uint64_t gap_start = cursor > resume_block ? cursor : resume_block;
+        if (!delta && end > gap_start) {
+            uint64_t off = gap_start * h.block_size;
+            uint64_t stop = end * h.block_size;
+            if (stop > h.device_size)
+                stop = h.device_size;
+
+            if (stop > off && !zero_range(dev_fd, is_blk, off, stop - off)) {
+                fprintf(stderr, RED "\nERROR:" WHITE " zeroing %s failed: %s\n" RESET,
+                        opt->device, strerror(errno));
+                goto out;
+            }
+            unsynced += stop > off ? stop - off : 0;
+        }
+
+        if (tag == RAW_TAG_END)
+            break;
+
+        /* Extent data, unless a previous run already wrote it */
+        if (first + count > resume_block) {
+            uint64_t skip = resume_block > first ? resume_block - first : 0;
+
+            if (!pwrite_all(dev_fd,
+                            data + skip * h.block_size,
+                            (size_t)(count - skip) * h.block_size,
+                            (off_t)((first + skip) * h.block_size))) {
+                fprintf(stderr, RED "\nERROR:" WHITE " write to %s failed: %s\n" RESET,
+                        opt->device, strerror(errno));
+                goto out;
+            }
+            unsynced += (count - skip) * (uint64_t)h.block_size;
+
+            if (opt->drop_cache)
+                cache_window_wrote(&cache, (off_t)((first + count) * h.block_size));
+        }
+
+        cursor = first + count;
+        extents++;
+        data_blocks += count;
+
+        /* Flush + journal: only flushed data is recorded as done */
+        if (journaling && unsynced >= JOURNAL_INTERVAL_BYTES) {
+            if (fdatasync(dev_fd) != 0) {
+                fprintf(stderr, RED "\nERROR:" WHITE " flushing %s failed: %s\n" RESET,
+                        opt->device, strerror(errno));
+                goto out;
+            }
+
+            jr.used_blocks_done = data_blocks;
+            jr.extents_done = cursor >= resume_block ? extents : 0;   /* next_block == cursor */
+            jr.next_block = cursor > resume_block ? cursor : resume_block;
+            jr.target_offset = jr.next_block * h.block_size;
+            jr.stream_offset = in.offset;
+            jr.image_offset = opt->image_position ? opt->image_position(opt->image_ctx) : 0;
+
+            if (!journal_save(opt->journal_path, &jr)) {
+                fprintf(stderr,
+                        YELLOW "\nWARNING: cannot write restore journal %s; this restore cannot be resumed.\n" RESET,
+                        opt->journal_path);
+                journaling = false;
+            }
+            unsynced = 0;
+        }
+
+        double t = now_sec();
+        if (t - t_report >= 1.0) {
+            double elapsed = t - t_start;
+            fprintf(stderr, WHITE "\rRestored %.1f%%  (%.2f MB/s) " RESET,
+                    100.0 * (double)cursor / (double)h.total_blocks,
+                    elapsed > 0.0 ? (double)cursor * h.block_size / (1024.0 * 1024.0) / elapsed : 0.0);
+            t_report = t;
+        }
+    }
+
+    fprintf(stderr, WHITE "\rRestored 100.0%%, %" PRIu64 " extents, %.2f MB of data\n" RESET,
+            extents, (double)data_blocks * h.block_size / (1024.0 * 1024.0));
+
+    /* A padded final block may have written past the end of a file target */
+    if (S_ISREG(st.st_mode) && (uint64_t)st.st_size <= h.device_size &&
+        ftruncate(dev_fd, (off_t)h.device_size) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot resize %s: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+
+    if (opt->drop_cache)
+        cache_window_finish(&cache);
+
+    if (fdatasync(dev_fd) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " flushing %s failed: %s\n" RESET,
+                opt->device, strerror(errno));
+        goto out;
+    }
+
+    if (opt->journal_path)
+        journal_remove(opt->journal_path);
+
+    result = APPLY_OK;
+
+out:
+    if (dev_fd >= 0)
+        close(dev_fd);
+    free(data);
+    free(in.buf);
+    return result;
+}
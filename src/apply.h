@@ -0,0 +1,67 @@
+#ifndef APPLY_H
+#define APPLY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "journal.h"
+
+/*
+ * Native image applier.
+ *
+ * Reads a decompressed partclone (v2) stream from a file descriptor and
+ * writes the used blocks straight to the target device, verifying each
+ * checksum group before it is written.  Because Imprint knows exactly
+ * which block it is writing, it can journal flushed progress and skip
+ * already-restored groups when a restore is resumed.
+ *
+ * Anything Imprint does not understand natively is reported as
+ * APPLY_FALLBACK *before* a single byte reaches the target, so the
+ * caller can fall back to the partclone restore pipeline.  A checksum
+ * that does not match is corruption, not an unknown format: the restore
+ * fails (APPLY_FAILED) rather than being handed to partclone.
+ */
+
+typedef enum {
+    APPLY_OK,
+    APPLY_FALLBACK,    /* not handled natively; target untouched */
+    APPLY_FAILED
+} ApplyResult;
+
+typedef struct {
+    const char *device;
+
+    /* Journal file to maintain (NULL disables journaling) */
+    const char *journal_path;
+
+    /* Progress to resume from (NULL = restore everything) */
+    const RestoreJournal *resume;
+
+    /* Compressed bytes consumed so far, recorded in the journal */
+    unsigned long long (*image_position)(void *ctx);
+    void *image_ctx;
+
+    /* Keep what is written out of the page cache (see pagecache.h) */
+    bool drop_cache;
+
+    /*
+     * On resume, restart the stream at decompressed offset `offset`
+     * (a checksum-group boundary) instead of decoding everything
+     * before it: on success *fd reads the stream from there on and
+     * in_fd is no longer read.  NULL, or false for an image without a
+     * frame index, keeps decoding from the beginning.
+     */
+    bool (*seek)(void *ctx, uint64_t offset, int *fd);
+    void *seek_ctx;
+} ApplyOptions;
+
+ApplyResult apply_partclone_stream(int in_fd, const ApplyOptions *opt);
+
+/*
+ * Same for Imprint raw images (see rawimage.h).  Gaps between the
+ * stored extents are zeroed, so the whole target is rewritten, except
+ * for delta images, which only write their extents.
+ * There is no partclone fallback: any problem is APPLY_FAILED.
+ */
+ApplyResult apply_raw_stream(int in_fd, const ApplyOptions *opt);
+
+#endif /* APPLY_H */
@@ -5,8 +5,21 @@
 #include "ui.h"
 #include "colors.h"
 #include "config.h"
+#include "frameidx.h"
+#include "imgwriter.h"
+#include "diskset.h"
+#include "rawimage.h"
+#include "cbt.h"
+#include "luks.h"
+#include "snapshot.h"
+#include "rescue.h"
+#include "repo.h"
+#include "s3.h"
+#include "netimg.h"
+#include "pipeimg.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -15,23 +28,63 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
 
 void print_backup_usage(void)
 {
     fprintf(stderr,
             YELLOW "\nUsage:\n"
             WHITE  "  imprintb --source <device> --target <image> [options]\n"
+                   "  imprintb --disk <disk> [--disk <disk> ...] --target <directory> [options]\n"
                    "\n"
             YELLOW "Required arguments:\n"
             WHITE  "  --source <device>       Block device to back up (e.g. /dev/sda3, /dev/mapper/cryptroot)\n"
-                   "  --target <path>         Output image path (without extension)\n"
+                   "  --target <path>         Output image path (without extension), or\n"
+                   "                          repo://<dir>/<name> to store it in a deduplicating repository, or\n"
+                   "                          s3://<bucket>/<prefix> to upload it to S3-compatible storage;\n"
+                   "                          tcp://<host>[:<port>]/<name> to send it to imprint-serve;\n"
+                   "                          - to write it as one stream to stdout (for imprintr --image -);\n"
+                   "                          given again, each further --target gets a copy of the image\n"
+                   "\n"
+            YELLOW "Whole-disk mode:\n"
+            WHITE  "  --disk <disk>           Back up the partition table and every supported partition\n"
+                   "                          of <disk> (repeatable; different disks run concurrently)\n"
+                   "  --target <directory>    Directory that receives the image set\n"
                    "\n"
             YELLOW "Options:\n"
             WHITE  "  --compress <type>       Compression: lz4, zstd, gzip\n"
                    "  --chunk <MB>            Split output into chunks of <MB> each (0 = no chunking)\n"
                    "  --help                  Show this help message and exit\n"
                    "  --force                 Overwrite existing backup files without confirmation\n"
+                   "  --native                Read ext2/3/4 and NTFS with Imprint's parallel reader instead of\n"
+                   "                          partclone (same image format; see native_threads in config)\n"
+                   "  --cache-neutral         Write the image without filling the page cache, for backups of\n"
+                   "                          a busy system (see cache_neutral in config)\n"
+                   "  --verify-writes         Read every chunk back from the medium while the next ones are\n"
+                   "                          written; a mismatch fails the backup (see verify_writes)\n"
+                   "  --incremental-from <image>\n"
+                   "                          Store only the blocks that changed since <image> was taken\n"
+                   "                          (source: a dm-era device, see --cbt-setup, or a thin LV\n"
+                   "                          snapshot in the same pool as the source of <image>)\n"
+                   "  --ciphertext            For an unlocked LUKS mapper: image the encrypted partition\n"
+                   "                          underneath, copying only blocks the filesystem uses\n"
+                   "  --snapshot              Back up a mounted LVM or device-mapper source from a\n"
+                   "                          short-lived snapshot (see snapshot_cow_percent in config)\n"
+                   "  --rescue                For a failing disk: read the easy parts first, skip past bad\n"
+                   "                          areas and retry them at the end (see rescue_* in config)\n"
+                   "  --reuse-from <image>    On btrfs or XFS: share the compressed frames that are identical\n"
+                   "                          to those of an earlier zstd/lz4 image by reflink instead of\n"
+                   "                          writing them again\n"
+                   "  --stripe <directory>    Spread the chunk files round-robin over the --target directory\n"
+                   "                          and <directory> (repeatable), writing to all of them at once\n"
+                   "\n"
+            YELLOW "Changed-block tracking:\n"
+            WHITE  "  --cbt-setup <device> --cbt-meta <metadata device>\n"
+                   "                          Put a dm-era target over <device> so later backups can be\n"
+                   "                          incremental; repeat after every boot before mounting\n"
                    "\n"
             YELLOW "Positional form (equivalent):\n"
             WHITE  "  imprintb <device> <image>\n"
@@ -40,10 +93,39 @@ void print_backup_usage(void)
             WHITE  "  imprintb --source /dev/sda3 --target /mnt/backup/system\n"
                    "  imprintb --source /dev/mapper/cryptroot --target /mnt/backup/root --compress zstd --chunk 4096\n"
                    "  imprintb /dev/nvme0n1p5 /backup/home\n"
+                   "  imprintb --disk /dev/nvme0n1 --disk /dev/sda --target /mnt/backup/machine\n"
+                   "  imprintb --source /dev/mapper/imprint-era-sda3 --target /mnt/backup/mon \\\n"
+                   "           --incremental-from /mnt/backup/sun.img.zst\n"
+                   "  imprintb --source /dev/sda3 --target repo:///mnt/backup/repo/laptop-2026-10-19\n"
+                   "  imprintb --source /dev/sda3 --target /mnt/btrfs/mon --reuse-from /mnt/btrfs/sun.img.zst\n"
+                   "  imprintb --source /dev/sda3 --target /mnt/usb/system --target /mnt/nas/system\n"
+                   "  imprintb --source /dev/sda3 --target /mnt/usb1/system --stripe /mnt/usb2 --chunk 256\n"
+                   "  imprintb --source /dev/sda3 --target s3://backups/laptop/system --compress zstd\n"
+                   "  imprintb --source /dev/sda3 --target tcp://backupserver/laptop/system --compress zstd\n"
+                   "  imprintb --source /dev/sda3 --target - --compress zstd | ssh host 'imprintr --image - \\\n"
+                   "           --target /dev/sdb3 --force'\n"
                    "\n"
             YELLOW "Notes:\n"
-            WHITE  "  - The source device must not be mounted.\n"
+            WHITE  "  - The source device must not be mounted, unless --snapshot is given.\n"
                    "  - Encrypted LUKS volumes must be unlocked before use (e.g. via cryptsetup).\n"
+                   "  - Partitions partclone cannot handle (swap, unknown, locked LUKS) are imaged raw;\n"
+                   "    only non-zero blocks are stored, and restore zeroes the rest.\n"
+                   "  - Thin LVs imaged raw read only their provisioned blocks.\n"
+                   "  - --rescue stages the data read in <image>.rescue next to the image; unreadable\n"
+                   "    ranges are listed in the metadata and restore as zeros.\n"
+                   "  - A repo:// target keeps each distinct chunk of data once across all images in the\n"
+                   "    repository (zstd-compressed); --compress and --chunk do not apply to it.\n"
+                   "  - With several --target (zstd or lz4), the stream is compressed once and written to\n"
+                   "    every destination by a thread of its own.  One that fails or stalls is dropped;\n"
+                   "    see mirror_* in config for whether the backup then still succeeds.\n"
+                   "  - A striped image keeps its .json, .sha256 and .idx next to chunk 0; imprintr finds\n"
+                   "    the other chunks through the metadata and reads them from all stripes in parallel.\n"
+                   "  - An s3:// target streams the image into a multipart upload (see s3_* in config); the\n"
+                   "    credentials come from AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY (keep them with\n"
+                   "    sudo -E).  Requests are made by curl, 7.75 or newer.\n"
+                   "  - A tcp:// target streams the image to imprint-serve over net_streams connections\n"
+                   "    (see config), which stores it below its --dir; --chunk applies there.  There is no\n"
+                   "    authentication or encryption, so use it on a trusted network or an SSH tunnel.\n"
                    "  - The target image should not include an extension; Imprint adds one automatically.\n" RESET
     );
 }
@@ -79,6 +161,18 @@ static bool backup_outputs_exist(const char *output_path)
     return false;
 }
 
+/* Old metadata would vouch for a half-written image after a crash */
+static void drop_stale_metadata(const char *output_path)
+{
+    char old_path[PATH_MAX + 8];
+
+    snprintf(old_path, sizeof(old_path), "%s.json", output_path);
+    unlink(old_path);
+
+    snprintf(old_path, sizeof(old_path), "%s.sha256", output_path);
+    unlink(old_path);
+}
+
 
 bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out)
 {
@@ -93,6 +187,20 @@ bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out)
     out->chunk_override_set = false;
 
     out->force = false;   /* NEW */
+    out->native = false;
+    out->cache_neutral = false;
+    out->verify_writes = false;
+    out->incremental_from = NULL;
+    out->cbt_setup = NULL;
+    out->cbt_meta = NULL;
+    out->ciphertext = false;
+    out->snapshot = false;
+    out->rescue = false;
+    out->reuse_from = NULL;
+    out->mirror_count = 0;
+    out->stripe_count = 0;
+
+    out->disk_count = 0;
 
     bool saw_cli_flag = false;
     int positional_count = 0;
@@ -113,13 +221,24 @@ bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out)
 
         if (strcmp(arg, "--target") == 0) {
             saw_cli_flag = true;
-            if (i + 1 < argc) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, RED "ERROR" RESET ": --target requires a value\n");
+                out->parse_error = true;
+                return true;
+            }
+            /* Every further --target receives a copy of the same image */
+            if (!out->target) {
                 out->target = argv[++i];
                 continue;
             }
-            fprintf(stderr, RED "ERROR" RESET ": --target requires a value\n");
-            out->parse_error = true;
-            return true;
+            if (out->mirror_count >= BACKUP_MAX_TARGETS - 1) {
+                fprintf(stderr, RED "ERROR" RESET ": too many --target arguments (max %d)\n",
+                        BACKUP_MAX_TARGETS);
+                out->parse_error = true;
+                return true;
+            }
+            out->mirrors[out->mirror_count++] = argv[++i];
+            continue;
         }
 
         if (strcmp(arg, "--compress") == 0) {
@@ -157,6 +276,97 @@ bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out)
             continue;
         }
 
+        if (strcmp(arg, "--native") == 0) {
+            saw_cli_flag = true;
+            out->native = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--cache-neutral") == 0) {
+            saw_cli_flag = true;
+            out->cache_neutral = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--verify-writes") == 0) {
+            saw_cli_flag = true;
+            out->verify_writes = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--ciphertext") == 0) {
+            saw_cli_flag = true;
+            out->ciphertext = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--snapshot") == 0) {
+            saw_cli_flag = true;
+            out->snapshot = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--rescue") == 0) {
+            saw_cli_flag = true;
+            out->rescue = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--incremental-from") == 0 ||
+            strcmp(arg, "--reuse-from") == 0 ||
+            strcmp(arg, "--cbt-setup") == 0 ||
+            strcmp(arg, "--cbt-meta") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 >= argc) {
+                fprintf(stderr, RED "ERROR" RESET ": %s requires a value\n", arg);
+                out->parse_error = true;
+                return true;
+            }
+            if (strcmp(arg, "--incremental-from") == 0)
+                out->incremental_from = argv[++i];
+            else if (strcmp(arg, "--reuse-from") == 0)
+                out->reuse_from = argv[++i];
+            else if (strcmp(arg, "--cbt-setup") == 0)
+                out->cbt_setup = argv[++i];
+            else
+                out->cbt_meta = argv[++i];
+            continue;
+        }
+
+        if (strcmp(arg, "--disk") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 >= argc) {
+                fprintf(stderr, RED "ERROR" RESET ": --disk requires a value\n");
+                out->parse_error = true;
+                return true;
+            }
+            if (out->disk_count >= BACKUP_MAX_DISKS) {
+                fprintf(stderr, RED "ERROR" RESET ": too many --disk arguments (max %d)\n",
+                        BACKUP_MAX_DISKS);
+                out->parse_error = true;
+                return true;
+            }
+            out->disks[out->disk_count++] = argv[++i];
+            continue;
+        }
+
+        if (strcmp(arg, "--stripe") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 >= argc) {
+                fprintf(stderr, RED "ERROR" RESET ": --stripe requires a value\n");
+                out->parse_error = true;
+                return true;
+            }
+            if (out->stripe_count >= BACKUP_MAX_STRIPES) {
+                fprintf(stderr, RED "ERROR" RESET ": too many --stripe arguments (max %d)\n",
+                        BACKUP_MAX_STRIPES);
+                out->parse_error = true;
+                return true;
+            }
+            out->stripes[out->stripe_count++] = argv[++i];
+            continue;
+        }
+
         /* Positional arguments */
         if (arg[0] != '-') {
             if (positional_count == 0)
@@ -178,6 +388,85 @@ bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out)
         return true;
     }
 
+    /* Changed-block tracking setup: --cbt-setup <dev> --cbt-meta <dev> */
+    if (out->cbt_setup) {
+        if (!out->cbt_meta || out->source || out->target || out->disk_count > 0) {
+            fprintf(stderr, RED "ERROR" RESET ": --cbt-setup takes only --cbt-meta <metadata device>\n");
+            out->parse_error = true;
+            return true;
+        }
+        out->cli_mode = true;
+        return true;
+    }
+
+    if (out->ciphertext && (out->incremental_from || out->disk_count > 0)) {
+        fprintf(stderr, RED "ERROR" RESET ": --ciphertext cannot be combined with --incremental-from or --disk\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->snapshot && (out->incremental_from || out->ciphertext || out->disk_count > 0)) {
+        fprintf(stderr, RED "ERROR" RESET ": --snapshot cannot be combined with --incremental-from, --ciphertext or --disk\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->rescue && (out->incremental_from || out->ciphertext || out->snapshot ||
+                        out->disk_count > 0)) {
+        fprintf(stderr, RED "ERROR" RESET ": --rescue cannot be combined with --incremental-from, --ciphertext, --snapshot or --disk\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->reuse_from && out->disk_count > 0) {
+        fprintf(stderr, RED "ERROR" RESET ": --reuse-from cannot be combined with --disk\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->mirror_count > 0 && (out->disk_count > 0 || out->reuse_from)) {
+        fprintf(stderr, RED "ERROR" RESET ": several --target cannot be combined with --disk or --reuse-from\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->stripe_count > 0 && (out->disk_count > 0 || out->reuse_from || out->mirror_count > 0)) {
+        fprintf(stderr, RED "ERROR" RESET ": --stripe cannot be combined with --disk, --reuse-from or several --target\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->incremental_from && out->disk_count > 0) {
+        fprintf(stderr, RED "ERROR" RESET ": --incremental-from cannot be combined with --disk\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    if (out->disk_count > 0 && out->target &&
+        (strncmp(out->target, REPO_PREFIX, strlen(REPO_PREFIX)) == 0 ||
+         strncmp(out->target, S3_PREFIX, strlen(S3_PREFIX)) == 0 ||
+         strncmp(out->target, NET_PREFIX, strlen(NET_PREFIX)) == 0)) {
+        fprintf(stderr, RED "ERROR" RESET ": --disk cannot write to a repo://, s3:// or tcp:// target\n");
+        out->parse_error = true;
+        return true;
+    }
+
+    /* Whole-disk form: --disk ... --target <dir> */
+    if (out->disk_count > 0) {
+        if (out->source || positional_count > 0) {
+            fprintf(stderr, RED "ERROR" RESET ": --disk cannot be combined with --source\n");
+            out->parse_error = true;
+            return true;
+        }
+        if (!out->target) {
+            fprintf(stderr, RED "ERROR" RESET ": --disk requires --target <directory>\n");
+            out->parse_error = true;
+            return true;
+        }
+        out->cli_mode = true;
+        return true;
+    }
+
     /* CLI flag form */
     if (saw_cli_flag) {
         if (!out->source || !out->target) {
@@ -266,7 +555,8 @@ static const char *partclone_backend_for_fs(const char *fs_type)
 
     /* Add more mappings as needed. */
 
-    return NULL;
+    /* Anything else (swap, unknown, locked LUKS): Imprint's raw imager */
+    return RAW_BACKEND;
 }
 
 
@@ -319,134 +609,623 @@ static char *join_path(const char *dir, const char *filename)
 
 
 
-/* Run partclone + compressor + streaming checksum pipeline. */
-bool run_backup_pipeline(const char *backend,
-                         const char *device,
-                         const char *fs_type,
-                         const char *output_path,
-                         const char *compressor,
-                         int chunk_mb)
+static bool self_exe_path(char *self, size_t len)
 {
-    (void)fs_type;
+    ssize_t n = readlink("/proc/self/exe", self, len - 1);
+    if (n <= 0)
+        return false;
+    self[n] = '\0';
+    return true;
+}
 
-    if (!backend || !device || !output_path)
+/*
+ * Command line of the raw imager: this very binary, run as
+ * `imprintb --raw-stream <device>`, writes the image to stdout
+ * exactly like `partclone -c -s <device>` would.
+ */
+static bool raw_backend_command(const char *device, char *out, size_t out_len)
+{
+    char self[512];
+    if (!self_exe_path(self, sizeof(self)))
         return false;
 
-    uid_t euid = geteuid();
+    int len = snprintf(out, out_len, "'%s' --raw-stream '%s'", self, device);
+    return len > 0 && (size_t)len < out_len;
+}
 
-    /* Require root privileges for partclone */
-    if (euid != 0) {
-        if (gx_no_gui) {
-            ui_error(RED "This operation requires root privileges. Please run Imprint with sudo." RESET);
-            return false;
-        }
-        /* GUI mode: continue; partclone will be wrapped in pkexec below */
-    }
+/*
+ * What the running incremental backup starts from (see cbt.h): the
+ * parent's era for CBT_BACKEND, its thin device id for THIN_BACKEND
+ * (-1: all provisioned blocks).  Set by backup_run_cli().
+ */
+static long long cbt_since = -1;
+
+/*
+ * `imprintb --delta-stream <device> <era>` or
+ * `imprintb --thin-stream <device> [<dev id>]`: the blocks that matter
+ * as a raw image.
+ */
+static bool delta_backend_command(const char *backend, const char *device,
+                                  char *out, size_t out_len)
+{
+    char self[512];
+    if (!self_exe_path(self, sizeof(self)))
+        return false;
 
-    /* Determine compressor command based on effective compressor */
-    const char *comp_cmd = get_compressor_cmd(compressor);
+    int len;
+    if (strcmp(backend, THIN_BACKEND) == 0 && cbt_since < 0)
+        len = snprintf(out, out_len, "'%s' --thin-stream '%s'", self, device);
+    else if (strcmp(backend, THIN_BACKEND) == 0)
+        len = snprintf(out, out_len, "'%s' --thin-stream '%s' %lld", self, device, cbt_since);
+    else if (cbt_since >= 0)
+        len = snprintf(out, out_len, "'%s' --delta-stream '%s' %lld", self, device, cbt_since);
+    else
+        return false;
 
-    fprintf(stderr,
-            YELLOW "Using compressor: %s\n" RESET,
-            comp_cmd);
+    return len > 0 && (size_t)len < out_len;
+}
 
-    if (chunk_mb > 0) {
-        fprintf(stderr,
-                YELLOW "Output chunking: On (%d MB)\n",
-                chunk_mb);
-    } else {
-        fprintf(stderr,
-                YELLOW "Output chunking: Off\n");
-    }
+/* Native reader for the plaintext of a --ciphertext backup ("-": none) */
+static const char *luks_fs = "-";
 
-    /* Build the partclone command */
-    char partclone_cmd[1024];
-    snprintf(partclone_cmd, sizeof(partclone_cmd),
-             "%s -c -s '%s'",
-             backend,
-             device);
+/* `imprintb --luks-stream <mapper> <fs>`: the encrypted partition, used blocks only */
+static bool luks_backend_command(const char *device, char *out, size_t out_len)
+{
+    char self[512];
+    if (!self_exe_path(self, sizeof(self)))
+        return false;
 
-    /* Wrap partclone appropriately */
-    char partclone_wrapper[2048];
+    int len = snprintf(out, out_len, "'%s' --luks-stream '%s' %s", self, device, luks_fs);
+    return len > 0 && (size_t)len < out_len;
+}
 
-    if (euid == 0) {
-        snprintf(partclone_wrapper, sizeof(partclone_wrapper),
-                 "%s",
-                 partclone_cmd);
-    } else {
-        snprintf(partclone_wrapper, sizeof(partclone_wrapper),
-                 "pkexec %s",
-                 partclone_cmd);
-    }
+/* Native reader for the used-block map of a --rescue backup, and its staging file */
+static const char *rescue_fs = "-";
+static char rescue_work[PATH_MAX];
 
-    /* Determine FIFO directory */
-    char fifo_dir[1024];
+/* `imprintb --rescue-stream <device> <fs> <staging> <slow ms> <retries>` */
+static bool rescue_backend_command(const char *device, char *out, size_t out_len)
+{
+    char self[512];
+    if (!self_exe_path(self, sizeof(self)))
+        return false;
 
-    if (gx_workdir_override[0] != '\0') {
-        snprintf(fifo_dir, sizeof(fifo_dir), "%s", gx_workdir_override);
+    int len = snprintf(out, out_len, "'%s' --rescue-stream '%s' %s '%s' %d %d",
+                       self, device, rescue_fs, rescue_work,
+                       gx_config.rescue_slow_ms, gx_config.rescue_retries);
+    return len > 0 && (size_t)len < out_len;
+}
+
+/*
+ * Command line of a native reader (see pcsource.h).  It writes the
+ * same partclone stream as `backend -c -s <device>`, so metadata and
+ * restore are unchanged; it execs partclone itself when the
+ * filesystem uses features it does not handle.
+ */
+static bool native_backend_command(const char *backend, const char *device,
+                                   char *out, size_t out_len)
+{
+    const char *fs;
+    if (strcmp(backend, "partclone.extfs") == 0)
+        fs = "extfs";
+    else if (strcmp(backend, "partclone.ntfs") == 0)
+        fs = "ntfs";
+    else
+        return false;
+
+    if (!gx_config.native_readers)
+        return false;
+
+    char self[512];
+    if (!self_exe_path(self, sizeof(self)))
+        return false;
+
+    int len = snprintf(out, out_len, "'%s' --native-stream %s '%s' %d",
+                       self, fs, device, gx_config.native_threads);
+    return len > 0 && (size_t)len < out_len;
+}
+
+/* Map compression string to an in-process frame format (0 = none) */
+static int get_frame_compression(const char *comp)
+{
+    if (comp && strcmp(comp, "gzip") == 0)
+        return 0;
+
+    if (comp && strcmp(comp, "zstd") == 0)
+        return FRAME_COMP_ZSTD;
+
+    return FRAME_COMP_LZ4;  /* default */
+}
+
+/*
+ * Where one backup goes.  run_cli(), backup_run_interactive() and
+ * backup_disk_partition() each fill one in and hand it down the
+ * pipeline; zeroed, it is a plain local image.
+ */
+struct BackupTarget {
+    /* Earlier image to reflink identical frames from (--reuse-from) */
+    const char *reuse_image;
+
+    /*
+     * Further destinations of the image (several --target) and, after
+     * the run, which copies completed (output_path first).
+     */
+    const char *const *mirror_images;
+    int mirror_image_count;
+    bool *mirror_copy_ok;
+
+    /* Further directories the chunks are striped over (--stripe) */
+    const char *const *stripe_dirs;
+    int stripe_dir_count;
+
+    /* Repository target (see repo.h): repo_dir is empty for others */
+    char repo_dir[PATH_MAX];
+    char repo_name[256];
+    RepoStats repo_stats;
+
+    /*
+     * Remote targets: the image streams into an S3 multipart upload
+     * (see s3.h), to imprint-serve (see netimg.h, net_target set) or to
+     * stdout (see pipeimg.h, pipe_target set); checksum, index and
+     * metadata are staged in remote_staging and sent after it.
+     * remote_staging is empty for other targets.
+     */
+    S3Object s3_image;
+    NetTarget net_image;
+    bool net_target;
+    NetWriter *net_upload;
+    bool pipe_target;
+    PipeWriter *pipe_out;
+    char remote_location[1400];
+    char remote_staging[PATH_MAX];
+    uint64_t remote_bytes;
+};
+
+static bool s3_stream(void *ctx, const void *buf, size_t len)
+{
+    return s3_writer_write(ctx, buf, len);
+}
+
+static bool net_stream(void *ctx, const void *buf, size_t len)
+{
+    return net_writer_write(ctx, buf, len);
+}
+
+static bool pipe_stream(void *ctx, const void *buf, size_t len)
+{
+    BackupTarget *t = ctx;
+
+    t->remote_bytes += len;
+    return pipe_writer_write(t->pipe_out, buf, len);
+}
+
+/*
+ * zstd / lz4: read partclone's output directly and compress it into
+ * independent frames in-process (see imgwriter.h).  The image stays
+ * readable by `zstd -dc` / `lz4 -dc`, and the frame index written
+ * next to it allows random access for instant restore.
+ */
+static bool run_framed_backup(BackupTarget *t,
+                              const char *partclone_cmd,
+                              const char *output_path,
+                              int compression,
+                              int chunk_mb)
+{
+    fprintf(stderr,
+            YELLOW "Starting partclone with in-process %s compression (%d KB frames)...\n" RESET,
+            compression == FRAME_COMP_ZSTD ? "zstd" : "lz4",
+            gx_config.frame_size_kb);
+    fprintf(stderr,
+            GREEN "     %s\n\n" RESET,
+            partclone_cmd);
+
+    S3Writer *upload = NULL;
+    ImageWriter *w;
+
+    if (t->pipe_target) {
+        /* Closed by backup_run_cli(); the metadata still follows */
+        char header[PATH_MAX + 8];
+        snprintf(header, sizeof(header), "%s.json", output_path);
+
+        t->remote_bytes = 0;
+        t->pipe_out = pipe_writer_open(header);
+        w = t->pipe_out ? image_writer_open_stream(output_path, pipe_stream, t,
+                                                   compression, gx_config.frame_size_kb, 0)
+                        : NULL;
+    } else if (t->remote_staging[0] != '\0' && t->net_target) {
+        fprintf(stderr, YELLOW "Sending to %s (%d connections)\n" RESET,
+                t->remote_location, gx_config.net_streams);
+
+        /* Closed by backup_run_cli(); the metadata still follows */
+        t->net_upload = net_writer_open(&t->net_image, gx_config.net_streams, chunk_mb);
+        w = t->net_upload ? image_writer_open_stream(output_path, net_stream, t->net_upload,
+                                                     compression, gx_config.frame_size_kb, 0)
+                          : NULL;
+    } else if (t->remote_staging[0] != '\0') {
+        fprintf(stderr, YELLOW "Uploading to %s (%d MB parts, %d at a time)\n" RESET,
+                t->remote_location, gx_config.s3_part_mb, gx_config.s3_parallel);
+
+        upload = s3_writer_open(&t->s3_image, gx_config.s3_part_mb, gx_config.s3_parallel);
+        w = upload ? image_writer_open_stream(output_path, s3_stream, upload,
+                                              compression, gx_config.frame_size_kb, 0)
+                   : NULL;
+        if (!w)
+            s3_writer_close(upload, false, NULL);
     } else {
-        const char *slash = strrchr(output_path, '/');
-        if (slash) {
-            size_t len = (size_t)(slash - output_path);
-            if (len >= sizeof(fifo_dir))
-                len = sizeof(fifo_dir) - 1;
-            memcpy(fifo_dir, output_path, len);
-            fifo_dir[len] = '\0';
-        } else {
-            snprintf(fifo_dir, sizeof(fifo_dir), ".");
-        }
+        w = image_writer_open(output_path,
+                              compression,
+                              chunk_mb,
+                              gx_config.frame_size_kb,
+                              0);
     }
 
-    mkdir(fifo_dir, 0700);
+    if (!w) {
+        ui_error("Failed to create the backup image.");
+        return false;
+    }
 
-    /* 1. Create FIFO for checksum */
-    char checksum_fifo[1024];
+    if (gx_config.cache_neutral)
+        image_writer_drop_cache(w);
+    if (gx_config.verify_writes) {
+        if (t->pipe_target || t->remote_staging[0] != '\0')
+            fprintf(stderr, YELLOW "Images sent elsewhere are not read back (--verify-writes).\n" RESET);
+        else
+            image_writer_verify_writes(w);
+    }
 
-    size_t need = strlen(fifo_dir) + strlen("/sha256pipe.fifo") + 1;
-    if (need >= sizeof(checksum_fifo)) {
-        ui_error("FIFO path too long.");
+    /* Without reuse the image is simply written in full */
+    if (t->reuse_image && !image_writer_reuse_from(w, t->reuse_image))
+        fprintf(stderr, YELLOW "Writing the whole image instead of reusing frames from %s.\n" RESET,
+                t->reuse_image);
+
+    if (t->mirror_image_count > 0 &&
+        !image_writer_add_mirrors(w, t->mirror_images, t->mirror_image_count,
+                                  gx_config.mirror_buffer_mb,
+                                  gx_config.mirror_stall_sec,
+                                  gx_config.mirror_require_all != 0)) {
+        image_writer_close(w, false);
+        ui_error("Failed to create the backup copies.");
         return false;
     }
 
-    snprintf(checksum_fifo, sizeof(checksum_fifo),
-             "%s/sha256pipe.fifo",
-             fifo_dir);
+    if (t->stripe_dir_count > 0 &&
+        !image_writer_add_stripes(w, t->stripe_dirs, t->stripe_dir_count,
+                                  gx_config.stripe_buffer_mb,
+                                  gx_config.mirror_stall_sec)) {
+        image_writer_close(w, false);
+        ui_error("Failed to set up the stripe directories.");
+        return false;
+    }
 
-    if (mkfifo(checksum_fifo, 0600) != 0) {
-        perror("mkfifo (checksum fifo)");
-        ui_error("Failed to create checksum FIFO.\n\n"
-        "The destination or work directory may not support FIFOs.");
+    /* One local destination: written from a queue (see write_buffer_mb) */
+    if (gx_config.write_buffer_mb > 0 && t->mirror_image_count == 0 && t->stripe_dir_count == 0 &&
+        !t->reuse_image && t->remote_staging[0] == '\0' &&
+        !image_writer_add_write_behind(w, gx_config.write_buffer_mb, gx_config.spill_dir,
+                                       gx_config.spill_max_mb, gx_config.write_stall_sec)) {
+        image_writer_close(w, false);
+        ui_error("Failed to set up the write-behind buffer.");
         return false;
     }
 
-    /* 2. Start sha256sum in background */
-    pid_t sha_pid = fork();
-    if (sha_pid < 0) {
-        perror("fork (sha256sum)");
-        unlink(checksum_fifo);
-        ui_error("Failed to start checksum process.");
+    FILE *src = popen(partclone_cmd, "r");
+    if (!src) {
+        perror("popen (partclone)");
+        image_writer_close(w, false);
+        ui_error("Failed to start partclone.");
         return false;
     }
 
-    if (sha_pid == 0) {
-        char sha_cmd[2048];
-        snprintf(sha_cmd, sizeof(sha_cmd),
-                 "sha256sum < '%s' > '%s.sha256'",
-                 checksum_fifo,
-                 output_path);
+    size_t buf_size = 1024 * 1024;
+    unsigned char *buf = malloc(buf_size);
+    bool ok = (buf != NULL);
 
-        execl("/bin/sh", "sh", "-c", sha_cmd, (char *)NULL);
-        perror("execl (sha256sum)");
-        _exit(127);
+    while (ok) {
+        size_t n = fread(buf, 1, buf_size, src);
+        if (n == 0)
+            break;
+        ok = image_writer_write(w, buf, n);
     }
 
-    /*
-     * 3. Build the corrected streaming pipeline.
-     *    Add '; wait' so the shell waits for ALL pipeline processes.
-     */
-    char full_cmd[4096];
+    free(buf);
 
-    if (chunk_mb > 0) {
+    int rc = pclose(src);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0)
+        ok = false;
+
+    ok = image_writer_close_copies(w, ok, t->mirror_image_count > 0 ? t->mirror_copy_ok : NULL);
+
+    /* Completes the object only if everything went in */
+    if (upload && !s3_writer_close(upload, ok, &t->remote_bytes))
+        ok = false;
+
+    /* Every block acknowledged by the receiver */
+    if (t->net_upload && !net_writer_finish(t->net_upload, ok, &t->remote_bytes))
+        ok = false;
+
+    if (!ok) {
+        ui_error(
+            "Backup failed.\n\n"
+            "Partclone reported an error (shown on terminal output).\n"
+            "No backup image was created.\n\n"
+        );
+        return false;
+    }
+
+    return true;
+}
+
+static bool run_repo_backup(BackupTarget *t, const char *partclone_cmd)
+{
+    fprintf(stderr,
+            YELLOW "Starting partclone into repository %s (content-defined chunks, zstd)...\n" RESET,
+            t->repo_dir);
+    fprintf(stderr,
+            GREEN "     %s\n\n" RESET,
+            partclone_cmd);
+
+    RepoWriter *w = repo_writer_open(t->repo_dir, t->repo_name, 0);
+    if (!w) {
+        ui_error("Failed to create the backup image.");
+        return false;
+    }
+
+    FILE *src = popen(partclone_cmd, "r");
+    if (!src) {
+        perror("popen (partclone)");
+        repo_writer_close(w, false, NULL);
+        ui_error("Failed to start partclone.");
+        return false;
+    }
+
+    size_t buf_size = 1024 * 1024;
+    unsigned char *buf = malloc(buf_size);
+    bool ok = (buf != NULL);
+
+    while (ok) {
+        size_t n = fread(buf, 1, buf_size, src);
+        if (n == 0)
+            break;
+        ok = repo_writer_write(w, buf, n);
+    }
+
+    free(buf);
+
+    int rc = pclose(src);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0)
+        ok = false;
+
+    if (!repo_writer_close(w, ok, &t->repo_stats)) {
+        ui_error(
+            "Backup failed.\n\n"
+            "Partclone reported an error (shown on terminal output).\n"
+            "No backup image was created.\n\n"
+        );
+        return false;
+    }
+
+    fprintf(stderr,
+            YELLOW "Deduplication: %llu of %llu chunks were new (%.2f MB stored for %.2f MB of image)\n" RESET,
+            (unsigned long long)t->repo_stats.new_chunks,
+            (unsigned long long)t->repo_stats.chunks,
+            t->repo_stats.new_bytes / (1024.0 * 1024.0),
+            t->repo_stats.raw_bytes / (1024.0 * 1024.0));
+    return true;
+}
+
+/*
+ * The shell pipeline only closes its files: flush the image, its
+ * checksum and the directory before the metadata calls it complete.
+ */
+static bool sync_pipeline_image(const char *output_path, int chunk_mb)
+{
+    char path[PATH_MAX + 16];
+
+    if (chunk_mb > 0) {
+        for (unsigned i = 0; i < 1000; i++) {
+            snprintf(path, sizeof(path), "%s.%03u", output_path, i);
+            if (access(path, F_OK) != 0)
+                break;
+            if (!gx_fsync_path(path))
+                return false;
+        }
+    } else if (!gx_fsync_path(output_path)) {
+        return false;
+    }
+
+    snprintf(path, sizeof(path), "%s.sha256", output_path);
+    return gx_fsync_path(path) && gx_fsync_parent(output_path);
+}
+
+/* Run partclone + compressor + streaming checksum pipeline. */
+bool run_backup_pipeline(const char *backend,
+                         const char *device,
+                         const char *fs_type,
+                         const char *output_path,
+                         const char *compressor,
+                         int chunk_mb,
+                         BackupTarget *t)
+{
+    (void)fs_type;
+
+    if (!backend || !device || !output_path)
+        return false;
+
+    BackupTarget local;
+    if (!t) {
+        memset(&local, 0, sizeof(local));
+        t = &local;
+    }
+
+    uid_t euid = geteuid();
+
+    /* Require root privileges for partclone */
+    if (euid != 0) {
+        if (gx_no_gui) {
+            ui_error(RED "This operation requires root privileges. Please run Imprint with sudo." RESET);
+            return false;
+        }
+        /* GUI mode: continue; partclone will be wrapped in pkexec below */
+    }
+
+    /* Determine compressor command based on effective compressor */
+    const char *comp_cmd = get_compressor_cmd(compressor);
+
+    if (t->repo_dir[0] == '\0') {
+        fprintf(stderr,
+                YELLOW "Using compressor: %s\n" RESET,
+                comp_cmd);
+
+        if (chunk_mb > 0) {
+            fprintf(stderr,
+                    YELLOW "Output chunking: On (%d MB)\n",
+                    chunk_mb);
+        } else {
+            fprintf(stderr,
+                    YELLOW "Output chunking: Off\n");
+        }
+    }
+
+    /* Build the partclone command (or the raw imager standing in for it) */
+    char partclone_cmd[1024];
+
+    if (strcmp(backend, RAW_BACKEND) == 0) {
+        if (!raw_backend_command(device, partclone_cmd, sizeof(partclone_cmd))) {
+            ui_error("Cannot locate the imprintb executable for raw imaging.");
+            return false;
+        }
+    } else if (strcmp(backend, LUKS_BACKEND) == 0) {
+        if (!luks_backend_command(device, partclone_cmd, sizeof(partclone_cmd))) {
+            ui_error("Cannot locate the imprintb executable for ciphertext imaging.");
+            return false;
+        }
+        fprintf(stderr, YELLOW "Ciphertext passthrough: On (no decryption)\n" RESET);
+    } else if (strcmp(backend, RESCUE_BACKEND) == 0) {
+        if (!rescue_backend_command(device, partclone_cmd, sizeof(partclone_cmd))) {
+            ui_error("Cannot locate the imprintb executable for rescue imaging.");
+            return false;
+        }
+        fprintf(stderr, YELLOW "Rescue mode: On (bad areas are skipped and retried last)\n" RESET);
+    } else if (strcmp(backend, CBT_BACKEND) == 0 || strcmp(backend, THIN_BACKEND) == 0) {
+        if (!delta_backend_command(backend, device, partclone_cmd, sizeof(partclone_cmd))) {
+            ui_error("Cannot locate the imprintb executable for incremental imaging.");
+            return false;
+        }
+        if (strcmp(backend, CBT_BACKEND) == 0)
+            fprintf(stderr, YELLOW "Incremental: blocks written since era %lld\n" RESET,
+                    cbt_since);
+        else if (cbt_since >= 0)
+            fprintf(stderr, YELLOW "Incremental: blocks that differ from thin device %lld\n" RESET,
+                    cbt_since);
+        else
+            fprintf(stderr, YELLOW "Thin LV: reading provisioned blocks only\n" RESET);
+    } else if (native_backend_command(backend, device, partclone_cmd, sizeof(partclone_cmd))) {
+        fprintf(stderr, YELLOW "Native reader: On (%d threads)\n" RESET,
+                gx_config.native_threads);
+    } else {
+        snprintf(partclone_cmd, sizeof(partclone_cmd),
+                 "%s -c -s '%s'",
+                 backend,
+                 device);
+    }
+
+    /* Wrap partclone appropriately */
+    char partclone_wrapper[2048];
+
+    if (euid == 0) {
+        snprintf(partclone_wrapper, sizeof(partclone_wrapper),
+                 "%s",
+                 partclone_cmd);
+    } else {
+        snprintf(partclone_wrapper, sizeof(partclone_wrapper),
+                 "pkexec %s",
+                 partclone_cmd);
+    }
+
+    int frame_comp = get_frame_compression(compressor);
+    if (gx_config.verify_writes && (t->repo_dir[0] != '\0' || frame_comp == 0))
+        fprintf(stderr, YELLOW "Only zstd and lz4 image files are read back (--verify-writes).\n" RESET);
+
+    /* repo:// target: chunked, deduplicated and compressed in-process */
+    if (t->repo_dir[0] != '\0')
+        return run_repo_backup(t, partclone_wrapper);
+
+    /* zstd / lz4: compress in-process, no shell pipeline needed */
+    if (frame_comp != 0)
+        return run_framed_backup(t, partclone_wrapper, output_path, frame_comp, chunk_mb);
+
+    /* Determine FIFO directory */
+    char fifo_dir[1024];
+
+    if (gx_workdir_override[0] != '\0') {
+        snprintf(fifo_dir, sizeof(fifo_dir), "%s", gx_workdir_override);
+    } else {
+        const char *slash = strrchr(output_path, '/');
+        if (slash) {
+            size_t len = (size_t)(slash - output_path);
+            if (len >= sizeof(fifo_dir))
+                len = sizeof(fifo_dir) - 1;
+            memcpy(fifo_dir, output_path, len);
+            fifo_dir[len] = '\0';
+        } else {
+            snprintf(fifo_dir, sizeof(fifo_dir), ".");
+        }
+    }
+
+    mkdir(fifo_dir, 0700);
+
+    /*
+     * 1. Create FIFO for checksum.  Named after the image so that
+     *    whole-disk backups running side by side do not collide.
+     */
+    char checksum_fifo[1024];
+
+    const char *image_name = strrchr(output_path, '/');
+    image_name = image_name ? image_name + 1 : output_path;
+
+    int need = snprintf(checksum_fifo, sizeof(checksum_fifo),
+                        "%s/.%s.sha256.fifo",
+                        fifo_dir,
+                        image_name);
+    if (need < 0 || (size_t)need >= sizeof(checksum_fifo)) {
+        ui_error("FIFO path too long.");
+        return false;
+    }
+
+    if (mkfifo(checksum_fifo, 0600) != 0) {
+        perror("mkfifo (checksum fifo)");
+        ui_error("Failed to create checksum FIFO.\n\n"
+        "The destination or work directory may not support FIFOs.");
+        return false;
+    }
+
+    /* 2. Start sha256sum in background */
+    pid_t sha_pid = fork();
+    if (sha_pid < 0) {
+        perror("fork (sha256sum)");
+        unlink(checksum_fifo);
+        ui_error("Failed to start checksum process.");
+        return false;
+    }
+
+    if (sha_pid == 0) {
+        char sha_cmd[2048];
+        snprintf(sha_cmd, sizeof(sha_cmd),
+                 "sha256sum < '%s' > '%s.sha256'",
+                 checksum_fifo,
+                 output_path);
+
+        execl("/bin/sh", "sh", "-c", sha_cmd, (char *)NULL);
+        perror("execl (sha256sum)");
+        _exit(127);
+    }
+
+    /*
+     * 3. Build the corrected streaming pipeline.
+     *    Add '; wait' so the shell waits for ALL pipeline processes.
+     */
+    char full_cmd[4096];
+
+    if (chunk_mb > 0) {
         /* Chunked output */
         snprintf(full_cmd, sizeof(full_cmd),
                  "set -o pipefail; "
@@ -490,6 +1269,12 @@ bool run_backup_pipeline(const char *backend,
     if (rc != -1)
         exit_code = WEXITSTATUS(rc);
 
+    if (rc != -1 && exit_code == 0 && !sync_pipeline_image(output_path, chunk_mb)) {
+        fprintf(stderr, RED "ERROR:" WHITE " flushing the image to disk failed: %s\n" RESET,
+                strerror(errno));
+        exit_code = 1;
+    }
+
     if (rc == -1 || exit_code != 0) {
 
         /* On failure, remove image and checksum */
@@ -535,14 +1320,10 @@ bool backup_run_interactive(void)
         return false;
     }
 
-    /* 3. Detect filesystem type. */
+    /* 3. Detect filesystem type (none found: raw image). */
     char fs_type[64] = {0};
-    if (!get_fs_type(device, fs_type, sizeof(fs_type))) {
-        ui_error("Could not detect filesystem type for the selected partition.");
-        free(dir);
-        free(device);
-        return false;
-    }
+    if (!get_fs_type(device, fs_type, sizeof(fs_type)))
+        snprintf(fs_type, sizeof(fs_type), "unknown");
 
     /* 4. Map to partclone backend. */
     const char *backend = partclone_backend_for_fs(fs_type);
@@ -609,15 +1390,21 @@ bool backup_run_interactive(void)
             free(output_path);
             return false;
         }
+
+        drop_stale_metadata(output_path);
     }
 
     /* 7. Run backup pipeline */
+    BackupTarget target;
+    memset(&target, 0, sizeof(target));
+
     bool ok = run_backup_pipeline(backend,
                                   device,
                                   fs_type,
                                   output_path,
                                   gx_config.compression,
-                                  gx_config.chunk_size_mb);
+                                  gx_config.chunk_size_mb,
+                                  &target);
 
 
     /* Capture end time */
@@ -785,11 +1572,91 @@ bool backup_run_interactive(void)
 
 
 
-bool backup_run_cli(const char *device,
+/*
+ * <dir>/<name> of a further --target -> <dir>/<name>.img.<ext>, the
+ * naming of the first one.  False (printed) unless <dir> exists.
+ */
+static bool mirror_image_path(const char *target, const char *ext,
+                              char *out, size_t out_len)
+{
+    const char *slash = strrchr(target, '/');
+    if (!slash || strncmp(target, REPO_PREFIX, strlen(REPO_PREFIX)) == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s: a further --target must be a <directory>/<name> path\n" RESET,
+                target);
+        return false;
+    }
+
+    char dir[1024];
+    size_t dlen = (size_t)(slash - target);
+    if (dlen >= sizeof(dir))
+        dlen = sizeof(dir) - 1;
+    memcpy(dir, target, dlen);
+    dir[dlen] = '\0';
+
+    struct stat st;
+    if (dlen > 0 && (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))) {
+        fprintf(stderr, RED "ERROR:" WHITE " output directory does not exist: %s\n" RESET, dir);
+        return false;
+    }
+
+    snprintf(out, out_len, "%s.img.%s", target, ext);
+    return true;
+}
+
+/* Empty and remove the remote target's staging directory */
+static void remove_remote_staging(BackupTarget *t)
+{
+    DIR *d = opendir(t->remote_staging);
+
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+                continue;
+            char path[PATH_MAX + 256];
+            snprintf(path, sizeof(path), "%s/%s", t->remote_staging, de->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+
+    rmdir(t->remote_staging);
+    t->remote_staging[0] = '\0';
+}
+
+/* Upload <image><suffix> as <key><suffix>; missing_ok for optional files */
+static bool remote_upload_sidecar(BackupTarget *t, const char *image, const char *suffix,
+                                  bool missing_ok)
+{
+    char path[PATH_MAX + 16];
+    snprintf(path, sizeof(path), "%s%s", image, suffix);
+
+    if (missing_ok && access(path, F_OK) != 0)
+        return true;
+
+    if (t->net_target)
+        return net_writer_put_file(t->net_upload, suffix, path);
+
+    S3Object o = t->s3_image;
+    snprintf(o.key, sizeof(o.key), "%s%s", t->s3_image.key, suffix);
+    return s3_put_file(&o, path);
+}
+
+static bool run_cli(BackupTarget *t,
+                    const char *device,
                     const char *output_path,
                     const char *compressor,
                     int chunk_mb,
-                    bool force)   // ← NEW
+                    bool force,   // ← NEW
+                    const char *incremental_from,
+                    bool ciphertext,
+                    bool snapshot,
+                    bool rescue,
+                    const char *reuse_from,
+                    const char *const *mirrors,
+                    int mirror_count,
+                    const char *const *stripes,
+                    int stripe_count)
 {
     (void)compressor;
 
@@ -811,45 +1678,239 @@ bool backup_run_cli(const char *device,
     /* ---------------------------------------------
      * Reject mounted source partitions
      * --------------------------------------------- */
-    if (gx_is_partition_mounted(device)) {
-        ui_error(WHITE "The source partition is mounted and cannot be backed up." RESET);
+    if (!snapshot && gx_is_partition_mounted(device)) {
+        ui_error(WHITE "The source partition is mounted and cannot be backed up "
+                 "(--snapshot backs up LVM and device-mapper sources live)." RESET);
         return false;
     }
 
     /* ---------------------------------------------
-     * Validate target directory exists
+     * Repository target: repo://<dir>/<name>
      * --------------------------------------------- */
-    const char *slash = strrchr(output_path, '/');
-    if (!slash) {
-        ui_error(WHITE "Output path must include a directory." RESET);
-        return false;
+    if (strncmp(output_path, REPO_PREFIX, strlen(REPO_PREFIX)) == 0) {
+        if (!repo_parse_target(output_path, t->repo_dir, sizeof(t->repo_dir),
+                               t->repo_name, sizeof(t->repo_name))) {
+            t->repo_dir[0] = '\0';
+            ui_error(WHITE "A repository target must look like repo://<directory>/<name>." RESET);
+            return false;
+        }
+
+        if (!repo_init(t->repo_dir)) {
+            t->repo_dir[0] = '\0';
+            return false;
+        }
+
+        if (chunk_mb > 0)
+            fprintf(stderr, YELLOW "Output chunking does not apply to repository images; ignored.\n" RESET);
+        chunk_mb = 0;
     }
 
     /* ---------------------------------------------
-     * Normalize target filename
+     * S3 target: s3://<bucket>/<prefix>
      * --------------------------------------------- */
-    char normalized_path[2048];
-    const char *ext = get_compression_ext(gx_config.compression);
+    char s3_output[PATH_MAX + 1100];
 
-    if (slash) {
-        char dir_part[1024];
-        size_t dlen = slash - output_path;
-        if (dlen >= sizeof(dir_part))
-            dlen = sizeof(dir_part) - 1;
+    if (strncmp(output_path, S3_PREFIX, strlen(S3_PREFIX)) == 0) {
+        if (!s3_parse_url(output_path, &t->s3_image)) {
+            ui_error(WHITE "An S3 target must look like s3://<bucket>/<name>." RESET);
+            return false;
+        }
+        if (!s3_check_credentials())
+            return false;
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "An s3:// target needs zstd or lz4 compression." RESET);
+            return false;
+        }
+        if (mirror_count > 0 || stripe_count > 0 || reuse_from || rescue) {
+            ui_error(WHITE "An s3:// target cannot be combined with further --target copies, "
+                     "--stripe, --reuse-from or --rescue." RESET);
+            return false;
+        }
 
-        memcpy(dir_part, output_path, dlen);
-        dir_part[dlen] = '\0';
+        if (chunk_mb > 0)
+            fprintf(stderr, YELLOW "Output chunking does not apply to S3 images; ignored.\n" RESET);
+        chunk_mb = 0;
 
-        const char *fname = slash + 1;
+        snprintf(t->remote_staging, sizeof(t->remote_staging), "/tmp/imprint-s3-XXXXXX");
+        if (!mkdtemp(t->remote_staging)) {
+            t->remote_staging[0] = '\0';
+            ui_error(WHITE "Cannot create a staging directory in /tmp." RESET);
+            return false;
+        }
 
-        snprintf(normalized_path, sizeof(normalized_path),
-                 "%s/%s.img.%s",
-                 dir_part, fname, ext);
+        /* The object gets the name a file would: <prefix>.img.<ext> */
+        const char *ext = get_compression_ext(gx_config.compression);
+        const char *name = strrchr(t->s3_image.key, '/');
+        name = name ? name + 1 : t->s3_image.key;
 
-        output_path = normalized_path;
-    } else {
-        snprintf(normalized_path, sizeof(normalized_path),
-                 "%s.img.%s",
+        snprintf(s3_output, sizeof(s3_output), "%s/%s", t->remote_staging, name);
+        strncat(t->s3_image.key, ".img.", sizeof(t->s3_image.key) - strlen(t->s3_image.key) - 1);
+        strncat(t->s3_image.key, ext, sizeof(t->s3_image.key) - strlen(t->s3_image.key) - 1);
+        snprintf(t->remote_location, sizeof(t->remote_location), "s3://%s/%s", t->s3_image.bucket, t->s3_image.key);
+
+        /* curl exiting early must not take the backup down with SIGPIPE */
+        signal(SIGPIPE, SIG_IGN);
+        output_path = s3_output;
+    }
+
+    /* ---------------------------------------------
+     * Network target: tcp://<host>[:<port>]/<name>
+     * --------------------------------------------- */
+    char net_output[PATH_MAX + 1100];
+    bool net_exists = false;
+
+    if (strncmp(output_path, NET_PREFIX, strlen(NET_PREFIX)) == 0) {
+        if (!net_parse_url(output_path, &t->net_image)) {
+            ui_error(WHITE "A network target must look like tcp://<host>[:<port>]/<name>, "
+                     "with a relative name." RESET);
+            return false;
+        }
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "A tcp:// target needs zstd or lz4 compression." RESET);
+            return false;
+        }
+        if (mirror_count > 0 || stripe_count > 0 || reuse_from || rescue) {
+            ui_error(WHITE "A tcp:// target cannot be combined with further --target copies, "
+                     "--stripe, --reuse-from or --rescue." RESET);
+            return false;
+        }
+
+        /* The server file gets the name a local one would: <name>.img.<ext> */
+        const char *ext = get_compression_ext(gx_config.compression);
+        size_t nlen = strlen(t->net_image.name);
+        if (nlen + 5 + strlen(ext) >= sizeof(t->net_image.name)) {
+            ui_error(WHITE "The network target name is too long." RESET);
+            return false;
+        }
+        snprintf(t->net_image.name + nlen, sizeof(t->net_image.name) - nlen, ".img.%s", ext);
+
+        /* Also tells whether imprint-serve is there at all */
+        long long existing = net_image_size(&t->net_image);
+        if (existing == -2)
+            return false;
+        net_exists = existing >= 0;
+
+        snprintf(t->remote_staging, sizeof(t->remote_staging), "/tmp/imprint-net-XXXXXX");
+        if (!mkdtemp(t->remote_staging)) {
+            t->remote_staging[0] = '\0';
+            ui_error(WHITE "Cannot create a staging directory in /tmp." RESET);
+            return false;
+        }
+
+        const char *name = strrchr(t->net_image.name, '/');
+        name = name ? name + 1 : t->net_image.name;
+
+        snprintf(net_output, sizeof(net_output), "%s/%.*s", t->remote_staging,
+                 (int)(strlen(name) - 5 - strlen(ext)), name);
+        snprintf(t->remote_location, sizeof(t->remote_location), "%s%s%s%s:%s/%s", NET_PREFIX,
+                 strchr(t->net_image.host, ':') ? "[" : "", t->net_image.host,
+                 strchr(t->net_image.host, ':') ? "]" : "", t->net_image.port, t->net_image.name);
+
+        t->net_target = true;
+        signal(SIGPIPE, SIG_IGN);
+        output_path = net_output;
+    }
+
+    /* ---------------------------------------------
+     * Standard output: --target -
+     * --------------------------------------------- */
+    char pipe_output[PATH_MAX + 8];
+
+    if (strcmp(output_path, PIPE_TARGET) == 0) {
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "--target - needs zstd or lz4 compression." RESET);
+            return false;
+        }
+        if (mirror_count > 0 || stripe_count > 0 || reuse_from || rescue || incremental_from) {
+            ui_error(WHITE "--target - cannot be combined with further --target copies, "
+                     "--stripe, --reuse-from, --rescue or --incremental-from." RESET);
+            return false;
+        }
+
+        if (chunk_mb > 0)
+            fprintf(stderr, YELLOW "Output chunking does not apply to a stream on stdout; ignored.\n" RESET);
+        chunk_mb = 0;
+
+        snprintf(t->remote_staging, sizeof(t->remote_staging), "/tmp/imprint-pipe-XXXXXX");
+        if (!mkdtemp(t->remote_staging)) {
+            t->remote_staging[0] = '\0';
+            ui_error(WHITE "Cannot create a staging directory in /tmp." RESET);
+            return false;
+        }
+
+        snprintf(pipe_output, sizeof(pipe_output), "%s/stdout", t->remote_staging);
+        snprintf(t->remote_location, sizeof(t->remote_location), "%s", PIPE_TARGET);
+
+        /* A reader that goes away is an error, not a signal */
+        t->pipe_target = true;
+        signal(SIGPIPE, SIG_IGN);
+        output_path = pipe_output;
+    }
+
+    /* ---------------------------------------------
+     * Reflink reuse: framed images only
+     * --------------------------------------------- */
+    if (reuse_from) {
+        char first[PATH_MAX + 8];
+        snprintf(first, sizeof(first), "%s.000", reuse_from);
+
+        if (t->repo_dir[0] != '\0') {
+            ui_error(WHITE "--reuse-from does not apply to repo:// targets; the repository "
+                     "already stores every chunk once." RESET);
+            return false;
+        }
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "--reuse-from needs zstd or lz4 compression." RESET);
+            return false;
+        }
+        if (access(reuse_from, F_OK) != 0 && access(first, F_OK) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " image not found: %s\n" RESET, reuse_from);
+            return false;
+        }
+        t->reuse_image = reuse_from;
+    }
+
+    /* ---------------------------------------------
+     * Validate target directory exists
+     * --------------------------------------------- */
+    const char *slash = strrchr(output_path, '/');
+    if (!slash) {
+        ui_error(WHITE "Output path must include a directory." RESET);
+        return false;
+    }
+
+    /* ---------------------------------------------
+     * Normalize target filename
+     * --------------------------------------------- */
+    char normalized_path[2048];
+    const char *ext = get_compression_ext(gx_config.compression);
+
+    if (t->repo_dir[0] != '\0') {
+        /* The recipe goes into the repository under the name given */
+        snprintf(normalized_path, sizeof(normalized_path),
+                 "%s/images/%s",
+                 t->repo_dir, t->repo_name);
+
+        output_path = normalized_path;
+    } else if (slash) {
+        char dir_part[1024];
+        size_t dlen = slash - output_path;
+        if (dlen >= sizeof(dir_part))
+            dlen = sizeof(dir_part) - 1;
+
+        memcpy(dir_part, output_path, dlen);
+        dir_part[dlen] = '\0';
+
+        const char *fname = slash + 1;
+
+        snprintf(normalized_path, sizeof(normalized_path),
+                 "%s/%s.img.%s",
+                 dir_part, fname, ext);
+
+        output_path = normalized_path;
+    } else {
+        snprintf(normalized_path, sizeof(normalized_path),
+                 "%s.img.%s",
                  output_path, ext);
 
         output_path = normalized_path;
@@ -875,13 +1936,115 @@ bool backup_run_cli(const char *device,
         return false;
     }
 
+    /* ---------------------------------------------
+     * Several targets: one stream, a copy in each
+     * --------------------------------------------- */
+    char mirror_paths[BACKUP_MAX_TARGETS][2048];
+    const char *copy_paths[BACKUP_MAX_TARGETS];
+    bool copy_ok[BACKUP_MAX_TARGETS];
+    int copy_count = 1;
+
+    copy_paths[0] = output_path;
+    copy_ok[0] = true;
+
+    if (mirror_count > 0) {
+        if (t->repo_dir[0] != '\0') {
+            ui_error(WHITE "A repo:// target cannot be combined with further --target copies." RESET);
+            return false;
+        }
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "Several --target copies need zstd or lz4 compression." RESET);
+            return false;
+        }
+
+        for (int i = 0; i < mirror_count && i < BACKUP_MAX_TARGETS - 1; i++) {
+            if (!mirror_image_path(mirrors[i], ext, mirror_paths[i], sizeof(mirror_paths[i])))
+                return false;
+
+            for (int j = 0; j < copy_count; j++) {
+                if (strcmp(copy_paths[j], mirror_paths[i]) == 0) {
+                    fprintf(stderr, RED "ERROR:" WHITE " %s is given as --target twice\n" RESET,
+                            mirror_paths[i]);
+                    return false;
+                }
+            }
+
+            copy_paths[copy_count] = mirror_paths[i];
+            copy_ok[copy_count] = false;
+            copy_count++;
+        }
+
+        t->mirror_images = &copy_paths[1];
+        t->mirror_image_count = copy_count - 1;
+        t->mirror_copy_ok = copy_ok;
+    }
+
+    /* ---------------------------------------------
+     * Striping: chunk i in directory i % n
+     * --------------------------------------------- */
+    const char *stripe_list[BACKUP_MAX_STRIPES + 1];
+    char stripe_paths[BACKUP_MAX_STRIPES][2048];
+    int stripe_total = 1;
+
+    stripe_list[0] = dir;
+
+    if (stripe_count > 0) {
+        if (t->repo_dir[0] != '\0') {
+            ui_error(WHITE "--stripe does not apply to repo:// targets." RESET);
+            return false;
+        }
+        if (get_frame_compression(gx_config.compression) == 0) {
+            ui_error(WHITE "--stripe needs zstd or lz4 compression." RESET);
+            return false;
+        }
+        if (chunk_mb <= 0) {
+            ui_error(WHITE "--stripe spreads chunk files; give a chunk size with --chunk." RESET);
+            return false;
+        }
+
+        const char *name = strrchr(output_path, '/') + 1;
+
+        for (int i = 0; i < stripe_count && i < BACKUP_MAX_STRIPES; i++) {
+            struct stat sst;
+            if (stat(stripes[i], &sst) != 0 || !S_ISDIR(sst.st_mode)) {
+                fprintf(stderr, RED "ERROR:" WHITE " stripe directory does not exist: %s\n" RESET,
+                        stripes[i]);
+                return false;
+            }
+
+            /* Two stripes in one directory would share file names */
+            for (int j = 0; j < stripe_total; j++) {
+                struct stat ost;
+                if (stat(stripe_list[j], &ost) == 0 &&
+                    ost.st_dev == sst.st_dev && ost.st_ino == sst.st_ino) {
+                    fprintf(stderr, RED "ERROR:" WHITE " %s is used as a stripe twice\n" RESET,
+                            stripes[i]);
+                    return false;
+                }
+            }
+
+            stripe_list[stripe_total] = stripes[i];
+            snprintf(stripe_paths[i], sizeof(stripe_paths[i]), "%s/%s", stripes[i], name);
+            stripe_total++;
+        }
+
+        if (chunk_mb > gx_config.stripe_buffer_mb)
+            fprintf(stderr,
+                    YELLOW "Chunks (%d MB) larger than stripe_buffer_mb (%d MB) let the stripes\n"
+                    "overlap only partly; a smaller --chunk spreads the load better.\n" RESET,
+                    chunk_mb, gx_config.stripe_buffer_mb);
+
+        t->stripe_dirs = &stripe_list[1];
+        t->stripe_dir_count = stripe_total - 1;
+    }
+
     /* ---------------------------------------------
      * Detect filesystem
      * --------------------------------------------- */
     char fs_type[64] = {0};
     if (!get_fs_type(device, fs_type, sizeof(fs_type))) {
-        ui_error(RED "Could not detect filesystem type." RESET);
-        return false;
+        fprintf(stderr, YELLOW "No filesystem detected; the partition will be imaged raw.\n" RESET);
+        snprintf(fs_type, sizeof(fs_type), "unknown");
     }
 
     /* ---------------------------------------------
@@ -893,6 +2056,118 @@ bool backup_run_cli(const char *device,
         return false;
     }
 
+    /* ---------------------------------------------
+     * Ciphertext passthrough: image the LUKS partition
+     * under the mapper, recorded as that partition
+     * --------------------------------------------- */
+    char meta_device[PATH_MAX];
+    const char *meta_fs = fs_type;
+    snprintf(meta_device, sizeof(meta_device), "%s", device);
+
+    if (ciphertext) {
+        LuksMapping luks;
+        char why[256];
+
+        if (!luks_probe(device, &luks, why, sizeof(why))) {
+            fprintf(stderr, RED "ERROR:" WHITE " --ciphertext: %s\n" RESET, why);
+            return false;
+        }
+
+        snprintf(meta_device, sizeof(meta_device), "%s", luks.backing_dev);
+
+        if (strcmp(backend, "partclone.extfs") == 0)
+            luks_fs = "extfs";
+        else if (strcmp(backend, "partclone.ntfs") == 0)
+            luks_fs = "ntfs";
+        else
+            luks_fs = "-";
+
+        fprintf(stderr,
+                YELLOW "Imaging the encrypted partition %s (payload at %.2f MB)\n" RESET,
+                meta_device, luks.payload_offset / (1024.0 * 1024.0));
+
+        backend = LUKS_BACKEND;
+        meta_fs = "crypto_LUKS";
+    }
+
+    /* ---------------------------------------------
+     * Rescue: our own reader, staging next to the image
+     * --------------------------------------------- */
+    if (rescue) {
+        if (strcmp(backend, "partclone.extfs") == 0)
+            rescue_fs = "extfs";
+        else if (strcmp(backend, "partclone.ntfs") == 0)
+            rescue_fs = "ntfs";
+        else
+            rescue_fs = "-";
+
+        snprintf(rescue_work, sizeof(rescue_work), "%s.rescue", output_path);
+        backend = RESCUE_BACKEND;
+    }
+
+    /* ---------------------------------------------
+     * Changed-block tracking (dm-era, thin LVs)
+     * --------------------------------------------- */
+    CbtDevice cbt;
+    ThinDevice thin;
+    bool plain = !ciphertext && !snapshot && !rescue;
+    bool era_source = plain && cbt_probe(device, &cbt);
+    bool thin_source = plain && !era_source && thin_probe(device, &thin);
+
+    CbtParent parent;
+    cbt_since = -1;
+
+    if (incremental_from) {
+        if (!era_source && !thin_source) {
+            ui_error(RED "--incremental-from needs a dm-era device (see --cbt-setup) or a thin LV." RESET);
+            return false;
+        }
+
+        if (!cbt_read_parent(incremental_from, &parent))
+            return false;
+
+        if (era_source) {
+            if (parent.cbt_era < 0) {
+                fprintf(stderr,
+                        RED "ERROR:" WHITE " %s was not taken from a dm-era device, so nothing\n"
+                        "       is known about what changed since.  Take a full backup of the era device first.\n" RESET,
+                        incremental_from);
+                return false;
+            }
+
+            struct stat pst, dst;
+            bool same = (stat(parent.device, &pst) == 0 && stat(device, &dst) == 0)
+                        ? pst.st_rdev == dst.st_rdev
+                        : strcmp(parent.device, device) == 0;
+            if (!same) {
+                fprintf(stderr,
+                        RED "ERROR:" WHITE " %s was taken from %s, not %s.\n" RESET,
+                        incremental_from, parent.device, device);
+                return false;
+            }
+
+            cbt_since = parent.cbt_era;
+            backend = CBT_BACKEND;
+        } else {
+            /* The parent must be another thin device of the same pool */
+            if (parent.thin_dev_id < 0 || strcmp(parent.thin_pool, thin.pool_name) != 0 ||
+                (uint64_t)parent.thin_dev_id == thin.dev_id) {
+                fprintf(stderr,
+                        RED "ERROR:" WHITE " %s was not taken from another thin LV in pool %s.\n" RESET,
+                        incremental_from, thin.pool_name);
+                return false;
+            }
+
+            cbt_since = parent.thin_dev_id;
+            backend = THIN_BACKEND;
+        }
+    } else if (era_source) {
+        fprintf(stderr,
+                YELLOW "Changed-block tracking: On; later backups can use --incremental-from.\n" RESET);
+    } else if (thin_source && strcmp(backend, RAW_BACKEND) == 0) {
+        backend = THIN_BACKEND;
+    }
+
     /* ---------------------------------------------
      * FIFO capability
      * --------------------------------------------- */
@@ -907,13 +2182,33 @@ bool backup_run_cli(const char *device,
     /* ---------------------------------------------
      * Overwrite confirmation (CLI)
      * --------------------------------------------- */
-    if (!force && backup_outputs_exist(output_path)) {
+    /* Copies and stripe directories get the same file names */
+    const char *out_paths[BACKUP_MAX_TARGETS + BACKUP_MAX_STRIPES];
+    int out_count = 0;
+
+    for (int i = 0; i < copy_count; i++)
+        out_paths[out_count++] = copy_paths[i];
+    for (int i = 0; i < stripe_total - 1; i++)
+        out_paths[out_count++] = stripe_paths[i];
+
+    bool remote_exists = net_exists ||
+                         (t->remote_staging[0] != '\0' && !t->net_target && !t->pipe_target &&
+                          s3_object_size(&t->s3_image) >= 0);
+    bool outputs_exist = remote_exists;
+    for (int i = 0; i < out_count; i++)
+        if (backup_outputs_exist(out_paths[i]))
+            outputs_exist = true;
+
+    if (!force && outputs_exist) {
+        fprintf(stderr, YELLOW "WARNING:" WHITE " Backup files already exist:\n" RESET);
+        if (remote_exists)
+            fprintf(stderr, WHITE "    %s\n" RESET, t->remote_location);
+        for (int i = 0; i < out_count; i++)
+            if (backup_outputs_exist(out_paths[i]))
+                fprintf(stderr, WHITE "    %s\n" RESET, out_paths[i]);
         fprintf(stderr,
-                YELLOW "WARNING:" WHITE " Backup files already exist:\n"
-                "    %s\n\n"
-                "They will be overwritten.\n"
-                "Proceed? [y/N]: " RESET,
-                output_path);
+                WHITE "\nThey will be overwritten.\n"
+                "Proceed? [y/N]: " RESET);
 
         fflush(stderr);
 
@@ -930,19 +2225,130 @@ bool backup_run_cli(const char *device,
     }
 
 
+    /*
+     * Start a new era just before reading: everything written from now
+     * on belongs to the next incremental backup.
+     */
+    MetadataExtra extra = { -1, NULL, -1, NULL, -1, -1, false, NULL, 0, 0, NULL, NULL, 0, NULL, 0, NULL, NULL };
+
+    if (era_source) {
+        uint32_t era;
+        if (!cbt_checkpoint(device, &era))
+            return false;
+        extra.cbt_era = era;
+    }
+
+    if (thin_source) {
+        extra.thin_pool = thin.pool_name;
+        extra.thin_dev_id = (long long)thin.dev_id;
+    }
+
+    if (incremental_from) {
+        extra.parent_image = parent.base;
+        extra.parent_cbt_era = era_source ? parent.cbt_era : -1;
+        extra.parent_thin_dev_id = thin_source ? parent.thin_dev_id : -1;
+    }
+
+    /* Deltas, thin, LUKS and rescue images are raw; the parent link marks deltas */
+    bool raw_image = strcmp(backend, CBT_BACKEND) == 0 || strcmp(backend, THIN_BACKEND) == 0 ||
+                     strcmp(backend, LUKS_BACKEND) == 0 || strcmp(backend, RESCUE_BACKEND) == 0;
+
+    if (t->remote_staging[0] != '\0')
+        extra.location = t->remote_location;
+
+    for (int i = 0; i < out_count; i++)
+        drop_stale_metadata(out_paths[i]);
+
+    /* A stream starts with what is known of the image before it is read */
+    if (t->pipe_target) {
+        extra.checksum = "";
+        bool have_header = write_metadata_ex(output_path, meta_device, meta_fs,
+                                             raw_image ? RAW_BACKEND : backend,
+                                             gx_config.compression, 0, 1, &extra);
+        extra.checksum = NULL;
+
+        if (!have_header) {
+            ui_error(WHITE "Cannot stage the stream header in /tmp." RESET);
+            return false;
+        }
+    }
+
+    /* ---------------------------------------------
+     * Live source: read from a snapshot instead
+     * --------------------------------------------- */
+    Snapshot snap;
+    const char *read_device = device;
+
+    if (snapshot) {
+        if (!snapshot_create(device, dir, &snap))
+            return false;
+        snapshot_monitor_start(&snap);
+        read_device = snap.device;
+    }
+
     /* ---------------------------------------------
      * Run backup pipeline
      * --------------------------------------------- */
     bool ok = run_backup_pipeline(backend,
-                                  device,
+                                  read_device,
                                   fs_type,
                                   output_path,
                                   compressor,
-                                  chunk_mb);
+                                  chunk_mb,
+                                  t);
+
+    if (snapshot) {
+        if (!snapshot_monitor_stop(&snap)) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " the snapshot overflowed while it was read, so the image is not\n"
+                    "       consistent.  Raise snapshot_cow_percent (now %d%%) or back up at a quieter time.\n" RESET,
+                    gx_config.snapshot_cow_percent);
+            ok = false;
+        }
+        if (!snapshot_remove(&snap))
+            ok = false;
+    }
+
+    /* What a rescue could not read goes into the metadata */
+    uint64_t *unrecovered = NULL;
+
+    if (rescue && !ok) {
+        struct stat wst;
+        if (stat(rescue_work, &wst) == 0)
+            fprintf(stderr,
+                    YELLOW "The data read so far is kept in %s\n"
+                    "(a sparse copy of the partition; unread areas are zeros).\n" RESET,
+                    rescue_work);
+    } else if (rescue) {
+        size_t count;
+        uint64_t bytes;
+
+        if (rescue_read_map(rescue_work, &unrecovered, &count, &bytes)) {
+            extra.rescue = true;
+            extra.unrecovered = unrecovered;
+            extra.unrecovered_count = count;
+            extra.unrecovered_bytes = bytes;
+        }
+    }
 
     if (!ok)
         return false;
 
+    /* The summary describes the first copy that completed */
+    for (int i = 0; i < copy_count; i++) {
+        if (!copy_ok[i])
+            continue;
+
+        output_path = copy_paths[i];
+        slash = strrchr(output_path, '/');
+        len = (size_t)(slash - output_path);
+        if (len >= sizeof(dir))
+            len = sizeof(dir) - 1;
+        memcpy(dir, output_path, len);
+        dir[len] = '\0';
+        break;
+    }
+
     /* ---------------------------------------------
      * Compute duration
      * --------------------------------------------- */
@@ -969,7 +2375,16 @@ bool backup_run_cli(const char *device,
     off_t alloc_size = 0;
     int chunk_count = 0;
 
-    if (chunk_mb > 0) {
+    if (t->remote_staging[0] != '\0') {
+        /* Nothing on disk; the object, the server or the stream has the image */
+        file_size = (off_t)t->remote_bytes;
+        if (chunk_mb > 0) {
+            uint64_t chunk_bytes = (uint64_t)chunk_mb * 1024 * 1024;
+            chunk_count = (int)((t->remote_bytes + chunk_bytes - 1) / chunk_bytes);
+            if (chunk_count == 0)
+                chunk_count = 1;
+        }
+    } else if (chunk_mb > 0) {
         /* Chunked mode: count sequential chunk files: base.000, base.001, ... */
         const char *base = strrchr(output_path, '/');
         base = base ? base + 1 : output_path;
@@ -988,9 +2403,10 @@ bool backup_run_cli(const char *device,
         /* Count chunks numerically (GUI‑compatible logic) */
         for (unsigned i = 0; i < 1000; i++) {
 
-            /* Build chunk path safely */
+            /* Build chunk path safely (striped: chunk i in stripe i % n) */
             char chunk_path[2048];
-            snprintf(chunk_path, sizeof(chunk_path), "%s/%s", dir, prefix);
+            snprintf(chunk_path, sizeof(chunk_path), "%s/%s",
+                     i % stripe_total ? stripe_list[i % stripe_total] : dir, prefix);
 
             /* Append the numeric suffix safely */
             char suffix[8];
@@ -1024,7 +2440,13 @@ bool backup_run_cli(const char *device,
 
     double size_mb = (double)file_size / (1024.0 * 1024.0);
 
-    if (chunk_mb > 0 && chunk_count > 0) {
+    if (t->repo_dir[0] != '\0') {
+        /* Only new chunks take space; throughput counts the whole image */
+        snprintf(size_str, sizeof(size_str),
+                 "%.2f MB new in the repository",
+                 t->repo_stats.new_bytes / (1024.0 * 1024.0));
+        size_mb = t->repo_stats.raw_bytes / (1024.0 * 1024.0);
+    } else if (chunk_mb > 0 && chunk_count > 0) {
         snprintf(size_str, sizeof(size_str),
                  "%.2f MB (%d chunks)", size_mb, chunk_count);
     } else {
@@ -1042,7 +2464,7 @@ bool backup_run_cli(const char *device,
     /* ---------------------------------------------
      * Save config (backup_dir) — GUI only
      * --------------------------------------------- */
-    if (!gx_no_gui) {
+    if (!gx_no_gui && t->remote_staging[0] == '\0') {
         size_t dlen = strlen(dir);
         if (dlen >= sizeof(gx_config.backup_dir))
             dlen = sizeof(gx_config.backup_dir) - 1;
@@ -1067,13 +2489,82 @@ bool backup_run_cli(const char *device,
         chunk_count = 1;                 // single file
     }
 
-    write_metadata(output_path,
-                   device,
-                   fs_type,
-                   backend,
-                   gx_config.compression,
-                   effective_chunk_mb,    // ✅ reflects actual behavior
-                   chunk_count);
+    if (copy_count > 1) {
+        extra.copies = copy_paths;
+        extra.copy_ok = copy_ok;
+        extra.copy_count = copy_count;
+    }
+
+    if (stripe_total > 1) {
+        extra.stripe_dirs = stripe_list;
+        extra.stripe_count = stripe_total;
+    }
+
+    /* Every complete copy gets the same metadata */
+    for (int i = 0; i < copy_count; i++) {
+        if (!copy_ok[i])
+            continue;
+
+        write_metadata_ex(copy_paths[i],
+                          meta_device,
+                          meta_fs,
+                          raw_image ? RAW_BACKEND : backend,
+                          t->repo_dir[0] != '\0' ? REPO_COMPRESSION : gx_config.compression,
+                          effective_chunk_mb,    // ✅ reflects actual behavior
+                          chunk_count,
+                          &extra);
+    }
+
+    if (rescue) {
+        rescue_cleanup(rescue_work);
+        free(unrecovered);
+    }
+
+    /*
+     * S3: the metadata goes last, so its object marks a complete image.
+     * tcp://: imprint-serve keeps the image once END has it all on disk.
+     * stdout: the trailer tells the reader the stream is complete.
+     */
+    if (t->pipe_target) {
+        char staged_meta[PATH_MAX + 8];
+        snprintf(staged_meta, sizeof(staged_meta), "%s.json", output_path);
+
+        bool sent = pipe_writer_close(t->pipe_out, staged_meta);
+        t->pipe_out = NULL;
+        if (!sent) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " the end of the stream could not be written to stdout;\n"
+                    "       the reader will not accept the image.\n" RESET);
+            return false;
+        }
+
+        snprintf(alloc_str, sizeof(alloc_str), "none (standard output)");
+    } else if (t->remote_staging[0] != '\0') {
+        bool sent = remote_upload_sidecar(t, output_path, ".sha256", false) &&
+                    remote_upload_sidecar(t, output_path, ".idx", true) &&
+                    remote_upload_sidecar(t, output_path, ".json", false);
+
+        if (t->net_target) {
+            sent = net_writer_close(t->net_upload, sent) && sent;
+            t->net_upload = NULL;
+            if (!sent) {
+                fprintf(stderr,
+                        RED "ERROR:" WHITE " %s could not be completed on the server;\n"
+                        "       it keeps the previous image of that name, if any.\n" RESET,
+                        t->remote_location);
+                return false;
+            }
+        } else if (!sent) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " %s was uploaded, but its checksum, index or metadata\n"
+                    "       could not be; imprintr cannot restore it as it is.\n" RESET,
+                    t->remote_location);
+            return false;
+        }
+
+        output_path = t->remote_location;
+        snprintf(alloc_str, sizeof(alloc_str), t->net_target ? "on the server" : "none (object storage)");
+    }
 
     snprintf(sha_path, sizeof(sha_path), "%s", output_path);
     strncat(sha_path, ".sha256", sizeof(sha_path) - strlen(sha_path) - 1);
@@ -1085,16 +2576,28 @@ bool backup_run_cli(const char *device,
     /* ---------------------------------------------
      * Print summary
      * --------------------------------------------- */
-    fprintf(stderr,
-            YELLOW "\nImage written to:\n"
-            "    %s\n\n"
-            "Checksum written to:\n"
-            "    %s\n\n"
-            "Metadata written to:\n"
-            "    %s\n\n" RESET,
-            output_path,
-            sha_path,
-            meta_path);
+    if (t->pipe_target)
+        fprintf(stderr,
+                YELLOW "\nImage, checksum and metadata written to standard output.\n\n" RESET);
+    else
+        fprintf(stderr,
+                YELLOW "\nImage written to:\n"
+                "    %s\n\n"
+                "Checksum written to:\n"
+                "    %s\n\n"
+                "Metadata written to:\n"
+                "    %s\n\n" RESET,
+                output_path,
+                sha_path,
+                meta_path);
+
+    if (copy_count > 1) {
+        fprintf(stderr, YELLOW "Copies:\n" RESET);
+        for (int i = 0; i < copy_count; i++)
+            fprintf(stderr, "    %s  %s\n", copy_paths[i],
+                    copy_ok[i] ? GREEN "complete" RESET : RED "FAILED" RESET);
+        fprintf(stderr, "\n");
+    }
 
     fprintf(stderr,
             WHITE "Backup file size: %s\n"
@@ -1116,3 +2619,325 @@ bool backup_run_cli(const char *device,
     return true;
 }
 
+bool backup_run_cli(const char *device,
+                    const char *output_path,
+                    const char *compressor,
+                    int chunk_mb,
+                    bool force,
+                    const char *incremental_from,
+                    bool ciphertext,
+                    bool snapshot,
+                    bool rescue,
+                    const char *reuse_from,
+                    const char *const *mirrors,
+                    int mirror_count,
+                    const char *const *stripes,
+                    int stripe_count)
+{
+    BackupTarget target;
+    BackupTarget *t = &target;
+    memset(t, 0, sizeof(*t));
+
+    bool ok = run_cli(t, device, output_path, compressor, chunk_mb, force,
+                      incremental_from, ciphertext, snapshot, rescue, reuse_from,
+                      mirrors, mirror_count, stripes, stripe_count);
+
+    /* A failed backup hangs up, and the server drops what it received */
+    if (t->net_upload) {
+        net_writer_close(t->net_upload, false);
+        t->net_upload = NULL;
+    }
+
+    /* A failed stream stops without its trailer */
+    if (t->pipe_out) {
+        pipe_writer_close(t->pipe_out, NULL);
+        t->pipe_out = NULL;
+    }
+
+    if (t->remote_staging[0] != '\0')
+        remove_remote_staging(t);
+
+    return ok;
+}
+
+
+
+
+/* ---------------------------------------------------------
+ * Whole-disk backup
+ * --------------------------------------------------------- */
+
+/* Number of chunk files <image>.000, <image>.001, ... */
+static int count_image_chunks(const char *output_path)
+{
+    int count = 0;
+
+    for (unsigned i = 0; i < 1000; i++) {
+        char chunk_path[2064];
+        snprintf(chunk_path, sizeof(chunk_path), "%s.%03u", output_path, i);
+
+        struct stat st;
+        if (stat(chunk_path, &st) != 0)
+            break;
+
+        count++;
+    }
+
+    return count;
+}
+
+typedef struct {
+    DiskSet set;
+    const char *dir;
+    const char *compressor;
+    int chunk_mb;
+
+    bool ok;
+    double seconds;
+} DiskBackupJob;
+
+static bool backup_disk_partition(DiskBackupJob *job, DiskPart *part)
+{
+    const char *backend = partclone_backend_for_fs(part->fs_type);
+
+    char name[256];
+    build_default_filename(part->device, part->fs_type, name, sizeof(name));
+
+    char output_path[2048];
+    snprintf(output_path, sizeof(output_path), "%s/%s", job->dir, name);
+
+    fprintf(stderr,
+            YELLOW "\nImaging %s (%s) to %s\n" RESET,
+            part->device, part->fs_type, output_path);
+
+    drop_stale_metadata(output_path);
+
+    BackupTarget target;
+    memset(&target, 0, sizeof(target));
+
+    if (!run_backup_pipeline(backend,
+                             part->device,
+                             part->fs_type,
+                             output_path,
+                             job->compressor,
+                             job->chunk_mb,
+                             &target))
+        return false;
+
+    int chunk_count = (job->chunk_mb > 0) ? count_image_chunks(output_path) : 1;
+
+    write_metadata(output_path,
+                   part->device,
+                   part->fs_type,
+                   backend,
+                   gx_config.compression,
+                   job->chunk_mb,
+                   chunk_count);
+
+    snprintf(part->image, sizeof(part->image), "%s", name);
+    return true;
+}
+
+/* One thread per physical disk: its partitions are imaged in order */
+static void *backup_disk_main(void *arg)
+{
+    DiskBackupJob *job = arg;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    job->ok = diskset_save_table(&job->set, job->dir);
+
+    for (int i = 0; job->ok && i < job->set.count; i++)
+        job->ok = backup_disk_partition(job, &job->set.parts[i]);
+
+    if (job->ok) {
+        char manifest[2048];
+        diskset_manifest_path(job->dir, job->set.disk, manifest, sizeof(manifest));
+        job->ok = diskset_write_manifest(&job->set, manifest);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    job->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    return NULL;
+}
+
+bool backup_run_disks(const char *const *disks,
+                      int disk_count,
+                      const char *target_dir,
+                      const char *compressor,
+                      int chunk_mb,
+                      bool force)
+{
+    if (geteuid() != 0) {
+        ui_error(RED "This operation requires root privileges. Please run Imprint with sudo." RESET);
+        return false;
+    }
+
+    if (!is_program_available("sfdisk")) {
+        ui_error(WHITE "Whole-disk backups require sfdisk (util-linux)." RESET);
+        return false;
+    }
+
+    struct stat st;
+    if (stat(target_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        ui_error(RED "Output directory does not exist." RESET);
+        return false;
+    }
+
+    DiskBackupJob *jobs = calloc((size_t)disk_count, sizeof(*jobs));
+    if (!jobs)
+        return false;
+
+    /* ---------------------------------------------
+     * Plan: partitions, filesystems, mounted checks
+     * --------------------------------------------- */
+    bool ok = true;
+    bool outputs_exist = false;
+
+    for (int d = 0; ok && d < disk_count; d++) {
+        DiskBackupJob *job = &jobs[d];
+
+        for (int k = 0; k < d; k++) {
+            if (strcmp(disks[k], disks[d]) == 0) {
+                fprintf(stderr, RED "ERROR:" WHITE " %s was given twice.\n" RESET, disks[d]);
+                ok = false;
+            }
+        }
+
+        if (!ok || !diskset_scan(disks[d], &job->set)) {
+            ok = false;
+            break;
+        }
+
+        job->dir = target_dir;
+        job->compressor = compressor;
+        job->chunk_mb = chunk_mb;
+
+        char manifest[2048];
+        diskset_manifest_path(target_dir, disks[d], manifest, sizeof(manifest));
+        if (stat(manifest, &st) == 0)
+            outputs_exist = true;
+
+        fprintf(stderr, YELLOW "\n%s:\n" RESET, disks[d]);
+
+        for (int i = 0; i < job->set.count; i++) {
+            DiskPart *part = &job->set.parts[i];
+
+            if (gx_is_partition_mounted(part->device)) {
+                fprintf(stderr,
+                        RED "ERROR:" WHITE " %s is mounted and cannot be backed up.\n" RESET,
+                        part->device);
+                ok = false;
+                continue;
+            }
+
+            if (!get_fs_type(part->device, part->fs_type, sizeof(part->fs_type)))
+                snprintf(part->fs_type, sizeof(part->fs_type), "unknown");
+
+            fprintf(stderr,
+                    WHITE "    %-24s %-12s %s\n" RESET,
+                    part->device,
+                    part->fs_type,
+                    partclone_backend_for_fs(part->fs_type));
+
+            char name[256];
+            build_default_filename(part->device, part->fs_type, name, sizeof(name));
+
+            char output_path[2048];
+            snprintf(output_path, sizeof(output_path), "%s/%s", target_dir, name);
+
+            if (backup_outputs_exist(output_path))
+                outputs_exist = true;
+        }
+    }
+
+    if (!ok) {
+        free(jobs);
+        return false;
+    }
+
+    /* ---------------------------------------------
+     * Overwrite confirmation (once for the whole set)
+     * --------------------------------------------- */
+    if (!force && outputs_exist) {
+        fprintf(stderr,
+                YELLOW "\nWARNING:" WHITE " Backup files already exist in:\n"
+                "    %s\n\n"
+                "They will be overwritten.\n"
+                "Proceed? [y/N]: " RESET,
+                target_dir);
+
+        fflush(stderr);
+
+        char buf[16] = {0};
+        if (!fgets(buf, sizeof(buf), stdin) || (buf[0] != 'y' && buf[0] != 'Y')) {
+            fprintf(stderr, WHITE "Backup cancelled.\n");
+            free(jobs);
+            return false;
+        }
+    }
+
+    if (!gx_test_fifo_capability(target_dir)) {
+        snprintf(gx_workdir_override, sizeof(gx_workdir_override),
+                 "/tmp/imprint_work");
+        mkdir(gx_workdir_override, 0700);
+    } else {
+        gx_workdir_override[0] = '\0';
+    }
+
+    /* ---------------------------------------------
+     * One worker per disk
+     * --------------------------------------------- */
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pthread_t *threads = calloc((size_t)disk_count, sizeof(*threads));
+    bool *started = calloc((size_t)disk_count, sizeof(*started));
+
+    for (int d = 0; threads && started && d < disk_count; d++)
+        started[d] = (pthread_create(&threads[d], NULL, backup_disk_main, &jobs[d]) == 0);
+
+    for (int d = 0; d < disk_count; d++) {
+        if (threads && started && started[d])
+            pthread_join(threads[d], NULL);
+        else
+            jobs[d].ok = false;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double duration_sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    free(threads);
+    free(started);
+
+    /* ---------------------------------------------
+     * Summary
+     * --------------------------------------------- */
+    fprintf(stderr, WHITE "\n----------------------------------------\n" RESET);
+
+    for (int d = 0; d < disk_count; d++) {
+        char manifest[2048];
+        diskset_manifest_path(target_dir, disks[d], manifest, sizeof(manifest));
+
+        if (jobs[d].ok) {
+            fprintf(stderr,
+                    GREEN "%s" WHITE " backed up in %.2f seconds\n"
+                    "    Manifest: %s\n" RESET,
+                    disks[d], jobs[d].seconds, manifest);
+        } else {
+            fprintf(stderr, RED "%s" WHITE " backup FAILED\n" RESET, disks[d]);
+            ok = false;
+        }
+    }
+
+    fprintf(stderr, WHITE "Total duration: %.2f seconds\n" RESET, duration_sec);
+    fprintf(stderr, WHITE "----------------------------------------\n" RESET);
+
+    if (ok)
+        fprintf(stderr, GREEN "Disk backup completed successfully.\n" RESET);
+
+    free(jobs);
+    return ok;
+}
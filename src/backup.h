@@ -22,6 +22,10 @@
  *  - chunk_override_set tells us whether the user explicitly provided --chunk
  *    (this allows distinguishing "no override" from "--chunk 0")
  */
+#define BACKUP_MAX_DISKS 16
+#define BACKUP_MAX_TARGETS 8
+#define BACKUP_MAX_STRIPES 7   /* besides the --target directory */
+
 typedef struct {
     bool cli_mode;
     bool parse_error;
@@ -34,15 +38,45 @@ typedef struct {
     bool chunk_override_set;
 
     bool force;   /* NEW */
+    bool native;  /* --native: use the native ext2/3/4 and NTFS readers */
+    bool cache_neutral;  /* --cache-neutral: keep the image out of the page cache */
+    bool verify_writes;  /* --verify-writes: read the image back as it is written */
+
+    const char *incremental_from;   /* --incremental-from <parent image> */
+    const char *cbt_setup;          /* --cbt-setup <device> */
+    const char *cbt_meta;           /* --cbt-meta <metadata device> */
+    bool ciphertext;                /* --ciphertext: LUKS passthrough */
+    bool snapshot;                  /* --snapshot: read a live source from a snapshot */
+    bool rescue;                    /* --rescue: failing-disk reader */
+    const char *reuse_from;         /* --reuse-from <earlier image>: reflink identical frames */
+
+    const char *mirrors[BACKUP_MAX_TARGETS - 1];  /* --target given again: copies */
+    int mirror_count;
+
+    const char *stripes[BACKUP_MAX_STRIPES];      /* --stripe <dir>, repeatable */
+    int stripe_count;
+
+    const char *disks[BACKUP_MAX_DISKS];   /* --disk <disk>, repeatable */
+    int disk_count;
 } BackupCLIArgs;
 
 /*
  * Parse CLI arguments for imprintb.
  * Supports:
  *   --source <device>
- *   --target <path>
+ *   --target <path>   (repeatable: a copy of the image in each)
  *   --compress <type>
  *   --chunk <size_mb>
+ *   --disk <disk>     (whole-disk mode; --target is then a directory)
+ *   --native          (native parallel readers for ext2/3/4 and NTFS)
+ *   --cache-neutral   (image written without filling the page cache)
+ *   --incremental-from <image>   (delta since <image>, dm-era sources only)
+ *   --cbt-setup <device> --cbt-meta <device>   (create the dm-era device)
+ *   --ciphertext      (image the encrypted partition under a LUKS mapper)
+ *   --snapshot        (back up a mounted LVM/dm source from a snapshot)
+ *   --rescue          (failing disk: bad areas skipped, retried last)
+ *   --reuse-from <image>         (reflink frames identical to <image>)
+ *   --stripe <dir>    (repeatable: spread the chunks over more directories)
  *   <device> <path>   (positional fallback)
  *
  * Returns true if CLI mode should be used.
@@ -58,14 +92,53 @@ bool parse_backup_cli_args(int argc, char **argv, BackupCLIArgs *out);
  *   - effective compressor (config or override)
  *   - effective chunk size (config or override)
  *
+ * incremental_from (may be NULL) names the parent image: only blocks
+ * written since it was taken are stored (see cbt.h).  ciphertext
+ * images the LUKS partition under the mapper `device` (see luks.h).
+ * snapshot reads a mounted `device` through a temporary snapshot
+ * (see snapshot.h).  rescue reads a failing `device` with the
+ * skip-and-retry reader (see rescue.h).
+ *
+ * output_path may be repo://<dir>/<name>: the image is stored in a
+ * deduplicating repository instead (see repo.h).  reuse_from (may be
+ * NULL) names an earlier framed image on the same btrfs or XFS
+ * filesystem whose identical frames are reflinked (see imgwriter.h).
+ * mirrors (mirror_count entries) are further targets that receive the
+ * same image at the same time; the mirror_* settings decide whether
+ * one complete copy is enough.  stripes (stripe_count entries) are
+ * further directories the chunk files are spread over (see stripe.h).
+ *
  * Returns true on success, false on failure.
  */
 bool backup_run_cli(const char *device,
                     const char *output_path,
                     const char *compressor,
                     int chunk_mb,
-                    bool force);
+                    bool force,
+                    const char *incremental_from,
+                    bool ciphertext,
+                    bool snapshot,
+                    bool rescue,
+                    const char *reuse_from,
+                    const char *const *mirrors,
+                    int mirror_count,
+                    const char *const *stripes,
+                    int stripe_count);
 
+/*
+ * Whole-disk backup: save the partition table and boot area of each
+ * disk and image every supported partition into target_dir (see
+ * diskset.h for the layout).  Partitions of one disk are imaged one
+ * after another; different disks are imaged concurrently.
+ *
+ * Returns true only if every disk was backed up completely.
+ */
+bool backup_run_disks(const char *const *disks,
+                      int disk_count,
+                      const char *target_dir,
+                      const char *compressor,
+                      int chunk_mb,
+                      bool force);
 
 /*
  * Run an interactive backup session:
@@ -89,13 +162,17 @@ bool backup_run_interactive(void);
  *
  * compressor = effective compressor (config or override)
  * chunk_mb   = effective chunk size (config or override)
+ * target     = where the image goes (NULL: a plain local image)
  */
+typedef struct BackupTarget BackupTarget;
+
 bool run_backup_pipeline(const char *backend,
                          const char *device,
                          const char *fs_type,
                          const char *output_path,
                          const char *compressor,
-                         int chunk_mb);
+                         int chunk_mb,
+                         BackupTarget *target);
 
 void print_backup_usage(void);
 
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+
+#include "cast.h"
+#include "netimg.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#define CAST_MAGIC 0x43504d49u   /* "IMPC" */
+
+bool cast_parse_group(const char *spec, CastGroup *out)
+{
+    char host[64];
+    const char *colon = strchr(spec, ':');
+    size_t hlen = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    if (hlen == 0 || hlen >= sizeof(host))
+        return false;
+    memcpy(host, spec, hlen);
+    host[hlen] = '\0';
+
+    if (inet_pton(AF_INET, host, &out->group) != 1 || !IN_MULTICAST(ntohl(out->group.s_addr)))
+        return false;
+
+    out->port = CAST_DEFAULT_PORT;
+    if (colon) {
+        char *end;
+        long port = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535)
+            return false;
+        out->port = (uint16_t)port;
+    }
+
+    return true;
+}
+
+bool cast_parse_url(const char *url, CastGroup *out)
+{
+    size_t plen = strlen(CAST_PREFIX);
+
+    if (!url || strncmp(url, CAST_PREFIX, plen) != 0)
+        return false;
+
+    /* A trailing slash is harmless */
+    char spec[80];
+    snprintf(spec, sizeof(spec), "%s", url + plen);
+    size_t len = strlen(spec);
+    if (len > 0 && spec[len - 1] == '/')
+        spec[len - 1] = '\0';
+
+    return cast_parse_group(spec, out);
+}
+
+size_t cast_pack(unsigned char *pkt, uint16_t type, uint32_t session, uint32_t seq,
+                 const void *payload, size_t len)
+{
+    cast_put_le32(pkt, CAST_MAGIC);
+    pkt[4] = (unsigned char)type;
+    pkt[5] = (unsigned char)(type >> 8);
+    pkt[6] = pkt[7] = 0;
+    cast_put_le32(pkt + 8, session);
+    cast_put_le32(pkt + 12, seq);
+    cast_put_le32(pkt + 16, (uint32_t)len);
+    cast_put_le32(pkt + 20, net_crc32c(0, payload, len));
+
+    if (len > 0)
+        memcpy(pkt + CAST_HEADER_SIZE, payload, len);
+    return CAST_HEADER_SIZE + len;
+}
+
+bool cast_unpack(const unsigned char *pkt, size_t n, CastHeader *h)
+{
+    if (n < CAST_HEADER_SIZE || cast_le32(pkt) != CAST_MAGIC)
+        return false;
+
+    h->type = (uint16_t)(pkt[4] | pkt[5] << 8);
+    h->session = cast_le32(pkt + 8);
+    h->seq = cast_le32(pkt + 12);
+    h->len = cast_le32(pkt + 16);
+
+    return h->len == n - CAST_HEADER_SIZE &&
+           net_crc32c(0, pkt + CAST_HEADER_SIZE, h->len) == cast_le32(pkt + 20);
+}
+
+int cast_socket(const CastGroup *g, const char *interface, bool receiver, int ttl)
+{
+    struct in_addr ifaddr = { htonl(INADDR_ANY) };
+
+    if (interface && interface[0] != '\0' && inet_pton(AF_INET, interface, &ifaddr) != 1) {
+        fprintf(stderr, RED "ERROR:" WHITE " not an IPv4 interface address: %s\n" RESET, interface);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " socket: %s\n" RESET, strerror(errno));
+        return -1;
+    }
+
+    /* Room for bursts while the restore is busy writing */
+    int bufsize = 8 * 1024 * 1024;
+    setsockopt(fd, SOL_SOCKET, receiver ? SO_RCVBUF : SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    if (receiver) {
+        /* Several receivers on one machine share the port */
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        addr.sin_addr = g->group;
+        addr.sin_port = htons(g->port);
+
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = g->group;
+        mreq.imr_interface = ifaddr;
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot join %s port %u: %s\n" RESET,
+                    inet_ntoa(g->group), g->port, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    } else {
+        unsigned char loop = 1, hops = (unsigned char)ttl;
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+
+        if ((ifaddr.s_addr != htonl(INADDR_ANY) &&
+             setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) != 0) ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot send to %s: %s\n" RESET,
+                    inet_ntoa(g->group), strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* -------------------------------------------------------------
+ * Receiver
+ *
+ * A thread takes the packets into a ring of `window` slots: packet s
+ * goes to slot s % window, from the next one the restore needs (cons)
+ * up to a window ahead.  It also does the talking: JOIN until
+ * accepted, then STATUS every CAST_STATUS_MS.
+ * ------------------------------------------------------------- */
+#define CAST_STATUS_MS 50
+#define CAST_JOIN_MS   200
+
+struct CastReader {
+    int fd;
+    CastGroup group;
+    uint32_t id;
+
+    pthread_t thread;
+    bool started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    bool have_session;
+    uint32_t session;
+    struct sockaddr_in sender;
+    uint64_t meta_size;
+    uint64_t total;             /* metadata + image bytes */
+    uint32_t npackets;
+    uint32_t window;
+    unsigned char *ring;        /* window * CAST_PAYLOAD */
+    unsigned char *have;        /* per slot */
+
+    uint32_t cons;              /* next packet the restore needs */
+    size_t cons_off;            /* bytes of it already read */
+    uint32_t seen;              /* one past the highest packet known sent */
+
+    bool joined;
+    bool failed;
+    bool stop;
+    char why[160];
+    double last_heard;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t packet_len(const CastReader *r, uint32_t seq)
+{
+    uint64_t off = (uint64_t)seq * CAST_PAYLOAD;
+    uint64_t left = r->total - off;
+    return left < CAST_PAYLOAD ? (uint32_t)left : CAST_PAYLOAD;
+}
+
+static void send_to_sender(CastReader *r, uint16_t type, uint32_t seq,
+                           const void *payload, size_t len)
+{
+    unsigned char pkt[CAST_PACKET_MAX];
+    size_t n = cast_pack(pkt, type, r->session, seq, payload, len);
+    sendto(r->fd, pkt, n, MSG_DONTWAIT, (struct sockaddr *)&r->sender, sizeof(r->sender));
+}
+
+/* First ANNOUNCE: size the ring (lock held) */
+static void adopt_session(CastReader *r, const CastHeader *h, const unsigned char *p,
+                          const struct sockaddr_in *from)
+{
+    uint64_t meta = cast_le64(p);
+    uint64_t image = cast_le64(p + 8);
+    uint32_t window = cast_le32(p + 16);
+    uint64_t npackets = (meta + image + CAST_PAYLOAD - 1) / CAST_PAYLOAD;
+
+    if (window == 0 || (uint64_t)window * CAST_PAYLOAD > (uint64_t)CAST_MAX_WINDOW_MB << 20 ||
+        npackets > UINT32_MAX) {
+        snprintf(r->why, sizeof(r->why), "the sender announced an unusable transfer");
+        r->failed = true;
+        return;
+    }
+
+    r->ring = malloc((size_t)window * CAST_PAYLOAD);
+    r->have = calloc(window, 1);
+    if (!r->ring || !r->have) {
+        snprintf(r->why, sizeof(r->why), "not enough memory for a %u MB window",
+                 (unsigned)((uint64_t)window * CAST_PAYLOAD >> 20));
+        r->failed = true;
+        return;
+    }
+
+    r->have_session = true;
+    r->session = h->session;
+    r->sender = *from;
+    r->meta_size = meta;
+    r->total = meta + image;
+    r->npackets = (uint32_t)npackets;
+    r->window = window;
+
+    fprintf(stderr, YELLOW "Found imprint-cast at %s: %.2f MB image, joining...\n" RESET,
+            inet_ntoa(from->sin_addr), image / (1024.0 * 1024.0));
+}
+
+static void take_packet(CastReader *r, const unsigned char *pkt, size_t n,
+                        const struct sockaddr_in *from)
+{
+    CastHeader h;
+    if (!cast_unpack(pkt, n, &h))
+        return;
+
+    const unsigned char *p = pkt + CAST_HEADER_SIZE;
+
+    pthread_mutex_lock(&r->lock);
+
+    if (!r->have_session) {
+        if (h.type == CAST_ANNOUNCE && h.len >= 32 && !r->failed)
+            adopt_session(r, &h, p, from);
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+    if (h.session != r->session) {
+        pthread_mutex_unlock(&r->lock);
+        return;
+    }
+
+    r->last_heard = now_sec();
+
+    switch (h.type) {
+    case CAST_ANNOUNCE:
+        /* Only the end of the stream is NAKed from what the sender says */
+        if (h.len >= 32 && cast_le32(p + 20) == r->npackets)
+            r->seen = r->npackets;
+        break;
+
+    case CAST_ACCEPT:
+    case CAST_REJECT:
+        if (h.len < 4 || cast_le32(p) != r->id || r->joined)
+            break;
+        if (h.type == CAST_ACCEPT) {
+            r->joined = true;
+        } else {
+            snprintf(r->why, sizeof(r->why), "%.*s", (int)(h.len - 4), (const char *)p + 4);
+            r->failed = true;
+        }
+        pthread_cond_broadcast(&r->cond);
+        break;
+
+    case CAST_DATA: {
+        uint32_t seq = h.seq;
+        if (!r->joined || seq < r->cons || seq - r->cons >= r->window ||
+            seq >= r->npackets || h.len != packet_len(r, seq))
+            break;
+
+        uint32_t slot = seq % r->window;
+        if (!r->have[slot]) {
+            memcpy(r->ring + (size_t)slot * CAST_PAYLOAD, p, h.len);
+            r->have[slot] = 1;
+            if (seq == r->cons)
+                pthread_cond_broadcast(&r->cond);
+        }
+        if (seq + 1 > r->seen)
+            r->seen = seq + 1;
+        break;
+    }
+    }
+
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* STATUS: the next packet needed and the gaps up to the highest seen */
+static void send_status(CastReader *r)
+{
+    unsigned char payload[4 + CAST_MAX_NAKS * 8];
+    size_t len = 4;
+    int naks = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    uint32_t cons = r->cons;
+    uint32_t end = r->seen;
+    if (end > cons + r->window)
+        end = cons + r->window;
+
+    for (uint32_t s = cons; s < end && naks < CAST_MAX_NAKS; s++) {
+        if (r->have[s % r->window])
+            continue;
+
+        uint32_t first = s;
+        while (s < end && !r->have[s % r->window])
+            s++;
+        cast_put_le32(payload + len, first);
+        cast_put_le32(payload + len + 4, s - first);
+        len += 8;
+        naks++;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+
+    cast_put_le32(payload, r->id);
+    send_to_sender(r, CAST_STATUS, cons, payload, len);
+}
+
+static void *receive_main(void *arg)
+{
+    CastReader *r = arg;
+    unsigned char pkt[CAST_PACKET_MAX + 64];
+    double next_talk = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop)
+            break;
+
+        struct pollfd pfd = { r->fd, POLLIN, 0 };
+        poll(&pfd, 1, 10);
+
+        for (;;) {
+            struct sockaddr_in from;
+            socklen_t flen = sizeof(from);
+            ssize_t n = recvfrom(r->fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                                 (struct sockaddr *)&from, &flen);
+            if (n < 0)
+                break;
+            take_packet(r, pkt, (size_t)n, &from);
+        }
+
+        double now = now_sec();
+        if (now < next_talk)
+            continue;
+
+        pthread_mutex_lock(&r->lock);
+        bool have_session = r->have_session && !r->failed;
+        bool joined = r->joined;
+        if (have_session && now - r->last_heard > CAST_TIMEOUT_SEC) {
+            snprintf(r->why, sizeof(r->why), "the sender has gone silent");
+            r->failed = true;
+            pthread_cond_broadcast(&r->cond);
+            have_session = false;
+        }
+        pthread_mutex_unlock(&r->lock);
+
+        if (have_session && joined) {
+            send_status(r);
+            next_talk = now + CAST_STATUS_MS / 1000.0;
+        } else if (have_session) {
+            unsigned char id[4];
+            cast_put_le32(id, r->id);
+            send_to_sender(r, CAST_JOIN, 0, id, sizeof(id));
+            next_talk = now + CAST_JOIN_MS / 1000.0;
+        }
+    }
+
+    return NULL;
+}
+
+CastReader *cast_reader_open(const CastGroup *g, const char *interface)
+{
+    CastReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->group = *g;
+    r->fd = cast_socket(g, interface, true, 0);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    if (getrandom(&r->id, sizeof(r->id), 0) != sizeof(r->id))
+        r->id = (uint32_t)getpid() ^ (uint32_t)time(NULL);
+    r->last_heard = now_sec();
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    fprintf(stderr, YELLOW "Waiting for imprint-cast on %s port %u...\n" RESET,
+            inet_ntoa(g->group), g->port);
+
+    if (pthread_create(&r->thread, NULL, receive_main, r) != 0) {
+        cast_reader_close(r);
+        return NULL;
+    }
+    r->started = true;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->joined && !r->failed)
+        pthread_cond_wait(&r->cond, &r->lock);
+    bool ok = r->joined && !r->failed;
+    pthread_mutex_unlock(&r->lock);
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " imprint-cast on %s: %s\n" RESET,
+                inet_ntoa(g->group), r->why);
+        cast_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+uint64_t cast_reader_meta_size(const CastReader *r)
+{
+    return r->meta_size;
+}
+
+ssize_t cast_reader_read(CastReader *r, void *buf, size_t len)
+{
+    unsigned char *out = buf;
+    size_t done = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (done < len) {
+        if (r->cons >= r->npackets)
+            break;
+
+        uint32_t slot = r->cons % r->window;
+
+        if (!r->have[slot]) {
+            /* Hand over what there is before waiting */
+            if (done > 0)
+                break;
+            if (r->failed) {
+                fprintf(stderr, RED "\nERROR:" WHITE " multicast restore: %s\n" RESET, r->why);
+                pthread_mutex_unlock(&r->lock);
+                return -1;
+            }
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+
+        size_t plen = packet_len(r, r->cons);
+        size_t take = plen - r->cons_off;
+        if (take > len - done)
+            take = len - done;
+
+        memcpy(out + done, r->ring + (size_t)slot * CAST_PAYLOAD + r->cons_off, take);
+        done += take;
+        r->cons_off += take;
+
+        if (r->cons_off == plen) {
+            r->have[slot] = 0;
+            r->cons++;
+            r->cons_off = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return (ssize_t)done;
+}
+
+void cast_reader_close(CastReader *r)
+{
+    if (!r)
+        return;
+
+    if (r->started) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_mutex_unlock(&r->lock);
+        pthread_join(r->thread, NULL);
+    }
+
+    /* The last word: complete (a few times, it is UDP), or gone */
+    if (r->have_session && r->joined) {
+        if (r->cons >= r->npackets) {
+            for (int i = 0; i < 3; i++)
+                send_status(r);
+        } else {
+            unsigned char id[4];
+            cast_put_le32(id, r->id);
+            send_to_sender(r, CAST_LEAVE, r->cons, id, sizeof(id));
+        }
+    }
+
+    close(r->fd);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->ring);
+    free(r->have);
+    free(r);
+}
@@ -0,0 +1,143 @@
+#ifndef CAST_H
+#define CAST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+ * One image to many machines over UDP multicast.
+ *
+ * `imprint-cast --image <image>` sends the metadata followed by the
+ * compressed image, cut into numbered packets of CAST_PAYLOAD bytes, to
+ * a multicast group once, whatever the number of receivers.
+ * `imprintr --image mcast://<group>[:<port>] --target <device>` joins
+ * the group, restores the image as it arrives, and tells the sender
+ * how far it got (STATUS): the next packet it needs, plus the ranges
+ * it is missing below the highest one seen (NAKs).  Missing packets
+ * are multicast again, once for every receiver that lost them.
+ *
+ * The sender keeps the last `window` packets for repairs and never
+ * runs more than that ahead of the slowest receiver, so a receiver
+ * with a slow disk holds the transfer back rather than falling out of
+ * it.  A receiver silent for CAST_TIMEOUT_SEC is dropped.
+ *
+ * Every packet is a 24-byte header and a payload:
+ *
+ *   magic "IMPC", type (u16), 0 (u16), session, seq, payload length,
+ *   CRC-32C of the payload (all little-endian, u32 unless noted)
+ *
+ *   ANNOUNCE  sender, every CAST_ANNOUNCE_MS: meta size (u64), image
+ *             size (u64), window (packets), packets sent so far,
+ *             started (0/1)
+ *   JOIN      receiver id; answered by ACCEPT or REJECT (multicast,
+ *             "<id>" then a reason)
+ *   DATA      packet seq of the metadata + image stream
+ *   STATUS    receiver id, then up to CAST_MAX_NAKS (first, count)
+ *             ranges; seq = next packet needed
+ *   LEAVE     receiver id: gave up before the end
+ *
+ * IPv4 only; there is no authentication or encryption.
+ */
+
+#define CAST_PREFIX              "mcast://"
+#define CAST_DEFAULT_GROUP       "239.255.74.93"
+#define CAST_DEFAULT_PORT        7494
+#define CAST_PAYLOAD             1400
+#define CAST_HEADER_SIZE         24
+#define CAST_PACKET_MAX          (CAST_HEADER_SIZE + CAST_PAYLOAD)
+#define CAST_DEFAULT_RATE_MBIT   500
+#define CAST_DEFAULT_WINDOW_MB   64
+#define CAST_MAX_WINDOW_MB       1024
+#define CAST_MAX_RECEIVERS       256
+#define CAST_MAX_NAKS            64
+#define CAST_ANNOUNCE_MS         100
+#define CAST_TIMEOUT_SEC         30
+
+enum {
+    CAST_ANNOUNCE = 1,
+    CAST_JOIN,
+    CAST_ACCEPT,
+    CAST_REJECT,
+    CAST_DATA,
+    CAST_STATUS,
+    CAST_LEAVE
+};
+
+typedef struct {
+    struct in_addr group;
+    uint16_t port;
+} CastGroup;
+
+typedef struct {
+    uint16_t type;
+    uint32_t session;
+    uint32_t seq;
+    uint32_t len;
+} CastHeader;
+
+static inline void cast_put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline void cast_put_le64(unsigned char *p, uint64_t v)
+{
+    cast_put_le32(p, (uint32_t)v);
+    cast_put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t cast_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t cast_le64(const unsigned char *p)
+{
+    return (uint64_t)cast_le32(p) | (uint64_t)cast_le32(p + 4) << 32;
+}
+
+/* "<group>[:<port>]"; false unless group is an IPv4 multicast address */
+bool cast_parse_group(const char *spec, CastGroup *out);
+
+/* "mcast://<group>[:<port>]" */
+bool cast_parse_url(const char *url, CastGroup *out);
+
+/* Header + payload into pkt (CAST_PACKET_MAX bytes); the packet length. */
+size_t cast_pack(unsigned char *pkt, uint16_t type, uint32_t session, uint32_t seq,
+                 const void *payload, size_t len);
+
+/* Check magic, length and CRC of a received packet. */
+bool cast_unpack(const unsigned char *pkt, size_t n, CastHeader *h);
+
+/*
+ * UDP socket for the group.  A receiver binds the group port and joins
+ * on `interface` (IPv4 address of the local interface, NULL or "" =
+ * the system's choice); a sender binds an ephemeral port and sends
+ * through that interface with the given TTL.  -1 on failure (printed).
+ */
+int cast_socket(const CastGroup *g, const char *interface, bool receiver, int ttl);
+
+typedef struct CastReader CastReader;
+
+/*
+ * Join the group and wait for a sender to accept this receiver (until
+ * one shows up).  NULL on failure (printed).
+ */
+CastReader *cast_reader_open(const CastGroup *g, const char *interface);
+
+/* Bytes of metadata at the start of the stream, before the image. */
+uint64_t cast_reader_meta_size(const CastReader *r);
+
+/* Same contract as image_reader_read() (see prefetch.h). */
+ssize_t cast_reader_read(CastReader *r, void *buf, size_t len);
+
+/* Stop receiving; tells the sender whether all of it arrived. */
+void cast_reader_close(CastReader *r);
+
+#endif /* CAST_H */
@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+
+#include "cbt.h"
+#include "utils.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* -------------------------------------------------------------
+ * dmsetup helpers
+ * ------------------------------------------------------------- */
+static bool dm_first_line(const char *verb, const char *device, char *out, size_t out_len)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "dmsetup %s '%s' 2>/dev/null", verb, device);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return false;
+
+    bool ok = fgets(out, (int)out_len, fp) != NULL;
+    int rc = pclose(fp);
+
+    return ok && rc != -1 && WIFEXITED(rc) && WEXITSTATUS(rc) == 0;
+}
+
+static bool dm_message(const char *device, const char *msg)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "dmsetup message '%s' 0 %s", device, msg);
+
+    int rc = system(cmd);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " dm-era message '%s' to %s failed\n" RESET, msg, device);
+        return false;
+    }
+    return true;
+}
+
+bool cbt_probe(const char *device, CbtDevice *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    char line[512];
+    if (!dm_first_line("table", device, line, sizeof(line)))
+        return false;
+
+    /* "0 <sectors> era <metadata maj:min> <origin maj:min> <block sectors>" */
+    char target[32], meta[32], origin[32];
+    unsigned bs = 0;
+
+    if (sscanf(line, "%*u %*u %31s %31s %31s %u", target, meta, origin, &bs) != 4 ||
+        strcmp(target, "era") != 0 || bs == 0)
+        return false;
+
+    snprintf(out->metadata_dev, sizeof(out->metadata_dev), "/dev/block/%s", meta);
+    snprintf(out->origin_dev, sizeof(out->origin_dev), "/dev/block/%s", origin);
+    out->block_sectors = bs;
+    return true;
+}
+
+static bool current_era(const char *device, uint32_t *era)
+{
+    char line[512];
+    if (!dm_first_line("status", device, line, sizeof(line)))
+        return false;
+
+    /* "0 <sectors> era <md block size> <used>/<total> <current era> <held root>" */
+    char target[32];
+    unsigned e = 0;
+
+    if (sscanf(line, "%*u %*u %31s %*u %*s %u", target, &e) != 2 ||
+        strcmp(target, "era") != 0)
+        return false;
+
+    *era = e;
+    return true;
+}
+
+bool cbt_checkpoint(const char *device, uint32_t *era)
+{
+    if (!dm_message(device, "checkpoint"))
+        return false;
+
+    if (!current_era(device, era)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read the current era of %s\n" RESET, device);
+        return false;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Setup
+ * ------------------------------------------------------------- */
+bool cbt_setup(const char *origin, const char *metadata_dev)
+{
+    if (!metadata_dev) {
+        fprintf(stderr, RED "ERROR:" WHITE " --cbt-setup needs --cbt-meta <metadata device>\n" RESET);
+        return false;
+    }
+
+    if (!is_program_available("dmsetup")) {
+        fprintf(stderr, RED "ERROR:" WHITE " dmsetup is not installed.\n" RESET);
+        return false;
+    }
+
+    struct stat st;
+    if (stat(origin, &st) != 0 || !S_ISBLK(st.st_mode) ||
+        stat(metadata_dev, &st) != 0 || !S_ISBLK(st.st_mode)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s and %s must both be block devices.\n" RESET,
+                origin, metadata_dev);
+        return false;
+    }
+
+    if (gx_is_partition_mounted(origin)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s is mounted; unmount it first.\n" RESET, origin);
+        return false;
+    }
+
+    long long size = get_partition_size_bytes(origin);
+    if (size <= 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot determine the size of %s\n" RESET, origin);
+        return false;
+    }
+
+    const char *base = strrchr(origin, '/');
+    base = base ? base + 1 : origin;
+
+    char name[128];
+    snprintf(name, sizeof(name), CBT_DM_PREFIX "%s", base);
+
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd),
+             "dmsetup create '%s' --table '0 %lld era %s %s %d'",
+             name, size / 512, metadata_dev, origin, CBT_BLOCK_SECTORS);
+
+    fprintf(stderr, YELLOW "Creating dm-era device:\n" GREEN "     %s\n" RESET, cmd);
+
+    int rc = system(cmd);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " dmsetup create failed.\n" RESET);
+        return false;
+    }
+
+    fprintf(stderr,
+            GREEN "\nChanged-block tracking is active on /dev/mapper/%s.\n" RESET
+            WHITE "  - Mount and back up /dev/mapper/%s instead of %s.\n"
+            "  - Run this command again after every boot, before mounting;\n"
+            "    the history is kept on %s.\n"
+            "  - The first backup of the era device is a full image; later runs can use\n"
+            "    --incremental-from <previous image>.\n" RESET,
+            name, name, origin, metadata_dev);
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Changed ranges (era_invalidate XML)
+ * ------------------------------------------------------------- */
+static bool xml_attr(const char *line, const char *attr, uint64_t *out)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "%s=\"", attr);
+
+    const char *p = strstr(line, key);
+    if (!p)
+        return false;
+
+    *out = strtoull(p + strlen(key), NULL, 10);
+    return true;
+}
+
+static bool push_range(RawRange **ranges, size_t *count, size_t *cap,
+                       uint64_t offset, uint64_t length)
+{
+    /* Tools emit ascending blocks; merge neighbours as they come */
+    if (*count > 0) {
+        RawRange *last = &(*ranges)[*count - 1];
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return true;
+        }
+    }
+
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        RawRange *grown = realloc(*ranges, *cap * sizeof(*grown));
+        if (!grown)
+            return false;
+        *ranges = grown;
+    }
+
+    (*ranges)[(*count)++] = (RawRange){ offset, length };
+    return true;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const RawRange *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Sort and merge overlapping or touching ranges in place */
+static void normalize_ranges(RawRange *ranges, size_t *count)
+{
+    if (*count < 2)
+        return;
+
+    qsort(ranges, *count, sizeof(*ranges), range_cmp);
+
+    size_t out = 0;
+    for (size_t i = 1; i < *count; i++) {
+        RawRange *last = &ranges[out];
+        uint64_t last_end = last->offset + last->length;
+
+        if (ranges[i].offset <= last_end) {
+            uint64_t end = ranges[i].offset + ranges[i].length;
+            if (end > last_end)
+                last->length = end - last->offset;
+        } else {
+            ranges[++out] = ranges[i];
+        }
+    }
+    *count = out + 1;
+}
+
+bool cbt_changed_ranges(const char *device, uint32_t since,
+                        RawRange **ranges, size_t *count)
+{
+    *ranges = NULL;
+    *count = 0;
+
+    CbtDevice cbt;
+    if (!cbt_probe(device, &cbt)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s is not a dm-era device\n" RESET, device);
+        return false;
+    }
+
+    if (!is_program_available("era_invalidate")) {
+        fprintf(stderr, RED "ERROR:" WHITE " era_invalidate (thin-provisioning-tools) is not installed.\n" RESET);
+        return false;
+    }
+
+    /* era_invalidate reads a metadata snapshot, never the live tree */
+    if (!dm_message(device, "take_metadata_snap"))
+        return false;
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd),
+             "era_invalidate --metadata-snapshot --written-since %u '%s'",
+             since, cbt.metadata_dev);
+
+    uint64_t block_bytes = (uint64_t)cbt.block_sectors * 512;
+    size_t cap = 0;
+    bool ok = true;
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        perror("popen (era_invalidate)");
+        ok = false;
+    }
+
+    char line[256];
+    while (ok && fp && fgets(line, sizeof(line), fp)) {
+        uint64_t a, b;
+
+        if (strstr(line, "<range") && xml_attr(line, "begin", &a) && xml_attr(line, "end", &b)) {
+            if (b > a)
+                ok = push_range(ranges, count, &cap, a * block_bytes, (b - a) * block_bytes);
+        } else if (strstr(line, "<block") && xml_attr(line, "block", &a)) {
+            ok = push_range(ranges, count, &cap, a * block_bytes, block_bytes);
+        }
+    }
+
+    if (fp) {
+        int rc = pclose(fp);
+        if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " era_invalidate failed.\n" RESET);
+            ok = false;
+        }
+    }
+
+    if (!dm_message(device, "drop_metadata_snap"))
+        ok = false;
+
+    if (ok)
+        normalize_ranges(*ranges, count);
+
+    if (!ok) {
+        free(*ranges);
+        *ranges = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Parent image metadata
+ * ------------------------------------------------------------- */
+static bool json_string(const char *line, const char *key, char *out, size_t out_len)
+{
+    const char *p = strstr(line, key);
+    if (!p)
+        return false;
+    p = strchr(p + strlen(key), ':');
+    if (!p)
+        return false;
+    p = strchr(p, '"');
+    if (!p)
+        return false;
+    p++;
+
+    const char *end = strchr(p, '"');
+    if (!end)
+        return false;
+
+    size_t len = (size_t)(end - p);
+    if (len >= out_len)
+        len = out_len - 1;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return true;
+}
+
+bool cbt_read_parent(const char *parent, CbtParent *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->cbt_era = -1;
+    out->thin_dev_id = -1;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", parent);
+
+    /* Accept <base>.json and <base>.000 as well as <base> */
+    size_t len = strlen(path);
+    if (len > 5 && strcmp(path + len - 5, ".json") == 0) {
+        path[len - 5] = '\0';
+    } else if (len > 4 && path[len - 4] == '.' &&
+               isdigit((unsigned char)path[len - 3]) &&
+               isdigit((unsigned char)path[len - 2]) &&
+               isdigit((unsigned char)path[len - 1])) {
+        path[len - 4] = '\0';
+    }
+
+    char meta_path[PATH_MAX + 8];
+    snprintf(meta_path, sizeof(meta_path), "%s.json", path);
+
+    FILE *fp = fopen(meta_path, "r");
+    if (!fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open the parent metadata %s\n" RESET, meta_path);
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        const char *p;
+        if ((p = strstr(line, "\"cbt_era\"")) && (p = strchr(p, ':')))
+            out->cbt_era = atoll(p + 1);
+        else if ((p = strstr(line, "\"thin_dev_id\"")) && (p = strchr(p, ':')))
+            out->thin_dev_id = atoll(p + 1);
+        else if (!json_string(line, "\"thin_pool\"", out->thin_pool, sizeof(out->thin_pool)) &&
+                 out->device[0] == '\0')
+            json_string(line, "\"device\"", out->device, sizeof(out->device));
+    }
+    fclose(fp);
+
+    /* Store an absolute path so the chain survives a change of cwd */
+    char resolved[PATH_MAX];
+    char *dir_end = strrchr(path, '/');
+    int n;
+    if (dir_end) {
+        *dir_end = '\0';
+        n = snprintf(out->base, sizeof(out->base), "%s/%s",
+                     realpath(path, resolved) ? resolved : path, dir_end + 1);
+    } else if (getcwd(resolved, sizeof(resolved))) {
+        n = snprintf(out->base, sizeof(out->base), "%s/%s", resolved, path);
+    } else {
+        n = snprintf(out->base, sizeof(out->base), "%s", path);
+    }
+
+    if (n < 0 || (size_t)n >= sizeof(out->base)) {
+        fprintf(stderr, RED "ERROR:" WHITE " parent image path is too long: %s\n" RESET, parent);
+        return false;
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Thin LVs: mappings from the pool metadata (thin_dump/thin_delta)
+ * ------------------------------------------------------------- */
+static bool dm_name_of(const char *majmin, char *out, size_t out_len)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/block/%s/dm/name", majmin);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    bool ok = fgets(out, (int)out_len, fp) != NULL;
+    fclose(fp);
+
+    if (ok)
+        out[strcspn(out, "\n")] = '\0';
+    return ok && out[0] != '\0';
+}
+
+bool thin_probe(const char *device, ThinDevice *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    char line[512];
+    if (!dm_first_line("table", device, line, sizeof(line)))
+        return false;
+
+    /* "0 <sectors> thin <pool maj:min> <dev id> [<external origin>]" */
+    char target[32], pool[32];
+    unsigned long long dev_id;
+
+    if (sscanf(line, "%*u %*u %31s %31s %llu", target, pool, &dev_id) != 3 ||
+        strcmp(target, "thin") != 0)
+        return false;
+
+    /* An external origin supplies unmapped blocks: they are not zero */
+    char extra[64];
+    if (sscanf(line, "%*u %*u %*s %*s %*u %63s", extra) == 1)
+        return false;
+
+    char pool_dev[64];
+    snprintf(pool_dev, sizeof(pool_dev), "/dev/block/%s", pool);
+
+    /* "0 <sectors> thin-pool <metadata maj:min> <data maj:min> <block sectors> ..." */
+    char meta[32];
+    unsigned bs = 0;
+
+    if (!dm_first_line("table", pool_dev, line, sizeof(line)) ||
+        sscanf(line, "%*u %*u %31s %31s %*s %u", target, meta, &bs) != 3 ||
+        strcmp(target, "thin-pool") != 0 || bs == 0)
+        return false;
+
+    if (!dm_name_of(pool, out->pool_name, sizeof(out->pool_name)))
+        snprintf(out->pool_name, sizeof(out->pool_name), "%s", pool);
+
+    snprintf(out->pool_dev, sizeof(out->pool_dev), "%s", pool_dev);
+    snprintf(out->metadata_dev, sizeof(out->metadata_dev), "/dev/block/%s", meta);
+    out->dev_id = dev_id;
+    out->block_sectors = bs;
+    return true;
+}
+
+/*
+ * Run a thin-provisioning-tools command on a reserved metadata
+ * snapshot and collect the ranges it reports.  With since < 0 these
+ * are the device's mappings (thin_dump); otherwise the blocks that
+ * differ from thin device `since` (thin_delta).
+ */
+static bool thin_ranges(const ThinDevice *t, long long since,
+                        RawRange **ranges, size_t *count)
+{
+    *ranges = NULL;
+    *count = 0;
+
+    const char *tool = since < 0 ? "thin_dump" : "thin_delta";
+    if (!is_program_available(tool)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s (thin-provisioning-tools) is not installed.\n" RESET, tool);
+        return false;
+    }
+
+    char cmd[512];
+    if (since < 0)
+        snprintf(cmd, sizeof(cmd), "thin_dump --metadata-snap --dev-id %llu '%s'",
+                 (unsigned long long)t->dev_id, t->metadata_dev);
+    else
+        snprintf(cmd, sizeof(cmd), "thin_delta --metadata-snap --snap1 %lld --snap2 %llu '%s'",
+                 since, (unsigned long long)t->dev_id, t->metadata_dev);
+
+    /* The live metadata may change under us; read a frozen copy */
+    if (!dm_message(t->pool_dev, "reserve_metadata_snap"))
+        return false;
+
+    uint64_t block_bytes = (uint64_t)t->block_sectors * 512;
+    size_t cap = 0;
+    bool ok = true;
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        perror("popen (thin tools)");
+        ok = false;
+    }
+
+    char line[512];
+    while (ok && fp && fgets(line, sizeof(line), fp)) {
+        uint64_t a, b;
+
+        if (strstr(line, "<range_mapping") &&
+            xml_attr(line, "origin_begin", &a) && xml_attr(line, "length", &b)) {
+            ok = push_range(ranges, count, &cap, a * block_bytes, b * block_bytes);
+        } else if (strstr(line, "<single_mapping") && xml_attr(line, "origin_block", &a)) {
+            ok = push_range(ranges, count, &cap, a * block_bytes, block_bytes);
+        } else if ((strstr(line, "<different") || strstr(line, "<left_only") ||
+                    strstr(line, "<right_only")) &&
+                   xml_attr(line, "begin", &a) && xml_attr(line, "length", &b)) {
+            /* left_only: unmapped now, so the delta writes zeros there */
+            ok = push_range(ranges, count, &cap, a * block_bytes, b * block_bytes);
+        }
+    }
+
+    if (fp) {
+        int rc = pclose(fp);
+        if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " %s failed.\n" RESET, tool);
+            ok = false;
+        }
+    }
+
+    if (!dm_message(t->pool_dev, "release_metadata_snap"))
+        ok = false;
+
+    if (ok)
+        normalize_ranges(*ranges, count);
+
+    if (!ok) {
+        free(*ranges);
+        *ranges = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * imprintb --delta-stream <device> <since>
+ * imprintb --thin-stream <device> [<since dev id>]
+ * ------------------------------------------------------------- */
+int cbt_delta_main(const char *device, const char *since)
+{
+    char *end = NULL;
+    unsigned long era = strtoul(since, &end, 10);
+
+    if (!end || *end != '\0' || era > UINT32_MAX) {
+        fprintf(stderr, RED "ERROR:" WHITE " invalid era '%s'\n" RESET, since);
+        return EXIT_FAILURE;
+    }
+
+    RawRange *ranges = NULL;
+    size_t count = 0;
+
+    if (!cbt_changed_ranges(device, (uint32_t)era, &ranges, &count))
+        return EXIT_FAILURE;
+
+    bool ok = raw_stream_ranges(device, ranges, count, RAW_FLAG_DELTA, STDOUT_FILENO);
+    free(ranges);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int thin_stream_main(const char *device, const char *since)
+{
+    long long since_id = -1;
+
+    if (since) {
+        char *end = NULL;
+        since_id = strtoll(since, &end, 10);
+        if (!end || *end != '\0' || since_id < 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " invalid thin device id '%s'\n" RESET, since);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ThinDevice t;
+    if (!thin_probe(device, &t)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s is not a thin LV\n" RESET, device);
+        return EXIT_FAILURE;
+    }
+
+    RawRange *ranges = NULL;
+    size_t count = 0;
+
+    if (!thin_ranges(&t, since_id, &ranges, &count))
+        return EXIT_FAILURE;
+
+    bool ok = raw_stream_ranges(device, ranges, count,
+                                since_id < 0 ? 0 : RAW_FLAG_DELTA, STDOUT_FILENO);
+    free(ranges);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,102 @@
+#ifndef CBT_H
+#define CBT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rawimage.h"
+
+/*
+ * Changed-block tracking with dm-era.
+ *
+ * `imprintb --cbt-setup <device> --cbt-meta <metadata device>` puts a
+ * dm-era target (/dev/mapper/imprint-era-<name>) over the partition.
+ * As long as the filesystem is only ever mounted through that device,
+ * dm-era records in which era each block was last written.
+ *
+ * Every backup of an era device starts a new era with `checkpoint` and
+ * stores it as "cbt_era" in the image metadata: the image contains
+ * everything written before that era.  An incremental backup
+ * (`--incremental-from <parent>`) asks era_invalidate for the blocks
+ * written since the parent's era and stores just those in a delta raw
+ * image (RAW_FLAG_DELTA) whose metadata points at the parent.
+ * imprintr restores the full image and then each delta in order.
+ *
+ * Thin LVs need no setup: the pool metadata already says which blocks
+ * of a thin device are provisioned.  A thin LV without a filesystem
+ * partclone knows is imaged from its mappings (thin_dump) instead of
+ * reading unprovisioned space as zeros.  Thin snapshots are chained
+ * the same way as era images: --incremental-from a thin snapshot's
+ * image stores only the blocks thin_delta reports as differing.
+ */
+
+/* Pipeline backends; the metadata of both records RAW_BACKEND */
+#define CBT_BACKEND        "imprint.delta"
+#define THIN_BACKEND       "imprint.thin"
+
+#define CBT_DM_PREFIX      "imprint-era-"
+
+/* dm-era tracking granularity: 64 KiB */
+#define CBT_BLOCK_SECTORS  128
+
+typedef struct {
+    char metadata_dev[64];       /* /dev/block/<maj:min> */
+    char origin_dev[64];
+    uint32_t block_sectors;
+} CbtDevice;
+
+/* True if `device` is a dm-era target (filled into *out). */
+bool cbt_probe(const char *device, CbtDevice *out);
+
+/* Create the dm-era device for `origin`, keeping its history on `metadata_dev`. */
+bool cbt_setup(const char *origin, const char *metadata_dev);
+
+/* Start a new era; *era receives it. */
+bool cbt_checkpoint(const char *device, uint32_t *era);
+
+/*
+ * Byte ranges of `device` written in era `since` or later, sorted and
+ * merged.  The caller frees *ranges.
+ */
+bool cbt_changed_ranges(const char *device, uint32_t since,
+                        RawRange **ranges, size_t *count);
+
+typedef struct {
+    char pool_name[128];         /* dm name of the thin-pool target */
+    char pool_dev[64];           /* /dev/block/<maj:min> */
+    char metadata_dev[64];
+    uint64_t dev_id;             /* thin device id within the pool */
+    uint32_t block_sectors;      /* pool data block size */
+} ThinDevice;
+
+/* True if `device` is a thin LV without an external origin. */
+bool thin_probe(const char *device, ThinDevice *out);
+
+/* What a parent image's metadata says about its source */
+typedef struct {
+    char base[1024];             /* absolute image base path */
+    char device[1024];
+    long long cbt_era;           /* -1: not an era device */
+    char thin_pool[128];         /* "": not a thin LV */
+    long long thin_dev_id;
+} CbtParent;
+
+/* Resolve a parent image given as base path, chunk or .json file. */
+bool cbt_read_parent(const char *parent, CbtParent *out);
+
+/*
+ * Entry point for `imprintb --delta-stream <device> <since era>`:
+ * writes the delta image of `device` to stdout.
+ */
+int cbt_delta_main(const char *device, const char *since);
+
+/*
+ * Entry point for `imprintb --thin-stream <device> [<since dev id>]`:
+ * writes a raw image of the provisioned blocks of `device`, or with
+ * `since` a delta image of the blocks that differ from that thin
+ * device (a snapshot in the same pool).
+ */
+int thin_stream_main(const char *device, const char *since);
+
+#endif /* CBT_H */
@@ -1,4 +1,12 @@
 #include "config.h"
+#include "prefetch.h"
+#include "frameidx.h"
+#include "pcsource.h"
+#include "snapshot.h"
+#include "rescue.h"
+#include "imgwriter.h"
+#include "s3.h"
+#include "netimg.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,6 +72,135 @@ static void parse_config_line(char *line)
         if (gx_config.chunk_size_mb < 0)
             gx_config.chunk_size_mb = 0;   // safety
     }
+
+    if (strcmp(key, "prefetch_depth") == 0) {
+        gx_config.prefetch_depth = atoi(value);
+        if (gx_config.prefetch_depth < 0)
+            gx_config.prefetch_depth = 0;
+    }
+
+    if (strcmp(key, "prefetch_mem_mb") == 0) {
+        gx_config.prefetch_mem_mb = atoi(value);
+        if (gx_config.prefetch_mem_mb <= 0)
+            gx_config.prefetch_mem_mb = PREFETCH_DEFAULT_MEM_MB;
+    }
+
+    if (strcmp(key, "frame_size_kb") == 0) {
+        gx_config.frame_size_kb = atoi(value);
+        if (gx_config.frame_size_kb < 64 || gx_config.frame_size_kb > 65536)
+            gx_config.frame_size_kb = FRAME_DEFAULT_SIZE_KB;
+    }
+
+    if (strcmp(key, "native_readers") == 0) {
+        gx_config.native_readers = atoi(value) ? 1 : 0;
+    }
+
+    if (strcmp(key, "native_threads") == 0) {
+        gx_config.native_threads = atoi(value);
+        if (gx_config.native_threads < 1 || gx_config.native_threads > 64)
+            gx_config.native_threads = PC_SOURCE_DEFAULT_THREADS;
+    }
+
+    if (strcmp(key, "snapshot_cow_percent") == 0) {
+        gx_config.snapshot_cow_percent = atoi(value);
+        if (gx_config.snapshot_cow_percent < 1 || gx_config.snapshot_cow_percent > 100)
+            gx_config.snapshot_cow_percent = SNAPSHOT_DEFAULT_COW_PERCENT;
+    }
+
+    if (strcmp(key, "rescue_slow_ms") == 0) {
+        gx_config.rescue_slow_ms = atoi(value);
+        if (gx_config.rescue_slow_ms < 10 || gx_config.rescue_slow_ms > 600000)
+            gx_config.rescue_slow_ms = RESCUE_DEFAULT_SLOW_MS;
+    }
+
+    if (strcmp(key, "rescue_retries") == 0) {
+        gx_config.rescue_retries = atoi(value);
+        if (gx_config.rescue_retries < 0 || gx_config.rescue_retries > 16)
+            gx_config.rescue_retries = RESCUE_DEFAULT_RETRIES;
+    }
+
+    if (strcmp(key, "mirror_buffer_mb") == 0) {
+        gx_config.mirror_buffer_mb = atoi(value);
+        if (gx_config.mirror_buffer_mb < 1 || gx_config.mirror_buffer_mb > 4096)
+            gx_config.mirror_buffer_mb = MIRROR_DEFAULT_BUFFER_MB;
+    }
+
+    if (strcmp(key, "mirror_stall_sec") == 0) {
+        gx_config.mirror_stall_sec = atoi(value);
+        if (gx_config.mirror_stall_sec < 5 || gx_config.mirror_stall_sec > 86400)
+            gx_config.mirror_stall_sec = MIRROR_DEFAULT_STALL_SEC;
+    }
+
+    if (strcmp(key, "mirror_require_all") == 0)
+        gx_config.mirror_require_all = atoi(value) ? 1 : 0;
+
+    if (strcmp(key, "stripe_buffer_mb") == 0) {
+        gx_config.stripe_buffer_mb = atoi(value);
+        if (gx_config.stripe_buffer_mb < 1 || gx_config.stripe_buffer_mb > 16384)
+            gx_config.stripe_buffer_mb = STRIPE_DEFAULT_BUFFER_MB;
+    }
+
+    if (strcmp(key, "write_buffer_mb") == 0) {
+        gx_config.write_buffer_mb = atoi(value);
+        if (gx_config.write_buffer_mb < 0 || gx_config.write_buffer_mb > 16384)
+            gx_config.write_buffer_mb = WRITE_DEFAULT_BUFFER_MB;
+    }
+
+    if (strcmp(key, "write_stall_sec") == 0) {
+        gx_config.write_stall_sec = atoi(value);
+        if (gx_config.write_stall_sec < 0 || gx_config.write_stall_sec > 86400)
+            gx_config.write_stall_sec = 0;
+    }
+
+    if (strcmp(key, "spill_dir") == 0) {
+        strncpy(gx_config.spill_dir, value, sizeof(gx_config.spill_dir) - 1);
+        gx_config.spill_dir[sizeof(gx_config.spill_dir) - 1] = '\0';
+    }
+
+    if (strcmp(key, "spill_max_mb") == 0) {
+        gx_config.spill_max_mb = atoi(value);
+        if (gx_config.spill_max_mb < 64 || gx_config.spill_max_mb > 1048576)
+            gx_config.spill_max_mb = WRITE_DEFAULT_SPILL_MB;
+    }
+
+    if (strcmp(key, "cache_neutral") == 0)
+        gx_config.cache_neutral = atoi(value) ? 1 : 0;
+
+    if (strcmp(key, "verify_writes") == 0)
+        gx_config.verify_writes = atoi(value) ? 1 : 0;
+
+    if (strcmp(key, "s3_endpoint") == 0) {
+        strncpy(gx_config.s3_endpoint, value, sizeof(gx_config.s3_endpoint) - 1);
+        gx_config.s3_endpoint[sizeof(gx_config.s3_endpoint) - 1] = '\0';
+    }
+
+    if (strcmp(key, "s3_region") == 0) {
+        strncpy(gx_config.s3_region, value, sizeof(gx_config.s3_region) - 1);
+        gx_config.s3_region[sizeof(gx_config.s3_region) - 1] = '\0';
+    }
+
+    if (strcmp(key, "s3_part_mb") == 0) {
+        gx_config.s3_part_mb = atoi(value);
+        if (gx_config.s3_part_mb < 5 || gx_config.s3_part_mb > 5120)
+            gx_config.s3_part_mb = S3_DEFAULT_PART_MB;
+    }
+
+    if (strcmp(key, "s3_parallel") == 0) {
+        gx_config.s3_parallel = atoi(value);
+        if (gx_config.s3_parallel < 1 || gx_config.s3_parallel > S3_MAX_PARALLEL)
+            gx_config.s3_parallel = S3_DEFAULT_PARALLEL;
+    }
+
+    if (strcmp(key, "net_streams") == 0) {
+        gx_config.net_streams = atoi(value);
+        if (gx_config.net_streams < 1 || gx_config.net_streams > NET_MAX_STREAMS)
+            gx_config.net_streams = NET_DEFAULT_STREAMS;
+    }
+
+    if (strcmp(key, "cast_interface") == 0) {
+        strncpy(gx_config.cast_interface, value, sizeof(gx_config.cast_interface) - 1);
+        gx_config.cast_interface[sizeof(gx_config.cast_interface) - 1] = '\0';
+    }
 }
 
 /* ---------------------------------------------------------
@@ -165,6 +302,26 @@ void ghostx_config_load(void)
     memset(&gx_config, 0, sizeof(gx_config));
 
     gx_config.chunk_size_mb = 0;   // default: no chunking
+    gx_config.prefetch_depth = PREFETCH_DEFAULT_DEPTH;
+    gx_config.prefetch_mem_mb = PREFETCH_DEFAULT_MEM_MB;
+    gx_config.frame_size_kb = FRAME_DEFAULT_SIZE_KB;
+    gx_config.native_readers = 0;
+    gx_config.native_threads = PC_SOURCE_DEFAULT_THREADS;
+    gx_config.snapshot_cow_percent = SNAPSHOT_DEFAULT_COW_PERCENT;
+    gx_config.rescue_slow_ms = RESCUE_DEFAULT_SLOW_MS;
+    gx_config.rescue_retries = RESCUE_DEFAULT_RETRIES;
+    gx_config.mirror_buffer_mb = MIRROR_DEFAULT_BUFFER_MB;
+    gx_config.mirror_stall_sec = MIRROR_DEFAULT_STALL_SEC;
+    gx_config.mirror_require_all = 1;
+    gx_config.stripe_buffer_mb = STRIPE_DEFAULT_BUFFER_MB;
+    gx_config.write_buffer_mb = WRITE_DEFAULT_BUFFER_MB;
+    gx_config.write_stall_sec = 0;   // default: wait for a stalled target
+    gx_config.spill_max_mb = WRITE_DEFAULT_SPILL_MB;
+    gx_config.cache_neutral = 0;
+    gx_config.verify_writes = 0;
+    gx_config.s3_part_mb = S3_DEFAULT_PART_MB;
+    gx_config.s3_parallel = S3_DEFAULT_PARALLEL;
+    gx_config.net_streams = NET_DEFAULT_STREAMS;
 
     /* Default compression */
     strncpy(gx_config.compression, "lz4", sizeof(gx_config.compression) - 1);
@@ -227,6 +384,97 @@ void ghostx_config_save(void)
             "#   0     - disabled (single large image file)\n"
             "#   >0    - split compressed output into chunks of this size (MB)\n"
             "#           Example: 2048 = 2GB chunks\n"
+            "#\n"
+            "# prefetch_depth=\n"
+            "#   restore: number of chunk files opened and read ahead\n"
+            "#   0     - disabled (strictly sequential reads)\n"
+            "#\n"
+            "# prefetch_mem_mb=\n"
+            "#   restore: memory cap for read-ahead buffers (MB)\n"
+            "#\n"
+            "# frame_size_kb=\n"
+            "#   backup: uncompressed KB per independent zstd/lz4 frame\n"
+            "#   smaller frames = faster random access, slightly larger images\n"
+            "#\n"
+            "# native_readers=\n"
+            "#   backup: 1 = image ext2/3/4 and NTFS with Imprint's own parallel reader\n"
+            "#           (falls back to partclone for anything it cannot handle)\n"
+            "#\n"
+            "# native_threads=\n"
+            "#   backup: reader threads used by the native readers\n"
+            "#\n"
+            "# snapshot_cow_percent=\n"
+            "#   backup --snapshot: copy-on-write space reserved for writes made\n"
+            "#           during the backup, as a percentage of the source size\n"
+            "#\n"
+            "# rescue_slow_ms=\n"
+            "#   backup --rescue: a read taking longer than this counts as bad\n"
+            "#\n"
+            "# rescue_retries=\n"
+            "#   backup --rescue: passes over unreadable ranges after the first copy\n"
+            "#\n"
+            "# mirror_buffer_mb=\n"
+            "#   backup with several --target: queue (MB) per destination, so a\n"
+            "#           briefly slow one does not hold back the others\n"
+            "#\n"
+            "# mirror_stall_sec=\n"
+            "#   backup with several --target or --stripe: a\n"
+            "#           destination that takes no data for this many seconds is given up\n"
+            "#\n"
+            "# mirror_require_all=\n"
+            "#   backup with several --target: 1 = the backup fails unless every\n"
+            "#           copy completes, 0 = one complete copy is enough\n"
+            "#\n"
+            "# stripe_buffer_mb=\n"
+            "#   backup --stripe: queue (MB) per stripe directory; chunks up to this\n"
+            "#           size keep every directory writing at once\n"
+            "#\n"
+            "# write_buffer_mb=\n"
+            "#   backup to a single file target: queue (MB) between compression and\n"
+            "#           the target, so reading goes on while it stalls (0 = off)\n"
+            "#\n"
+            "# write_stall_sec=\n"
+            "#   backup with write_buffer_mb: once spill_dir is full, give up on a\n"
+            "#           target that takes no data for this many seconds (0 = wait)\n"
+            "#\n"
+            "# spill_dir=\n"
+            "#   backup: directory on fast local storage where the image waits when\n"
+            "#           the write_buffer_mb queue is full (default: none, wait)\n"
+            "#\n"
+            "# spill_max_mb=\n"
+            "#   backup: most MB waiting in spill_dir at once\n"
+            "#\n"
+            "# cache_neutral=\n"
+            "#   backup and restore: 1 = image files and the restored device only\n"
+            "#           pass through a small window of the page cache, so a backup\n"
+            "#           of a busy server does not evict its working set\n"
+            "#\n"
+            "# verify_writes=\n"
+            "#   backup: 1 = read every chunk back from the medium once it is flushed,\n"
+            "#           while the next ones are written, and fail the backup if it\n"
+            "#           differs from what was written\n"
+            "#\n"
+            "# s3_endpoint=\n"
+            "#   s3:// images: S3-compatible server, e.g. http://localhost:9000 for\n"
+            "#           MinIO (default: AWS_ENDPOINT_URL, else AWS)\n"
+            "#\n"
+            "# s3_region=\n"
+            "#   s3:// images: region requests are signed for (default: AWS_REGION,\n"
+            "#           else us-east-1)\n"
+            "#\n"
+            "# s3_part_mb=\n"
+            "#   backup to s3://: upload part size (MB, at least 5); memory use is\n"
+            "#           about (s3_parallel + 1) parts\n"
+            "#\n"
+            "# s3_parallel=\n"
+            "#   s3:// images: parts uploaded, or ranges downloaded, at the same time\n"
+            "#\n"
+            "# net_streams=\n"
+            "#   tcp:// images: parallel connections to imprint-serve (1-16)\n"
+            "#\n"
+            "# cast_interface=\n"
+            "#   mcast:// images: IPv4 address of the interface to receive on\n"
+            "#           (default: the system's choice)\n"
             "# ------------------------------------------------------------\n\n"
     );
 
@@ -237,6 +485,40 @@ void ghostx_config_save(void)
         fprintf(fp, "compression=%s\n", gx_config.compression);
 
     fprintf(fp, "chunk_size_mb=%d\n", gx_config.chunk_size_mb);
+    fprintf(fp, "prefetch_depth=%d\n", gx_config.prefetch_depth);
+    fprintf(fp, "prefetch_mem_mb=%d\n", gx_config.prefetch_mem_mb);
+    fprintf(fp, "frame_size_kb=%d\n", gx_config.frame_size_kb);
+    fprintf(fp, "native_readers=%d\n", gx_config.native_readers);
+    fprintf(fp, "native_threads=%d\n", gx_config.native_threads);
+    fprintf(fp, "snapshot_cow_percent=%d\n", gx_config.snapshot_cow_percent);
+    fprintf(fp, "rescue_slow_ms=%d\n", gx_config.rescue_slow_ms);
+    fprintf(fp, "rescue_retries=%d\n", gx_config.rescue_retries);
+    fprintf(fp, "mirror_buffer_mb=%d\n", gx_config.mirror_buffer_mb);
+    fprintf(fp, "mirror_stall_sec=%d\n", gx_config.mirror_stall_sec);
+    fprintf(fp, "mirror_require_all=%d\n", gx_config.mirror_require_all);
+    fprintf(fp, "stripe_buffer_mb=%d\n", gx_config.stripe_buffer_mb);
+    fprintf(fp, "write_buffer_mb=%d\n", gx_config.write_buffer_mb);
+    fprintf(fp, "write_stall_sec=%d\n", gx_config.write_stall_sec);
+
+    if (gx_config.spill_dir[0] != '\0')
+        fprintf(fp, "spill_dir=%s\n", gx_config.spill_dir);
+
+    fprintf(fp, "spill_max_mb=%d\n", gx_config.spill_max_mb);
+    fprintf(fp, "cache_neutral=%d\n", gx_config.cache_neutral);
+    fprintf(fp, "verify_writes=%d\n", gx_config.verify_writes);
+
+    if (gx_config.s3_endpoint[0] != '\0')
+        fprintf(fp, "s3_endpoint=%s\n", gx_config.s3_endpoint);
+
+    if (gx_config.s3_region[0] != '\0')
+        fprintf(fp, "s3_region=%s\n", gx_config.s3_region);
+
+    fprintf(fp, "s3_part_mb=%d\n", gx_config.s3_part_mb);
+    fprintf(fp, "s3_parallel=%d\n", gx_config.s3_parallel);
+    fprintf(fp, "net_streams=%d\n", gx_config.net_streams);
+
+    if (gx_config.cast_interface[0] != '\0')
+        fprintf(fp, "cast_interface=%s\n", gx_config.cast_interface);
 
     fclose(fp);
 
@@ -10,6 +10,30 @@ typedef struct {
     char backup_dir[1024];
     char compression[32];
     int  chunk_size_mb;   // 0 = disabled, >0 = chunk size in MB
+    int  prefetch_depth;  // restore: chunks opened ahead (0 = no read-ahead)
+    int  prefetch_mem_mb; // restore: memory cap for in-flight reads
+    int  frame_size_kb;   // backup: uncompressed bytes per zstd/lz4 frame
+    int  native_readers;  // backup: 1 = read ext2/3/4 and NTFS natively instead of partclone
+    int  native_threads;  // backup: parallel reader threads for native readers
+    int  snapshot_cow_percent; // backup --snapshot: COW area as % of the source size
+    int  rescue_slow_ms;  // backup --rescue: reads slower than this skip ahead
+    int  rescue_retries;  // backup --rescue: retry passes over skipped ranges
+    int  mirror_buffer_mb;   // backup, several --target: queue per destination
+    int  mirror_stall_sec;   // backup, several --target: give up on a destination idle this long
+    int  mirror_require_all; // backup, several --target: 1 = fail unless every copy completes
+    int  stripe_buffer_mb;   // backup --stripe: queue per stripe directory
+    int  write_buffer_mb;    // backup to one file target: write-behind queue, 0 = write directly
+    int  write_stall_sec;    // backup, write-behind: give up on a stalled target once spill is full, 0 = wait
+    char spill_dir[1024];    // backup: local directory for what the write-behind queue cannot hold
+    int  spill_max_mb;       // backup: largest spill file
+    int  cache_neutral;      // 1 = keep images and restored devices out of the page cache
+    int  verify_writes;      // backup: 1 = read each image file back from the medium and compare
+    char s3_endpoint[256];   // s3:// images: scheme://host[:port], empty = AWS
+    char s3_region[64];      // s3:// images: signing region, empty = environment or us-east-1
+    int  s3_part_mb;         // backup to s3://: multipart upload part size
+    int  s3_parallel;        // s3:// images: parts uploaded / ranges fetched at once
+    int  net_streams;        // tcp:// images: connections to imprint-serve
+    char cast_interface[64]; // mcast:// images: IPv4 address of the interface to join on
 } GhostXConfig;
 
 extern GhostXConfig gx_config;
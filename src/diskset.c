@@ -0,0 +1,487 @@
+#include "diskset.h"
+#include "utils.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+const char *diskset_disk_name(const char *disk)
+{
+    const char *slash = strrchr(disk, '/');
+    return slash ? slash + 1 : disk;
+}
+
+void diskset_manifest_path(const char *dir, const char *disk,
+                           char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s/%s.disk.json", dir, diskset_disk_name(disk));
+}
+
+void diskset_partition_device(const char *disk, int number,
+                              char *out, size_t out_len)
+{
+    /* nvme0n1, mmcblk0, loop0: partitions get a 'p' separator */
+    size_t len = strlen(disk);
+    bool digit_end = len > 0 && isdigit((unsigned char)disk[len - 1]);
+
+    snprintf(out, out_len, "%s%s%d", disk, digit_end ? "p" : "", number);
+}
+
+/* Trailing number of a partition device name (sda3 -> 3, nvme0n1p2 -> 2) */
+static int partition_number(const char *name)
+{
+    size_t len = strlen(name);
+    size_t i = len;
+
+    while (i > 0 && isdigit((unsigned char)name[i - 1]))
+        i--;
+
+    return (i < len) ? atoi(name + i) : -1;
+}
+
+bool diskset_scan(const char *disk, DiskSet *set)
+{
+    memset(set, 0, sizeof(*set));
+    snprintf(set->disk, sizeof(set->disk), "%s", disk);
+
+    set->size_bytes = get_partition_size_bytes(disk);
+    if (set->size_bytes <= 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " could not determine the size of %s\n" RESET, disk);
+        return false;
+    }
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "lsblk -lnpo NAME,TYPE '%s' 2>/dev/null", disk);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        perror("popen (lsblk)");
+        return false;
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        char name[256], type[32];
+
+        if (sscanf(line, "%255s %31s", name, type) != 2)
+            continue;
+
+        /* Only direct partitions; skip the disk itself and any holders */
+        if (strcmp(type, "part") != 0)
+            continue;
+
+        if (set->count >= DISKSET_MAX_PARTS) {
+            fprintf(stderr, RED "ERROR:" WHITE " too many partitions on %s\n" RESET, disk);
+            pclose(fp);
+            return false;
+        }
+
+        DiskPart *p = &set->parts[set->count++];
+        p->number = partition_number(name);
+        snprintf(p->device, sizeof(p->device), "%s", name);
+    }
+
+    pclose(fp);
+
+    if (set->count == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " no partitions found on %s\n" RESET, disk);
+        return false;
+    }
+
+    return true;
+}
+
+bool diskset_save_table(DiskSet *set, const char *dir)
+{
+    const char *name = diskset_disk_name(set->disk);
+
+    if (snprintf(set->table_file, sizeof(set->table_file), "%s.sfdisk", name) >= (int)sizeof(set->table_file) ||
+        snprintf(set->boot_file, sizeof(set->boot_file), "%s.boot", name) >= (int)sizeof(set->boot_file)) {
+        fprintf(stderr, RED "ERROR:" WHITE " disk name too long: %s\n" RESET, set->disk);
+        return false;
+    }
+
+    /* 1. Partition table */
+    char table_path[1024];
+    snprintf(table_path, sizeof(table_path), "%s/%s", dir, set->table_file);
+
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd), "sfdisk --dump '%s' > '%s'", set->disk, table_path);
+
+    int rc = system(cmd);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " failed to save the partition table of %s\n" RESET,
+                set->disk);
+        unlink(table_path);
+        return false;
+    }
+
+    FILE *fp = fopen(table_path, "r");
+    if (fp) {
+        char line[512];
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "label: %15s", set->label) == 1)
+                break;
+        }
+        fclose(fp);
+    }
+
+    if (set->label[0] == '\0') {
+        fprintf(stderr, RED "ERROR:" WHITE " %s has no recognizable partition table\n" RESET,
+                set->disk);
+        return false;
+    }
+
+    /* 2. Boot area: MBR boot code and whatever lives before the first partition */
+    char boot_path[1024];
+    snprintf(boot_path, sizeof(boot_path), "%s/%s", dir, set->boot_file);
+
+    size_t len = DISKSET_BOOT_BYTES;
+    if ((long long)len > set->size_bytes)
+        len = (size_t)set->size_bytes;
+
+    unsigned char *buf = malloc(len);
+    if (!buf)
+        return false;
+
+    bool ok = false;
+    int in = open(set->disk, O_RDONLY | O_CLOEXEC);
+    int out = open(boot_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (in >= 0 && out >= 0 &&
+        pread(in, buf, len, 0) == (ssize_t)len &&
+        write(out, buf, len) == (ssize_t)len &&
+        fsync(out) == 0)
+        ok = true;
+
+    if (in >= 0)
+        close(in);
+    if (out >= 0)
+        close(out);
+    free(buf);
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " failed to save the boot area of %s\n" RESET,
+                set->disk);
+        unlink(boot_path);
+    }
+
+    return ok;
+}
+
+bool diskset_write_manifest(const DiskSet *set, const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("fopen (disk manifest)");
+        return false;
+    }
+
+    /* One partition per line, so the loader can stay line based */
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"tool_version\": \"1.2\",\n");
+    fprintf(fp, "  \"timestamp\": %ld,\n", (long)time(NULL));
+    fprintf(fp, "  \"disk\": \"%s\",\n", set->disk);
+    fprintf(fp, "  \"disk_size_bytes\": %lld,\n", set->size_bytes);
+    fprintf(fp, "  \"partition_table\": \"%s\",\n", set->label);
+    fprintf(fp, "  \"table_file\": \"%s\",\n", set->table_file);
+    fprintf(fp, "  \"boot_file\": \"%s\",\n", set->boot_file);
+    fprintf(fp, "  \"partitions\": [\n");
+
+    for (int i = 0; i < set->count; i++) {
+        const DiskPart *p = &set->parts[i];
+        fprintf(fp,
+                "    { \"number\": %d, \"device\": \"%s\", \"filesystem\": \"%s\", \"image\": \"%s\" }%s\n",
+                p->number, p->device, p->fs_type, p->image,
+                i + 1 < set->count ? "," : "");
+    }
+
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    bool ok = (fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+    if (fclose(fp) != 0)
+        ok = false;
+
+    return ok;
+}
+
+/* Copy the string value of "key" on this line into out */
+static bool json_string(const char *line, const char *key, char *out, size_t out_len)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+
+    const char *p = strstr(line, pattern);
+    if (!p)
+        return false;
+
+    p = strchr(p + strlen(pattern), ':');
+    if (!p)
+        return false;
+    p = strchr(p, '"');
+    if (!p)
+        return false;
+    p++;
+
+    const char *end = strchr(p, '"');
+    if (!end)
+        return false;
+
+    size_t len = (size_t)(end - p);
+    if (len >= out_len)
+        len = out_len - 1;
+
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return true;
+}
+
+static bool json_number(const char *line, const char *key, long long *out)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+
+    const char *p = strstr(line, pattern);
+    if (!p)
+        return false;
+
+    p = strchr(p + strlen(pattern), ':');
+    if (!p)
+        return false;
+
+    *out = atoll(p + 1);
+    return true;
+}
+
+bool diskset_load_manifest(const char *path, DiskSet *set)
+{
+    memset(set, 0, sizeof(*set));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open disk manifest: %s\n" RESET, path);
+        return false;
+    }
+
+    char line[2048];
+    long long v;
+
+    while (fgets(line, sizeof(line), fp)) {
+
+        /* Partition entries */
+        if (json_number(line, "number", &v)) {
+            if (set->count >= DISKSET_MAX_PARTS)
+                continue;
+
+            DiskPart *p = &set->parts[set->count++];
+            p->number = (int)v;
+            json_string(line, "device", p->device, sizeof(p->device));
+            json_string(line, "filesystem", p->fs_type, sizeof(p->fs_type));
+            json_string(line, "image", p->image, sizeof(p->image));
+            continue;
+        }
+
+        if (json_number(line, "disk_size_bytes", &v)) {
+            set->size_bytes = v;
+            continue;
+        }
+
+        if (json_string(line, "disk", set->disk, sizeof(set->disk)) ||
+            json_string(line, "partition_table", set->label, sizeof(set->label)) ||
+            json_string(line, "table_file", set->table_file, sizeof(set->table_file)) ||
+            json_string(line, "boot_file", set->boot_file, sizeof(set->boot_file)))
+            continue;
+    }
+
+    fclose(fp);
+
+    if (set->table_file[0] == '\0' || set->count == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " disk manifest is incomplete: %s\n" RESET, path);
+        return false;
+    }
+
+    return true;
+}
+
+/* Geometry of a saved sfdisk dump, all in bytes */
+static bool read_table_extent(const char *table_path,
+                              long long *first_start,
+                              long long *last_end)
+{
+    FILE *fp = fopen(table_path, "r");
+    if (!fp)
+        return false;
+
+    long long sector = 512;
+    long long first = -1, last = 0;
+    char line[1024];
+
+    while (fgets(line, sizeof(line), fp)) {
+        long long v;
+
+        if (sscanf(line, "sector-size: %lld", &v) == 1 && v > 0) {
+            sector = v;
+            continue;
+        }
+
+        const char *s = strstr(line, "start=");
+        const char *z = strstr(line, "size=");
+        if (!s || !z)
+            continue;
+
+        long long start = atoll(s + 6);
+        long long size = atoll(z + 5);
+
+        if (first < 0 || start < first)
+            first = start;
+        if (start + size > last)
+            last = start + size;
+    }
+
+    fclose(fp);
+
+    if (first < 0)
+        return false;
+
+    *first_start = first * sector;
+    *last_end = last * sector;
+    return true;
+}
+
+static bool restore_boot_area(const DiskSet *set, const char *boot_path,
+                              const char *target_disk, long long first_start)
+{
+    int in = open(boot_path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        fprintf(stderr, YELLOW "Boot area file missing; leaving boot code untouched.\n" RESET);
+        return true;
+    }
+
+    unsigned char *buf = malloc(DISKSET_BOOT_BYTES);
+    ssize_t n = buf ? read(in, buf, DISKSET_BOOT_BYTES) : -1;
+    close(in);
+
+    if (n < 512) {
+        free(buf);
+        fprintf(stderr, RED "ERROR:" WHITE " boot area file is truncated: %s\n" RESET, boot_path);
+        return false;
+    }
+
+    int out = open(target_disk, O_WRONLY | O_CLOEXEC);
+    if (out < 0) {
+        perror("open (target disk)");
+        free(buf);
+        return false;
+    }
+
+    /*
+     * Boot code: the first 440 bytes of the MBR.  The partition entries
+     * and signature that follow were just written by sfdisk.
+     */
+    bool ok = (pwrite(out, buf, 440, 0) == 440);
+
+    /* MBR disks: bootloaders (e.g. GRUB core.img) live in the post-MBR gap */
+    if (ok && strcmp(set->label, "dos") == 0) {
+        long long gap_end = first_start < n ? first_start : n;
+
+        if (gap_end > 512)
+            ok = (pwrite(out, buf + 512, (size_t)(gap_end - 512), 512) == gap_end - 512);
+    }
+
+    if (ok && fsync(out) != 0)
+        ok = false;
+
+    close(out);
+    free(buf);
+
+    if (!ok)
+        fprintf(stderr, RED "ERROR:" WHITE " failed to write the boot area to %s\n" RESET, target_disk);
+
+    return ok;
+}
+
+bool diskset_apply_table(const DiskSet *set, const char *dir,
+                         const char *target_disk)
+{
+    char table_path[1024];
+    snprintf(table_path, sizeof(table_path), "%s/%s", dir, set->table_file);
+
+    long long first_start = 0, last_end = 0;
+    if (!read_table_extent(table_path, &first_start, &last_end)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read partition table dump: %s\n" RESET, table_path);
+        return false;
+    }
+
+    /* GPT keeps a backup header in the last 33 sectors */
+    long long need = last_end;
+    if (strcmp(set->label, "gpt") == 0)
+        need += 33 * 512;
+
+    long long have = get_partition_size_bytes(target_disk);
+    if (have < need) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " Target disk is too small for the saved partition table.\n"
+                "       Needed: %.2f GB\n"
+                "       Target: %.2f GB\n" RESET,
+                need / 1e9,
+                have / 1e9);
+        return false;
+    }
+
+    /*
+     * last-lba pins the usable area to the size of the original disk;
+     * dropping it lets a larger target keep its extra space.  The
+     * device line names the source disk and is not needed either.
+     */
+    char cmd[2048];
+    snprintf(cmd, sizeof(cmd),
+             "sed -e '/^last-lba:/d' -e '/^device:/d' '%s' | sfdisk --quiet '%s'",
+             table_path,
+             target_disk);
+
+    fprintf(stderr, YELLOW "Writing partition table:\n" RESET GREEN "     %s\n\n" RESET, cmd);
+
+    int rc = system(cmd);
+    if (rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " sfdisk failed to write the partition table.\n" RESET);
+        return false;
+    }
+
+    char boot_path[1024];
+    snprintf(boot_path, sizeof(boot_path), "%s/%s", dir, set->boot_file);
+
+    if (set->boot_file[0] != '\0' &&
+        !restore_boot_area(set, boot_path, target_disk, first_start))
+        return false;
+
+    /* Let udev create the partition nodes before anyone opens them */
+    if (system("udevadm settle >/dev/null 2>&1") == -1)
+        perror("system (udevadm)");
+
+    for (int i = 0; i < set->count; i++) {
+        char part[300];
+        diskset_partition_device(target_disk, set->parts[i].number, part, sizeof(part));
+
+        struct stat st;
+        int waited = 0;
+        while (stat(part, &st) != 0 && waited < 100) {
+            usleep(100 * 1000);
+            waited++;
+        }
+
+        if (waited >= 100) {
+            fprintf(stderr, RED "ERROR:" WHITE " partition %s did not appear\n" RESET, part);
+            return false;
+        }
+    }
+
+    return true;
+}
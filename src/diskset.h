@@ -0,0 +1,72 @@
+#ifndef DISKSET_H
+#define DISKSET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Whole-disk image sets.
+ *
+ * A whole-disk backup of /dev/sda written to <dir> consists of:
+ *
+ *   <dir>/sda.disk.json    manifest (this module)
+ *   <dir>/sda.sfdisk       partition table as dumped by `sfdisk --dump`
+ *   <dir>/sda.boot         first MiB of the disk (boot code, post-MBR gap)
+ *   <dir>/sda1_vfat.img.*  one regular Imprint image per partition
+ *   ...
+ *
+ * The partition images are ordinary images with their own .json,
+ * .sha256 (and .idx) files, so each one can also be restored on its
+ * own with imprintr.
+ */
+
+#define DISKSET_MAX_PARTS   128
+#define DISKSET_BOOT_BYTES  (1024 * 1024)
+
+typedef struct {
+    int  number;            /* partition number (sda3 -> 3) */
+    char device[256];       /* partition device at backup time */
+    char fs_type[64];
+    char image[512];        /* image file name, relative to the manifest;
+                               empty if the partition was not imaged */
+} DiskPart;
+
+typedef struct {
+    char disk[256];
+    long long size_bytes;
+    char label[16];         /* "gpt" or "dos" */
+    char table_file[256];
+    char boot_file[256];
+    int count;
+    DiskPart parts[DISKSET_MAX_PARTS];
+} DiskSet;
+
+/* "/dev/nvme0n1" -> "nvme0n1" */
+const char *diskset_disk_name(const char *disk);
+
+/* <dir>/<name>.disk.json */
+void diskset_manifest_path(const char *dir, const char *disk,
+                           char *out, size_t out_len);
+
+/* Device node of partition <number> on <disk> (sda -> sda3, nvme0n1 -> nvme0n1p3) */
+void diskset_partition_device(const char *disk, int number,
+                              char *out, size_t out_len);
+
+/* Fill set->disk, size, and the list of partitions (no images yet) */
+bool diskset_scan(const char *disk, DiskSet *set);
+
+/* Dump the partition table and boot area of set->disk into <dir> */
+bool diskset_save_table(DiskSet *set, const char *dir);
+
+bool diskset_write_manifest(const DiskSet *set, const char *path);
+bool diskset_load_manifest(const char *path, DiskSet *set);
+
+/*
+ * Recreate the saved partition table on <target_disk> and put the
+ * boot area back.  Waits until the kernel has created the partition
+ * device nodes.  <dir> is the directory holding the manifest.
+ */
+bool diskset_apply_table(const DiskSet *set, const char *dir,
+                         const char *target_disk);
+
+#endif /* DISKSET_H */
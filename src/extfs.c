@@ -0,0 +1,272 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "extfs.h"
+#include "pcimage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define EXT_SB_OFFSET               1024
+#define EXT_SB_SIZE                 1024
+#define EXT_SB_MAGIC                0xEF53
+
+#define EXT_STATE_VALID             0x0001
+#define EXT_STATE_ERROR             0x0002
+
+#define EXT_COMPAT_SPARSE_SUPER2    0x0200
+#define EXT_INCOMPAT_RECOVER        0x0004
+#define EXT_INCOMPAT_JOURNAL_DEV    0x0008
+#define EXT_INCOMPAT_META_BG        0x0010
+#define EXT_INCOMPAT_64BIT          0x0080
+#define EXT_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT_RO_COMPAT_GDT_CSUM      0x0010
+#define EXT_RO_COMPAT_BIGALLOC      0x0200
+#define EXT_RO_COMPAT_METADATA_CSUM 0x0400
+
+#define EXT_BG_BLOCK_UNINIT         0x0002
+
+static uint16_t get_le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static bool read_exact(int fd, void *buf, size_t len, uint64_t off)
+{
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (n == 0)
+            return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* sparse_super: backups only in groups 0, 1 and powers of 3, 5 and 7 */
+static bool is_power_of(uint64_t n, uint64_t base)
+{
+    while (n > 1 && n % base == 0)
+        n /= base;
+    return n == 1;
+}
+
+static bool group_has_super(uint64_t group, bool sparse)
+{
+    if (!sparse || group <= 1)
+        return true;
+    if (group % 2 == 0)
+        return false;
+    return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+static void mark_range(unsigned char *bitmap, uint64_t total,
+                       uint64_t first, uint64_t count)
+{
+    for (uint64_t b = first; b < first + count && b < total; b++)
+        pc_set_bit(bitmap, b);
+}
+
+bool extfs_read_bitmap(int fd, ExtBitmap *out, bool *unsupported,
+                       char *err, size_t err_len)
+{
+    memset(out, 0, sizeof(*out));
+    *unsupported = false;
+
+    unsigned char sb[EXT_SB_SIZE];
+    if (!read_exact(fd, sb, sizeof(sb), EXT_SB_OFFSET)) {
+        snprintf(err, err_len, "cannot read the superblock");
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 1. Superblock: only layouts we fully understand
+     * --------------------------------------------------------- */
+    *unsupported = true;
+
+    if (get_le16(sb + 56) != EXT_SB_MAGIC) {
+        snprintf(err, err_len, "no ext2/3/4 superblock");
+        return false;
+    }
+
+    uint16_t state = get_le16(sb + 58);
+    uint32_t compat = get_le32(sb + 92);
+    uint32_t incompat = get_le32(sb + 96);
+    uint32_t ro_compat = get_le32(sb + 100);
+
+    if (!(state & EXT_STATE_VALID) || (state & EXT_STATE_ERROR)) {
+        snprintf(err, err_len, "filesystem was not cleanly unmounted or has errors");
+        return false;
+    }
+    if (incompat & EXT_INCOMPAT_RECOVER) {
+        snprintf(err, err_len, "journal needs recovery");
+        return false;
+    }
+    if (incompat & (EXT_INCOMPAT_JOURNAL_DEV | EXT_INCOMPAT_META_BG)) {
+        snprintf(err, err_len, "journal device or meta_bg layout");
+        return false;
+    }
+    if (ro_compat & EXT_RO_COMPAT_BIGALLOC) {
+        snprintf(err, err_len, "bigalloc");
+        return false;
+    }
+    if (compat & EXT_COMPAT_SPARSE_SUPER2) {
+        snprintf(err, err_len, "sparse_super2");
+        return false;
+    }
+
+    uint32_t log_bs = get_le32(sb + 24);
+    if (log_bs > 6) {
+        snprintf(err, err_len, "implausible block size");
+        return false;
+    }
+
+    bool is64 = (incompat & EXT_INCOMPAT_64BIT) != 0;
+    uint32_t bs = 1024u << log_bs;
+    uint64_t blocks = get_le32(sb + 4);
+    if (is64)
+        blocks |= (uint64_t)get_le32(sb + 0x150) << 32;
+
+    uint32_t first_data = get_le32(sb + 20);
+    uint32_t bpg = get_le32(sb + 32);
+    uint32_t ipg = get_le32(sb + 40);
+    uint32_t inode_size = get_le32(sb + 76) >= 1 ? get_le16(sb + 88) : 128;
+    uint32_t desc_size = is64 ? get_le16(sb + 254) : 32;
+    uint32_t reserved_gdt = get_le16(sb + 206);
+
+    if (blocks <= first_data || bpg == 0 || bpg > bs * 8 || ipg == 0 ||
+        inode_size < 128 || desc_size < 32 || (is64 && desc_size < 64)) {
+        snprintf(err, err_len, "implausible superblock geometry");
+        return false;
+    }
+
+    uint64_t groups = (blocks - first_data + bpg - 1) / bpg;
+    uint64_t gdt_blocks = (groups * desc_size + bs - 1) / bs;
+    uint64_t itable_blocks = ((uint64_t)ipg * inode_size + bs - 1) / bs;
+    bool sparse = (ro_compat & EXT_RO_COMPAT_SPARSE_SUPER) != 0;
+    bool uninit_ok = (ro_compat & (EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    *unsupported = false;
+
+    /* ---------------------------------------------------------
+     * 2. Group descriptors (right after the primary superblock)
+     * --------------------------------------------------------- */
+    unsigned char *gdt = malloc(gdt_blocks * bs);
+    unsigned char *bmblock = malloc(bs);
+    unsigned char *bitmap = calloc(1, pc_bitmap_bytes(blocks));
+
+    if (!gdt || !bmblock || !bitmap) {
+        snprintf(err, err_len, "out of memory");
+        goto fail;
+    }
+
+    if (!read_exact(fd, gdt, gdt_blocks * bs, (uint64_t)(first_data + 1) * bs)) {
+        snprintf(err, err_len, "cannot read the group descriptors");
+        goto fail;
+    }
+
+    /* Boot block(s) in front of the first group */
+    mark_range(bitmap, blocks, 0, first_data);
+
+    /* ---------------------------------------------------------
+     * 3. Per-group block bitmaps
+     * --------------------------------------------------------- */
+    for (uint64_t g = 0; g < groups; g++) {
+        const unsigned char *d = gdt + g * desc_size;
+        uint16_t flags = get_le16(d + 0x12);
+        uint64_t start = first_data + g * bpg;
+        uint64_t count = blocks - start < bpg ? blocks - start : bpg;
+
+        if (uninit_ok && (flags & EXT_BG_BLOCK_UNINIT)) {
+            /* Never initialized: only the superblock backup and
+             * descriptor copies live here (plus other groups'
+             * metadata, marked below). */
+            if (group_has_super(g, sparse))
+                mark_range(bitmap, blocks, start, 1 + gdt_blocks + reserved_gdt);
+            continue;
+        }
+
+        uint64_t bb = get_le32(d);
+        if (desc_size >= 64)
+            bb |= (uint64_t)get_le32(d + 0x20) << 32;
+
+        if (bb == 0 || bb >= blocks) {
+            snprintf(err, err_len, "group %llu has an invalid block bitmap location",
+                     (unsigned long long)g);
+            goto fail;
+        }
+
+        if (!read_exact(fd, bmblock, bs, bb * bs)) {
+            snprintf(err, err_len, "cannot read the block bitmap of group %llu",
+                     (unsigned long long)g);
+            goto fail;
+        }
+
+        if (start % 8 == 0) {
+            /* Byte aligned: copy whole bytes, then the tail bits */
+            uint64_t whole = count / 8;
+            memcpy(bitmap + start / 8, bmblock, whole);
+            for (uint64_t i = whole * 8; i < count; i++)
+                if (pc_test_bit(bmblock, i))
+                    pc_set_bit(bitmap, start + i);
+        } else {
+            for (uint64_t i = 0; i < count; i++)
+                if (pc_test_bit(bmblock, i))
+                    pc_set_bit(bitmap, start + i);
+        }
+    }
+
+    /* ---------------------------------------------------------
+     * 4. Bitmaps and inode tables of every group, wherever
+     *    flex_bg put them (possibly inside an uninit group)
+     * --------------------------------------------------------- */
+    for (uint64_t g = 0; g < groups; g++) {
+        const unsigned char *d = gdt + g * desc_size;
+        uint64_t bbm = get_le32(d);
+        uint64_t ibm = get_le32(d + 4);
+        uint64_t itb = get_le32(d + 8);
+
+        if (desc_size >= 64) {
+            bbm |= (uint64_t)get_le32(d + 0x20) << 32;
+            ibm |= (uint64_t)get_le32(d + 0x24) << 32;
+            itb |= (uint64_t)get_le32(d + 0x28) << 32;
+        }
+
+        mark_range(bitmap, blocks, bbm, 1);
+        mark_range(bitmap, blocks, ibm, 1);
+        mark_range(bitmap, blocks, itb, itable_blocks);
+    }
+
+    out->block_size = bs;
+    out->total_blocks = blocks;
+    out->used_blocks = pc_bitmap_count(bitmap, blocks);
+    out->bitmap = bitmap;
+
+    free(gdt);
+    free(bmblock);
+    return true;
+
+fail:
+    free(gdt);
+    free(bmblock);
+    free(bitmap);
+    return false;
+}
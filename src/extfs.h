@@ -0,0 +1,37 @@
+#ifndef EXTFS_H
+#define EXTFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Native ext2/3/4 used-block reader.
+ *
+ * Parses the superblock and group descriptors and assembles the
+ * filesystem's block bitmap, computing the bitmap of groups that
+ * were never initialized (BLOCK_UNINIT) the way e2fsprogs does.
+ *
+ * Only filesystems that are cleanly unmounted and use the classic
+ * descriptor layout are handled; anything else (needs journal
+ * recovery, errors, meta_bg, bigalloc, sparse_super2, external
+ * journal device) is reported as unsupported so the caller can use
+ * partclone.extfs instead.
+ */
+
+typedef struct {
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t used_blocks;
+    unsigned char *bitmap;       /* caller frees */
+} ExtBitmap;
+
+/*
+ * Returns true with the bitmap filled in.  On false, err holds the
+ * reason and *unsupported tells whether it is "not handled natively"
+ * (fall back to partclone) rather than an I/O error.
+ */
+bool extfs_read_bitmap(int fd, ExtBitmap *out, bool *unsupported,
+                       char *err, size_t err_len);
+
+#endif /* EXTFS_H */
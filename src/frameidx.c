@@ -0,0 +1,488 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "frameidx.h"
+#include "pcimage.h"
+#include "stripe.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+#define INDEX_HEADER_SIZE  56
+#define INDEX_ENTRY_SIZE   24
+#define INDEX_HASH_SIZE    32
+
+/* Chunk sets are named base.000 .. base.999 */
+#define MAX_CHUNKS  1000
+
+/* -------------------------------------------------------------
+ * Little-endian helpers
+ * ------------------------------------------------------------- */
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+void frame_index_path_for(const char *image_base, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s.idx", image_base);
+}
+
+/* -------------------------------------------------------------
+ * Load / save
+ * ------------------------------------------------------------- */
+bool frame_index_load(const char *path, FrameIndex *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+
+    unsigned char hdr[INDEX_HEADER_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), fp) != sizeof(hdr) ||
+        memcmp(hdr, FRAME_INDEX_MAGIC, 8) != 0 ||
+        (get_le32(hdr + 8) != FRAME_INDEX_VERSION &&
+         get_le32(hdr + 8) != FRAME_INDEX_VERSION_HASHED)) {
+        fclose(fp);
+        return false;
+    }
+
+    out->hashed = get_le32(hdr + 8) == FRAME_INDEX_VERSION_HASHED;
+    size_t entry_size = INDEX_ENTRY_SIZE + (out->hashed ? INDEX_HASH_SIZE : 0);
+
+    out->compression = get_le32(hdr + 12);
+    out->frame_size  = get_le32(hdr + 16);
+    out->chunk_bytes = get_le64(hdr + 24);
+    out->raw_size    = get_le64(hdr + 32);
+    out->comp_size   = get_le64(hdr + 40);
+    out->count       = get_le64(hdr + 48);
+
+    if (out->count == 0 || out->count > (1ULL << 32)) {
+        fclose(fp);
+        return false;
+    }
+
+    size_t table_len = (size_t)out->count * entry_size;
+    unsigned char *table = malloc(table_len);
+    out->frames = calloc((size_t)out->count, sizeof(FrameEntry));
+
+    unsigned char crc_raw[4];
+    bool ok = table && out->frames &&
+              fread(table, 1, table_len, fp) == table_len &&
+              fread(crc_raw, 1, 4, fp) == 4;
+
+    fclose(fp);
+
+    if (ok) {
+        uint32_t crc = pc_crc32(0, hdr, sizeof(hdr));
+        crc = pc_crc32(crc, table, table_len);
+        ok = (crc == get_le32(crc_raw));
+    }
+
+    for (uint64_t i = 0; ok && i < out->count; i++) {
+        const unsigned char *e = table + i * entry_size;
+        out->frames[i].raw_off  = get_le64(e);
+        out->frames[i].comp_off = get_le64(e + 8);
+        out->frames[i].comp_len = get_le32(e + 16);
+        out->frames[i].raw_len  = get_le32(e + 20);
+        if (out->hashed)
+            memcpy(out->frames[i].hash, e + INDEX_ENTRY_SIZE, INDEX_HASH_SIZE);
+    }
+
+    free(table);
+
+    if (!ok)
+        frame_index_free(out);
+
+    return ok;
+}
+
+bool frame_index_save(const char *path, const FrameIndex *idx)
+{
+    unsigned char hdr[INDEX_HEADER_SIZE] = {0};
+
+    memcpy(hdr, FRAME_INDEX_MAGIC, 8);
+    put_le32(hdr + 8, idx->hashed ? FRAME_INDEX_VERSION_HASHED : FRAME_INDEX_VERSION);
+    put_le32(hdr + 12, idx->compression);
+    put_le32(hdr + 16, idx->frame_size);
+    put_le64(hdr + 24, idx->chunk_bytes);
+    put_le64(hdr + 32, idx->raw_size);
+    put_le64(hdr + 40, idx->comp_size);
+    put_le64(hdr + 48, idx->count);
+
+    size_t entry_size = INDEX_ENTRY_SIZE + (idx->hashed ? INDEX_HASH_SIZE : 0);
+    size_t table_len = (size_t)idx->count * entry_size;
+    unsigned char *table = malloc(table_len ? table_len : 1);
+    if (!table)
+        return false;
+
+    for (uint64_t i = 0; i < idx->count; i++) {
+        unsigned char *e = table + i * entry_size;
+        put_le64(e, idx->frames[i].raw_off);
+        put_le64(e + 8, idx->frames[i].comp_off);
+        put_le32(e + 16, idx->frames[i].comp_len);
+        put_le32(e + 20, idx->frames[i].raw_len);
+        if (idx->hashed)
+            memcpy(e + INDEX_ENTRY_SIZE, idx->frames[i].hash, INDEX_HASH_SIZE);
+    }
+
+    unsigned char crc_raw[4];
+    put_le32(crc_raw, pc_crc32(pc_crc32(0, hdr, sizeof(hdr)), table, table_len));
+
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "wb");
+    if (!fp) {
+        free(table);
+        return false;
+    }
+
+    bool ok = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr) &&
+              fwrite(table, 1, table_len, fp) == table_len &&
+              fwrite(crc_raw, 1, 4, fp) == 4 &&
+              fflush(fp) == 0 &&
+              fsync(fileno(fp)) == 0;
+
+    ok = (fclose(fp) == 0) && ok;
+    free(table);
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+
+    return true;
+}
+
+void frame_index_free(FrameIndex *idx)
+{
+    free(idx->frames);
+    idx->frames = NULL;
+    idx->count = 0;
+}
+
+int64_t frame_index_find(const FrameIndex *idx, uint64_t raw_off)
+{
+    if (raw_off >= idx->raw_size)
+        return -1;
+
+    uint64_t lo = 0, hi = idx->count;
+
+    /* Last frame whose raw_off <= target */
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (idx->frames[mid].raw_off <= raw_off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return (int64_t)lo;
+}
+
+/* -------------------------------------------------------------
+ * Random-access reader
+ * ------------------------------------------------------------- */
+typedef struct {
+    int64_t frame;          /* -1 = empty */
+    uint64_t last_use;
+    unsigned char *data;
+} CacheSlot;
+
+struct FrameReader {
+    char base[1024];
+    StripeDirs stripes;
+    const FrameIndex *idx;
+
+    int fds[MAX_CHUNKS];    /* lazily opened; single file uses fds[0] */
+
+    CacheSlot *slots;
+    int nslots;
+    uint64_t tick;
+
+    unsigned char *comp_buf;
+    size_t comp_cap;
+
+    ZSTD_DCtx *zctx;
+    LZ4F_dctx *lctx;
+
+    uint64_t bytes_read;
+
+    pthread_mutex_t lock;
+};
+
+static int chunk_fd(FrameReader *r, unsigned idx)
+{
+    if (idx >= MAX_CHUNKS)
+        return -1;
+
+    if (r->fds[idx] >= 0)
+        return r->fds[idx];
+
+    char path[2200];
+    if (r->idx->chunk_bytes > 0)
+        stripe_chunk_path(&r->stripes, r->base, idx, path, sizeof(path));
+    else
+        snprintf(path, sizeof(path), "%s", r->base);
+
+    r->fds[idx] = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fds[idx] < 0)
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open %s: %s\n" RESET,
+                path, strerror(errno));
+
+    return r->fds[idx];
+}
+
+/* Read compressed bytes, crossing chunk boundaries as needed */
+static bool read_compressed(FrameReader *r, unsigned char *dst,
+                            size_t len, uint64_t off)
+{
+    uint64_t cb = r->idx->chunk_bytes;
+
+    while (len > 0) {
+        unsigned file = cb ? (unsigned)(off / cb) : 0;
+        uint64_t in_file = cb ? off % cb : off;
+        size_t take = len;
+
+        if (cb && take > cb - in_file)
+            take = (size_t)(cb - in_file);
+
+        int fd = chunk_fd(r, file);
+        if (fd < 0)
+            return false;
+
+        ssize_t n = pread(fd, dst, take, (off_t)in_file);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        r->bytes_read += (uint64_t)n;
+        dst += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+static bool decode_frame(FrameReader *r, const FrameEntry *fe, unsigned char *out)
+{
+    if (r->comp_cap < fe->comp_len) {
+        unsigned char *nb = realloc(r->comp_buf, fe->comp_len);
+        if (!nb)
+            return false;
+        r->comp_buf = nb;
+        r->comp_cap = fe->comp_len;
+    }
+
+    if (!read_compressed(r, r->comp_buf, fe->comp_len, fe->comp_off))
+        return false;
+
+    if (r->idx->compression == FRAME_COMP_ZSTD) {
+        size_t n = ZSTD_decompressDCtx(r->zctx, out, fe->raw_len,
+                                       r->comp_buf, fe->comp_len);
+        return !ZSTD_isError(n) && n == fe->raw_len;
+    }
+
+    /* LZ4 frame */
+    LZ4F_resetDecompressionContext(r->lctx);
+
+    size_t in_pos = 0, out_pos = 0;
+    for (;;) {
+        size_t in_len = fe->comp_len - in_pos;
+        size_t out_len = fe->raw_len - out_pos;
+
+        size_t hint = LZ4F_decompress(r->lctx,
+                                      out + out_pos, &out_len,
+                                      r->comp_buf + in_pos, &in_len,
+                                      NULL);
+        if (LZ4F_isError(hint))
+            return false;
+
+        in_pos += in_len;
+        out_pos += out_len;
+
+        if (hint == 0)
+            break;
+        if (in_len == 0 && out_len == 0)
+            return false;   /* truncated frame */
+    }
+
+    return out_pos == fe->raw_len;
+}
+
+/* Return the cached, decoded frame (caller holds the lock) */
+static const unsigned char *get_frame(FrameReader *r, int64_t frame)
+{
+    CacheSlot *victim = &r->slots[0];
+
+    for (int i = 0; i < r->nslots; i++) {
+        CacheSlot *s = &r->slots[i];
+        if (s->frame == frame) {
+            s->last_use = ++r->tick;
+            return s->data;
+        }
+        if (s->frame < 0 || s->last_use < victim->last_use)
+            victim = s;
+        if (s->frame < 0)
+            break;
+    }
+
+    if (!decode_frame(r, &r->idx->frames[frame], victim->data)) {
+        fprintf(stderr, RED "ERROR:" WHITE " failed to decode image frame %lld.\n" RESET,
+                (long long)frame);
+        victim->frame = -1;
+        return NULL;
+    }
+
+    victim->frame = frame;
+    victim->last_use = ++r->tick;
+    return victim->data;
+}
+
+FrameReader *frame_reader_open(const char *image_base,
+                               const FrameIndex *idx,
+                               int cache_frames)
+{
+    if (idx->compression != FRAME_COMP_ZSTD && idx->compression != FRAME_COMP_LZ4)
+        return NULL;
+
+    FrameReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    snprintf(r->base, sizeof(r->base), "%s", image_base);
+    r->idx = idx;
+    if (idx->chunk_bytes > 0)
+        stripe_dirs_load(r->base, &r->stripes);
+
+    for (int i = 0; i < MAX_CHUNKS; i++)
+        r->fds[i] = -1;
+
+    if (cache_frames < 1)
+        cache_frames = 1;
+
+    /* Largest frame (the last one may be shorter than frame_size) */
+    uint32_t max_raw = idx->frame_size;
+    for (uint64_t i = 0; i < idx->count; i++)
+        if (idx->frames[i].raw_len > max_raw)
+            max_raw = idx->frames[i].raw_len;
+
+    r->nslots = cache_frames;
+    r->slots = calloc((size_t)cache_frames, sizeof(CacheSlot));
+    bool ok = (r->slots != NULL);
+
+    for (int i = 0; ok && i < cache_frames; i++) {
+        r->slots[i].frame = -1;
+        r->slots[i].data = malloc(max_raw);
+        ok = (r->slots[i].data != NULL);
+    }
+
+    if (ok && idx->compression == FRAME_COMP_ZSTD)
+        ok = (r->zctx = ZSTD_createDCtx()) != NULL;
+    if (ok && idx->compression == FRAME_COMP_LZ4)
+        ok = !LZ4F_isError(LZ4F_createDecompressionContext(&r->lctx, LZ4F_VERSION));
+
+    pthread_mutex_init(&r->lock, NULL);
+
+    if (!ok) {
+        frame_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+ssize_t frame_reader_pread(FrameReader *r, void *dst, size_t len, uint64_t raw_off)
+{
+    unsigned char *out = dst;
+    size_t done = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (done < len) {
+        int64_t f = frame_index_find(r->idx, raw_off + done);
+        if (f < 0)
+            break;      /* end of stream */
+
+        const unsigned char *data = get_frame(r, f);
+        if (!data) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+
+        const FrameEntry *fe = &r->idx->frames[f];
+        uint64_t in_frame = raw_off + done - fe->raw_off;
+        size_t take = fe->raw_len - (size_t)in_frame;
+        if (take > len - done)
+            take = len - done;
+
+        memcpy(out + done, data + in_frame, take);
+        done += take;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return (ssize_t)done;
+}
+
+uint64_t frame_reader_bytes_read(FrameReader *r)
+{
+    pthread_mutex_lock(&r->lock);
+    uint64_t n = r->bytes_read;
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+void frame_reader_close(FrameReader *r)
+{
+    if (!r)
+        return;
+
+    for (int i = 0; i < MAX_CHUNKS; i++)
+        if (r->fds[i] >= 0)
+            close(r->fds[i]);
+
+    if (r->slots) {
+        for (int i = 0; i < r->nslots; i++)
+            free(r->slots[i].data);
+        free(r->slots);
+    }
+
+    free(r->comp_buf);
+    ZSTD_freeDCtx(r->zctx);
+    if (r->lctx)
+        LZ4F_freeDecompressionContext(r->lctx);
+
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
@@ -0,0 +1,108 @@
+#ifndef FRAMEIDX_H
+#define FRAMEIDX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Frame index.
+ *
+ * imprintb compresses zstd and lz4 images as a series of independent
+ * frames, each holding a fixed amount of the uncompressed partclone
+ * stream.  The frames are simply concatenated, so `zstd -dc` and
+ * `lz4 -dc` still read the image as one stream, but with the index
+ * (<image>.idx) any byte of the stream can be reached by decoding a
+ * single frame.
+ *
+ * On-disk layout (little-endian):
+ *
+ *   "IMPRIDX1"                      8 bytes
+ *   version, compression            u32, u32
+ *   frame_size, reserved            u32, u32
+ *   chunk_bytes                     u64   (0 = single file)
+ *   raw_size, comp_size             u64, u64
+ *   frame_count                     u64
+ *   frame_count x { raw_off u64, comp_off u64, comp_len u32, raw_len u32 }
+ *   crc32 of everything above       u32
+ *
+ * Offsets are relative to the whole stream; for chunk sets the file
+ * holding comp_off is comp_off / chunk_bytes.
+ *
+ * Version 2 indexes (images written to reflink-capable filesystems,
+ * see imgwriter.h) append the SHA-256 of each compressed frame to its
+ * entry.
+ */
+
+#define FRAME_INDEX_MAGIC    "IMPRIDX1"
+#define FRAME_INDEX_VERSION  1
+#define FRAME_INDEX_VERSION_HASHED  2
+
+/* Default uncompressed bytes per frame */
+#define FRAME_DEFAULT_SIZE_KB  1024
+
+enum {
+    FRAME_COMP_ZSTD = 1,
+    FRAME_COMP_LZ4  = 2
+};
+
+typedef struct {
+    uint64_t raw_off;
+    uint64_t comp_off;
+    uint32_t comp_len;
+    uint32_t raw_len;
+    unsigned char hash[32];     /* hashed indexes only */
+} FrameEntry;
+
+typedef struct {
+    uint32_t compression;
+    uint32_t frame_size;
+    uint64_t chunk_bytes;
+    uint64_t raw_size;
+    uint64_t comp_size;
+    uint64_t count;
+    bool hashed;                /* entries carry frame hashes (version 2) */
+    FrameEntry *frames;
+} FrameIndex;
+
+/* Build the index path for an image: <image_base>.idx */
+void frame_index_path_for(const char *image_base, char *out, size_t out_len);
+
+bool frame_index_load(const char *path, FrameIndex *out);
+
+/* Atomically write the index (temp + fsync + rename). */
+bool frame_index_save(const char *path, const FrameIndex *idx);
+
+void frame_index_free(FrameIndex *idx);
+
+/* Frame holding raw stream offset `raw_off`, or -1 past the end. */
+int64_t frame_index_find(const FrameIndex *idx, uint64_t raw_off);
+
+/*
+ * Random-access reader.
+ *
+ * Reads arbitrary ranges of the uncompressed stream by decoding the
+ * frames that cover them, keeping the most recently used frames in
+ * an LRU cache.  Safe to call from several threads.
+ */
+typedef struct FrameReader FrameReader;
+
+/*
+ * image_base   = image filename, or chunk base when idx->chunk_bytes > 0
+ * cache_frames = number of decoded frames kept in memory (>= 1)
+ */
+FrameReader *frame_reader_open(const char *image_base,
+                               const FrameIndex *idx,
+                               int cache_frames);
+
+/* Read len bytes at raw_off.  Returns bytes read (short at end of
+ * stream), or -1 on I/O or decode error. */
+ssize_t frame_reader_pread(FrameReader *r, void *dst, size_t len, uint64_t raw_off);
+
+/* Compressed bytes read from the image so far. */
+uint64_t frame_reader_bytes_read(FrameReader *r);
+
+void frame_reader_close(FrameReader *r);
+
+#endif /* FRAMEIDX_H */
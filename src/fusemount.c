@@ -0,0 +1,495 @@
+#define _GNU_SOURCE
+
+#include "fusemount.h"
+#include "frameidx.h"
+#include "pcimage.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <linux/fuse.h>
+
+#define ROOT_INO   FUSE_ROOT_ID
+#define IMAGE_INO  2
+
+/* Requests handled concurrently */
+#define MOUNT_THREADS  4
+
+/* Largest read we ask the kernel to send (max_pages * page size) */
+#define MOUNT_MAX_READ  (1024 * 1024)
+
+/* Request buffer: header + largest write the kernel may send */
+#define MOUNT_REQ_BUF   (MOUNT_MAX_READ + 4096)
+
+typedef struct {
+    int fuse_fd;
+    const char *file_name;
+
+    PcLayout layout;
+    FrameIndex idx;
+    FrameReader *reader;
+
+    uint64_t size;          /* bytes in the virtual partition file */
+    struct timespec mtime;
+
+    int threads_running;
+} MountState;
+
+static bool layout_read(void *ctx, void *dst, size_t len, uint64_t off)
+{
+    return frame_reader_pread(ctx, dst, len, off) == (ssize_t)len;
+}
+
+/* -------------------------------------------------------------
+ * Partition contents
+ * ------------------------------------------------------------- */
+static bool fill_range(MountState *st, unsigned char *dst, uint64_t off, size_t len)
+{
+    uint32_t bs = st->layout.h.block_size;
+    uint64_t total = st->layout.h.total_blocks;
+
+    while (len > 0) {
+        uint64_t b = off / bs;
+        uint32_t in_block = (uint32_t)(off % bs);
+        size_t take = bs - in_block;
+        if (take > len)
+            take = len;
+
+        if (b >= total || !pc_test_bit(st->layout.bitmap, b)) {
+            memset(dst, 0, take);   /* unused: never stored in the image */
+        } else {
+            uint64_t src = pc_layout_offset(&st->layout, b) + in_block;
+            if (frame_reader_pread(st->reader, dst, take, src) != (ssize_t)take)
+                return false;
+        }
+
+        dst += take;
+        off += take;
+        len -= take;
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Replies
+ * ------------------------------------------------------------- */
+static void reply(MountState *st, uint64_t unique, int error,
+                  const void *data, size_t len)
+{
+    struct fuse_out_header out;
+    out.unique = unique;
+    out.error = -error;
+    out.len = (uint32_t)(sizeof(out) + (error ? 0 : len));
+
+    struct iovec iov[2] = {
+        { &out, sizeof(out) },
+        { (void *)data, error ? 0 : len }
+    };
+
+    /* ENOENT here means the request was interrupted; nothing to do */
+    if (writev(st->fuse_fd, iov, (error || !len) ? 1 : 2) < 0 &&
+        errno != ENOENT)
+        perror("fuse reply");
+}
+
+static void fill_attr(const MountState *st, uint64_t ino, struct fuse_attr *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->ino = ino;
+    a->atime = a->mtime = a->ctime = (uint64_t)st->mtime.tv_sec;
+    a->atimensec = a->mtimensec = a->ctimensec = (uint32_t)st->mtime.tv_nsec;
+    a->blksize = 4096;
+
+    if (ino == ROOT_INO) {
+        a->mode = S_IFDIR | 0555;
+        a->nlink = 2;
+    } else {
+        a->mode = S_IFREG | 0444;
+        a->nlink = 1;
+        a->size = st->size;
+        a->blocks = (st->size + 511) / 512;
+    }
+}
+
+static void do_init(MountState *st, uint64_t unique, const struct fuse_init_in *in)
+{
+    struct fuse_init_out out;
+    memset(&out, 0, sizeof(out));
+
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = in->minor < FUSE_KERNEL_MINOR_VERSION ? in->minor : FUSE_KERNEL_MINOR_VERSION;
+    out.max_readahead = in->max_readahead;
+    out.flags = in->flags & (FUSE_ASYNC_READ | FUSE_MAX_PAGES);
+    out.max_background = 16;
+    out.congestion_threshold = 12;
+    out.max_write = 4096;
+    out.time_gran = 1;
+    out.max_pages = MOUNT_MAX_READ / 4096;
+
+    reply(st, unique, 0, &out, sizeof(out));
+}
+
+static void do_lookup(MountState *st, uint64_t unique, uint64_t parent, const char *name)
+{
+    if (parent != ROOT_INO || strcmp(name, st->file_name) != 0) {
+        reply(st, unique, ENOENT, NULL, 0);
+        return;
+    }
+
+    struct fuse_entry_out e;
+    memset(&e, 0, sizeof(e));
+    e.nodeid = IMAGE_INO;
+    e.entry_valid = 3600;
+    e.attr_valid = 3600;
+    fill_attr(st, IMAGE_INO, &e.attr);
+
+    reply(st, unique, 0, &e, sizeof(e));
+}
+
+static void do_getattr(MountState *st, uint64_t unique, uint64_t ino)
+{
+    if (ino != ROOT_INO && ino != IMAGE_INO) {
+        reply(st, unique, ENOENT, NULL, 0);
+        return;
+    }
+
+    struct fuse_attr_out a;
+    memset(&a, 0, sizeof(a));
+    a.attr_valid = 3600;
+    fill_attr(st, ino, &a.attr);
+
+    reply(st, unique, 0, &a, sizeof(a));
+}
+
+static void do_open(MountState *st, uint64_t unique, uint64_t ino,
+                    const struct fuse_open_in *in, bool dir)
+{
+    if (dir ? ino != ROOT_INO : ino != IMAGE_INO) {
+        reply(st, unique, dir ? ENOTDIR : EISDIR, NULL, 0);
+        return;
+    }
+
+    if ((in->flags & O_ACCMODE) != O_RDONLY) {
+        reply(st, unique, EROFS, NULL, 0);
+        return;
+    }
+
+    struct fuse_open_out out;
+    memset(&out, 0, sizeof(out));
+    out.open_flags = FOPEN_KEEP_CACHE;
+
+    reply(st, unique, 0, &out, sizeof(out));
+}
+
+static void do_read(MountState *st, uint64_t unique, const struct fuse_read_in *in,
+                    unsigned char **buf, size_t *cap)
+{
+    uint64_t off = in->offset;
+    size_t len = in->size;
+
+    if (off >= st->size) {
+        reply(st, unique, 0, NULL, 0);
+        return;
+    }
+    if (len > st->size - off)
+        len = (size_t)(st->size - off);
+
+    if (len > *cap) {
+        unsigned char *nb = realloc(*buf, len);
+        if (!nb) {
+            reply(st, unique, ENOMEM, NULL, 0);
+            return;
+        }
+        *buf = nb;
+        *cap = len;
+    }
+
+    if (!fill_range(st, *buf, off, len)) {
+        reply(st, unique, EIO, NULL, 0);
+        return;
+    }
+
+    reply(st, unique, 0, *buf, len);
+}
+
+static void do_readdir(MountState *st, uint64_t unique, const struct fuse_read_in *in)
+{
+    struct { uint64_t ino; const char *name; uint32_t type; } ents[3] = {
+        { ROOT_INO,  ".",           S_IFDIR >> 12 },
+        { ROOT_INO,  "..",          S_IFDIR >> 12 },
+        { IMAGE_INO, st->file_name, S_IFREG >> 12 }
+    };
+
+    unsigned char out[4096 + 256];
+    size_t used = 0;
+
+    for (uint64_t i = in->offset; i < 3; i++) {
+        size_t namelen = strlen(ents[i].name);
+        size_t reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+
+        if (used + reclen > in->size || used + reclen > sizeof(out))
+            break;
+
+        struct fuse_dirent *d = (struct fuse_dirent *)(out + used);
+        memset(d, 0, reclen);
+        d->ino = ents[i].ino;
+        d->off = i + 1;
+        d->namelen = (uint32_t)namelen;
+        d->type = ents[i].type;
+        memcpy(d->name, ents[i].name, namelen);
+
+        used += reclen;
+    }
+
+    reply(st, unique, 0, out, used);
+}
+
+static void do_statfs(MountState *st, uint64_t unique)
+{
+    struct fuse_statfs_out out;
+    memset(&out, 0, sizeof(out));
+    out.st.bsize = 4096;
+    out.st.frsize = 4096;
+    out.st.blocks = (st->size + 4095) / 4096;
+    out.st.files = 2;
+    out.st.namelen = 255;
+
+    reply(st, unique, 0, &out, sizeof(out));
+}
+
+/* -------------------------------------------------------------
+ * Request loop (one per thread, all reading the same /dev/fuse)
+ * ------------------------------------------------------------- */
+static void *worker_main(void *arg)
+{
+    MountState *st = arg;
+    unsigned char *req = malloc(MOUNT_REQ_BUF);
+    unsigned char *data = NULL;
+    size_t data_cap = 0;
+
+    while (req) {
+        ssize_t n = read(st->fuse_fd, req, MOUNT_REQ_BUF);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == ENOENT)
+                continue;
+            break;      /* ENODEV: unmounted */
+        }
+        if ((size_t)n < sizeof(struct fuse_in_header))
+            continue;
+
+        const struct fuse_in_header *h = (const void *)req;
+        const void *body = req + sizeof(*h);
+
+        switch (h->opcode) {
+        case FUSE_INIT:
+            do_init(st, h->unique, body);
+            break;
+        case FUSE_LOOKUP:
+            do_lookup(st, h->unique, h->nodeid, body);
+            break;
+        case FUSE_GETATTR:
+            do_getattr(st, h->unique, h->nodeid);
+            break;
+        case FUSE_OPEN:
+            do_open(st, h->unique, h->nodeid, body, false);
+            break;
+        case FUSE_OPENDIR:
+            do_open(st, h->unique, h->nodeid, body, true);
+            break;
+        case FUSE_READ:
+            do_read(st, h->unique, body, &data, &data_cap);
+            break;
+        case FUSE_READDIR:
+            do_readdir(st, h->unique, body);
+            break;
+        case FUSE_STATFS:
+            do_statfs(st, h->unique);
+            break;
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_FLUSH:
+        case FUSE_ACCESS:
+        case FUSE_DESTROY:
+            reply(st, h->unique, 0, NULL, 0);
+            break;
+        case FUSE_FORGET:
+        case FUSE_BATCH_FORGET:
+        case FUSE_INTERRUPT:
+            break;      /* no reply expected */
+        case FUSE_SETATTR:
+        case FUSE_WRITE:
+        case FUSE_CREATE:
+        case FUSE_MKNOD:
+        case FUSE_MKDIR:
+        case FUSE_UNLINK:
+        case FUSE_RMDIR:
+        case FUSE_RENAME:
+        case FUSE_SETXATTR:
+        case FUSE_REMOVEXATTR:
+            reply(st, h->unique, EROFS, NULL, 0);
+            break;
+        default:
+            reply(st, h->unique, ENOSYS, NULL, 0);
+            break;
+        }
+    }
+
+    free(data);
+    free(req);
+    __atomic_sub_fetch(&st->threads_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+ * Entry point
+ * ------------------------------------------------------------- */
+bool fuse_mount_image(const char *image_base,
+                      const char *mountpoint,
+                      const char *file_name,
+                      int cache_mb)
+{
+    MountState st;
+    memset(&st, 0, sizeof(st));
+    st.fuse_fd = -1;
+    st.file_name = file_name;
+
+    char idx_path[1100];
+    frame_index_path_for(image_base, idx_path, sizeof(idx_path));
+
+    if (!frame_index_load(idx_path, &st.idx)) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " cannot read the frame index %s.\n"
+                "       Only zstd and lz4 images written by imprintb 0.9.6 or later can be mounted.\n" RESET,
+                idx_path);
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(idx_path, &sb) == 0)
+        st.mtime = sb.st_mtim;
+
+    int frames = (int)(((uint64_t)cache_mb * 1024 * 1024) / st.idx.frame_size);
+    if (frames < 2)
+        frames = 2;
+
+    st.reader = frame_reader_open(image_base, &st.idx, frames);
+    if (!st.reader) {
+        frame_index_free(&st.idx);
+        return false;
+    }
+
+    char why[128];
+    if (!pc_layout_load(&st.layout, layout_read, st.reader, why, sizeof(why))) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot mount image: %s\n" RESET, why);
+        frame_reader_close(st.reader);
+        frame_index_free(&st.idx);
+        return false;
+    }
+
+    st.size = st.layout.h.device_size
+            ? st.layout.h.device_size
+            : st.layout.h.total_blocks * st.layout.h.block_size;
+
+    /* ---------------------------------------------------------
+     * Mount
+     * --------------------------------------------------------- */
+    bool ok = true;
+
+    st.fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+    if (st.fuse_fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open /dev/fuse: %s\n" RESET, strerror(errno));
+        ok = false;
+    }
+
+    if (ok) {
+        char opts[256];
+        snprintf(opts, sizeof(opts),
+                 "fd=%d,rootmode=40000,user_id=%u,group_id=%u,"
+                 "allow_other,default_permissions,max_read=%d",
+                 st.fuse_fd, (unsigned)getuid(), (unsigned)getgid(), MOUNT_MAX_READ);
+
+        if (mount("imprint", mountpoint, "fuse.imprint",
+                  MS_RDONLY | MS_NOSUID | MS_NODEV, opts) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot mount on %s: %s\n" RESET,
+                    mountpoint, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        if (st.fuse_fd >= 0)
+            close(st.fuse_fd);
+        pc_layout_free(&st.layout);
+        frame_reader_close(st.reader);
+        frame_index_free(&st.idx);
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * Serve until unmounted; signals unmount
+     * --------------------------------------------------------- */
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    pthread_t tids[MOUNT_THREADS];
+    int started = 0;
+
+    for (int i = 0; i < MOUNT_THREADS; i++) {
+        __atomic_add_fetch(&st.threads_running, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&tids[i], NULL, worker_main, &st) != 0) {
+            __atomic_sub_fetch(&st.threads_running, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        started++;
+    }
+
+    fprintf(stderr,
+            GREEN "Image mounted read-only at %s\n\n" RESET
+            WHITE "To get at the files, loop-mount the partition file, e.g.:\n"
+            YELLOW "    mount -o loop,ro '%s/%s' /mnt/restore\n\n" RESET
+            WHITE "Press Ctrl-C (or umount %s) to detach.\n" RESET,
+            mountpoint, mountpoint, file_name, mountpoint);
+
+    bool unmount_sent = false;
+
+    while (__atomic_load_n(&st.threads_running, __ATOMIC_ACQUIRE) > 0) {
+        struct timespec tick = { 1, 0 };
+        int sig = sigtimedwait(&mask, NULL, &tick);
+
+        if (sig > 0 && !unmount_sent) {
+            fprintf(stderr, YELLOW "\nUnmounting %s...\n" RESET, mountpoint);
+            if (umount2(mountpoint, MNT_DETACH) != 0)
+                perror("umount");
+            unmount_sent = true;
+        }
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    fprintf(stderr, WHITE "Image bytes read: %.2f MB\n" RESET,
+            (double)frame_reader_bytes_read(st.reader) / (1024.0 * 1024.0));
+
+    close(st.fuse_fd);
+    pc_layout_free(&st.layout);
+    frame_reader_close(st.reader);
+    frame_index_free(&st.idx);
+    return true;
+}
@@ -0,0 +1,33 @@
+#ifndef FUSEMOUNT_H
+#define FUSEMOUNT_H
+
+#include <stdbool.h>
+
+/*
+ * Read-only FUSE view of an image.
+ *
+ * The mountpoint contains a single file holding the partition exactly
+ * as a full restore would produce it.  Reads are served from the frame
+ * index: only the frames that hold the requested blocks are read and
+ * decoded (with an LRU cache of decoded frames), and blocks that are
+ * unused according to partclone's bitmap read as zeros without
+ * touching the image at all.  Loop-mount the file to get at the files.
+ *
+ * Talks the FUSE kernel protocol on /dev/fuse directly, so no libfuse
+ * is needed; mounting requires root.
+ */
+
+/*
+ * image_base = image filename, or chunk base for chunked images
+ * file_name  = name of the file shown inside the mountpoint
+ * cache_mb   = memory for decoded frames
+ *
+ * Runs in the foreground until the filesystem is unmounted or the
+ * process receives SIGINT/SIGTERM.
+ */
+bool fuse_mount_image(const char *image_base,
+                      const char *mountpoint,
+                      const char *file_name,
+                      int cache_mb);
+
+#endif /* FUSEMOUNT_H */
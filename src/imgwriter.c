@@ -0,0 +1,1736 @@
+#define _GNU_SOURCE
+
+#include "imgwriter.h"
+#include "frameidx.h"
+#include "stripe.h"
+#include "pagecache.h"
+#include "utils.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <linux/fs.h>
+#include <linux/magic.h>
+#include <zstd.h>
+#include <lz4frame.h>
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+#define MAX_WORKERS  16
+#define MAX_CHUNKS   1000    /* split -a 3 naming: .000 .. .999 */
+
+#define ZSTD_LEVEL   6       /* matches the former `zstd -6` */
+#define LZ4_LEVEL    1       /* matches the former `lz4 -1` */
+
+/* Alignment padding: a skippable frame, understood by zstd and lz4 */
+#define SKIPPABLE_MAGIC   0x184D2A5Eu
+#define SKIPPABLE_HEADER  8
+#define MAX_ALIGN         65536
+
+/* Largest single write() of a mirror thread */
+#define SINK_PIECE        (1024 * 1024)
+
+/* Finished chunk files waiting for their fsync */
+#define SYNC_QUEUE        4
+
+/* Reads when checking a file back from the medium */
+#define VERIFY_READ       (4 * 1024 * 1024)
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_FILLING,
+    SLOT_PENDING,
+    SLOT_BUSY,
+    SLOT_DONE,
+    SLOT_FAILED
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    uint64_t seq;
+    unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    size_t out_len;
+    unsigned char hash[SHA256_DIGEST_LENGTH];   /* of out, when aligned */
+} Slot;
+
+/*
+ * A full chunk file is fsynced and closed by a thread of its own while
+ * the next one fills, so the image is on disk by the time the last
+ * chunk is, without a long flush at the end.  With verify, the thread
+ * then reads the chunk back from the medium and compares it with the
+ * digest of what was written.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    int fds[SYNC_QUEUE];
+    char paths[SYNC_QUEUE][1100];
+    unsigned char digests[SYNC_QUEUE][SHA256_DIGEST_LENGTH];
+    int head;
+    int count;
+    bool eof;
+    bool failed;
+    bool drop_cache;        /* also drop each file from the page cache */
+    bool verify;
+} ChunkSyncer;
+
+/*
+ * One destination of the image (single file or chunk set), or one
+ * directory of a striped chunk set.  With mirrors, stripes or
+ * write-behind, every destination is written by a thread of its own
+ * from a bounded queue, so a slow one holds the others back only once
+ * its queue is full.  Write-behind can also spill to a local file:
+ * once the queue is full, bytes go there, and keep going there until
+ * the thread has caught up with all of it, so they leave in order.
+ */
+typedef struct {
+    uint64_t chunk_bytes;   /* copies of the writer's settings: a */
+    int stall_sec;          /* stalled thread may outlive the writer */
+    char path[1024];
+    int fd;                 /* -1 until the first chunk is opened */
+    unsigned chunk;
+    unsigned chunk_step;    /* stripes: chunks of one directory are n apart */
+    uint64_t in_chunk;
+    int chunks_created;
+    bool drop_cache;        /* keep the chunk files out of the page cache */
+    CacheWindow cache;
+    ChunkSyncer *syncer;    /* started with the second chunk */
+    bool verify;            /* read each chunk back once it is flushed */
+    SHA256_CTX chunk_sha;   /* of the current chunk, with verify */
+    ImageStreamFn stream;   /* instead of files, if set */
+    void *stream_ctx;
+
+    /* Mirrors only */
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t qlock;
+    pthread_cond_t qcv;
+    unsigned char *ring;
+    size_t cap;
+    size_t head;            /* oldest queued byte */
+    size_t len;             /* bytes queued */
+    bool eof;               /* nothing more will be queued */
+    bool done;              /* thread finished */
+    bool failed;            /* write error, or given up */
+    bool stalled;           /* given up while the thread was blocked */
+    bool dropped;           /* no longer fed */
+    bool ok;                /* completed (set on close) */
+    time_t progress;        /* last progress, monotonic seconds */
+
+    /* Write-behind spill file, after everything in the ring */
+    bool spill;             /* spill_fd is open */
+    bool spill_broken;      /* a spill write failed; queue only */
+    int spill_fd;
+    uint64_t spill_head;    /* file offset of the oldest spilled byte */
+    uint64_t spill_len;     /* bytes spilled and not yet written */
+    uint64_t spill_cap;
+    uint64_t spill_peak;
+    uint64_t spill_total;
+    unsigned char *spill_buf;   /* SINK_PIECE, for the thread's reads */
+} Sink;
+
+/* Earlier image whose frames can be reflinked */
+typedef struct {
+    char base[1024];
+    StripeDirs stripes;
+    FrameIndex idx;
+    int *fds;               /* per chunk file, opened on demand */
+    unsigned nfiles;
+
+    /* Open addressing on the hash: frame number + 1, 0 = empty */
+    uint64_t *table;
+    uint64_t mask;
+
+    uint64_t frames;        /* reflinked so far */
+    uint64_t bytes;
+    bool disabled;          /* the filesystem refused; write instead */
+} ReuseSource;
+
+struct ImageWriter {
+    int compression;
+    uint64_t chunk_bytes;
+    size_t frame_size;
+    size_t out_cap;
+
+    /* Compression workers */
+    pthread_t workers[MAX_WORKERS];
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    bool stop;
+
+    /* Frame slots, slot for sequence s is s % nslots */
+    Slot *slots;
+    int nslots;
+    uint64_t next_seq;      /* next frame to fill */
+    uint64_t write_seq;     /* next frame to write */
+    Slot *filling;
+
+    /* Output: sinks[0] is output_path, then the mirrors or stripes */
+    Sink *sinks;
+    int nsinks;
+    int stall_sec;
+    bool require_all;
+    bool striped;
+    bool drop_cache;
+    bool verify;
+    uint64_t emitted;       /* stream bytes handed to the sinks */
+    SHA256_CTX sha;
+
+    FrameIndex idx;
+    uint64_t idx_cap;
+
+    uint64_t raw_total;
+    uint64_t comp_total;
+    bool failed;
+
+    /* Reflink-friendly layout (btrfs, XFS) */
+    uint32_t align;         /* frames start on this boundary, 0 = packed */
+    unsigned char *pad;     /* MAX_ALIGN + SKIPPABLE_HEADER bytes */
+    ReuseSource *reuse;
+};
+
+/* -------------------------------------------------------------
+ * Compression workers
+ * ------------------------------------------------------------- */
+static bool compress_slot(ImageWriter *w, Slot *s, ZSTD_CCtx *zctx)
+{
+    if (w->compression == FRAME_COMP_ZSTD) {
+        size_t n = ZSTD_compress2(zctx, s->out, w->out_cap, s->in, s->in_len);
+        if (ZSTD_isError(n))
+            return false;
+        s->out_len = n;
+        return true;
+    }
+
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = LZ4_LEVEL;
+    prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+    prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    prefs.frameInfo.contentSize = s->in_len;
+
+    size_t n = LZ4F_compressFrame(s->out, w->out_cap, s->in, s->in_len, &prefs);
+    if (LZ4F_isError(n))
+        return false;
+    s->out_len = n;
+    return true;
+}
+
+static void *worker_main(void *arg)
+{
+    ImageWriter *w = arg;
+    ZSTD_CCtx *zctx = NULL;
+
+    if (w->compression == FRAME_COMP_ZSTD) {
+        zctx = ZSTD_createCCtx();
+        if (zctx) {
+            ZSTD_CCtx_setParameter(zctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+            ZSTD_CCtx_setParameter(zctx, ZSTD_c_checksumFlag, 1);
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        /* Oldest pending frame first */
+        Slot *job = NULL;
+        for (int i = 0; i < w->nslots; i++) {
+            Slot *s = &w->slots[i];
+            if (s->state == SLOT_PENDING && (!job || s->seq < job->seq))
+                job = s;
+        }
+
+        if (!job) {
+            if (w->stop)
+                break;
+            pthread_cond_wait(&w->work_cv, &w->lock);
+            continue;
+        }
+
+        job->state = SLOT_BUSY;
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = (w->compression != FRAME_COMP_ZSTD || zctx) &&
+                  compress_slot(w, job, zctx);
+
+        if (ok && w->align)
+            SHA256(job->out, job->out_len, job->hash);
+
+        pthread_mutex_lock(&w->lock);
+        job->state = ok ? SLOT_DONE : SLOT_FAILED;
+        pthread_cond_broadcast(&w->done_cv);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    ZSTD_freeCCtx(zctx);
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+ * Chunk syncer
+ * ------------------------------------------------------------- */
+/*
+ * Read a flushed file back, past the page cache, and compare it with
+ * the digest of what was written to it.  1 = same, 0 = different,
+ * -1 = cannot be read (errno set).
+ */
+static int verify_file(const char *path, int wfd, const unsigned char *digest)
+{
+    posix_fadvise(wfd, 0, 0, POSIX_FADV_DONTNEED);
+
+    int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0 && errno == EINVAL)
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    void *buf = NULL;
+    if (posix_memalign(&buf, MAX_ALIGN, VERIFY_READ) != 0) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    SHA256_CTX c;
+    SHA256_Init(&c);
+
+    int result = 1;
+
+    for (;;) {
+        ssize_t n = read(fd, buf, VERIFY_READ);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Some filesystems refuse O_DIRECT; drop it and retry */
+            if (errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        SHA256_Update(&c, buf, (size_t)n);
+    }
+
+    int err = errno;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    free(buf);
+
+    if (result < 0) {
+        errno = err;
+        return -1;
+    }
+
+    unsigned char got[SHA256_DIGEST_LENGTH];
+    SHA256_Final(got, &c);
+    return memcmp(got, digest, sizeof(got)) == 0 ? 1 : 0;
+}
+
+/* Check a flushed file and say what is wrong with it */
+static bool verify_written(const char *path, int wfd, const unsigned char *digest)
+{
+    int v = verify_file(path, wfd, digest);
+
+    if (v < 0)
+        fprintf(stderr, RED "\nERROR:" WHITE " reading %s back failed: %s\n" RESET,
+                path, strerror(errno));
+    else if (v == 0)
+        fprintf(stderr, RED "\nERROR:" WHITE " %s reads back differently from what was written; "
+                "the medium is corrupting data.\n" RESET, path);
+    return v == 1;
+}
+
+static void *syncer_main(void *arg)
+{
+    ChunkSyncer *y = arg;
+
+    pthread_mutex_lock(&y->lock);
+
+    for (;;) {
+        while (y->count == 0 && !y->eof)
+            pthread_cond_wait(&y->cv, &y->lock);
+        if (y->count == 0)
+            break;
+
+        int fd = y->fds[y->head];
+        const char *path = y->paths[y->head];
+        const unsigned char *digest = y->digests[y->head];
+        bool verify = y->verify && !y->failed;
+        pthread_mutex_unlock(&y->lock);
+
+        bool ok = fsync(fd) == 0;
+        if (!ok)
+            fprintf(stderr, RED "\nERROR:" WHITE " flushing %s failed: %s\n" RESET,
+                    path, strerror(errno));
+        else if (verify)
+            ok = verify_written(path, fd, digest);
+
+        if (y->drop_cache)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        if (close(fd) != 0 && ok) {
+            fprintf(stderr, RED "\nERROR:" WHITE " closing %s failed: %s\n" RESET,
+                    path, strerror(errno));
+            ok = false;
+        }
+
+        pthread_mutex_lock(&y->lock);
+        y->head = (y->head + 1) % SYNC_QUEUE;
+        y->count--;
+        if (!ok)
+            y->failed = true;
+        pthread_cond_broadcast(&y->cv);
+    }
+
+    pthread_mutex_unlock(&y->lock);
+    return NULL;
+}
+
+/* Hand over a full chunk file; false once a flush has failed */
+static bool syncer_push(Sink *k, int fd, const char *path, const unsigned char *digest)
+{
+    ChunkSyncer *y = k->syncer;
+
+    if (!y) {
+        y = calloc(1, sizeof(*y));
+        if (!y) {
+            close(fd);
+            return false;
+        }
+        y->drop_cache = k->drop_cache;
+        y->verify = k->verify;
+        pthread_mutex_init(&y->lock, NULL);
+        pthread_cond_init(&y->cv, NULL);
+
+        if (pthread_create(&y->thread, NULL, syncer_main, y) != 0) {
+            pthread_cond_destroy(&y->cv);
+            pthread_mutex_destroy(&y->lock);
+            free(y);
+            close(fd);
+            return false;
+        }
+        k->syncer = y;
+    }
+
+    pthread_mutex_lock(&y->lock);
+    while (y->count == SYNC_QUEUE)
+        pthread_cond_wait(&y->cv, &y->lock);
+
+    int at = (y->head + y->count) % SYNC_QUEUE;
+    y->fds[at] = fd;
+    snprintf(y->paths[at], sizeof(y->paths[at]), "%s", path);
+    memcpy(y->digests[at], digest, SHA256_DIGEST_LENGTH);
+    y->count++;
+    bool ok = !y->failed;
+    pthread_cond_broadcast(&y->cv);
+    pthread_mutex_unlock(&y->lock);
+    return ok;
+}
+
+/* False once a chunk handed over could not be flushed or verified */
+static bool syncer_ok(Sink *k)
+{
+    ChunkSyncer *y = k->syncer;
+    if (!y)
+        return true;
+
+    pthread_mutex_lock(&y->lock);
+    bool ok = !y->failed;
+    pthread_mutex_unlock(&y->lock);
+    return ok;
+}
+
+/* Wait until every handed-over chunk is flushed and closed */
+static bool syncer_finish(Sink *k)
+{
+    ChunkSyncer *y = k->syncer;
+    if (!y)
+        return true;
+
+    pthread_mutex_lock(&y->lock);
+    y->eof = true;
+    pthread_cond_broadcast(&y->cv);
+    pthread_mutex_unlock(&y->lock);
+    pthread_join(y->thread, NULL);
+
+    bool ok = !y->failed;
+    pthread_cond_destroy(&y->cv);
+    pthread_mutex_destroy(&y->lock);
+    free(y);
+    k->syncer = NULL;
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Output (single file or chunk set)
+ * ------------------------------------------------------------- */
+static void chunk_path(const Sink *k, unsigned idx, char *out, size_t len)
+{
+    if (k->chunk_bytes > 0)
+        snprintf(out, len, "%s.%03u", k->path, idx);
+    else
+        snprintf(out, len, "%s", k->path);
+}
+
+static bool open_chunk(Sink *k, unsigned idx)
+{
+    if (idx >= MAX_CHUNKS) {
+        fprintf(stderr, RED "ERROR:" WHITE " image needs more than %d chunks; use a larger chunk size.\n" RESET,
+                MAX_CHUNKS);
+        return false;
+    }
+
+    char path[1100];
+    chunk_path(k, idx, path, sizeof(path));
+
+    k->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (k->fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s: %s\n" RESET,
+                path, strerror(errno));
+        return false;
+    }
+
+    k->chunk = idx;
+    k->in_chunk = 0;
+    k->chunks_created = (int)idx + 1;
+    cache_window_init(&k->cache, k->fd, 0);
+    SHA256_Init(&k->chunk_sha);
+    return true;
+}
+
+/* Move on to the next chunk file once the current one is full */
+static bool roll_chunk(Sink *k)
+{
+    if (k->chunk_bytes == 0 || k->in_chunk < k->chunk_bytes)
+        return true;
+
+    char path[1100];
+    unsigned char digest[SHA256_DIGEST_LENGTH] = {0};
+    chunk_path(k, k->chunk, path, sizeof(path));
+    if (k->verify)
+        SHA256_Final(digest, &k->chunk_sha);
+
+    int fd = k->fd;
+    k->fd = -1;
+    if (!syncer_push(k, fd, path, digest))
+        return false;
+    return open_chunk(k, k->chunk + k->chunk_step);
+}
+
+/* Bytes that reached the current chunk without write_out() (reflinks) */
+static void chunk_hash(Sink *k, const unsigned char *buf, size_t len)
+{
+    if (k->verify)
+        SHA256_Update(&k->chunk_sha, buf, len);
+}
+
+/* Flush and close the last chunk once the earlier ones are flushed */
+static bool close_output(Sink *k, bool ok)
+{
+    ok = syncer_finish(k) && ok;
+
+    /* A stripe may not have received any chunk */
+    if (k->fd >= 0) {
+        if (k->drop_cache)
+            cache_window_finish(&k->cache);
+        if (ok && fsync(k->fd) != 0)
+            ok = false;
+
+        if (ok && k->verify) {
+            char path[1100];
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            chunk_path(k, k->chunk, path, sizeof(path));
+            SHA256_Final(digest, &k->chunk_sha);
+            ok = verify_written(path, k->fd, digest);
+        }
+
+        if (close(k->fd) != 0)
+            ok = false;
+        k->fd = -1;
+    }
+
+    return ok;
+}
+
+static bool write_out(Sink *k, const unsigned char *buf, size_t len)
+{
+    uint64_t chunk_bytes = k->chunk_bytes;
+
+    if (k->stream)
+        return k->stream(k->stream_ctx, buf, len);
+
+    /* A chunk already written went bad: stop here */
+    if (!syncer_ok(k))
+        return false;
+
+    while (len > 0) {
+        if (k->fd < 0 && !open_chunk(k, k->chunk))
+            return false;
+        if (!roll_chunk(k))
+            return false;
+
+        size_t take = len;
+        if (chunk_bytes > 0 && take > chunk_bytes - k->in_chunk)
+            take = (size_t)(chunk_bytes - k->in_chunk);
+
+        ssize_t n = write(k->fd, buf, take);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, RED "\nERROR:" WHITE " writing %s failed: %s\n" RESET,
+                    k->path, strerror(errno));
+            return false;
+        }
+
+        chunk_hash(k, buf, (size_t)n);
+        k->in_chunk += (uint64_t)n;
+        buf += n;
+        len -= (size_t)n;
+
+        if (k->drop_cache)
+            cache_window_wrote(&k->cache, (off_t)k->in_chunk);
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Mirrors
+ * ------------------------------------------------------------- */
+static time_t now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool pwrite_full(int fd, const unsigned char *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return true;
+}
+
+static bool pread_full(int fd, unsigned char *buf, size_t len, uint64_t off)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, RED "\nERROR:" WHITE " reading the spill file failed: %s\n" RESET,
+                    n < 0 ? strerror(errno) : "short read");
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return true;
+}
+
+/* Wait on the sink's condition for at most a second (qlock held) */
+static void sink_wait(Sink *k)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&k->qcv, &k->qlock, &ts);
+}
+
+static void *sink_main(void *arg)
+{
+    Sink *k = arg;
+
+    pthread_mutex_lock(&k->qlock);
+
+    for (;;) {
+        while (k->len == 0 && k->spill_len == 0 && !k->eof && !k->failed)
+            pthread_cond_wait(&k->qcv, &k->qlock);
+        if ((k->len == 0 && k->spill_len == 0) || k->failed)
+            break;
+
+        /* The ring holds older bytes than the spill file */
+        if (k->len == 0) {
+            size_t piece = k->spill_len < SINK_PIECE ? (size_t)k->spill_len : SINK_PIECE;
+            uint64_t at = k->spill_head;
+
+            pthread_mutex_unlock(&k->qlock);
+            bool ok = pread_full(k->spill_fd, k->spill_buf, piece, at) &&
+                      write_out(k, k->spill_buf, piece);
+            if (ok)
+                fallocate(k->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)at, (off_t)piece);
+            pthread_mutex_lock(&k->qlock);
+
+            if (!ok) {
+                k->failed = true;
+                break;
+            }
+
+            k->spill_head += piece;
+            k->spill_len -= piece;
+            k->progress = now_sec();
+            pthread_cond_broadcast(&k->qcv);
+            continue;
+        }
+
+        size_t piece = k->len;
+        if (piece > k->cap - k->head)
+            piece = k->cap - k->head;
+        if (piece > SINK_PIECE)
+            piece = SINK_PIECE;
+
+        /* The queued bytes stay put until head moves past them */
+        const unsigned char *p = k->ring + k->head;
+        pthread_mutex_unlock(&k->qlock);
+        bool ok = write_out(k, p, piece);
+        pthread_mutex_lock(&k->qlock);
+
+        if (!ok) {
+            k->failed = true;
+            break;
+        }
+
+        k->head = (k->head + piece) % k->cap;
+        k->len -= piece;
+        k->progress = now_sec();
+        pthread_cond_broadcast(&k->qcv);
+    }
+
+    bool ok = !k->failed;
+    k->progress = now_sec();
+    pthread_mutex_unlock(&k->qlock);
+
+    ok = close_output(k, ok);
+
+    pthread_mutex_lock(&k->qlock);
+    if (!ok)
+        k->failed = true;
+    k->done = true;
+    pthread_cond_broadcast(&k->qcv);
+    pthread_mutex_unlock(&k->qlock);
+    return NULL;
+}
+
+/* Queue bytes for a mirrored destination; false once it is given up (never with stall_sec 0) */
+static bool sink_enqueue(Sink *k, const unsigned char *buf, size_t len)
+{
+    int stall_sec = k->stall_sec;
+
+    pthread_mutex_lock(&k->qlock);
+
+    while (len > 0 && !k->failed) {
+        /* Once the thread has caught up, the spill file starts over */
+        if (k->spill && k->spill_len == 0 && k->spill_head > 0) {
+            k->spill_head = 0;
+            if (ftruncate(k->spill_fd, 0) != 0)
+                k->spill_broken = true;
+        }
+
+        /* Behind the spilled bytes, or the ring is full: spill */
+        bool spilling = k->spill_len > 0 || k->len == k->cap;
+
+        if (spilling && k->spill && !k->spill_broken && k->spill_len < k->spill_cap) {
+            size_t take = len;
+            if (take > k->spill_cap - k->spill_len)
+                take = (size_t)(k->spill_cap - k->spill_len);
+            if (take > SINK_PIECE)
+                take = SINK_PIECE;
+
+            /* Only this thread appends; the sink thread reads below */
+            uint64_t at = k->spill_head + k->spill_len;
+            pthread_mutex_unlock(&k->qlock);
+            bool ok = pwrite_full(k->spill_fd, buf, take, at);
+            pthread_mutex_lock(&k->qlock);
+
+            if (!ok) {
+                fprintf(stderr, YELLOW "\nCannot write the spill file (%s); waiting for %s instead.\n" RESET,
+                        strerror(errno), k->path);
+                k->spill_broken = true;
+                continue;
+            }
+
+            k->spill_len += take;
+            k->spill_total += take;
+            if (k->spill_len > k->spill_peak)
+                k->spill_peak = k->spill_len;
+            buf += take;
+            len -= take;
+            pthread_cond_broadcast(&k->qcv);
+            continue;
+        }
+
+        if (spilling) {
+            sink_wait(k);
+            if (stall_sec > 0 && (k->spill_len > 0 || k->len == k->cap) &&
+                now_sec() - k->progress > stall_sec) {
+                k->failed = true;
+                k->stalled = true;
+            }
+            continue;
+        }
+
+        size_t tail = (k->head + k->len) % k->cap;
+        size_t take = k->cap - k->len;
+        if (take > k->cap - tail)
+            take = k->cap - tail;
+        if (take > len)
+            take = len;
+
+        memcpy(k->ring + tail, buf, take);
+        k->len += take;
+        buf += take;
+        len -= take;
+        pthread_cond_broadcast(&k->qcv);
+    }
+
+    bool ok = !k->failed;
+    pthread_mutex_unlock(&k->qlock);
+    return ok;
+}
+
+/* Hand stream bytes to every destination still being written */
+static bool emit(ImageWriter *w, const unsigned char *buf, size_t len)
+{
+    if (w->nsinks == 1 && !w->sinks[0].threaded)
+        return write_out(&w->sinks[0], buf, len);
+
+    /* Stripes: each chunk goes to one directory, round-robin */
+    while (w->striped && len > 0) {
+        uint64_t chunk = w->emitted / w->chunk_bytes;
+        size_t take = (size_t)(w->chunk_bytes - w->emitted % w->chunk_bytes);
+        if (take > len)
+            take = len;
+
+        Sink *k = &w->sinks[chunk % (uint64_t)w->nsinks];
+        if (!sink_enqueue(k, buf, take)) {
+            if (k->stalled)
+                fprintf(stderr, YELLOW "\n%s has not taken any data for %d seconds.\n" RESET,
+                        k->path, k->stall_sec);
+            return false;
+        }
+
+        w->emitted += take;
+        buf += take;
+        len -= take;
+    }
+
+    if (w->striped)
+        return true;
+
+    int live = 0;
+
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &w->sinks[i];
+        if (k->dropped)
+            continue;
+
+        if (sink_enqueue(k, buf, len)) {
+            live++;
+            continue;
+        }
+
+        k->dropped = true;
+        if (k->stalled)
+            fprintf(stderr, YELLOW "\n%s has not taken any data for %d seconds; giving up on it.\n" RESET,
+                    k->path, k->stall_sec);
+        if (w->require_all)
+            return false;
+        fprintf(stderr, YELLOW "Continuing with the other destinations.\n" RESET);
+    }
+
+    return live > 0;
+}
+
+/* Let a mirror thread write out its queue and wait for it (or give up) */
+static bool sink_finish(Sink *k)
+{
+    int stall_sec = k->stall_sec;
+
+    pthread_mutex_lock(&k->qlock);
+    k->eof = true;
+    pthread_cond_broadcast(&k->qcv);
+
+    while (!k->done && !k->stalled) {
+        sink_wait(k);
+        if (stall_sec > 0 && !k->done && now_sec() - k->progress > stall_sec) {
+            fprintf(stderr, YELLOW "%s has not finished writing for %d seconds; giving up on it.\n" RESET,
+                    k->path, stall_sec);
+            k->failed = true;
+            k->stalled = true;
+        }
+    }
+
+    bool ok = k->done && !k->failed;
+    pthread_mutex_unlock(&k->qlock);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Reflink reuse
+ * ------------------------------------------------------------- */
+
+/* Padding that puts the next frame on an alignment boundary */
+static size_t pad_after(const ImageWriter *w, size_t frame_len)
+{
+    if (!w->align)
+        return 0;
+
+    size_t gap = (w->align - frame_len % w->align) % w->align;
+    if (gap != 0 && gap < SKIPPABLE_HEADER)
+        gap += w->align;
+    return gap;
+}
+
+static const unsigned char *pad_bytes(ImageWriter *w, size_t pad)
+{
+    uint32_t hdr[2] = { SKIPPABLE_MAGIC, (uint32_t)(pad - SKIPPABLE_HEADER) };
+
+    for (int i = 0; i < SKIPPABLE_HEADER; i++)
+        w->pad[i] = (unsigned char)(hdr[i / 4] >> (8 * (i % 4)));
+    return w->pad;
+}
+
+static uint64_t hash_key(const unsigned char *hash)
+{
+    uint64_t k;
+    memcpy(&k, hash, sizeof(k));
+    return k;
+}
+
+static const FrameEntry *reuse_lookup(const ReuseSource *r, const Slot *s)
+{
+    for (uint64_t i = hash_key(s->hash) & r->mask; r->table[i] != 0; i = (i + 1) & r->mask) {
+        const FrameEntry *fe = &r->idx.frames[r->table[i] - 1];
+        if (fe->comp_len == s->out_len && fe->raw_len == s->in_len &&
+            memcmp(fe->hash, s->hash, SHA256_DIGEST_LENGTH) == 0)
+            return fe;
+    }
+    return NULL;
+}
+
+/* Share `len` bytes of the earlier frame `old` at the current position */
+static bool clone_frame(ImageWriter *w, const FrameEntry *old, uint64_t len)
+{
+    ReuseSource *r = w->reuse;
+    Sink *k = &w->sinks[0];
+    uint64_t cb = r->idx.chunk_bytes;
+    unsigned file = cb ? (unsigned)(old->comp_off / cb) : 0;
+
+    if (w->chunk_bytes > 0 && k->in_chunk + len > w->chunk_bytes)
+        return false;
+
+    if (r->fds[file] < 0) {
+        char path[2200];
+        if (cb)
+            stripe_chunk_path(&r->stripes, r->base, file, path, sizeof(path));
+        else
+            snprintf(path, sizeof(path), "%s", r->base);
+
+        r->fds[file] = open(path, O_RDONLY | O_CLOEXEC);
+        if (r->fds[file] < 0)
+            return false;
+    }
+
+    struct file_clone_range fcr = {
+        .src_fd = r->fds[file],
+        .src_offset = cb ? old->comp_off % cb : old->comp_off,
+        .src_length = len,
+        .dest_offset = k->in_chunk
+    };
+
+    if (ioctl(k->fd, FICLONERANGE, &fcr) != 0) {
+        if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL) {
+            fprintf(stderr, YELLOW "\nReflinks from %s are not possible here (%s); writing frames instead.\n" RESET,
+                    r->base, strerror(errno));
+            r->disabled = true;
+        }
+        return false;
+    }
+
+    if (lseek(k->fd, (off_t)(k->in_chunk + len), SEEK_SET) < 0)
+        return false;
+
+    k->in_chunk += len;
+    r->frames++;
+    r->bytes += len;
+    return true;
+}
+
+static void reuse_free(ReuseSource *r)
+{
+    if (!r)
+        return;
+
+    for (unsigned i = 0; r->fds && i < r->nfiles; i++)
+        if (r->fds[i] >= 0)
+            close(r->fds[i]);
+
+    free(r->fds);
+    free(r->table);
+    frame_index_free(&r->idx);
+    free(r);
+}
+
+/* Write the frame in slot s (caller holds the lock, frame is DONE) */
+static bool flush_slot(ImageWriter *w, Slot *s)
+{
+    if (w->idx.count == w->idx_cap) {
+        uint64_t cap = w->idx_cap ? w->idx_cap * 2 : 1024;
+        FrameEntry *nf = realloc(w->idx.frames, (size_t)cap * sizeof(FrameEntry));
+        if (!nf)
+            return false;
+        w->idx.frames = nf;
+        w->idx_cap = cap;
+    }
+
+    FrameEntry *fe = &w->idx.frames[w->idx.count++];
+    fe->raw_off = w->raw_total;
+    fe->comp_off = w->comp_total;
+    fe->comp_len = (uint32_t)s->out_len;
+    fe->raw_len = (uint32_t)s->in_len;
+    if (w->align)
+        memcpy(fe->hash, s->hash, SHA256_DIGEST_LENGTH);
+
+    size_t pad = pad_after(w, s->out_len);
+
+    /* The frame itself is private to this thread now */
+    pthread_mutex_unlock(&w->lock);
+
+    /* Reuse implies a single destination */
+    const FrameEntry *old = (w->reuse && !w->reuse->disabled) ? reuse_lookup(w->reuse, s) : NULL;
+    bool ok = !old || roll_chunk(&w->sinks[0]);
+    bool cloned = ok && old && clone_frame(w, old, s->out_len + pad);
+
+    if (ok && !cloned)
+        ok = emit(w, s->out, s->out_len) &&
+             (pad == 0 || emit(w, pad_bytes(w, pad), pad));
+
+    if (ok && cloned) {
+        chunk_hash(&w->sinks[0], s->out, s->out_len);
+        if (pad > 0)
+            chunk_hash(&w->sinks[0], pad_bytes(w, pad), pad);
+    }
+
+    if (ok) {
+        SHA256_Update(&w->sha, s->out, s->out_len);
+        if (pad > 0)
+            SHA256_Update(&w->sha, pad_bytes(w, pad), pad);
+    }
+    pthread_mutex_lock(&w->lock);
+
+    w->raw_total += s->in_len;
+    w->comp_total += s->out_len + pad;
+
+    s->state = SLOT_FREE;
+    s->in_len = 0;
+    w->write_seq++;
+    return ok;
+}
+
+/* Write frames in order, waiting for up to and including `upto` */
+static bool drain(ImageWriter *w, uint64_t upto, bool wait)
+{
+    pthread_mutex_lock(&w->lock);
+
+    while (w->write_seq < w->next_seq && w->write_seq <= upto) {
+        Slot *s = &w->slots[w->write_seq % (uint64_t)w->nslots];
+
+        if (s->state == SLOT_FAILED) {
+            fprintf(stderr, RED "\nERROR:" WHITE " compressing image frame failed.\n" RESET);
+            pthread_mutex_unlock(&w->lock);
+            return false;
+        }
+
+        if (s->state != SLOT_DONE) {
+            if (!wait)
+                break;
+            pthread_cond_wait(&w->done_cv, &w->lock);
+            continue;
+        }
+
+        if (!flush_slot(w, s)) {
+            pthread_mutex_unlock(&w->lock);
+            return false;
+        }
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+static void submit_filling(ImageWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->filling->state = SLOT_PENDING;
+    w->filling = NULL;
+    w->next_seq++;
+    pthread_cond_signal(&w->work_cv);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* -------------------------------------------------------------
+ * Public API
+ * ------------------------------------------------------------- */
+static ImageWriter *writer_open(const char *output_path,
+                                ImageStreamFn stream,
+                                void *stream_ctx,
+                                int compression,
+                                int chunk_mb,
+                                int frame_kb,
+                                int threads)
+{
+    if (compression != FRAME_COMP_ZSTD && compression != FRAME_COMP_LZ4)
+        return NULL;
+
+    ImageWriter *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->compression = compression;
+    w->chunk_bytes = chunk_mb > 0 ? (uint64_t)chunk_mb * 1024 * 1024 : 0;
+    w->frame_size = (size_t)(frame_kb > 0 ? frame_kb : FRAME_DEFAULT_SIZE_KB) * 1024;
+
+    if (compression == FRAME_COMP_ZSTD) {
+        w->out_cap = ZSTD_compressBound(w->frame_size);
+    } else {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+        prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        prefs.frameInfo.contentSize = w->frame_size;
+        w->out_cap = LZ4F_compressFrameBound(w->frame_size, &prefs);
+    }
+
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (int)n : 1;
+    }
+    if (threads > MAX_WORKERS)
+        threads = MAX_WORKERS;
+
+    /* Two frames per worker keeps everyone busy while one is written */
+    w->nslots = threads * 2;
+    w->slots = calloc((size_t)w->nslots, sizeof(Slot));
+    w->sinks = calloc(1, sizeof(Sink));
+    bool ok = (w->slots != NULL && w->sinks != NULL);
+
+    for (int i = 0; ok && i < w->nslots; i++) {
+        w->slots[i].in = malloc(w->frame_size);
+        w->slots[i].out = malloc(w->out_cap);
+        ok = w->slots[i].in && w->slots[i].out;
+    }
+
+    w->idx.compression = (uint32_t)compression;
+    w->idx.frame_size = (uint32_t)w->frame_size;
+    w->idx.chunk_bytes = w->chunk_bytes;
+
+    SHA256_Init(&w->sha);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_cv, NULL);
+    pthread_cond_init(&w->done_cv, NULL);
+
+    if (ok) {
+        Sink *k = &w->sinks[0];
+        k->chunk_bytes = w->chunk_bytes;
+        k->chunk_step = 1;
+        k->fd = -1;
+        k->stream = stream;
+        k->stream_ctx = stream_ctx;
+        snprintf(k->path, sizeof(k->path), "%s", output_path);
+        ok = stream || open_chunk(k, 0);
+        w->nsinks = 1;
+    }
+
+    /* Block-align frames where a later image can reflink them */
+    struct statfs sfs;
+    if (ok && !stream && fstatfs(w->sinks[0].fd, &sfs) == 0 &&
+        ((unsigned long)sfs.f_type == BTRFS_SUPER_MAGIC ||
+         (unsigned long)sfs.f_type == XFS_SUPER_MAGIC) &&
+        sfs.f_bsize >= 512 && sfs.f_bsize <= MAX_ALIGN &&
+        (sfs.f_bsize & (sfs.f_bsize - 1)) == 0 &&
+        w->chunk_bytes % (uint64_t)sfs.f_bsize == 0) {
+        w->align = (uint32_t)sfs.f_bsize;
+        w->pad = calloc(1, MAX_ALIGN + SKIPPABLE_HEADER);
+        w->idx.hashed = true;
+        ok = (w->pad != NULL);
+    }
+
+    for (int i = 0; ok && i < threads; i++) {
+        if (pthread_create(&w->workers[i], NULL, worker_main, w) != 0)
+            ok = false;
+        else
+            w->nworkers++;
+    }
+
+    if (!ok) {
+        image_writer_close(w, false);
+        return NULL;
+    }
+
+    return w;
+}
+
+ImageWriter *image_writer_open(const char *output_path,
+                               int compression,
+                               int chunk_mb,
+                               int frame_kb,
+                               int threads)
+{
+    return writer_open(output_path, NULL, NULL, compression, chunk_mb, frame_kb, threads);
+}
+
+ImageWriter *image_writer_open_stream(const char *output_path,
+                                      ImageStreamFn stream,
+                                      void *stream_ctx,
+                                      int compression,
+                                      int frame_kb,
+                                      int threads)
+{
+    return writer_open(output_path, stream, stream_ctx, compression, 0, frame_kb, threads);
+}
+
+/* Give every sink its queue and writer thread */
+static bool start_sinks(ImageWriter *w, int buffer_mb, int stall_sec)
+{
+    Sink *sinks = w->sinks;
+
+    w->stall_sec = stall_sec > 0 ? stall_sec : MIRROR_DEFAULT_STALL_SEC;
+
+    size_t cap = (size_t)buffer_mb * 1024 * 1024;
+
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &sinks[i];
+        k->ring = malloc(cap);
+        if (!k->ring)
+            return false;
+        k->cap = cap;
+        k->stall_sec = w->stall_sec;
+        k->progress = now_sec();
+        pthread_mutex_init(&k->qlock, NULL);
+        pthread_cond_init(&k->qcv, NULL);
+
+        if (pthread_create(&k->thread, NULL, sink_main, k) != 0) {
+            pthread_cond_destroy(&k->qcv);
+            pthread_mutex_destroy(&k->qlock);
+            return false;
+        }
+        k->threaded = true;
+    }
+
+    return true;
+}
+
+bool image_writer_add_mirrors(ImageWriter *w,
+                              const char *const *paths,
+                              int count,
+                              int buffer_mb,
+                              int stall_sec,
+                              bool require_all)
+{
+    if (count <= 0)
+        return true;
+
+    /* Threads keep pointers into the array, so it is sized once */
+    if (w->nsinks != 1 || w->next_seq != 0 || w->reuse)
+        return false;
+
+    Sink *sinks = realloc(w->sinks, (size_t)(count + 1) * sizeof(Sink));
+    if (!sinks)
+        return false;
+    w->sinks = sinks;
+    memset(&sinks[1], 0, (size_t)count * sizeof(Sink));
+
+    for (int i = 1; i <= count; i++) {
+        Sink *k = &sinks[i];
+        k->chunk_bytes = w->chunk_bytes;
+        k->chunk_step = 1;
+        k->drop_cache = w->drop_cache;
+        k->verify = w->verify;
+        k->fd = -1;
+        snprintf(k->path, sizeof(k->path), "%s", paths[i - 1]);
+        if (!open_chunk(k, 0))
+            return false;
+        w->nsinks++;
+    }
+
+    w->require_all = require_all;
+
+    return start_sinks(w, buffer_mb > 0 ? buffer_mb : MIRROR_DEFAULT_BUFFER_MB, stall_sec);
+}
+
+bool image_writer_add_stripes(ImageWriter *w,
+                              const char *const *dirs,
+                              int count,
+                              int buffer_mb,
+                              int stall_sec)
+{
+    if (count <= 0)
+        return true;
+
+    if (w->nsinks != 1 || w->next_seq != 0 || w->reuse || w->chunk_bytes == 0)
+        return false;
+
+    Sink *sinks = realloc(w->sinks, (size_t)(count + 1) * sizeof(Sink));
+    if (!sinks)
+        return false;
+    w->sinks = sinks;
+    memset(&sinks[1], 0, (size_t)count * sizeof(Sink));
+
+    const char *name = strrchr(sinks[0].path, '/');
+    name = name ? name + 1 : sinks[0].path;
+
+    /* Stripe s writes chunks s, s + n, s + 2n, ... when they come up */
+    for (int i = 0; i <= count; i++) {
+        Sink *k = &sinks[i];
+        k->chunk_step = (unsigned)(count + 1);
+        if (i == 0)
+            continue;
+
+        k->chunk_bytes = w->chunk_bytes;
+        k->chunk = (unsigned)i;
+        k->drop_cache = w->drop_cache;
+        k->verify = w->verify;
+        k->fd = -1;
+        if (snprintf(k->path, sizeof(k->path), "%s/%s", dirs[i - 1], name) >= (int)sizeof(k->path))
+            return false;
+        w->nsinks++;
+    }
+
+    w->striped = true;
+    w->require_all = true;
+
+    return start_sinks(w, buffer_mb > 0 ? buffer_mb : STRIPE_DEFAULT_BUFFER_MB, stall_sec);
+}
+
+bool image_writer_add_write_behind(ImageWriter *w,
+                                   int buffer_mb,
+                                   const char *spill_dir,
+                                   int spill_mb,
+                                   int stall_sec)
+{
+    if (w->nsinks != 1 || w->next_seq != 0 || w->reuse || w->sinks[0].stream)
+        return false;
+
+    Sink *k = &w->sinks[0];
+
+    if (spill_dir && spill_dir[0] != '\0') {
+        char path[1100];
+        snprintf(path, sizeof(path), "%s/imprint-spill-XXXXXX", spill_dir);
+
+        /* Unlinked right away: nothing to clean up, whatever happens */
+        k->spill_fd = mkostemp(path, O_CLOEXEC);
+        if (k->spill_fd < 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot create a spill file in %s: %s\n" RESET,
+                    spill_dir, strerror(errno));
+            return false;
+        }
+        unlink(path);
+
+        k->spill_buf = malloc(SINK_PIECE);
+        if (!k->spill_buf) {
+            close(k->spill_fd);
+            return false;
+        }
+        k->spill = true;
+        k->spill_cap = (uint64_t)(spill_mb > 0 ? spill_mb : WRITE_DEFAULT_SPILL_MB) * 1024 * 1024;
+    }
+
+    w->require_all = true;
+
+    if (!start_sinks(w, buffer_mb > 0 ? buffer_mb : WRITE_DEFAULT_BUFFER_MB, stall_sec))
+        return false;
+
+    /* Only a full spill file gives up; otherwise wait as a direct write would */
+    k->stall_sec = k->spill ? stall_sec : 0;
+    return true;
+}
+
+void image_writer_drop_cache(ImageWriter *w)
+{
+    w->drop_cache = true;
+
+    for (int i = 0; i < w->nsinks; i++)
+        w->sinks[i].drop_cache = true;
+}
+
+void image_writer_verify_writes(ImageWriter *w)
+{
+    w->verify = true;
+
+    for (int i = 0; i < w->nsinks; i++)
+        w->sinks[i].verify = true;
+}
+
+bool image_writer_reuse_from(ImageWriter *w, const char *prev_image)
+{
+    if (w->nsinks > 1 || w->sinks[0].threaded) {
+        fprintf(stderr, YELLOW "Frames are not reused when writing several copies.\n" RESET);
+        return false;
+    }
+
+    if (!w->align) {
+        fprintf(stderr,
+                YELLOW "The destination filesystem cannot share blocks (btrfs or XFS needed).\n" RESET);
+        return false;
+    }
+
+    ReuseSource *r = calloc(1, sizeof(*r));
+    if (!r)
+        return false;
+
+    /* prev_image may also name the first file of a chunk set */
+    char idx_path[1100];
+    snprintf(r->base, sizeof(r->base), "%s", prev_image);
+    frame_index_path_for(r->base, idx_path, sizeof(idx_path));
+    bool loaded = frame_index_load(idx_path, &r->idx);
+
+    size_t len = strlen(r->base);
+    if (!loaded && len > 4 && r->base[len - 4] == '.' &&
+        isdigit((unsigned char)r->base[len - 3]) &&
+        isdigit((unsigned char)r->base[len - 2]) &&
+        isdigit((unsigned char)r->base[len - 1])) {
+        r->base[len - 4] = '\0';
+        frame_index_path_for(r->base, idx_path, sizeof(idx_path));
+        loaded = frame_index_load(idx_path, &r->idx);
+    }
+
+    const char *why = NULL;
+    if (!loaded)
+        why = "it has no frame index";
+    else if (!r->idx.hashed)
+        why = "it was not written block-aligned to btrfs or XFS";
+    else if (r->idx.compression != w->idx.compression || r->idx.frame_size != w->idx.frame_size)
+        why = "it was written with another compression or frame size";
+
+    uint64_t size = 1;
+    while (!why && size < r->idx.count * 2)
+        size <<= 1;
+
+    uint64_t cb = r->idx.chunk_bytes;
+    r->nfiles = cb ? (unsigned)((r->idx.comp_size + cb - 1) / cb) : 1;
+
+    if (!why) {
+        stripe_dirs_load(r->base, &r->stripes);
+        r->table = calloc((size_t)size, sizeof(*r->table));
+        r->fds = malloc(r->nfiles * sizeof(*r->fds));
+        if (!r->table || !r->fds)
+            why = "out of memory";
+    }
+
+    if (why) {
+        fprintf(stderr, YELLOW "Cannot reuse frames from %s: %s.\n" RESET, prev_image, why);
+        reuse_free(r);
+        return false;
+    }
+
+    for (unsigned i = 0; i < r->nfiles; i++)
+        r->fds[i] = -1;
+    r->mask = size - 1;
+
+    /* Only frames that start on a boundary and own their padding */
+    uint64_t usable = 0;
+    for (uint64_t n = 0; n < r->idx.count; n++) {
+        const FrameEntry *fe = &r->idx.frames[n];
+        uint64_t end = fe->comp_off + fe->comp_len + pad_after(w, fe->comp_len);
+        uint64_t next = n + 1 < r->idx.count ? r->idx.frames[n + 1].comp_off : r->idx.comp_size;
+
+        if (fe->comp_off % w->align != 0 || end != next ||
+            (cb && fe->comp_off / cb != (end - 1) / cb))
+            continue;
+
+        uint64_t i = hash_key(fe->hash) & r->mask;
+        while (r->table[i] != 0)
+            i = (i + 1) & r->mask;
+        r->table[i] = n + 1;
+        usable++;
+    }
+
+    fprintf(stderr, YELLOW "Reusing identical frames of %s by reflink (%llu of %llu usable)\n" RESET,
+            r->base, (unsigned long long)usable, (unsigned long long)r->idx.count);
+
+    w->reuse = r;
+    return true;
+}
+
+bool image_writer_write(ImageWriter *w, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    if (w->failed)
+        return false;
+
+    while (len > 0) {
+        if (!w->filling) {
+            /* The slot for next_seq must have been written out first */
+            uint64_t seq = w->next_seq;
+            if (seq >= (uint64_t)w->nslots &&
+                !drain(w, seq - (uint64_t)w->nslots, true)) {
+                w->failed = true;
+                return false;
+            }
+
+            Slot *s = &w->slots[seq % (uint64_t)w->nslots];
+            s->state = SLOT_FILLING;
+            s->seq = seq;
+            s->in_len = 0;
+            w->filling = s;
+        }
+
+        Slot *s = w->filling;
+        size_t take = w->frame_size - s->in_len;
+        if (take > len)
+            take = len;
+
+        memcpy(s->in + s->in_len, p, take);
+        s->in_len += take;
+        p += take;
+        len -= take;
+
+        if (s->in_len == w->frame_size) {
+            submit_filling(w);
+
+            /* Opportunistically write whatever is already finished */
+            if (!drain(w, UINT64_MAX, false)) {
+                w->failed = true;
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+uint64_t image_writer_raw_bytes(const ImageWriter *w)
+{
+    return w->raw_total + (w->filling ? w->filling->in_len : 0);
+}
+
+uint64_t image_writer_comp_bytes(const ImageWriter *w)
+{
+    return w->comp_total;
+}
+
+static bool write_checksum_file(const char *image, const unsigned char *hash)
+{
+    char path[1100], tmp[1110];
+    snprintf(path, sizeof(path), "%s.sha256", image);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return false;
+
+    /* Same format `sha256sum < stream` used to produce */
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        fprintf(fp, "%02x", hash[i]);
+    fprintf(fp, "  -\n");
+
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static void remove_outputs(const Sink *k)
+{
+    char path[1100];
+
+    for (int i = 0; i < k->chunks_created; i++) {
+        chunk_path(k, (unsigned)i, path, sizeof(path));
+        unlink(path);
+    }
+
+    snprintf(path, sizeof(path), "%s.sha256", k->path);
+    unlink(path);
+    frame_index_path_for(k->path, path, sizeof(path));
+    unlink(path);
+}
+
+bool image_writer_close(ImageWriter *w, bool success)
+{
+    return image_writer_close_copies(w, success, NULL);
+}
+
+bool image_writer_close_copies(ImageWriter *w, bool success, bool *copy_ok)
+{
+    if (!w)
+        return false;
+
+    success = success && !w->failed;
+
+    /* Last, partial frame */
+    if (success && w->filling) {
+        if (w->filling->in_len > 0)
+            submit_filling(w);
+        else {
+            w->filling->state = SLOT_FREE;
+            w->filling = NULL;
+        }
+    }
+
+    if (success)
+        success = drain(w, UINT64_MAX, true);
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work_cv);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->nworkers; i++)
+        pthread_join(w->workers[i], NULL);
+
+    /* Flush every destination */
+    bool any_stalled = false;
+
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &w->sinks[i];
+
+        if (k->threaded) {
+            k->ok = sink_finish(k) && success;
+            if (k->stalled)
+                any_stalled = true;
+            else
+                pthread_join(k->thread, NULL);
+            continue;
+        }
+
+        k->ok = close_output(k, success);
+    }
+
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256_Final(hash, &w->sha);
+    w->idx.raw_size = w->raw_total;
+    w->idx.comp_size = w->comp_total;
+
+    int completed = 0;
+
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &w->sinks[i];
+        if (!k->ok)
+            continue;
+
+        /* Stripes hold chunks only; the rest stays next to chunk 0 */
+        if (!w->striped || i == 0) {
+            char idx_path[1100];
+            frame_index_path_for(k->path, idx_path, sizeof(idx_path));
+
+            k->ok = write_checksum_file(k->path, hash) &&
+                    (w->idx.count == 0 || frame_index_save(idx_path, &w->idx));
+        }
+
+        /* The new names, before the metadata says the image is there */
+        if (k->ok && !k->stream && !gx_fsync_parent(k->path)) {
+            fprintf(stderr, RED "ERROR:" WHITE " flushing the directory of %s failed: %s\n" RESET,
+                    k->path, strerror(errno));
+            k->ok = false;
+        }
+        if (k->ok)
+            completed++;
+    }
+
+    success = success && completed > 0 &&
+              (completed == w->nsinks || !w->require_all);
+
+    if (success && w->reuse)
+        fprintf(stderr, YELLOW "Reflinked %llu of %llu frames (%.2f MB) from %s\n" RESET,
+                (unsigned long long)w->reuse->frames,
+                (unsigned long long)w->idx.count,
+                w->reuse->bytes / (1024.0 * 1024.0),
+                w->reuse->base);
+
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &w->sinks[i];
+
+        if (success && k->ok)
+            continue;
+
+        k->ok = false;
+        if (k->stalled)
+            fprintf(stderr, YELLOW "%s is incomplete and was left as it is.\n" RESET,
+                    k->path);
+        else
+            remove_outputs(k);
+    }
+
+    if (copy_ok)
+        for (int i = 0; i < w->nsinks; i++)
+            copy_ok[i] = w->sinks[i].ok;
+
+    /* A stalled thread may still wake up and touch its sink and ring */
+    for (int i = 0; i < w->nsinks; i++) {
+        Sink *k = &w->sinks[i];
+        if (k->stalled) {
+            pthread_detach(k->thread);
+            continue;
+        }
+        if (k->spill) {
+            if (k->spill_total > 0)
+                fprintf(stderr,
+                        YELLOW "%s fell behind: %.2f MB went through the spill file "
+                        "(at most %.2f MB at once).\n" RESET,
+                        k->path, k->spill_total / (1024.0 * 1024.0),
+                        k->spill_peak / (1024.0 * 1024.0));
+            close(k->spill_fd);
+            free(k->spill_buf);
+        }
+        free(k->ring);
+        if (!k->threaded)
+            continue;
+        pthread_cond_destroy(&k->qcv);
+        pthread_mutex_destroy(&k->qlock);
+    }
+
+    if (!any_stalled)
+        free(w->sinks);
+
+    reuse_free(w->reuse);
+    free(w->pad);
+
+    if (w->slots) {
+        for (int i = 0; i < w->nslots; i++) {
+            free(w->slots[i].in);
+            free(w->slots[i].out);
+        }
+        free(w->slots);
+    }
+
+    free(w->idx.frames);
+    pthread_cond_destroy(&w->work_cv);
+    pthread_cond_destroy(&w->done_cv);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+
+    return success;
+}
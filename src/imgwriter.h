@@ -0,0 +1,165 @@
+#ifndef IMGWRITER_H
+#define IMGWRITER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Framed image writer.
+ *
+ * Replaces `compressor | tee fifo | split` for zstd and lz4 backups.
+ * The partclone stream is cut into fixed-size frames that worker
+ * threads compress independently; the calling thread writes finished
+ * frames in order, splitting the output into base.000, base.001, ...
+ * when chunking is enabled, and hashes the compressed bytes as they
+ * go out.  On success it writes <image>.sha256 (sha256sum format) and
+ * the frame index <image>.idx.
+ *
+ * On btrfs and XFS every frame starts on a filesystem block: the gap
+ * after it is filled with a skippable frame, which zstd and lz4 pass
+ * over, and the index records each frame's SHA-256.  A frame that is
+ * identical to one of an earlier image written this way can then be
+ * reflinked (FICLONERANGE) from that image instead of written.
+ *
+ * The same stream can go to several destinations at once (mirrors):
+ * each is then written by a thread of its own from a bounded queue
+ * and gets its own checksum and index.  A destination that fails, or
+ * takes no data for stall_sec, is dropped; the others carry on.
+ *
+ * A chunk set can instead be striped over several directories (see
+ * stripe.h), each written by its own thread in the same way.
+ *
+ * A single destination can be written the same way (write-behind),
+ * with an optional spill file on local storage for what does not fit
+ * in memory while the destination stalls.
+ */
+
+/* Defaults for the mirror_* and write_* settings (see config.h) */
+#define MIRROR_DEFAULT_BUFFER_MB   64
+#define MIRROR_DEFAULT_STALL_SEC   120
+#define STRIPE_DEFAULT_BUFFER_MB   256
+#define WRITE_DEFAULT_BUFFER_MB    64
+#define WRITE_DEFAULT_SPILL_MB     8192
+
+typedef struct ImageWriter ImageWriter;
+
+/*
+ * output_path = image filename; chunks get a .NNN suffix
+ * compression = FRAME_COMP_ZSTD or FRAME_COMP_LZ4
+ * chunk_mb    = 0 for a single file
+ * frame_kb    = uncompressed bytes per frame
+ * threads     = compression workers (0 = one per CPU, capped)
+ */
+ImageWriter *image_writer_open(const char *output_path,
+                               int compression,
+                               int chunk_mb,
+                               int frame_kb,
+                               int threads);
+
+/* Receives the compressed stream in order; false fails the image. */
+typedef bool (*ImageStreamFn)(void *ctx, const void *buf, size_t len);
+
+/*
+ * Same, but the image goes to stream() instead of a file (S3, network
+ * targets).  Only the checksum and index are written, as files next to
+ * output_path.  No chunks, alignment, mirrors or stripes.
+ */
+ImageWriter *image_writer_open_stream(const char *output_path,
+                                      ImageStreamFn stream,
+                                      void *stream_ctx,
+                                      int compression,
+                                      int frame_kb,
+                                      int threads);
+
+/*
+ * Share identical frames with prev_image (an image file or the first
+ * file of a chunk set) by reflink.  Call before the first write.
+ * Returns false, with a notice, if nothing can be reused: the
+ * destination cannot reflink, or prev_image was written with other
+ * frame settings or without block alignment.  Writing is unaffected.
+ */
+bool image_writer_reuse_from(ImageWriter *w, const char *prev_image);
+
+/*
+ * Also write the image to each of paths (same naming as output_path).
+ * Call before the first write.  buffer_mb is the queue of each
+ * destination.  require_all: the image fails unless every copy
+ * completes; otherwise one complete copy is enough.  False if a
+ * destination cannot be created (printed).
+ */
+bool image_writer_add_mirrors(ImageWriter *w,
+                              const char *const *paths,
+                              int count,
+                              int buffer_mb,
+                              int stall_sec,
+                              bool require_all);
+
+/*
+ * Spread the chunks round-robin over the directory of output_path and
+ * dirs (see stripe.h); chunked images only.  Call before the first
+ * write.  buffer_mb is the queue of each directory: while a chunk
+ * goes to one directory the others drain theirs, so chunks no larger
+ * than the queue keep every directory busy.  Every stripe must
+ * complete; one that stalls for stall_sec fails the image.
+ */
+bool image_writer_add_stripes(ImageWriter *w,
+                              const char *const *dirs,
+                              int count,
+                              int buffer_mb,
+                              int stall_sec);
+
+/*
+ * Write the single destination from a thread with a queue of
+ * buffer_mb, so that reading and compressing go on while it stalls
+ * (NAS and SMB targets flushing, for instance).  With spill_dir set,
+ * what does not fit in the queue goes to an unlinked file there, up
+ * to spill_mb, and reaches the destination in order after it.  Call
+ * before the first write; not with mirrors, stripes, reuse or a
+ * stream.  A stalled destination is waited for, as a direct write
+ * would be; only once the spill file is full does one that takes no
+ * data for stall_sec (if > 0) fail the image.  False if the spill
+ * file cannot be created (printed).
+ */
+bool image_writer_add_write_behind(ImageWriter *w,
+                                   int buffer_mb,
+                                   const char *spill_dir,
+                                   int spill_mb,
+                                   int stall_sec);
+
+/*
+ * Keep the image files out of the page cache as they are written (see
+ * pagecache.h).  Call before the first write.
+ */
+void image_writer_drop_cache(ImageWriter *w);
+
+/*
+ * Read every image file back from the medium once it is flushed and
+ * compare it with a SHA-256 taken as it was written.  Full chunks are
+ * checked while the next ones are written; a mismatch fails the next
+ * write, naming the chunk.  Call before the first write.
+ */
+void image_writer_verify_writes(ImageWriter *w);
+
+bool image_writer_write(ImageWriter *w, const void *buf, size_t len);
+
+/* Uncompressed / compressed bytes so far. */
+uint64_t image_writer_raw_bytes(const ImageWriter *w);
+uint64_t image_writer_comp_bytes(const ImageWriter *w);
+
+/*
+ * Finish the image.  With success == false (or if anything fails
+ * while finishing) every file the writer created is removed.
+ * Returns true only if the image, checksum and index are complete.
+ */
+bool image_writer_close(ImageWriter *w, bool success);
+
+/*
+ * Same, for a writer with mirrors.  copy_ok (may be NULL) receives
+ * one flag per destination, output_path first: true if that copy is
+ * complete.  Files of failed copies are removed, except those of a
+ * stalled destination, which cannot be touched safely.
+ */
+bool image_writer_close_copies(ImageWriter *w, bool success, bool *copy_ok);
+
+#endif /* IMGWRITER_H */
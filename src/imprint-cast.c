@@ -0,0 +1,598 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include "cast.h"
+#include "prefetch.h"
+#include "stripe.h"
+#include "colors.h"
+
+/*
+ * imprint-cast: sends one image to every `imprintr --image mcast://...`
+ * on the network at once (see cast.h for the protocol).
+ *
+ * The stream is the metadata followed by the image, in packets of
+ * CAST_PAYLOAD bytes kept in a ring of `window` packets: packet s sits
+ * in slot s % window until every receiver has moved past it, so any of
+ * them can be sent again.  Repairs go out before new packets, and both
+ * within --rate.
+ */
+
+typedef struct {
+    uint32_t id;
+    struct sockaddr_in addr;
+    uint32_t ack;               /* next packet it needs */
+    double last_heard;
+    bool gone;
+} Receiver;
+
+static Receiver receivers[CAST_MAX_RECEIVERS];
+static int nreceivers;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------------------------
+ * The stream: metadata, then the image (single file or chunk set)
+ * ------------------------------------------------------------- */
+typedef struct {
+    unsigned char *meta;
+    uint64_t meta_size;
+    ImageReader *image;
+    uint64_t image_size;
+    uint64_t pos;
+} Source;
+
+static bool source_open(Source *src, const char *path)
+{
+    char base[PATH_MAX], meta_path[PATH_MAX + 8];
+    size_t len = strlen(path);
+    struct stat st;
+    bool chunked = false;
+
+    memset(src, 0, sizeof(*src));
+
+    if (len >= sizeof(base)) {
+        fprintf(stderr, RED "ERROR:" WHITE " image path too long\n" RESET);
+        return false;
+    }
+    memcpy(base, path, len + 1);
+
+    /* <image>.000 names its chunk set */
+    if (len > 4 && strcmp(base + len - 4, ".000") == 0) {
+        base[len - 4] = '\0';
+        chunked = true;
+    } else if (stat(base, &st) != 0) {
+        chunked = true;
+    }
+
+    /* Metadata first: receivers need it before the first byte of image */
+    snprintf(meta_path, sizeof(meta_path), "%s.json", base);
+    FILE *fp = fopen(meta_path, "rb");
+    if (!fp || fseek(fp, 0, SEEK_END) != 0 || (long)(src->meta_size = (uint64_t)ftell(fp)) <= 0 ||
+        fseek(fp, 0, SEEK_SET) != 0 || !(src->meta = malloc(src->meta_size)) ||
+        fread(src->meta, 1, src->meta_size, fp) != src->meta_size) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read the metadata %s\n" RESET, meta_path);
+        if (fp)
+            fclose(fp);
+        free(src->meta);
+        src->meta = NULL;
+        return false;
+    }
+    fclose(fp);
+
+    if (chunked) {
+        StripeDirs stripes;
+        stripe_dirs_load(base, &stripes);
+
+        for (unsigned i = 0; i < 1000; i++) {
+            char chunk[PATH_MAX + 16];
+            stripe_chunk_path(&stripes, base, i, chunk, sizeof(chunk));
+            if (stat(chunk, &st) != 0)
+                break;
+            src->image_size += (uint64_t)st.st_size;
+        }
+    } else {
+        src->image_size = (uint64_t)st.st_size;
+    }
+
+    src->image = image_reader_open(base, chunked, PREFETCH_DEFAULT_DEPTH,
+                                   PREFETCH_DEFAULT_MEM_MB, false);
+    if (!src->image) {
+        free(src->meta);
+        src->meta = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+/* The next len bytes of the stream */
+static bool source_read(Source *src, unsigned char *buf, size_t len)
+{
+    while (len > 0 && src->pos < src->meta_size) {
+        size_t take = src->meta_size - src->pos;
+        if (take > len)
+            take = len;
+        memcpy(buf, src->meta + src->pos, take);
+        buf += take;
+        len -= take;
+        src->pos += take;
+    }
+
+    while (len > 0) {
+        ssize_t n = image_reader_read(src->image, buf, len);
+        if (n <= 0) {
+            fprintf(stderr, RED "\nERROR:" WHITE " the image is shorter than its files said\n" RESET);
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+        src->pos += (uint64_t)n;
+    }
+
+    return true;
+}
+
+static void source_close(Source *src)
+{
+    if (src->image)
+        image_reader_close(src->image);
+    free(src->meta);
+}
+
+/* -------------------------------------------------------------
+ * Sending
+ * ------------------------------------------------------------- */
+typedef struct {
+    int fd;
+    struct sockaddr_in group;
+    uint32_t session;
+
+    Source src;
+    uint64_t total;
+    uint32_t npackets;
+    uint32_t window;
+    unsigned char *ring;        /* window * CAST_PAYLOAD */
+    double *last_tx;            /* per slot */
+    unsigned char *queued;      /* per slot: waiting in repairs */
+
+    uint32_t *repairs;          /* FIFO of packets to send again */
+    size_t rhead, rcount;
+
+    uint32_t next;              /* next new packet */
+    bool started;
+    uint64_t sent_new, sent_again;
+} Cast;
+
+static uint32_t packet_len(const Cast *c, uint32_t seq)
+{
+    uint64_t left = c->total - (uint64_t)seq * CAST_PAYLOAD;
+    return left < CAST_PAYLOAD ? (uint32_t)left : CAST_PAYLOAD;
+}
+
+static void send_packet(Cast *c, uint16_t type, uint32_t seq, const void *payload, size_t len)
+{
+    unsigned char pkt[CAST_PACKET_MAX];
+    size_t n = cast_pack(pkt, type, c->session, seq, payload, len);
+
+    /* A full send buffer drops the packet; NAKs bring it back */
+    sendto(c->fd, pkt, n, 0, (struct sockaddr *)&c->group, sizeof(c->group));
+}
+
+static void announce(Cast *c, const Source *src)
+{
+    unsigned char p[32];
+    cast_put_le64(p, src->meta_size);
+    cast_put_le64(p + 8, src->image_size);
+    cast_put_le32(p + 16, c->window);
+    cast_put_le32(p + 20, c->next);
+    cast_put_le32(p + 24, c->started ? 1 : 0);
+    cast_put_le32(p + 28, 0);
+    send_packet(c, CAST_ANNOUNCE, 0, p, sizeof(p));
+}
+
+static void reply(Cast *c, uint16_t type, uint32_t id, const char *why)
+{
+    unsigned char p[4 + 128];
+    size_t len = 4;
+    cast_put_le32(p, id);
+    if (why) {
+        size_t wlen = strlen(why);
+        if (wlen > 128)
+            wlen = 128;
+        memcpy(p + 4, why, wlen);
+        len += wlen;
+    }
+    send_packet(c, type, 0, p, len);
+}
+
+static Receiver *find_receiver(uint32_t id)
+{
+    for (int i = 0; i < nreceivers; i++)
+        if (receivers[i].id == id)
+            return &receivers[i];
+    return NULL;
+}
+
+static void queue_repairs(Cast *c, uint32_t first, uint32_t count, double now)
+{
+    /* Only what is still in the ring and was not just sent */
+    uint64_t lo = c->next > c->window ? c->next - c->window : 0;
+    uint64_t from = first > lo ? first : lo;
+    uint64_t to = (uint64_t)first + count < c->next ? (uint64_t)first + count : c->next;
+
+    for (uint64_t s = from; s < to; s++) {
+        uint32_t slot = (uint32_t)(s % c->window);
+        if (c->queued[slot] || now - c->last_tx[slot] < 0.03)
+            continue;
+        c->repairs[(c->rhead + c->rcount) % c->window] = (uint32_t)s;
+        c->rcount++;
+        c->queued[slot] = 1;
+    }
+}
+
+static void take_control(Cast *c, const unsigned char *pkt, size_t n,
+                         const struct sockaddr_in *from, double now)
+{
+    CastHeader h;
+    if (!cast_unpack(pkt, n, &h) || h.session != c->session || h.len < 4)
+        return;
+
+    const unsigned char *p = pkt + CAST_HEADER_SIZE;
+    uint32_t id = cast_le32(p);
+    Receiver *r = find_receiver(id);
+
+    switch (h.type) {
+    case CAST_JOIN:
+        if (r && !r->gone) {
+            reply(c, CAST_ACCEPT, id, NULL);
+        } else if (c->started) {
+            reply(c, CAST_REJECT, id, "the transfer has already started");
+        } else if (nreceivers == CAST_MAX_RECEIVERS) {
+            reply(c, CAST_REJECT, id, "too many receivers");
+        } else {
+            r = &receivers[nreceivers++];
+            memset(r, 0, sizeof(*r));
+            r->id = id;
+            r->addr = *from;
+            r->last_heard = now;
+            reply(c, CAST_ACCEPT, id, NULL);
+            fprintf(stderr, GREEN "Receiver %d joined from %s\n" RESET,
+                    nreceivers, inet_ntoa(from->sin_addr));
+        }
+        break;
+
+    case CAST_STATUS:
+        if (!r || r->gone)
+            break;
+        r->last_heard = now;
+        if (h.seq > r->ack && h.seq <= c->npackets)
+            r->ack = h.seq;
+        for (uint32_t off = 4; off + 8 <= h.len; off += 8)
+            queue_repairs(c, cast_le32(p + off), cast_le32(p + off + 4), now);
+        break;
+
+    case CAST_LEAVE:
+        if (!r || r->gone)
+            break;
+        r->gone = true;
+        fprintf(stderr, RED "\nReceiver %s left at %.1f%%\n" RESET, inet_ntoa(r->addr.sin_addr),
+                c->npackets ? 100.0 * r->ack / c->npackets : 0.0);
+        break;
+    }
+}
+
+static void drain_control(Cast *c, double now)
+{
+    unsigned char pkt[CAST_PACKET_MAX + 64];
+
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t flen = sizeof(from);
+        ssize_t n = recvfrom(c->fd, pkt, sizeof(pkt), MSG_DONTWAIT,
+                             (struct sockaddr *)&from, &flen);
+        if (n < 0)
+            return;
+        take_control(c, pkt, (size_t)n, &from, now);
+    }
+}
+
+static void wait_for(int fd, int ms)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    poll(&pfd, 1, ms);
+}
+
+static bool run_cast(Cast *c, int want_receivers, int wait_sec, double rate)
+{
+    double first_join = 0, next_announce = 0, next_progress = 0;
+    double start = 0, tokens = 0, last_refill = 0;
+
+    fprintf(stderr, YELLOW "Waiting for receivers (%s)...\n" RESET,
+            want_receivers > 0 ? "until enough have joined" : "then a while for more");
+
+    for (;;) {
+        double now = now_sec();
+        drain_control(c, now);
+
+        if (now >= next_announce) {
+            announce(c, &c->src);
+            next_announce = now + CAST_ANNOUNCE_MS / 1000.0;
+        }
+
+        /* Before the start: only JOINs */
+        if (!c->started) {
+            if (nreceivers > 0 && first_join == 0)
+                first_join = now;
+
+            if ((want_receivers > 0 && nreceivers >= want_receivers) ||
+                (want_receivers == 0 && first_join > 0 && now - first_join >= wait_sec)) {
+                c->started = true;
+                start = last_refill = now;
+                fprintf(stderr, YELLOW "Sending to %d receiver%s\n" RESET,
+                        nreceivers, nreceivers == 1 ? "" : "s");
+                continue;
+            }
+            wait_for(c->fd, 20);
+            continue;
+        }
+
+        /* The slowest receiver still here sets how far ahead we may go */
+        uint32_t min_ack = c->npackets;
+        int live = 0;
+
+        for (int i = 0; i < nreceivers; i++) {
+            Receiver *r = &receivers[i];
+            if (r->gone)
+                continue;
+            if (r->ack < c->npackets && now - r->last_heard > CAST_TIMEOUT_SEC) {
+                r->gone = true;
+                fprintf(stderr, RED "\nReceiver %s dropped: silent for %d s\n" RESET,
+                        inet_ntoa(r->addr.sin_addr), CAST_TIMEOUT_SEC);
+                continue;
+            }
+            live++;
+            if (r->ack < min_ack)
+                min_ack = r->ack;
+        }
+
+        if (live == 0) {
+            fprintf(stderr, RED "\nERROR:" WHITE " no receivers left\n" RESET);
+            return false;
+        }
+        if (min_ack == c->npackets)
+            break;
+
+        if (rate > 0) {
+            tokens += (now - last_refill) * rate;
+            last_refill = now;
+            /* At most a short burst after a pause */
+            double burst = rate * 0.002 > 64.0 * CAST_PACKET_MAX ? rate * 0.002 : 64.0 * CAST_PACKET_MAX;
+            if (tokens > burst)
+                tokens = burst;
+        }
+
+        bool window_full = false;
+
+        while (rate == 0 || tokens >= CAST_PACKET_MAX) {
+            uint32_t seq;
+
+            if (c->rcount > 0) {
+                seq = c->repairs[c->rhead];
+                c->rhead = (c->rhead + 1) % c->window;
+                c->rcount--;
+                c->queued[seq % c->window] = 0;
+                if (seq < min_ack)
+                    continue;
+                c->sent_again++;
+            } else if (c->next < c->npackets && (uint64_t)c->next < (uint64_t)min_ack + c->window) {
+                seq = c->next;
+                if (!source_read(&c->src, c->ring + (size_t)(seq % c->window) * CAST_PAYLOAD,
+                                 packet_len(c, seq)))
+                    return false;
+                c->next++;
+                c->sent_new++;
+            } else {
+                window_full = c->next < c->npackets;
+                break;
+            }
+
+            uint32_t slot = seq % c->window;
+            send_packet(c, CAST_DATA, seq, c->ring + (size_t)slot * CAST_PAYLOAD, packet_len(c, seq));
+            c->last_tx[slot] = now;
+            tokens -= CAST_PACKET_MAX;
+
+            /* Unlimited: still look at the receivers now and then */
+            if (rate == 0 && (c->sent_new + c->sent_again) % 256 == 0)
+                break;
+        }
+
+        if (now >= next_progress) {
+            double secs = now - start;
+            uint64_t bytes = (uint64_t)min_ack * CAST_PAYLOAD;
+            fprintf(stderr, WHITE "\rSent %.1f%%, all receivers have %.1f%%  (%.2f MB/s), "
+                    "%d receiver%s, %.2f%% resent " RESET,
+                    100.0 * c->next / c->npackets, 100.0 * min_ack / c->npackets,
+                    secs > 0 ? bytes / (1024.0 * 1024.0) / secs : 0.0,
+                    live, live == 1 ? "" : "s",
+                    c->sent_new ? 100.0 * c->sent_again / c->sent_new : 0.0);
+            next_progress = now + 0.5;
+        }
+
+        /* Sleep until there is something to send, or to hear */
+        if (window_full || (c->next == c->npackets && c->rcount == 0))
+            wait_for(c->fd, 10);
+        else if (rate > 0 && tokens < CAST_PACKET_MAX)
+            wait_for(c->fd, 1);
+    }
+
+    double secs = now_sec() - start;
+    int complete = 0, dropped = 0;
+    for (int i = 0; i < nreceivers; i++) {
+        if (receivers[i].gone)
+            dropped++;
+        else
+            complete++;
+    }
+
+    fprintf(stderr,
+            WHITE "\n\nSent %.2f MB to %d receiver%s in %.2f seconds (%.2f MB/s), %.2f%% of packets resent\n" RESET,
+            c->total / (1024.0 * 1024.0), complete, complete == 1 ? "" : "s", secs,
+            secs > 0 ? c->total / (1024.0 * 1024.0) / secs : 0.0,
+            c->sent_new ? 100.0 * c->sent_again / c->sent_new : 0.0);
+    if (dropped > 0)
+        fprintf(stderr, RED "%d receiver%s dropped out\n" RESET, dropped, dropped == 1 ? "" : "s");
+
+    return dropped == 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            YELLOW "\nUsage: " WHITE "imprint-cast --image <image> [options]\n\n"
+            YELLOW "Options:\n" WHITE
+            "  --image <image>         Image to send (.img.zst, .img.lz4, .000, ...); its .json goes first\n"
+            "  --group <addr>[:<port>] Multicast group (default %s:%d)\n"
+            "  --receivers <N>         Start once N receivers have joined\n"
+            "  --wait <sec>            Without --receivers: start this long after the first\n"
+            "                          receiver joined (default 10)\n"
+            "  --rate <Mbit/s>         Send at most this fast, repairs included (default %d, 0 = no limit)\n"
+            "  --window <MB>           Packets kept for repairs; receivers use as much memory (default %d)\n"
+            "  --interface <address>   IPv4 address of the interface to send on\n"
+            "  --ttl <N>               Router hops the packets may cross (default 1)\n"
+            "  --help                  Show this help message\n\n"
+            YELLOW "Examples:\n" WHITE
+            "  imprint-cast --image /srv/images/lab.img.zst --receivers 30\n"
+            "  imprintr --image mcast://%s --target /dev/sda3 --force   (on every machine)\n\n"
+            YELLOW "Notes:\n" WHITE
+            "  - The image crosses the network once, however many machines receive it; lost packets\n"
+            "    are sent again for everyone who lost them, and the slowest receiver sets the pace.\n"
+            "  - Receivers must be waiting before the transfer starts.  IPv4 only, without\n"
+            "    authentication or encryption: use it on a trusted network.\n" RESET,
+            CAST_DEFAULT_GROUP, CAST_DEFAULT_PORT, CAST_DEFAULT_RATE_MBIT, CAST_DEFAULT_WINDOW_MB,
+            CAST_DEFAULT_GROUP
+    );
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = NULL, *interface = NULL;
+    const char *group_spec = CAST_DEFAULT_GROUP;
+    int want_receivers = 0, wait_sec = 10, window_mb = CAST_DEFAULT_WINDOW_MB, ttl = 1;
+    double rate_mbit = CAST_DEFAULT_RATE_MBIT;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0) {
+            usage();
+            return 0;
+        } else if (strcmp(a, "--image") == 0 && has_value) {
+            image = argv[++i];
+        } else if (strcmp(a, "--group") == 0 && has_value) {
+            group_spec = argv[++i];
+        } else if (strcmp(a, "--receivers") == 0 && has_value) {
+            want_receivers = atoi(argv[++i]);
+        } else if (strcmp(a, "--wait") == 0 && has_value) {
+            wait_sec = atoi(argv[++i]);
+        } else if (strcmp(a, "--rate") == 0 && has_value) {
+            rate_mbit = atof(argv[++i]);
+        } else if (strcmp(a, "--window") == 0 && has_value) {
+            window_mb = atoi(argv[++i]);
+        } else if (strcmp(a, "--interface") == 0 && has_value) {
+            interface = argv[++i];
+        } else if (strcmp(a, "--ttl") == 0 && has_value) {
+            ttl = atoi(argv[++i]);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    CastGroup group;
+
+    if (!image) {
+        usage();
+        return 1;
+    }
+    if (!cast_parse_group(group_spec, &group)) {
+        fprintf(stderr, RED "ERROR:" WHITE " --group must be an IPv4 multicast address (224.0.0.0/4)\n" RESET);
+        return 1;
+    }
+    if (want_receivers < 0 || want_receivers > CAST_MAX_RECEIVERS || wait_sec < 0 || rate_mbit < 0 ||
+        window_mb < 1 || window_mb > CAST_MAX_WINDOW_MB || ttl < 1 || ttl > 255) {
+        fprintf(stderr, RED "ERROR:" WHITE " option out of range (see --help)\n" RESET);
+        return 1;
+    }
+
+    Cast c;
+    memset(&c, 0, sizeof(c));
+
+    if (!source_open(&c.src, image))
+        return 1;
+
+    c.total = c.src.meta_size + c.src.image_size;
+    if ((c.total + CAST_PAYLOAD - 1) / CAST_PAYLOAD > UINT32_MAX) {
+        fprintf(stderr, RED "ERROR:" WHITE " the image is too large to multicast\n" RESET);
+        source_close(&c.src);
+        return 1;
+    }
+    c.npackets = (uint32_t)((c.total + CAST_PAYLOAD - 1) / CAST_PAYLOAD);
+    c.window = (uint32_t)(((uint64_t)window_mb << 20) / CAST_PAYLOAD);
+
+    c.ring = malloc((size_t)c.window * CAST_PAYLOAD);
+    c.last_tx = calloc(c.window, sizeof(double));
+    c.queued = calloc(c.window, 1);
+    c.repairs = malloc((size_t)c.window * sizeof(uint32_t));
+    c.fd = cast_socket(&group, interface, false, ttl);
+
+    bool ok = false;
+
+    if (c.ring && c.last_tx && c.queued && c.repairs && c.fd >= 0) {
+        memset(&c.group, 0, sizeof(c.group));
+        c.group.sin_family = AF_INET;
+        c.group.sin_addr = group.group;
+        c.group.sin_port = htons(group.port);
+
+        if (getrandom(&c.session, sizeof(c.session), 0) != sizeof(c.session))
+            c.session = (uint32_t)getpid() ^ (uint32_t)time(NULL);
+
+        char rate_str[32] = "full speed";
+        if (rate_mbit > 0)
+            snprintf(rate_str, sizeof(rate_str), "up to %.0f Mbit/s", rate_mbit);
+
+        fprintf(stderr, YELLOW "Casting %s (%.2f MB) to %s port %u at %s\n" RESET,
+                image, c.src.image_size / (1024.0 * 1024.0), inet_ntoa(group.group), group.port,
+                rate_str);
+
+        ok = run_cast(&c, want_receivers, wait_sec, rate_mbit * 1e6 / 8);
+    } else if (c.fd >= 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " not enough memory for a %d MB window\n" RESET, window_mb);
+    }
+
+    if (c.fd >= 0)
+        close(c.fd);
+    free(c.ring);
+    free(c.last_tx);
+    free(c.queued);
+    free(c.repairs);
+    source_close(&c.src);
+
+    return ok ? 0 : 1;
+}
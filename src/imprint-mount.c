@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include "fusemount.h"
+#include "colors.h"
+
+#define DEFAULT_CACHE_MB 64
+
+static void usage(void) {
+    fprintf(stderr,
+            YELLOW "\nUsage: " WHITE "imprint-mount [--cache-mb <MB>] <image-file> <mountpoint>\n\n"
+            YELLOW "Options:\n" WHITE
+            "  --cache-mb <MB>   Memory for decompressed frames (default %d)\n"
+            "  --help            Show this help message\n\n"
+            YELLOW "Example:\n" WHITE
+            "  sudo imprint-mount /mnt/backup/sda2_ext4.img.zst.000 /mnt/image\n"
+            "  sudo mount -o loop,ro /mnt/image/sda2_ext4.img /mnt/restore\n" RESET,
+            DEFAULT_CACHE_MB
+    );
+}
+
+/* Strip a .000 chunk suffix to get the image base */
+static void
+image_base_for(const char *imagefile, char *base, size_t base_len)
+{
+    snprintf(base, base_len, "%s", imagefile);
+
+    size_t len = strlen(base);
+    if (len > 4 &&
+        base[len-4] == '.' &&
+        isdigit((unsigned char)base[len-3]) &&
+        isdigit((unsigned char)base[len-2]) &&
+        isdigit((unsigned char)base[len-1])) {
+
+        base[len-4] = '\0';   // strip .000
+    }
+}
+
+/* Name of the partition file: image name without the compression
+ * extension (sda2_ext4.img.zst -> sda2_ext4.img) */
+static void
+partition_file_name(const char *base, char *out, size_t out_len)
+{
+    const char *slash = strrchr(base, '/');
+    snprintf(out, out_len, "%s", slash ? slash + 1 : base);
+
+    size_t len = strlen(out);
+    const char *exts[] = { ".zst", ".lz4", NULL };
+
+    for (int i = 0; exts[i]; i++) {
+        size_t elen = strlen(exts[i]);
+        if (len > elen && strcmp(out + len - elen, exts[i]) == 0) {
+            out[len - elen] = '\0';
+            return;
+        }
+    }
+
+    strncat(out, ".raw", out_len - strlen(out) - 1);
+}
+
+int main(int argc, char **argv) {
+    int cache_mb = DEFAULT_CACHE_MB;
+    int argi = 1;
+
+    /* No arguments at all */
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+
+    /* --help */
+    if (strcmp(argv[argi], "--help") == 0 || strcmp(argv[argi], "-h") == 0) {
+        usage();
+        return 0;
+    }
+
+    /* --cache-mb */
+    if (strcmp(argv[argi], "--cache-mb") == 0) {
+        if (argi + 1 >= argc || atoi(argv[argi + 1]) <= 0) {
+            fprintf(stderr, RED "\nError: " WHITE "--cache-mb requires a positive value\n");
+            usage();
+            return 1;
+        }
+        cache_mb = atoi(argv[argi + 1]);
+        argi += 2;
+    }
+
+    /* If next argument starts with '-' → unknown flag */
+    if (argi < argc && argv[argi][0] == '-') {
+        fprintf(stderr, RED "\nError: " WHITE "unknown option: %s\n", argv[argi]);
+        usage();
+        return 1;
+    }
+
+    /* Require image filename + mountpoint */
+    if (argi + 2 != argc) {
+        fprintf(stderr, RED "\nError: " WHITE "expected an image file and a mountpoint\n");
+        usage();
+        return 1;
+    }
+
+    const char *imagefile = argv[argi];
+    const char *mountpoint = argv[argi + 1];
+
+    if (geteuid() != 0) {
+        fprintf(stderr, RED "\nError: " WHITE "imprint-mount must be run as root (sudo).\n" RESET);
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(mountpoint, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, RED "\nError: " WHITE "mountpoint is not a directory: %s\n" RESET, mountpoint);
+        return 1;
+    }
+
+    char base[PATH_MAX];
+    image_base_for(imagefile, base, sizeof(base));
+
+    char file_name[NAME_MAX + 1];
+    partition_file_name(base, file_name, sizeof(file_name));
+
+    return fuse_mount_image(base, mountpoint, file_name, cache_mb) ? 0 : 1;
+}
@@ -0,0 +1,852 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "netimg.h"
+#include "colors.h"
+
+/*
+ * imprint-serve: receives images from `imprintb --target tcp://...`
+ * into a directory, and serves them to `imprintr --image tcp://...`.
+ *
+ * Every connection gets a thread.  The connections of one backup share
+ * a session: their blocks are written with pwrite() at the offsets they
+ * carry, into <name>.partial (or <name>.partial.NNN chunks) and its
+ * sidecars.  END renames them over the old image once everything is
+ * on disk; a session that ends any other way deletes them.
+ */
+
+static char serve_dir[PATH_MAX];
+
+/* Messages from all connection threads */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void serve_log(const char *color, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void serve_log(const char *color, const char *fmt, ...)
+{
+    char when[32];
+    time_t now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&log_lock);
+    fprintf(stderr, WHITE "%s " RESET "%s", when, color);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, RESET "\n");
+    pthread_mutex_unlock(&log_lock);
+    va_end(ap);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool send_err(int fd, const char *msg)
+{
+    return net_send(fd, NET_ERR, 0, NULL, 0, msg, strlen(msg));
+}
+
+/* -------------------------------------------------------------
+ * Receiving (PUT sessions)
+ * ------------------------------------------------------------- */
+static const char *const sidecars[] = { ".sha256", ".idx", ".json" };
+#define NSIDECARS 3
+
+typedef struct Session {
+    struct Session *next;
+    uint64_t id;
+    char path[PATH_MAX];        /* <dir>/<name> */
+    char peer[128];
+    uint64_t chunk_bytes;       /* 0 = single file */
+    int nstreams;
+    int refs;                   /* connections attached */
+    int done;                   /* connections that sent DONE */
+    bool failed;
+    bool complete;
+    double started;
+
+    pthread_mutex_t lock;
+    int *fds;                   /* per chunk file, -1 until written */
+    unsigned nfiles;
+    uint64_t written;
+    int sidecar_fds[NSIDECARS];
+} Session;
+
+static Session *sessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void partial_path(const Session *s, unsigned idx, char *out, size_t len)
+{
+    if (s->chunk_bytes > 0)
+        snprintf(out, len, "%s.partial.%03u", s->path, idx);
+    else
+        snprintf(out, len, "%s.partial", s->path);
+}
+
+static void final_path(const Session *s, unsigned idx, char *out, size_t len)
+{
+    if (s->chunk_bytes > 0)
+        snprintf(out, len, "%s.%03u", s->path, idx);
+    else
+        snprintf(out, len, "%s", s->path);
+}
+
+/* Find or start the session of a PUT; NULL with *why set if refused */
+static Session *session_attach(uint64_t id, int nstreams, int chunk_mb,
+                               const char *path, const char *peer, const char **why)
+{
+    pthread_mutex_lock(&sessions_lock);
+
+    Session *s = sessions;
+    for (; s; s = s->next) {
+        if (s->id == id)
+            break;
+        if (strcmp(s->path, path) == 0) {
+            *why = "that image is being received from another backup right now";
+            pthread_mutex_unlock(&sessions_lock);
+            return NULL;
+        }
+    }
+
+    if (s) {
+        if (s->nstreams != nstreams || strcmp(s->path, path) != 0 || s->failed) {
+            *why = "connection does not match its session";
+            s = NULL;
+        } else {
+            s->refs++;
+        }
+        pthread_mutex_unlock(&sessions_lock);
+        return s;
+    }
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        *why = "out of memory";
+        pthread_mutex_unlock(&sessions_lock);
+        return NULL;
+    }
+
+    s->id = id;
+    snprintf(s->path, sizeof(s->path), "%s", path);
+    snprintf(s->peer, sizeof(s->peer), "%s", peer);
+    s->chunk_bytes = (uint64_t)chunk_mb * 1024 * 1024;
+    s->nstreams = nstreams;
+    s->refs = 1;
+    s->started = now_sec();
+    for (int i = 0; i < NSIDECARS; i++)
+        s->sidecar_fds[i] = -1;
+    pthread_mutex_init(&s->lock, NULL);
+
+    s->next = sessions;
+    sessions = s;
+    pthread_mutex_unlock(&sessions_lock);
+
+    serve_log(YELLOW, "Receiving %s from %s (%d connection%s)", path, peer, nstreams,
+              nstreams == 1 ? "" : "s");
+    return s;
+}
+
+static void close_session_files(Session *s)
+{
+    for (unsigned i = 0; i < s->nfiles; i++) {
+        if (s->fds[i] >= 0)
+            close(s->fds[i]);
+        s->fds[i] = -1;
+    }
+    for (int i = 0; i < NSIDECARS; i++) {
+        if (s->sidecar_fds[i] >= 0)
+            close(s->sidecar_fds[i]);
+        s->sidecar_fds[i] = -1;
+    }
+}
+
+static void session_detach(Session *s)
+{
+    pthread_mutex_lock(&sessions_lock);
+
+    if (--s->refs > 0) {
+        /* One connection gone before END dooms the image */
+        if (!s->complete)
+            s->failed = true;
+        pthread_mutex_unlock(&sessions_lock);
+        return;
+    }
+
+    for (Session **pp = &sessions; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    close_session_files(s);
+
+    if (!s->complete) {
+        char path[PATH_MAX + 32];
+        for (unsigned i = 0; i < s->nfiles; i++) {
+            partial_path(s, i, path, sizeof(path));
+            unlink(path);
+        }
+        for (int i = 0; i < NSIDECARS; i++) {
+            snprintf(path, sizeof(path), "%s.partial%s", s->path, sidecars[i]);
+            unlink(path);
+        }
+        serve_log(RED, "Discarded %s: the backup did not complete", s->path);
+    }
+
+    free(s->fds);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+/* fd of chunk file idx, created on first use (session lock held) */
+static int session_file(Session *s, unsigned idx)
+{
+    if (idx >= s->nfiles) {
+        int *fds = realloc(s->fds, (idx + 1) * sizeof(*fds));
+        if (!fds)
+            return -1;
+        for (unsigned i = s->nfiles; i <= idx; i++)
+            fds[i] = -1;
+        s->fds = fds;
+        s->nfiles = idx + 1;
+    }
+
+    if (s->fds[idx] < 0) {
+        char path[PATH_MAX + 32];
+        partial_path(s, idx, path, sizeof(path));
+        s->fds[idx] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (s->fds[idx] < 0)
+            serve_log(RED, "Cannot create %s: %s", path, strerror(errno));
+    }
+
+    return s->fds[idx];
+}
+
+static bool pwrite_all(int fd, const unsigned char *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return true;
+}
+
+/* A block at its image offset, split where it crosses chunk files */
+static bool session_write(Session *s, uint64_t offset, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        unsigned idx = 0;
+        uint64_t in_file = offset;
+        size_t take = len;
+
+        if (s->chunk_bytes > 0) {
+            idx = (unsigned)(offset / s->chunk_bytes);
+            in_file = offset % s->chunk_bytes;
+            if (take > s->chunk_bytes - in_file)
+                take = (size_t)(s->chunk_bytes - in_file);
+        }
+
+        pthread_mutex_lock(&s->lock);
+        int fd = session_file(s, idx);
+        pthread_mutex_unlock(&s->lock);
+
+        if (fd < 0 || !pwrite_all(fd, buf, take, in_file))
+            return false;
+
+        __atomic_add_fetch(&s->written, (uint64_t)take, __ATOMIC_RELAXED);
+        buf += take;
+        len -= take;
+        offset += take;
+    }
+
+    return true;
+}
+
+static bool session_write_sidecar(Session *s, const char *suffix, uint64_t offset,
+                                  const unsigned char *buf, size_t len)
+{
+    int i = 0;
+    while (i < NSIDECARS && strcmp(sidecars[i], suffix) != 0)
+        i++;
+    if (i == NSIDECARS)
+        return false;
+
+    if (s->sidecar_fds[i] < 0) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s.partial%s", s->path, suffix);
+        s->sidecar_fds[i] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (s->sidecar_fds[i] < 0)
+            return false;
+    }
+
+    return pwrite_all(s->sidecar_fds[i], buf, len, offset);
+}
+
+/* Everything on disk, then the new image replaces the old one */
+static bool session_complete(Session *s, uint64_t size, const char **why)
+{
+    pthread_mutex_lock(&sessions_lock);
+    bool all_done = (s->done == s->nstreams && !s->failed);
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (!all_done) {
+        *why = "not every connection delivered its data";
+        return false;
+    }
+    if (s->written != size) {
+        *why = "image size does not match the data received";
+        return false;
+    }
+
+    /* An empty image still gets its file */
+    if (s->nfiles == 0 && session_file(s, 0) < 0) {
+        *why = "cannot create the image file";
+        return false;
+    }
+
+    for (unsigned i = 0; i < s->nfiles; i++) {
+        if (s->fds[i] < 0 || fsync(s->fds[i]) != 0) {
+            *why = s->fds[i] < 0 ? "a chunk file is missing" : "cannot flush the image to disk";
+            return false;
+        }
+    }
+    for (int i = 0; i < NSIDECARS; i++) {
+        if (s->sidecar_fds[i] >= 0 && fsync(s->sidecar_fds[i]) != 0) {
+            *why = "cannot flush the metadata to disk";
+            return false;
+        }
+    }
+    close_session_files(s);
+
+    /* Old files of that name go first: it may have had more chunks */
+    char from[PATH_MAX + 32], to[PATH_MAX + 32];
+
+    unlink(s->path);
+    for (unsigned i = 0; i < 1000; i++) {
+        snprintf(to, sizeof(to), "%s.%03u", s->path, i);
+        if (unlink(to) != 0 && errno == ENOENT)
+            break;
+    }
+
+    for (unsigned i = 0; i < s->nfiles; i++) {
+        partial_path(s, i, from, sizeof(from));
+        final_path(s, i, to, sizeof(to));
+        if (rename(from, to) != 0) {
+            *why = "cannot rename the image into place";
+            return false;
+        }
+    }
+
+    for (int i = 0; i < NSIDECARS; i++) {
+        snprintf(from, sizeof(from), "%s.partial%s", s->path, sidecars[i]);
+        snprintf(to, sizeof(to), "%s%s", s->path, sidecars[i]);
+        if (rename(from, to) == 0)
+            continue;
+        if (errno != ENOENT) {
+            *why = "cannot rename the metadata into place";
+            return false;
+        }
+        /* Not sent (e.g. no .idx): none from the old image either */
+        unlink(to);
+    }
+
+    /* The renames themselves */
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", s->path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    s->complete = true;
+
+    double secs = now_sec() - s->started;
+    serve_log(GREEN, "Stored %s: %.2f MB in %.1f s (%.2f MB/s)", s->path,
+              size / (1024.0 * 1024.0), secs,
+              secs > 0 ? size / (1024.0 * 1024.0) / secs : 0.0);
+    return true;
+}
+
+static void serve_put(int fd, unsigned char *buf, Session *s, int stream)
+{
+    NetMsg m;
+    bool done = false;
+
+    while (net_recv(fd, &m, buf, NET_BLOCK_SIZE + 64)) {
+        if (m.type == NET_DATA && !done) {
+            if (!session_write(s, m.offset, buf, m.len)) {
+                serve_log(RED, "Writing %s failed: %s", s->path, strerror(errno));
+                send_err(fd, "the server cannot write the image");
+                break;
+            }
+        } else if (m.type == NET_DONE && !done) {
+            pthread_mutex_lock(&sessions_lock);
+            s->done++;
+            pthread_mutex_unlock(&sessions_lock);
+            done = true;
+            if (!net_send(fd, NET_OK, 0, NULL, 0, NULL, 0))
+                break;
+        } else if (m.type == NET_FILE && done && stream == 0) {
+            size_t slen = strnlen((char *)buf, m.len);
+            if (slen == m.len || !net_suffix_ok((char *)buf) ||
+                !session_write_sidecar(s, (char *)buf, m.offset,
+                                       buf + slen + 1, m.len - slen - 1)) {
+                send_err(fd, "the server cannot write the metadata");
+                break;
+            }
+        } else if (m.type == NET_END && done && stream == 0) {
+            const char *why = NULL;
+            if (session_complete(s, m.offset, &why))
+                net_send(fd, NET_OK, 0, NULL, 0, NULL, 0);
+            else {
+                serve_log(RED, "Cannot complete %s: %s", s->path, why);
+                send_err(fd, why);
+            }
+            break;
+        } else {
+            send_err(fd, "unexpected message");
+            break;
+        }
+    }
+}
+
+/* -------------------------------------------------------------
+ * Serving (GET)
+ * ------------------------------------------------------------- */
+typedef struct {
+    char path[PATH_MAX];
+    int *fds;
+    unsigned nfiles;
+    uint64_t chunk_bytes;       /* 0 = single file */
+    uint64_t size;
+} ServedImage;
+
+static bool image_open(ServedImage *img, const char *path)
+{
+    memset(img, 0, sizeof(*img));
+    snprintf(img->path, sizeof(img->path), "%s", path);
+
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd >= 0) {
+        img->fds = malloc(sizeof(int));
+        if (!img->fds || fstat(fd, &st) != 0) {
+            close(fd);
+            free(img->fds);
+            img->fds = NULL;
+            return false;
+        }
+        img->fds[0] = fd;
+        img->nfiles = 1;
+        img->size = (uint64_t)st.st_size;
+        return true;
+    }
+
+    /* Chunk set: every chunk but the last has the size of .000 */
+    for (unsigned i = 0; i < 1000; i++) {
+        char chunk[PATH_MAX + 8];
+        snprintf(chunk, sizeof(chunk), "%s.%03u", path, i);
+        fd = open(chunk, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            break;
+
+        int *fds = realloc(img->fds, (i + 1) * sizeof(int));
+        if (!fds || fstat(fd, &st) != 0) {
+            close(fd);
+            if (fds)
+                img->fds = fds;
+            break;
+        }
+        img->fds = fds;
+        img->fds[i] = fd;
+        img->nfiles = i + 1;
+        if (i == 0)
+            img->chunk_bytes = (uint64_t)st.st_size;
+        img->size += (uint64_t)st.st_size;
+    }
+
+    return img->nfiles > 0 && img->chunk_bytes > 0;
+}
+
+static void image_close(ServedImage *img)
+{
+    for (unsigned i = 0; i < img->nfiles; i++)
+        close(img->fds[i]);
+    free(img->fds);
+    img->fds = NULL;
+    img->nfiles = 0;
+}
+
+static bool image_pread(const ServedImage *img, unsigned char *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        unsigned idx = 0;
+        uint64_t in_file = offset;
+        size_t take = len;
+
+        if (img->chunk_bytes > 0) {
+            idx = (unsigned)(offset / img->chunk_bytes);
+            in_file = offset % img->chunk_bytes;
+            if (take > img->chunk_bytes - in_file)
+                take = (size_t)(img->chunk_bytes - in_file);
+        }
+        if (idx >= img->nfiles)
+            return false;
+
+        ssize_t n = pread(img->fds[idx], buf, take, (off_t)in_file);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+
+    return true;
+}
+
+static bool serve_file(int fd, const ServedImage *img, const char *suffix, unsigned char *buf)
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s%s", img->path, suffix);
+
+    int ffd = open(path, O_RDONLY | O_CLOEXEC);
+    if (ffd < 0)
+        return send_err(fd, "no such file");
+
+    uint64_t offset = 0;
+    bool ok = true;
+
+    for (;;) {
+        ssize_t n = read(ffd, buf, NET_BLOCK_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        if (!net_send(fd, NET_FILE, offset, suffix, strlen(suffix) + 1, buf, (size_t)n)) {
+            ok = false;
+            break;
+        }
+        offset += (uint64_t)n;
+    }
+    close(ffd);
+
+    return ok ? net_send(fd, NET_OK, 0, NULL, 0, NULL, 0) : send_err(fd, "cannot read the file");
+}
+
+static void serve_get(int fd, unsigned char *buf, const ServedImage *img)
+{
+    NetMsg m;
+
+    while (net_recv(fd, &m, buf, NET_BLOCK_SIZE + 64)) {
+        if (m.type == NET_READ && m.len == 4) {
+            uint32_t want = (uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                            (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+
+            if (want > NET_BLOCK_SIZE || m.offset > img->size || want > img->size - m.offset ||
+                !image_pread(img, buf, want, m.offset)) {
+                send_err(fd, "cannot read that part of the image");
+                break;
+            }
+            if (!net_send(fd, NET_DATA, m.offset, NULL, 0, buf, want))
+                break;
+        } else if (m.type == NET_GETFILE && net_suffix_ok((char *)buf)) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), "%s", (char *)buf);
+            if (!serve_file(fd, img, suffix, buf))
+                break;
+        } else {
+            send_err(fd, "unexpected message");
+            break;
+        }
+    }
+}
+
+/* -------------------------------------------------------------
+ * Connections
+ * ------------------------------------------------------------- */
+typedef struct {
+    int fd;
+    char peer[128];
+} Connection;
+
+static void *connection_main(void *arg)
+{
+    Connection *c = arg;
+    int fd = c->fd;
+    unsigned char *buf = malloc(NET_BLOCK_SIZE + 64 + 1);
+    NetMsg m;
+
+    if (!buf || !net_recv(fd, &m, buf, NET_BLOCK_SIZE + 64) || m.type != NET_HELLO)
+        goto out;
+
+    char *hello = (char *)buf;
+    char path[PATH_MAX];
+
+    if (strncmp(hello, "PUT ", 4) == 0) {
+        unsigned long long id;
+        int stream, streams, chunk_mb, name_at = 0;
+
+        if (sscanf(hello + 4, "%llx %d %d %d %n", &id, &stream, &streams, &chunk_mb, &name_at) != 4 ||
+            name_at == 0 || stream < 0 || streams < 1 || streams > NET_MAX_STREAMS ||
+            stream >= streams || chunk_mb < 0 || !net_name_ok(hello + 4 + name_at)) {
+            send_err(fd, "bad request");
+            goto out;
+        }
+
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", serve_dir, hello + 4 + name_at) >= sizeof(path)) {
+            send_err(fd, "name too long");
+            goto out;
+        }
+
+        /* Subdirectories must exist already */
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", path);
+        *strrchr(dir, '/') = '\0';
+        struct stat st;
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            send_err(fd, "no such directory on the server");
+            goto out;
+        }
+
+        const char *why = NULL;
+        Session *s = session_attach((uint64_t)id, streams, chunk_mb, path, c->peer, &why);
+        if (!s) {
+            send_err(fd, why);
+            goto out;
+        }
+
+        if (net_send(fd, NET_OK, 0, NULL, 0, NULL, 0))
+            serve_put(fd, buf, s, stream);
+        session_detach(s);
+    } else if (strncmp(hello, "GET ", 4) == 0 && net_name_ok(hello + 4)) {
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", serve_dir, hello + 4) >= sizeof(path)) {
+            send_err(fd, "name too long");
+            goto out;
+        }
+
+        ServedImage img;
+        if (!image_open(&img, path)) {
+            image_close(&img);
+            send_err(fd, "no such image on the server");
+            goto out;
+        }
+
+        char size[32];
+        snprintf(size, sizeof(size), "%llu", (unsigned long long)img.size);
+        if (net_send(fd, NET_OK, 0, NULL, 0, size, strlen(size)))
+            serve_get(fd, buf, &img);
+        image_close(&img);
+    } else {
+        send_err(fd, "bad request");
+    }
+
+out:
+    close(fd);
+    free(buf);
+    free(c);
+    return NULL;
+}
+
+static int listen_on(const char *spec)
+{
+    /* [<address>:]<port>, [v6 address]:<port> */
+    char host[256] = "", port[16];
+    const char *colon = strrchr(spec, ':');
+
+    if (colon) {
+        size_t hlen = (size_t)(colon - spec);
+        if (hlen >= sizeof(host))
+            hlen = sizeof(host) - 1;
+        memcpy(host, spec, hlen);
+        host[hlen] = '\0';
+        if (host[0] == '[') {
+            memmove(host, host + 1, strlen(host));
+            char *close_br = strchr(host, ']');
+            if (close_br)
+                *close_br = '\0';
+        }
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    } else {
+        snprintf(port, sizeof(port), "%s", spec);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = host[0] ? AF_UNSPEC : AF_INET6;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    int rc = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " --listen %s: %s\n" RESET, spec, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    int err = 0;
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+
+        int one = 1, zero = 0;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        /* All addresses: IPv6 and IPv4 on one socket */
+        if (ai->ai_family == AF_INET6)
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+            break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        fprintf(stderr, RED "ERROR:" WHITE " cannot listen on %s: %s\n" RESET, spec, strerror(err));
+    return fd;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            YELLOW "\nUsage: " WHITE "imprint-serve --dir <directory> [--listen [<address>:]<port>]\n\n"
+            YELLOW "Options:\n" WHITE
+            "  --dir <directory>   Where images are received and served from\n"
+            "  --listen <spec>     Address and port to listen on (default: all addresses, port %s)\n"
+            "  --help              Show this help message\n\n"
+            YELLOW "Examples:\n" WHITE
+            "  imprint-serve --dir /srv/imprint\n"
+            "  imprintb --source /dev/sda3 --target tcp://backupserver/laptop-root --compress zstd\n"
+            "  imprintr --image tcp://backupserver/laptop-root.img.zst --target /dev/sda3\n\n"
+            YELLOW "Notes:\n" WHITE
+            "  - There is no authentication or encryption: run it on a trusted network, or\n"
+            "    listen on 127.0.0.1 and reach it through an SSH tunnel.\n"
+            "  - A backup that does not complete leaves the previous image of that name as it was.\n" RESET,
+            NET_DEFAULT_PORT
+    );
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = NULL;
+    const char *listen_spec = NET_DEFAULT_PORT;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            usage();
+            return 0;
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+            listen_spec = argv[++i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!dir) {
+        usage();
+        return 1;
+    }
+
+    if (!realpath(dir, serve_dir)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s: %s\n" RESET, dir, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (stat(serve_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, RED "ERROR:" WHITE " not a directory: %s\n" RESET, serve_dir);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = listen_on(listen_spec);
+    if (lfd < 0)
+        return 1;
+
+    serve_log(YELLOW, "Serving %s on %s", serve_dir, listen_spec);
+
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t alen = sizeof(addr);
+
+        int fd = accept4(lfd, (struct sockaddr *)&addr, &alen, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE)
+                continue;
+            fprintf(stderr, RED "ERROR:" WHITE " accept: %s\n" RESET, strerror(errno));
+            return 1;
+        }
+
+        Connection *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+
+        char host[INET6_ADDRSTRLEN] = "?";
+        getnameinfo((struct sockaddr *)&addr, alen, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+        snprintf(c->peer, sizeof(c->peer), "%s", host);
+
+        net_tune_socket(fd);
+
+        pthread_t t;
+        if (pthread_create(&t, NULL, connection_main, c) != 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        pthread_detach(t);
+    }
+}
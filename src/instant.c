@@ -0,0 +1,704 @@
+#define _GNU_SOURCE
+
+#include "instant.h"
+#include "frameidx.h"
+#include "pcimage.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+
+/* Blocks restored per background step (the lock is dropped in between) */
+#define COPY_BATCH_BLOCKS  256
+
+/* Decoded frames kept in memory */
+#define INSTANT_CACHE_FRAMES  32
+
+typedef struct {
+    PcLayout layout;
+    FrameIndex idx;
+    FrameReader *reader;
+
+    int dev_fd;
+    int sock;                   /* our end of the NBD socket pair */
+    uint64_t size;              /* bytes exposed through NBD */
+
+    /* One bit per filesystem block: already on the target.
+     * Unused blocks start out set -- there is nothing to restore. */
+    unsigned char *restored;
+    uint64_t remaining;         /* used blocks not yet on the target */
+
+    unsigned char *run_buf;     /* COPY_BATCH_BLOCKS blocks, under lock */
+
+    pthread_mutex_t lock;
+    int clients_waiting;        /* NBD requests queued on the lock */
+
+    bool stop_copy;             /* abandon the background copy */
+    bool copy_done;
+    bool serving;
+    bool failed;
+
+    uint64_t fetched_on_demand; /* blocks restored because of a read */
+} InstantState;
+
+/* -------------------------------------------------------------
+ * Small I/O helpers
+ * ------------------------------------------------------------- */
+static bool read_full(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool pwrite_full(int fd, const void *buf, size_t len, uint64_t off)
+{
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool pread_full(int fd, void *buf, size_t len, uint64_t off)
+{
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        if (n == 0) {
+            memset(p, 0, len);  /* past the end of a file target */
+            return true;
+        }
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool layout_read(void *ctx, void *dst, size_t len, uint64_t off)
+{
+    return frame_reader_pread(ctx, dst, len, off) == (ssize_t)len;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* -------------------------------------------------------------
+ * Restoring blocks (caller holds st->lock)
+ * ------------------------------------------------------------- */
+static bool needs_restore(const InstantState *st, uint64_t b)
+{
+    return !pc_test_bit(st->restored, b);
+}
+
+/* Restore `n` consecutive used blocks starting at `first` */
+static bool restore_run(InstantState *st, uint64_t first, uint32_t n)
+{
+    uint32_t bs = st->layout.h.block_size;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t off = pc_layout_offset(&st->layout, first + i);
+        if (frame_reader_pread(st->reader, st->run_buf + (size_t)i * bs, bs, off) != (ssize_t)bs)
+            return false;
+    }
+
+    if (!pwrite_full(st->dev_fd, st->run_buf, (size_t)n * bs, first * bs))
+        return false;
+
+    for (uint32_t i = 0; i < n; i++)
+        pc_set_bit(st->restored, first + i);
+
+    st->remaining -= n;
+    return true;
+}
+
+/* Make sure every block in [first, last] is on the target */
+static bool ensure_restored(InstantState *st, uint64_t first, uint64_t last)
+{
+    uint64_t total = st->layout.h.total_blocks;
+    if (first >= total)
+        return true;
+    if (last >= total)
+        last = total - 1;
+
+    uint64_t b = first;
+    while (b <= last) {
+        if (!needs_restore(st, b)) {
+            b++;
+            continue;
+        }
+
+        uint32_t n = 1;
+        while (b + n <= last && n < COPY_BATCH_BLOCKS && needs_restore(st, b + n))
+            n++;
+
+        if (!restore_run(st, b, n))
+            return false;
+
+        b += n;
+    }
+
+    return true;
+}
+
+/* Mark blocks fully overwritten by a client as restored */
+static void mark_restored(InstantState *st, uint64_t first, uint64_t last)
+{
+    uint64_t total = st->layout.h.total_blocks;
+
+    for (uint64_t b = first; b <= last && b < total; b++) {
+        if (needs_restore(st, b)) {
+            pc_set_bit(st->restored, b);
+            st->remaining--;
+        }
+    }
+}
+
+/* -------------------------------------------------------------
+ * Background copy
+ * ------------------------------------------------------------- */
+static void *copy_main(void *arg)
+{
+    InstantState *st = arg;
+    uint64_t total = st->layout.h.total_blocks;
+    uint64_t used = st->layout.h.used_blocks;
+    double t_start = now_sec();
+    double t_report = 0.0;
+
+    for (uint64_t b = 0; b < total; b += COPY_BATCH_BLOCKS) {
+        if (__atomic_load_n(&st->stop_copy, __ATOMIC_RELAXED))
+            break;
+
+        /* NBD requests go first */
+        while (__atomic_load_n(&st->clients_waiting, __ATOMIC_RELAXED) > 0)
+            usleep(200);
+
+        uint64_t last = b + COPY_BATCH_BLOCKS - 1;
+
+        pthread_mutex_lock(&st->lock);
+        bool ok = ensure_restored(st, b, last);
+        uint64_t remaining = st->remaining;
+        uint64_t fetched = st->fetched_on_demand;
+        pthread_mutex_unlock(&st->lock);
+
+        if (!ok) {
+            fprintf(stderr, RED "\nERROR:" WHITE " background copy failed near block %llu: %s\n" RESET,
+                    (unsigned long long)b, strerror(errno));
+            st->failed = true;
+            break;
+        }
+
+        double t = now_sec();
+        if (t - t_report >= 1.0 || remaining == 0) {
+            double done_mb = (double)(used - remaining) * st->layout.h.block_size / (1024.0 * 1024.0);
+            fprintf(stderr, WHITE "\rBackground copy %.1f%%  (%.2f MB/s, %llu blocks fetched on demand) " RESET,
+                    used ? 100.0 * (double)(used - remaining) / (double)used : 100.0,
+                    t > t_start ? done_mb / (t - t_start) : 0.0,
+                    (unsigned long long)fetched);
+            t_report = t;
+        }
+
+        if (remaining == 0)
+            break;
+    }
+
+    if (!st->failed && fdatasync(st->dev_fd) != 0)
+        st->failed = true;
+
+    pthread_mutex_lock(&st->lock);
+    bool complete = (st->remaining == 0) && !st->failed;
+    pthread_mutex_unlock(&st->lock);
+
+    if (complete)
+        fprintf(stderr,
+                GREEN "\nBackground copy complete: the target now holds the whole image.\n" RESET
+                YELLOW "The NBD device stays available until you disconnect it (Ctrl-C).\n" RESET);
+
+    __atomic_store_n(&st->copy_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+ * NBD server
+ * ------------------------------------------------------------- */
+static void lock_for_client(InstantState *st)
+{
+    __atomic_add_fetch(&st->clients_waiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&st->lock);
+    __atomic_sub_fetch(&st->clients_waiting, 1, __ATOMIC_RELAXED);
+}
+
+static int serve_read(InstantState *st, unsigned char *buf, uint32_t len, uint64_t off)
+{
+    uint32_t bs = st->layout.h.block_size;
+
+    lock_for_client(st);
+    uint64_t before = st->remaining;
+    bool ok = ensure_restored(st, off / bs, (off + len - 1) / bs);
+    st->fetched_on_demand += before - st->remaining;
+    pthread_mutex_unlock(&st->lock);
+
+    if (!ok || !pread_full(st->dev_fd, buf, len, off))
+        return EIO;
+
+    return 0;
+}
+
+static int serve_write(InstantState *st, const unsigned char *buf, uint32_t len, uint64_t off)
+{
+    uint32_t bs = st->layout.h.block_size;
+    uint64_t first = off / bs;
+    uint64_t last = (off + len - 1) / bs;
+    bool ok = true;
+
+    lock_for_client(st);
+
+    /* Partially covered edge blocks need their old contents first */
+    if (off % bs != 0)
+        ok = ensure_restored(st, first, first);
+    if (ok && (off + len) % bs != 0)
+        ok = ensure_restored(st, last, last);
+
+    if (ok) {
+        mark_restored(st, first, last);
+        ok = pwrite_full(st->dev_fd, buf, len, off);
+    }
+
+    pthread_mutex_unlock(&st->lock);
+    return ok ? 0 : EIO;
+}
+
+static int serve_trim(InstantState *st, uint32_t len, uint64_t off)
+{
+    uint32_t bs = st->layout.h.block_size;
+
+    /* Discarded blocks need not be restored; edges are left alone */
+    uint64_t first = (off + bs - 1) / bs;
+    uint64_t end = (off + len) / bs;
+
+    if (end > first) {
+        lock_for_client(st);
+        mark_restored(st, first, end - 1);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    return 0;
+}
+
+static bool send_reply(int sock, const char handle[8], int error,
+                       const void *data, uint32_t len)
+{
+    struct nbd_reply rep;
+    rep.magic = htonl(NBD_REPLY_MAGIC);
+    rep.error = htonl((uint32_t)error);
+    memcpy(rep.handle, handle, sizeof(rep.handle));
+
+    if (!write_full(sock, &rep, sizeof(rep)))
+        return false;
+
+    return error != 0 || !data || write_full(sock, data, len);
+}
+
+static void *server_main(void *arg)
+{
+    InstantState *st = arg;
+    unsigned char *buf = NULL;
+    size_t buf_cap = 0;
+
+    for (;;) {
+        struct nbd_request req;
+        if (!read_full(st->sock, &req, sizeof(req)))
+            break;
+
+        if (ntohl(req.magic) != NBD_REQUEST_MAGIC) {
+            fprintf(stderr, RED "\nERROR:" WHITE " bad NBD request magic.\n" RESET);
+            break;
+        }
+
+        uint32_t type = ntohl(req.type) & 0xffff;
+        uint64_t from = be64toh(req.from);
+        uint32_t len = ntohl(req.len);
+
+        if (type == NBD_CMD_DISC)
+            break;
+
+        if ((type == NBD_CMD_READ || type == NBD_CMD_WRITE) && len > buf_cap) {
+            unsigned char *nb = realloc(buf, len);
+            if (!nb)
+                break;
+            buf = nb;
+            buf_cap = len;
+        }
+
+        int err = 0;
+        bool ok = true;
+
+        switch (type) {
+        case NBD_CMD_READ:
+            if (len > 0 && from + len <= st->size)
+                err = serve_read(st, buf, len, from);
+            else if (len > 0)
+                err = EINVAL;
+            ok = send_reply(st->sock, req.handle, err, buf, len);
+            break;
+
+        case NBD_CMD_WRITE:
+            if (!read_full(st->sock, buf, len)) {
+                ok = false;
+                break;
+            }
+            if (len > 0 && from + len <= st->size)
+                err = serve_write(st, buf, len, from);
+            else if (len > 0)
+                err = EINVAL;
+            ok = send_reply(st->sock, req.handle, err, NULL, 0);
+            break;
+
+        case NBD_CMD_FLUSH:
+            err = fdatasync(st->dev_fd) == 0 ? 0 : EIO;
+            ok = send_reply(st->sock, req.handle, err, NULL, 0);
+            break;
+
+        case NBD_CMD_TRIM:
+            err = serve_trim(st, len, from);
+            ok = send_reply(st->sock, req.handle, err, NULL, 0);
+            break;
+
+        default:
+            ok = send_reply(st->sock, req.handle, EINVAL, NULL, 0);
+            break;
+        }
+
+        if (!ok)
+            break;
+    }
+
+    free(buf);
+    __atomic_store_n(&st->serving, false, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+typedef struct {
+    int nbd_fd;
+    int kernel_sock;
+} NbdKernel;
+
+static void *nbd_do_it_main(void *arg)
+{
+    NbdKernel *k = arg;
+
+    /* Blocks until the device is disconnected */
+    ioctl(k->nbd_fd, NBD_DO_IT);
+    ioctl(k->nbd_fd, NBD_CLEAR_QUE);
+    ioctl(k->nbd_fd, NBD_CLEAR_SOCK);
+
+    /* Lets the server see EOF if the kernel never took the socket */
+    close(k->kernel_sock);
+    return NULL;
+}
+
+/* Everything in st except the descriptors */
+static void instant_state_free(InstantState *st)
+{
+    pthread_mutex_destroy(&st->lock);
+    free(st->run_buf);
+    free(st->restored);
+    pc_layout_free(&st->layout);
+    frame_reader_close(st->reader);
+    frame_index_free(&st->idx);
+}
+
+/* -------------------------------------------------------------
+ * Entry point
+ * ------------------------------------------------------------- */
+bool instant_restore_run(const char *image_base,
+                         const char *device,
+                         const char *nbd_device)
+{
+    InstantState st;
+    memset(&st, 0, sizeof(st));
+    st.dev_fd = -1;
+    st.sock = -1;
+
+    /* ---------------------------------------------------------
+     * 1. Frame index + image layout
+     * --------------------------------------------------------- */
+    char idx_path[1100];
+    frame_index_path_for(image_base, idx_path, sizeof(idx_path));
+
+    if (!frame_index_load(idx_path, &st.idx)) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " instant restore needs the frame index %s.\n"
+                "       Only zstd and lz4 images written by this version of imprintb have one.\n" RESET,
+                idx_path);
+        return false;
+    }
+
+    st.reader = frame_reader_open(image_base, &st.idx, INSTANT_CACHE_FRAMES);
+    if (!st.reader) {
+        frame_index_free(&st.idx);
+        return false;
+    }
+
+    char why[128];
+    if (!pc_layout_load(&st.layout, layout_read, st.reader, why, sizeof(why))) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot use image for instant restore: %s\n" RESET, why);
+        frame_reader_close(st.reader);
+        frame_index_free(&st.idx);
+        return false;
+    }
+
+    uint64_t total = st.layout.h.total_blocks;
+    uint32_t bs = st.layout.h.block_size;
+
+    st.size = st.layout.h.device_size ? st.layout.h.device_size : total * bs;
+    st.remaining = st.layout.h.used_blocks;
+
+    /* Unused blocks count as restored from the start */
+    uint64_t bm_len = pc_bitmap_bytes(total);
+    st.restored = malloc(bm_len);
+    st.run_buf = malloc((size_t)COPY_BATCH_BLOCKS * bs);
+
+    bool ok = st.restored && st.run_buf;
+    if (ok) {
+        for (uint64_t i = 0; i < bm_len; i++)
+            st.restored[i] = (unsigned char)~st.layout.bitmap[i];
+    }
+
+    pthread_mutex_init(&st.lock, NULL);
+
+    /* ---------------------------------------------------------
+     * 2. Target + NBD device
+     * --------------------------------------------------------- */
+    int nbd_fd = -1;
+    int sp[2] = { -1, -1 };
+
+    if (ok) {
+        st.dev_fd = open(device, O_RDWR | O_CLOEXEC);
+        if (st.dev_fd < 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot open %s: %s\n" RESET,
+                    device, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (ok) {
+        nbd_fd = open(nbd_device, O_RDWR | O_CLOEXEC);
+        if (nbd_fd < 0) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " cannot open %s: %s\n"
+                    "       Is the nbd module loaded (modprobe nbd)?\n" RESET,
+                    nbd_device, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (ok && socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) != 0) {
+        perror("socketpair");
+        ok = false;
+    }
+
+    if (ok) {
+        unsigned long nbd_bs = (st.size % 4096 == 0) ? 4096 : 512;
+
+        ioctl(nbd_fd, NBD_CLEAR_SOCK);
+
+        if (ioctl(nbd_fd, NBD_SET_BLKSIZE, nbd_bs) < 0 ||
+            ioctl(nbd_fd, NBD_SET_SIZE_BLOCKS, (unsigned long)(st.size / nbd_bs)) < 0 ||
+            ioctl(nbd_fd, NBD_SET_FLAGS, NBD_FLAG_HAS_FLAGS |
+                                         NBD_FLAG_SEND_FLUSH |
+                                         NBD_FLAG_SEND_TRIM) < 0 ||
+            ioctl(nbd_fd, NBD_SET_SOCK, sp[1]) < 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot configure %s: %s\n"
+                    "       It may already be in use.\n" RESET,
+                    nbd_device, strerror(errno));
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        if (sp[0] >= 0) {
+            close(sp[0]);
+            close(sp[1]);
+        }
+        if (nbd_fd >= 0)
+            close(nbd_fd);
+        if (st.dev_fd >= 0)
+            close(st.dev_fd);
+        instant_state_free(&st);
+        return false;
+    }
+
+    st.sock = sp[0];
+    st.serving = true;
+
+    /* ---------------------------------------------------------
+     * 3. Threads: kernel NBD loop, request server, background copy.
+     *    Signals are handled here, synchronously.
+     * --------------------------------------------------------- */
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    NbdKernel kernel = { nbd_fd, sp[1] };
+    pthread_t t_nbd, t_server, t_copy;
+
+    int started = 0;
+    int err = pthread_create(&t_nbd, NULL, nbd_do_it_main, &kernel);
+    if (err == 0) {
+        started++;
+        err = pthread_create(&t_server, NULL, server_main, &st);
+    }
+    if (err == 0) {
+        started++;
+        err = pthread_create(&t_copy, NULL, copy_main, &st);
+    }
+
+    if (err != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot start the instant restore threads: %s\n" RESET,
+                strerror(err));
+
+        if (started == 0) {
+            ioctl(nbd_fd, NBD_CLEAR_SOCK);
+            close(sp[1]);
+        } else {
+            /* The kernel loop returns once the device is disconnected;
+             * without a server, closing our end is what gets it there */
+            ioctl(nbd_fd, NBD_DISCONNECT);
+            if (started == 2)
+                pthread_join(t_server, NULL);
+            else
+                shutdown(st.sock, SHUT_RDWR);
+            pthread_join(t_nbd, NULL);
+        }
+
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        close(st.sock);
+        close(nbd_fd);
+        close(st.dev_fd);
+        instant_state_free(&st);
+        return false;
+    }
+
+    fprintf(stderr,
+            GREEN "\n%s is online: it shows %s as if the restore had finished.\n" RESET
+            WHITE "Mount or boot from %s now; blocks are fetched from the image as they are read.\n"
+            "When you are done, unmount it and press Ctrl-C to disconnect.\n" RESET
+            YELLOW "Blocks are not verified against the image checksums in this mode.\n\n" RESET,
+            nbd_device, device, nbd_device);
+
+    bool disconnect_sent = false;
+    bool abandon_sent = false;
+    bool finishing_noted = false;
+
+    for (;;) {
+        struct timespec tick = { 1, 0 };
+        int sig = sigtimedwait(&mask, NULL, &tick);
+
+        if (sig > 0) {
+            if (!disconnect_sent) {
+                fprintf(stderr, YELLOW "\nDisconnecting %s...\n" RESET, nbd_device);
+                ioctl(nbd_fd, NBD_DISCONNECT);
+                disconnect_sent = true;
+            } else if (!abandon_sent) {
+                fprintf(stderr, RED "\nAbandoning the background copy; %s is incomplete.\n" RESET, device);
+                __atomic_store_n(&st.stop_copy, true, __ATOMIC_RELAXED);
+                abandon_sent = true;
+            }
+        }
+
+        bool serving = __atomic_load_n(&st.serving, __ATOMIC_ACQUIRE);
+        bool copy_done = __atomic_load_n(&st.copy_done, __ATOMIC_ACQUIRE);
+
+        if (!serving && !disconnect_sent) {
+            /* Disconnected from outside (e.g. nbd-client -d) */
+            ioctl(nbd_fd, NBD_DISCONNECT);
+            disconnect_sent = true;
+        }
+
+        if (!serving && !copy_done && !finishing_noted) {
+            fprintf(stderr,
+                    YELLOW "\n%s disconnected. Finishing the background copy before exiting "
+                    "(Ctrl-C again to abandon it).\n" RESET,
+                    nbd_device);
+            finishing_noted = true;
+        }
+
+        if (!serving && copy_done)
+            break;
+    }
+
+    pthread_join(t_server, NULL);
+    pthread_join(t_copy, NULL);
+    pthread_join(t_nbd, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    bool complete = (st.remaining == 0) && !st.failed;
+
+    if (fdatasync(st.dev_fd) != 0)
+        complete = false;
+
+    fprintf(stderr, WHITE "\nImage bytes read: %.2f MB\n" RESET,
+            (double)frame_reader_bytes_read(st.reader) / (1024.0 * 1024.0));
+
+    close(st.sock);
+    close(nbd_fd);
+    close(st.dev_fd);
+    instant_state_free(&st);
+
+    return complete;
+}
@@ -0,0 +1,39 @@
+#ifndef INSTANT_H
+#define INSTANT_H
+
+#include <stdbool.h>
+
+/*
+ * Instant restore.
+ *
+ * Exposes the restore target through a local NBD device right away.
+ * Reads of blocks that are already on the target are passed through;
+ * reads of blocks that are not are fetched from the image on demand
+ * (decoding only the frames that hold them), written to the target
+ * and then served.  Meanwhile a background thread copies everything
+ * else, so the target ends up fully restored.
+ *
+ * Writes through the NBD device go to the target as well, so the
+ * system can be booted or mounted read-write from /dev/nbdX while the
+ * copy is still running.
+ *
+ * Requires a framed image (zstd or lz4 with an <image>.idx index) and
+ * the nbd kernel module.
+ *
+ * Blocks are read out of single frames, so the partclone checksum groups
+ * (and the image SHA-256) are never checked: the data served and copied
+ * is unverified.  A normal restore verifies every group.
+ */
+
+/*
+ * image_base = image filename, or chunk base for chunked images
+ * device     = restore target (partition or file)
+ * nbd_device = e.g. /dev/nbd0
+ *
+ * Returns true once every used block is on the target.
+ */
+bool instant_restore_run(const char *image_base,
+                         const char *device,
+                         const char *nbd_device);
+
+#endif /* INSTANT_H */
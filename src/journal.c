@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+
+void journal_path_for(const char *image_base, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s.journal", image_base);
+}
+
+/* ---------------------------------------------------------
+ * Parse a key=value journal (same layout as the config file)
+ * --------------------------------------------------------- */
+bool journal_load(const char *path, RestoreJournal *out)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    memset(out, 0, sizeof(*out));
+
+    char line[512];
+    bool have_progress = false;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        char *eq = strchr(line, '=');
+        if (!eq)
+            continue;
+
+        *eq = '\0';
+        const char *key = line;
+        char *value = eq + 1;
+        value[strcspn(value, "\r\n")] = '\0';
+
+        if (strcmp(key, "device") == 0) {
+            snprintf(out->device, sizeof(out->device), "%s", value);
+        } else if (strcmp(key, "total_blocks") == 0) {
+            out->total_blocks = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "used_blocks") == 0) {
+            out->used_blocks = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "block_size") == 0) {
+            out->block_size = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(key, "bitmap_crc") == 0) {
+            out->bitmap_crc = (uint32_t)strtoul(value, NULL, 16);
+        } else if (strcmp(key, "used_blocks_done") == 0) {
+            out->used_blocks_done = strtoull(value, NULL, 10);
+            have_progress = true;
+        } else if (strcmp(key, "next_block") == 0) {
+            out->next_block = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "target_offset") == 0) {
+            out->target_offset = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "stream_offset") == 0) {
+            out->stream_offset = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "image_offset") == 0) {
+            out->image_offset = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "extents_done") == 0) {
+            out->extents_done = strtoull(value, NULL, 10);
+        } else if (strcmp(key, "timestamp") == 0) {
+            out->timestamp = atol(value);
+        }
+    }
+
+    fclose(fp);
+
+    return have_progress && out->device[0] != '\0' && out->block_size > 0;
+}
+
+bool journal_save(const char *path, const RestoreJournal *j)
+{
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+
+    fprintf(fp, "# Imprint restore journal -- do not edit.\n");
+    fprintf(fp, "# Resume with: imprintr --resume <image> %s\n", j->device);
+    fprintf(fp, "device=%s\n", j->device);
+    fprintf(fp, "total_blocks=%" PRIu64 "\n", j->total_blocks);
+    fprintf(fp, "used_blocks=%" PRIu64 "\n", j->used_blocks);
+    fprintf(fp, "block_size=%" PRIu32 "\n", j->block_size);
+    fprintf(fp, "bitmap_crc=%08" PRIx32 "\n", j->bitmap_crc);
+    fprintf(fp, "used_blocks_done=%" PRIu64 "\n", j->used_blocks_done);
+    fprintf(fp, "next_block=%" PRIu64 "\n", j->next_block);
+    fprintf(fp, "target_offset=%" PRIu64 "\n", j->target_offset);
+    fprintf(fp, "stream_offset=%" PRIu64 "\n", j->stream_offset);
+    fprintf(fp, "image_offset=%" PRIu64 "\n", j->image_offset);
+    fprintf(fp, "extents_done=%" PRIu64 "\n", j->extents_done);
+    fprintf(fp, "timestamp=%ld\n", (long)time(NULL));
+
+    bool ok = (fflush(fp) == 0) && (fsync(fd) == 0);
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return false;
+    }
+
+    /* Make the rename itself durable */
+    char dir[1100];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+        if (dir[0] == '\0')
+            strcpy(dir, "/");
+    } else {
+        strcpy(dir, ".");
+    }
+
+    int dfd = open(dir, O_RDONLY);
+    if (dfd >= 0) {
+        fsync(dfd);
+        close(dfd);
+    }
+
+    return true;
+}
+
+void journal_remove(const char *path)
+{
+    unlink(path);
+}
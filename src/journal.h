@@ -0,0 +1,52 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Restore journal.
+ *
+ * While imprintr writes an image natively it periodically flushes the
+ * target device and records the confirmed progress in a small text
+ * file next to the image (<image>.journal).  After a power loss or a
+ * disconnected USB drive, `imprintr --resume` reads the journal and
+ * restarts writing at the nearest checksum-group boundary before the
+ * recorded point instead of from the first block.
+ *
+ * The journal is replaced atomically (write temp + fsync + rename),
+ * so it always describes data that really reached the target.
+ */
+
+typedef struct {
+    char device[256];            /* restore target */
+
+    /* Identity of the image being restored */
+    uint64_t total_blocks;
+    uint64_t used_blocks;
+    uint32_t block_size;
+    uint32_t bitmap_crc;
+
+    /* Confirmed progress */
+    uint64_t used_blocks_done;   /* used blocks written and flushed */
+    uint64_t next_block;         /* first block not yet confirmed */
+    uint64_t target_offset;      /* byte offset of next_block on target */
+    uint64_t stream_offset;      /* decompressed stream offset of next group */
+    uint64_t image_offset;       /* compressed image bytes read so far */
+    uint64_t extents_done;       /* raw images: extents before stream_offset */
+
+    long timestamp;
+} RestoreJournal;
+
+/* Build the journal path for an image: <image_base>.journal */
+void journal_path_for(const char *image_base, char *out, size_t out_len);
+
+bool journal_load(const char *path, RestoreJournal *out);
+
+/* Atomically replace the journal file. */
+bool journal_save(const char *path, const RestoreJournal *j);
+
+void journal_remove(const char *path);
+
+#endif /* JOURNAL_H */
@@ -0,0 +1,195 @@
+#define _GNU_SOURCE
+
+#include "luks.h"
+#include "pcsource.h"
+#include "pcimage.h"
+#include "rawimage.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* "LUKS\xba\xbe", shared by LUKS1 and LUKS2 */
+static const unsigned char luks_magic[6] = { 'L', 'U', 'K', 'S', 0xba, 0xbe };
+
+/* -------------------------------------------------------------
+ * Mapping probe
+ * ------------------------------------------------------------- */
+
+/* /dev node of <maj:min>, from sysfs; /dev/block/<maj:min> otherwise */
+static void device_node(const char *majmin, char *out, size_t out_len)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/block/%s/uevent", majmin);
+
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        char line[256];
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, "DEVNAME=", 8) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                snprintf(out, out_len, "/dev/%s", line + 8);
+                fclose(fp);
+                return;
+            }
+        }
+        fclose(fp);
+    }
+
+    snprintf(out, out_len, "/dev/block/%s", majmin);
+}
+
+bool luks_probe(const char *mapper, LuksMapping *out, char *err, size_t err_len)
+{
+    memset(out, 0, sizeof(*out));
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "dmsetup table '%s' 2>/dev/null", mapper);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp) {
+        snprintf(err, err_len, "cannot run dmsetup");
+        return false;
+    }
+
+    char line[1024] = "";
+    int lines = 0;
+    char tmp[1024];
+    while (fgets(tmp, sizeof(tmp), fp)) {
+        if (lines++ == 0)
+            snprintf(line, sizeof(line), "%s", tmp);
+    }
+    pclose(fp);
+
+    /*
+     * "0 <sectors> crypt <cipher> <key> <iv offset> <maj:min> <offset> [<#opts> <opts>...]"
+     * (dmsetup hides the key unless asked for it)
+     */
+    unsigned long long sectors = 0, offset = 0;
+    char target[32], dev[32];
+
+    if (lines != 1 ||
+        sscanf(line, "%*u %llu %31s %*s %*s %*u %31s %llu", &sectors, target, dev, &offset) != 4 ||
+        strcmp(target, "crypt") != 0) {
+        snprintf(err, err_len, "%s is not a dm-crypt mapping", mapper);
+        return false;
+    }
+
+    if (strstr(line, "integrity:")) {
+        snprintf(err, err_len, "%s uses authenticated encryption (dm-integrity)", mapper);
+        return false;
+    }
+
+    device_node(dev, out->backing_dev, sizeof(out->backing_dev));
+    out->payload_offset = offset * 512;
+    out->payload_size = sectors * 512;
+
+    /* The header must be on the partition, or the image cannot be opened */
+    unsigned char magic[sizeof(luks_magic)];
+    int fd = open(out->backing_dev, O_RDONLY | O_CLOEXEC);
+    bool have = fd >= 0 && pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic) &&
+                memcmp(magic, luks_magic, sizeof(magic)) == 0;
+    if (fd >= 0)
+        close(fd);
+
+    if (!have || out->payload_offset == 0) {
+        snprintf(err, err_len, "no LUKS header on %s (plain dm-crypt or detached header)",
+                 out->backing_dev);
+        return false;
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * imprintb --luks-stream <mapper> <fs>
+ * ------------------------------------------------------------- */
+static bool add_range(RawRange **ranges, size_t *count, size_t *cap,
+                      uint64_t offset, uint64_t length)
+{
+    if (*count > 0) {
+        RawRange *last = &(*ranges)[*count - 1];
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return true;
+        }
+    }
+
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        RawRange *grown = realloc(*ranges, *cap * sizeof(*grown));
+        if (!grown)
+            return false;
+        *ranges = grown;
+    }
+
+    (*ranges)[(*count)++] = (RawRange){ offset, length };
+    return true;
+}
+
+int luks_stream_main(const char *mapper, const char *fs)
+{
+    LuksMapping m;
+    char why[256] = "";
+
+    if (!luks_probe(mapper, &m, why, sizeof(why))) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s\n" RESET, why);
+        return EXIT_FAILURE;
+    }
+
+    PcSource src = { 0 };
+    bool unsupported = true;
+    bool have_bitmap = strcmp(fs, "-") != 0 &&
+                       pc_source_bitmap(fs, mapper, &src, &unsupported, why, sizeof(why));
+
+    if (!have_bitmap && !unsupported) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s: %s\n" RESET, mapper, why);
+        return EXIT_FAILURE;
+    }
+
+    RawRange *ranges = NULL;
+    size_t count = 0, cap = 0;
+
+    /* LUKS header and keyslots: everything before the payload */
+    bool ok = add_range(&ranges, &count, &cap, 0, m.payload_offset);
+
+    if (have_bitmap) {
+        uint64_t bs = src.block_size;
+
+        for (uint64_t b = 0; ok && b < src.total_blocks; b++) {
+            if ((b & 7) == 0 && src.bitmap[b >> 3] == 0 && b + 8 <= src.total_blocks) {
+                b += 7;
+                continue;
+            }
+            if (!pc_test_bit(src.bitmap, b) || (b + 1) * bs > m.payload_size)
+                continue;
+            ok = add_range(&ranges, &count, &cap, m.payload_offset + b * bs, bs);
+        }
+
+        fprintf(stderr,
+                YELLOW "Ciphertext imaging: %s blocks used by the filesystem in %s\n" RESET,
+                src.fs, mapper);
+    } else {
+        if (strcmp(fs, "-") != 0)
+            fprintf(stderr, YELLOW "No used-block map for %s (%s); copying the whole payload.\n" RESET,
+                    mapper, why);
+        ok = ok && add_range(&ranges, &count, &cap, m.payload_offset, m.payload_size);
+    }
+
+    free((void *)src.bitmap);
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " out of memory\n" RESET);
+        free(ranges);
+        return EXIT_FAILURE;
+    }
+
+    ok = raw_stream_ranges(m.backing_dev, ranges, count, 0, STDOUT_FILENO);
+    free(ranges);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
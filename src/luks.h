@@ -0,0 +1,50 @@
+#ifndef LUKS_H
+#define LUKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Ciphertext-passthrough backups of LUKS volumes.
+ *
+ * `imprintb --ciphertext --source /dev/mapper/<name>` images the
+ * encrypted partition underneath an unlocked LUKS mapping instead of
+ * the plaintext: the used-block bitmap comes from the filesystem
+ * inside the mapping (native ext2/3/4 and NTFS readers), and the same
+ * blocks are read, shifted by the payload offset, from the partition
+ * itself together with the LUKS header.  Nothing is decrypted on
+ * backup or encrypted on restore, and the image stays encrypted at
+ * rest.
+ *
+ * The result is an ordinary raw image of the encrypted partition; it
+ * is restored onto a partition at least as large and opened with
+ * cryptsetup as before.  Free blocks come back as zeros, which
+ * decrypt to garbage that the filesystem never reads.
+ */
+
+/* Pipeline backend; metadata records RAW_BACKEND */
+#define LUKS_BACKEND "imprint.luks"
+
+typedef struct {
+    char backing_dev[256];       /* the LUKS partition, e.g. /dev/sda3 */
+    uint64_t payload_offset;     /* bytes: where the mapping starts */
+    uint64_t payload_size;       /* bytes: length of the mapping */
+} LuksMapping;
+
+/*
+ * True if `mapper` is a single dm-crypt mapping over a partition with
+ * a LUKS header.  Detached headers and dm-integrity (authenticated
+ * encryption) are rejected with a reason in err.
+ */
+bool luks_probe(const char *mapper, LuksMapping *out, char *err, size_t err_len);
+
+/*
+ * Entry point for `imprintb --luks-stream <mapper> <fs>`: write the
+ * raw image of the encrypted partition to stdout.  <fs> names the
+ * native reader for the plaintext ("extfs", "ntfs"); with "-" or a
+ * filesystem the reader cannot handle, the whole payload is copied.
+ */
+int luks_stream_main(const char *mapper, const char *fs);
+
+#endif /* LUKS_H */
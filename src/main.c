@@ -1,16 +1,50 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "utils.h"
 #include "backup.h"
 #include "config.h"
+#include "rawimage.h"
+#include "pcsource.h"
+#include "cbt.h"
+#include "luks.h"
+#include "rescue.h"
+#include "pipeimg.h"
 
 /* Forward declaration so we can call it early */
 void print_backup_usage(void);
 
 int main(int argc, char **argv)
 {
+    /* ---------------------------------------------------------
+     * Internal: raw imager used as the backend of a raw backup
+     * pipeline.  Writes the image stream to stdout.
+     * --------------------------------------------------------- */
+    if (argc == 3 && strcmp(argv[1], "--raw-stream") == 0)
+        return raw_stream_device(argv[2], STDOUT_FILENO) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    /* Internal: native used-block reader standing in for partclone */
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "--native-stream") == 0)
+        return pc_source_main(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 0);
+
+    /* Internal: blocks written since an era, for incremental backups */
+    if (argc == 4 && strcmp(argv[1], "--delta-stream") == 0)
+        return cbt_delta_main(argv[2], argv[3]);
+
+    /* Internal: provisioned (or differing) blocks of a thin LV */
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--thin-stream") == 0)
+        return thin_stream_main(argv[2], argc == 4 ? argv[3] : NULL);
+
+    /* Internal: ciphertext of a LUKS partition, blocks used in the mapper */
+    if (argc == 4 && strcmp(argv[1], "--luks-stream") == 0)
+        return luks_stream_main(argv[2], argv[3]);
+
+    /* Internal: failing-disk reader, bad areas last */
+    if (argc == 7 && strcmp(argv[1], "--rescue-stream") == 0)
+        return rescue_stream_main(argv[2], argv[3], argv[4], atoi(argv[5]), atoi(argv[6]));
+
     /* ---------------------------------------------------------
      * EARLY HELP DETECTION
      * Must run BEFORE banner, terminal spawning, or deps.
@@ -22,10 +56,26 @@ int main(int argc, char **argv)
         }
     }
 
+    /* ---------------------------------------------------------
+     * --target -: the image takes stdout, so everything printed
+     * goes to stderr.  Nothing to open a terminal window for.
+     * --------------------------------------------------------- */
+    bool to_stdout = false;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--target") == 0) {
+            to_stdout = strcmp(argv[i + 1], PIPE_TARGET) == 0;
+            break;
+        }
+    }
+
+    if (to_stdout && !pipe_claim_stdout())
+        return EXIT_FAILURE;
+
     /* ---------------------------------------------------------
      * Normal startup path
      * --------------------------------------------------------- */
-    gx_ensure_terminal(argc, argv);
+    if (!to_stdout)
+        gx_ensure_terminal(argc, argv);
 
     ghostx_print_banner("Imprint Disk Imager");
 
@@ -59,6 +109,13 @@ int main(int argc, char **argv)
             gx_config.compression[sizeof(gx_config.compression) - 1] = '\0';
         }
 
+        if (args.native)
+            gx_config.native_readers = 1;
+        if (args.cache_neutral)
+            gx_config.cache_neutral = 1;
+        if (args.verify_writes)
+            gx_config.verify_writes = 1;
+
         /*
          * Determine effective chunk size (MB)
          */
@@ -69,6 +126,26 @@ int main(int argc, char **argv)
             chunk_mb = gx_config.chunk_size_mb;
         }
 
+        /* -----------------------------------------------------
+         * Changed-block tracking setup
+         * ----------------------------------------------------- */
+        if (args.cbt_setup)
+            return cbt_setup(args.cbt_setup, args.cbt_meta) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        /* -----------------------------------------------------
+         * Whole-disk mode
+         * ----------------------------------------------------- */
+        if (args.disk_count > 0) {
+            bool ok = backup_run_disks(args.disks,
+                                       args.disk_count,
+                                       args.target,
+                                       gx_config.compression,
+                                       chunk_mb,
+                                       args.force);
+
+            return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
         /* -----------------------------------------------------
          * Run CLI backup
          * ----------------------------------------------------- */
@@ -76,7 +153,16 @@ int main(int argc, char **argv)
                                  args.target,
                                  gx_config.compression,   /* effective compressor */
                                  chunk_mb,                /* effective chunk size */
-                                 args.force);             /* NEW */
+                                 args.force,              /* NEW */
+                                 args.incremental_from,
+                                 args.ciphertext,
+                                 args.snapshot,
+                                 args.rescue,
+                                 args.reuse_from,
+                                 args.mirrors,
+                                 args.mirror_count,
+                                 args.stripes,
+                                 args.stripe_count);
 
         return ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
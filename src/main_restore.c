@@ -8,6 +8,7 @@
 #include "config.h"
 #include "colors.h"
 #include "ui.h"
+#include "pipeimg.h"
 
 int main(int argc, char **argv)
 {
@@ -27,6 +28,20 @@ int main(int argc, char **argv)
         }
     }
 
+    /* ---------------------------------------------------------
+     * --image -: the image comes on stdin; nothing else may read it
+     * --------------------------------------------------------- */
+    bool from_stdin = false;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0) {
+            from_stdin = strcmp(argv[i + 1], PIPE_TARGET) == 0;
+            break;
+        }
+    }
+
+    if (from_stdin && !pipe_claim_stdin())
+        return EXIT_FAILURE;
+
     /* ---------------------------------------------------------
      * Normal startup path
      * --------------------------------------------------------- */
@@ -62,9 +77,19 @@ int main(int argc, char **argv)
 
         /* Valid CLI mode → run non-interactive restore */
         if (args.cli_mode) {
+            /* Apply CLI prefetch overrides to config for this run */
+            if (args.prefetch_depth_set)
+                gx_config.prefetch_depth = args.prefetch_depth;
+            if (args.prefetch_mem_set)
+                gx_config.prefetch_mem_mb = args.prefetch_mem_mb;
+            if (args.cache_neutral)
+                gx_config.cache_neutral = 1;
+
             bool ok = restore_run_cli(args.image,
                                       args.target,
-                                      args.force);
+                                      args.force,
+                                      args.resume,
+                                      args.instant_nbd);
             return ok ? EXIT_SUCCESS : EXIT_FAILURE;
         }
 
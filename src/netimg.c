@@ -0,0 +1,988 @@
+#define _GNU_SOURCE
+
+#include "netimg.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <nmmintrin.h>
+
+#define NET_MAGIC        0x4e504d49u   /* "IMPN" */
+#define NET_HEADER_SIZE  24
+
+/* Largest message: a block, or a FILE piece with its suffix */
+#define NET_MSG_MAX      (NET_BLOCK_SIZE + 64)
+
+/* -------------------------------------------------------------
+ * Addressing
+ * ------------------------------------------------------------- */
+bool net_name_ok(const char *name)
+{
+    if (!name || name[0] == '\0' || name[0] == '/' || strlen(name) >= 900)
+        return false;
+
+    /* No ".." component anywhere */
+    for (const char *p = name; *p; ) {
+        const char *end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        if (len == 0 || (len == 2 && p[0] == '.' && p[1] == '.'))
+            return false;
+        if (!end)
+            break;
+        p = end + 1;
+    }
+
+    return true;
+}
+
+bool net_suffix_ok(const char *suffix)
+{
+    return strcmp(suffix, ".sha256") == 0 ||
+           strcmp(suffix, ".idx") == 0 ||
+           strcmp(suffix, ".json") == 0;
+}
+
+bool net_parse_url(const char *url, NetTarget *out)
+{
+    size_t plen = strlen(NET_PREFIX);
+
+    if (!url || strncmp(url, NET_PREFIX, plen) != 0)
+        return false;
+
+    const char *host = url + plen;
+    const char *slash = strchr(host, '/');
+    if (!slash || slash == host)
+        return false;
+
+    /* [v6 address] or host, then an optional :port */
+    const char *host_end = slash;
+    const char *port = NULL;
+
+    if (host[0] == '[') {
+        const char *close = memchr(host, ']', (size_t)(slash - host));
+        if (!close)
+            return false;
+        host++;
+        host_end = close;
+        if (close[1] == ':')
+            port = close + 2;
+    } else {
+        const char *colon = memchr(host, ':', (size_t)(slash - host));
+        if (colon) {
+            host_end = colon;
+            port = colon + 1;
+        }
+    }
+
+    size_t hlen = (size_t)(host_end - host);
+    size_t portlen = port ? (size_t)(slash - port) : 0;
+    if (hlen == 0 || hlen >= sizeof(out->host) || portlen >= sizeof(out->port) ||
+        (port && portlen == 0))
+        return false;
+
+    memcpy(out->host, host, hlen);
+    out->host[hlen] = '\0';
+
+    if (port) {
+        memcpy(out->port, port, portlen);
+        out->port[portlen] = '\0';
+    } else {
+        snprintf(out->port, sizeof(out->port), "%s", NET_DEFAULT_PORT);
+    }
+
+    snprintf(out->name, sizeof(out->name), "%s", slash + 1);
+    return net_name_ok(out->name);
+}
+
+/* -------------------------------------------------------------
+ * CRC-32C
+ *
+ * SSE4.2 has an instruction for it and is part of x86-64-v2, which
+ * the build targets (see `make verify-isa`).
+ * ------------------------------------------------------------- */
+uint32_t net_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t c = ~crc;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+
+    crc = (uint32_t)c;
+    for (; len > 0; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+
+    return ~crc;
+}
+
+/* -------------------------------------------------------------
+ * Messages
+ * ------------------------------------------------------------- */
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+void net_tune_socket(int fd)
+{
+    struct timeval tv = { NET_TIMEOUT_SEC, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* Requests are small and answered at once */
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int net_connect(const NetTarget *t)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(t->host, t->port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s: %s\n" RESET, t->host, gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    int err = 0;
+
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        err = errno;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot connect to %s port %s: %s\n" RESET,
+                t->host, t->port, strerror(err));
+        return -1;
+    }
+
+    net_tune_socket(fd);
+    return fd;
+}
+
+bool net_send(int fd, uint32_t type, uint64_t offset,
+              const void *hdr_part, size_t hdr_len,
+              const void *payload, size_t len)
+{
+    unsigned char hdr[NET_HEADER_SIZE];
+    uint32_t crc = net_crc32c(0, hdr_part, hdr_len);
+    crc = net_crc32c(crc, payload, len);
+
+    put_le32(hdr, NET_MAGIC);
+    put_le32(hdr + 4, type);
+    put_le64(hdr + 8, offset);
+    put_le32(hdr + 16, (uint32_t)(hdr_len + len));
+    put_le32(hdr + 20, crc);
+
+    struct iovec iov[3] = {
+        { hdr, sizeof(hdr) },
+        { (void *)hdr_part, hdr_len },
+        { (void *)payload, len }
+    };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 3;
+
+    size_t left = sizeof(hdr) + hdr_len + len;
+
+    while (left > 0) {
+        ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        left -= (size_t)n;
+
+        /* Skip what went out */
+        while (mh.msg_iovlen > 0 && (size_t)n >= mh.msg_iov[0].iov_len) {
+            n -= (ssize_t)mh.msg_iov[0].iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov[0].iov_base = (char *)mh.msg_iov[0].iov_base + n;
+            mh.msg_iov[0].iov_len -= (size_t)n;
+        }
+    }
+
+    return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+bool net_recv(int fd, NetMsg *msg, void *buf, size_t cap)
+{
+    unsigned char hdr[NET_HEADER_SIZE];
+
+    if (!recv_all(fd, hdr, sizeof(hdr)) || get_le32(hdr) != NET_MAGIC)
+        return false;
+
+    msg->type = get_le32(hdr + 4);
+    msg->offset = get_le64(hdr + 8);
+    msg->len = get_le32(hdr + 16);
+
+    if (msg->len > cap || !recv_all(fd, buf, msg->len))
+        return false;
+    if (net_crc32c(0, buf, msg->len) != get_le32(hdr + 20))
+        return false;
+
+    if (msg->len < cap)
+        ((char *)buf)[msg->len] = '\0';
+    return true;
+}
+
+/*
+ * Connect and say HELLO; the OK or ERR payload lands in reply (may be
+ * NULL).  -1 if the server cannot be reached (with a message), -2 if it
+ * refused.
+ */
+static int net_hello(const NetTarget *t, const char *hello, char *reply, size_t reply_len)
+{
+    int fd = net_connect(t);
+    if (fd < 0)
+        return -1;
+
+    char buf[1024];
+    NetMsg m;
+
+    if (!net_send(fd, NET_HELLO, 0, NULL, 0, hello, strlen(hello)) ||
+        !net_recv(fd, &m, buf, sizeof(buf) - 1)) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s:%s does not answer like imprint-serve\n" RESET,
+                t->host, t->port);
+        close(fd);
+        return -1;
+    }
+
+    const char *text = m.type == NET_OK || m.type == NET_ERR ? buf : "unexpected answer";
+    if (reply && reply_len > 0) {
+        size_t n = strnlen(text, reply_len - 1);
+        memcpy(reply, text, n);
+        reply[n] = '\0';
+    }
+
+    if (m.type != NET_OK) {
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+long long net_image_size(const NetTarget *t)
+{
+    char hello[1100], reply[256];
+    snprintf(hello, sizeof(hello), "GET %s", t->name);
+
+    int fd = net_hello(t, hello, reply, sizeof(reply));
+    if (fd < 0)
+        return fd == -2 ? -1 : -2;
+
+    close(fd);
+    return atoll(reply);
+}
+
+/*
+ * Receive GETFILE's answer into fp; false on ERR (*absent set) or a
+ * broken connection.
+ */
+static bool recv_file(int fd, const char *suffix, FILE *fp,
+                      char *err, size_t err_len, bool *absent)
+{
+    unsigned char *buf = malloc(NET_MSG_MAX + 1);
+    bool ok = (buf != NULL);
+    NetMsg m;
+
+    err[0] = '\0';
+
+    while (ok) {
+        if (!net_recv(fd, &m, buf, NET_MSG_MAX)) {
+            snprintf(err, err_len, "connection lost");
+            ok = false;
+            break;
+        }
+
+        if (m.type == NET_OK)
+            break;
+
+        if (m.type != NET_FILE) {
+            snprintf(err, err_len, "%s", m.type == NET_ERR ? (char *)buf : "unexpected answer");
+            *absent = (m.type == NET_ERR);
+            ok = false;
+            break;
+        }
+
+        size_t slen = strnlen((char *)buf, m.len);
+        if (slen == m.len || strcmp((char *)buf, suffix) != 0) {
+            snprintf(err, err_len, "unexpected file");
+            ok = false;
+            break;
+        }
+
+        size_t n = m.len - slen - 1;
+        if (fseeko(fp, (off_t)m.offset, SEEK_SET) != 0 ||
+            fwrite(buf + slen + 1, 1, n, fp) != n) {
+            snprintf(err, err_len, "%s", strerror(errno));
+            ok = false;
+        }
+    }
+
+    free(buf);
+    return ok;
+}
+
+bool net_get_file(const NetTarget *t, const char *suffix, const char *path, bool missing_ok)
+{
+    char hello[1100], reply[256];
+    snprintf(hello, sizeof(hello), "GET %s", t->name);
+
+    int fd = net_hello(t, hello, reply, sizeof(reply));
+    if (fd < 0) {
+        if (fd == -2 && !missing_ok)
+            fprintf(stderr, RED "ERROR:" WHITE " %s:%s: %s\n" RESET, t->host, t->port, reply);
+        return false;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    char err[256] = "";
+    bool absent = false;
+    bool ok = fp && net_send(fd, NET_GETFILE, 0, NULL, 0, suffix, strlen(suffix)) &&
+              recv_file(fd, suffix, fp, err, sizeof(err), &absent);
+
+    if (fp && fclose(fp) != 0)
+        ok = false;
+    close(fd);
+
+    if (!ok) {
+        unlink(path);
+        if (!(missing_ok && absent))
+            fprintf(stderr, RED "ERROR:" WHITE " fetching %s%s from %s: %s\n" RESET,
+                    t->name, suffix, t->host, err[0] ? err : strerror(errno));
+    }
+
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Sending an image
+ * ------------------------------------------------------------- */
+typedef enum {
+    BLOCK_FREE,
+    BLOCK_FILLING,
+    BLOCK_QUEUED,
+    BLOCK_SENDING
+} BlockState;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    uint64_t offset;
+    uint64_t seq;
+    BlockState state;
+} NetBlock;
+
+typedef struct {
+    struct NetWriter *w;
+    int fd;
+    pthread_t thread;
+    bool started;
+} NetStream;
+
+struct NetWriter {
+    NetTarget target;
+    NetStream streams[NET_MAX_STREAMS];
+    int nstreams;
+
+    NetBlock *blocks;
+    int nblocks;
+    NetBlock *filling;
+    uint64_t offset;        /* image bytes handed out so far */
+    uint64_t next_seq;
+    uint64_t send_seq;      /* blocks go out in order, each on any stream */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bool stop;
+    bool failed;
+    bool finished;
+};
+
+static void *send_main(void *arg)
+{
+    NetStream *s = arg;
+    NetWriter *w = s->w;
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        NetBlock *b = NULL;
+        while (!w->stop) {
+            for (int i = 0; i < w->nblocks && !b; i++)
+                if (w->blocks[i].state == BLOCK_QUEUED && w->blocks[i].seq == w->send_seq)
+                    b = &w->blocks[i];
+            if (b)
+                break;
+            pthread_cond_wait(&w->cv, &w->lock);
+        }
+        if (!b)
+            break;
+
+        b->state = BLOCK_SENDING;
+        w->send_seq++;
+        pthread_cond_broadcast(&w->cv);
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = !w->failed &&
+                  net_send(s->fd, NET_DATA, b->offset, NULL, 0, b->data, b->len);
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok && !w->failed) {
+            fprintf(stderr, RED "\nERROR:" WHITE " sending to %s:%s failed: %s\n" RESET,
+                    w->target.host, w->target.port, strerror(errno));
+            w->failed = true;
+        }
+        b->state = BLOCK_FREE;
+        b->len = 0;
+        pthread_cond_broadcast(&w->cv);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static void stop_streams(NetWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->cv);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->nstreams; i++) {
+        if (w->streams[i].started)
+            pthread_join(w->streams[i].thread, NULL);
+        w->streams[i].started = false;
+    }
+}
+
+NetWriter *net_writer_open(const NetTarget *t, int streams, int chunk_mb)
+{
+    if (streams <= 0)
+        streams = NET_DEFAULT_STREAMS;
+    if (streams > NET_MAX_STREAMS)
+        streams = NET_MAX_STREAMS;
+
+    NetWriter *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->target = *t;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cv, NULL);
+
+    /* Two blocks per stream: one on the wire, one being filled */
+    w->nblocks = streams * 2;
+    w->blocks = calloc((size_t)w->nblocks, sizeof(NetBlock));
+    bool ok = (w->blocks != NULL);
+    if (!ok)
+        w->nblocks = 0;
+
+    for (int i = 0; ok && i < w->nblocks; i++)
+        ok = (w->blocks[i].data = malloc(NET_BLOCK_SIZE)) != NULL;
+
+    /* Ties the connections together on the server */
+    uint64_t session = 0;
+    if (ok && getrandom(&session, sizeof(session), 0) != sizeof(session))
+        session = (uint64_t)getpid() << 32 ^ (uint64_t)time(NULL);
+
+    for (int i = 0; ok && i < streams; i++) {
+        char hello[1200], reply[256] = "";
+        snprintf(hello, sizeof(hello), "PUT %016llx %d %d %d %s",
+                 (unsigned long long)session, i, streams, chunk_mb > 0 ? chunk_mb : 0, t->name);
+
+        NetStream *s = &w->streams[i];
+        s->w = w;
+        s->fd = net_hello(t, hello, reply, sizeof(reply));
+        if (s->fd < 0) {
+            if (s->fd == -2)
+                fprintf(stderr, RED "ERROR:" WHITE " %s:%s: %s\n" RESET, t->host, t->port, reply);
+            ok = false;
+            break;
+        }
+        w->nstreams++;
+
+        if (pthread_create(&s->thread, NULL, send_main, s) != 0)
+            ok = false;
+        else
+            s->started = true;
+    }
+
+    if (!ok) {
+        net_writer_close(w, false);
+        return NULL;
+    }
+
+    return w;
+}
+
+static void queue_filling(NetWriter *w)
+{
+    w->filling->state = BLOCK_QUEUED;
+    w->filling = NULL;
+    pthread_cond_broadcast(&w->cv);
+}
+
+bool net_writer_write(NetWriter *w, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (len > 0 && !w->failed) {
+        if (!w->filling) {
+            for (int i = 0; i < w->nblocks && !w->filling; i++)
+                if (w->blocks[i].state == BLOCK_FREE)
+                    w->filling = &w->blocks[i];
+            if (!w->filling) {
+                pthread_cond_wait(&w->cv, &w->lock);
+                continue;
+            }
+            w->filling->state = BLOCK_FILLING;
+            w->filling->len = 0;
+            w->filling->offset = w->offset;
+            w->filling->seq = w->next_seq++;
+        }
+
+        NetBlock *b = w->filling;
+        size_t take = NET_BLOCK_SIZE - b->len;
+        if (take > len)
+            take = len;
+
+        /* The block is ours while it is filling */
+        pthread_mutex_unlock(&w->lock);
+        memcpy(b->data + b->len, p, take);
+        pthread_mutex_lock(&w->lock);
+
+        b->len += take;
+        w->offset += take;
+        p += take;
+        len -= take;
+
+        if (b->len == NET_BLOCK_SIZE)
+            queue_filling(w);
+    }
+
+    bool ok = !w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+bool net_writer_finish(NetWriter *w, bool success, uint64_t *bytes)
+{
+    pthread_mutex_lock(&w->lock);
+
+    if (success && !w->failed && w->filling)
+        queue_filling(w);
+
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < w->nblocks; i++)
+            if (w->blocks[i].state == BLOCK_QUEUED || w->blocks[i].state == BLOCK_SENDING)
+                busy = true;
+        if (!busy || w->failed)
+            break;
+        pthread_cond_wait(&w->cv, &w->lock);
+    }
+
+    success = success && !w->failed;
+    pthread_mutex_unlock(&w->lock);
+
+    stop_streams(w);
+
+    /* Each connection is drained once the receiver answers its DONE */
+    char buf[256];
+    NetMsg m;
+
+    for (int i = 0; success && i < w->nstreams; i++) {
+        if (!net_send(w->streams[i].fd, NET_DONE, 0, NULL, 0, NULL, 0) ||
+            !net_recv(w->streams[i].fd, &m, buf, sizeof(buf) - 1) || m.type != NET_OK) {
+            fprintf(stderr, RED "\nERROR:" WHITE " %s:%s did not confirm the image data\n" RESET,
+                    w->target.host, w->target.port);
+            success = false;
+        }
+    }
+
+    if (bytes)
+        *bytes = w->offset;
+
+    w->finished = success;
+    return success;
+}
+
+bool net_writer_put_file(NetWriter *w, const char *suffix, const char *path)
+{
+    if (!w->finished)
+        return false;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read %s: %s\n" RESET, path, strerror(errno));
+        return false;
+    }
+
+    unsigned char *buf = malloc(NET_BLOCK_SIZE);
+    bool ok = (buf != NULL);
+    uint64_t offset = 0;
+
+    while (ok) {
+        size_t n = fread(buf, 1, NET_BLOCK_SIZE, fp);
+        if (n == 0 && offset > 0)
+            break;
+
+        /* Suffix and its NUL, then the bytes (an empty file is one empty piece) */
+        ok = net_send(w->streams[0].fd, NET_FILE, offset, suffix, strlen(suffix) + 1, buf, n);
+        offset += n;
+        if (n < NET_BLOCK_SIZE)
+            break;
+    }
+
+    if (ferror(fp))
+        ok = false;
+    fclose(fp);
+    free(buf);
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " sending %s to %s failed\n" RESET, path, w->target.host);
+        w->finished = false;
+    }
+    return ok;
+}
+
+bool net_writer_close(NetWriter *w, bool success)
+{
+    if (!w)
+        return false;
+
+    stop_streams(w);
+
+    success = success && w->finished;
+
+    if (success) {
+        char buf[512];
+        NetMsg m;
+
+        success = net_send(w->streams[0].fd, NET_END, w->offset, NULL, 0, NULL, 0) &&
+                  net_recv(w->streams[0].fd, &m, buf, sizeof(buf) - 1);
+
+        if (!success)
+            fprintf(stderr, RED "ERROR:" WHITE " lost %s:%s while it completed the image\n" RESET,
+                    w->target.host, w->target.port);
+        else if (m.type != NET_OK) {
+            fprintf(stderr, RED "ERROR:" WHITE " %s:%s could not complete the image: %s\n" RESET,
+                    w->target.host, w->target.port, m.type == NET_ERR ? buf : "unexpected answer");
+            success = false;
+        }
+    }
+
+    /* Without END the receiver throws the image away */
+    for (int i = 0; i < w->nstreams; i++)
+        close(w->streams[i].fd);
+
+    if (w->blocks) {
+        for (int i = 0; i < w->nblocks; i++)
+            free(w->blocks[i].data);
+        free(w->blocks);
+    }
+    pthread_cond_destroy(&w->cv);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+
+    return success;
+}
+
+/* -------------------------------------------------------------
+ * Reading an image
+ * ------------------------------------------------------------- */
+typedef enum {
+    RANGE_FREE,
+    RANGE_FETCHING,
+    RANGE_READY,
+    RANGE_FAILED
+} RangeState;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t pos;
+    uint64_t seq;
+    RangeState state;
+} NetRange;
+
+typedef struct {
+    struct NetReader *r;
+    int fd;
+    pthread_t thread;
+    bool started;
+} NetFetcher;
+
+struct NetReader {
+    NetTarget target;
+    uint64_t size;
+    uint64_t nranges;
+
+    NetRange *slots;
+    int nslots;
+
+    NetFetcher fetchers[NET_MAX_STREAMS];
+    int nfetchers;
+
+    uint64_t next_fetch;
+    uint64_t consume;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bool stop;
+};
+
+static void *fetch_main(void *arg)
+{
+    NetFetcher *f = arg;
+    NetReader *r = f->r;
+
+    pthread_mutex_lock(&r->lock);
+
+    for (;;) {
+        /* Block seq goes into slot seq % nslots once it is free */
+        while (!r->stop && r->next_fetch < r->nranges &&
+               r->slots[r->next_fetch % (uint64_t)r->nslots].state != RANGE_FREE)
+            pthread_cond_wait(&r->cv, &r->lock);
+
+        if (r->stop || r->next_fetch >= r->nranges)
+            break;
+
+        uint64_t seq = r->next_fetch++;
+        NetRange *s = &r->slots[seq % (uint64_t)r->nslots];
+        s->seq = seq;
+        s->pos = 0;
+        s->state = RANGE_FETCHING;
+        pthread_mutex_unlock(&r->lock);
+
+        uint64_t offset = seq * NET_BLOCK_SIZE;
+        uint32_t want = (uint32_t)(r->size - offset < NET_BLOCK_SIZE ? r->size - offset
+                                                                     : NET_BLOCK_SIZE);
+        unsigned char req[4];
+        put_le32(req, want);
+
+        NetMsg m;
+        bool ok = net_send(f->fd, NET_READ, offset, NULL, 0, req, sizeof(req)) &&
+                  net_recv(f->fd, &m, s->data, NET_MSG_MAX) &&
+                  m.type == NET_DATA && m.offset == offset && m.len == want;
+
+        pthread_mutex_lock(&r->lock);
+        if (!ok)
+            fprintf(stderr, RED "\nERROR:" WHITE " reading %s from %s:%s failed at %llu\n" RESET,
+                    r->target.name, r->target.host, r->target.port, (unsigned long long)offset);
+        s->len = want;
+        s->state = ok ? RANGE_READY : RANGE_FAILED;
+        pthread_cond_broadcast(&r->cv);
+
+        /* A broken connection stays broken */
+        if (!ok)
+            break;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+NetReader *net_reader_open(const NetTarget *t, int streams, int mem_mb)
+{
+    if (streams <= 0)
+        streams = NET_DEFAULT_STREAMS;
+    if (streams > NET_MAX_STREAMS)
+        streams = NET_MAX_STREAMS;
+
+    NetReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->target = *t;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cv, NULL);
+
+    char hello[1100], reply[256] = "";
+    snprintf(hello, sizeof(hello), "GET %s", t->name);
+
+    bool ok = true;
+
+    for (int i = 0; ok && i < streams; i++) {
+        NetFetcher *f = &r->fetchers[i];
+        f->r = r;
+        f->fd = net_hello(t, hello, reply, sizeof(reply));
+        if (f->fd < 0) {
+            if (f->fd == -2)
+                fprintf(stderr, RED "ERROR:" WHITE " %s:%s: %s\n" RESET, t->host, t->port, reply);
+            ok = false;
+            break;
+        }
+        r->nfetchers++;
+        r->size = (uint64_t)atoll(reply);
+    }
+
+    r->nranges = (r->size + NET_BLOCK_SIZE - 1) / NET_BLOCK_SIZE;
+
+    /* Every fetcher busy plus one block being consumed, within mem_mb */
+    r->nslots = (int)(((uint64_t)(mem_mb > 0 ? mem_mb : 256) * 1024 * 1024) / NET_BLOCK_SIZE);
+    if (r->nslots < streams + 1)
+        r->nslots = streams + 1;
+
+    r->slots = ok ? calloc((size_t)r->nslots, sizeof(NetRange)) : NULL;
+    if (!r->slots)
+        r->nslots = 0;
+    ok = ok && r->slots;
+
+    for (int i = 0; ok && i < r->nslots; i++)
+        ok = (r->slots[i].data = malloc(NET_MSG_MAX + 1)) != NULL;
+
+    for (int i = 0; ok && i < r->nfetchers; i++) {
+        if (pthread_create(&r->fetchers[i].thread, NULL, fetch_main, &r->fetchers[i]) != 0)
+            ok = false;
+        else
+            r->fetchers[i].started = true;
+    }
+
+    if (!ok) {
+        net_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+ssize_t net_reader_read(NetReader *r, void *buf, size_t len)
+{
+    pthread_mutex_lock(&r->lock);
+
+    if (r->consume >= r->nranges) {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+
+    NetRange *s = &r->slots[r->consume % (uint64_t)r->nslots];
+    while (!(s->seq == r->consume && (s->state == RANGE_READY || s->state == RANGE_FAILED)))
+        pthread_cond_wait(&r->cv, &r->lock);
+
+    if (s->state == RANGE_FAILED) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    size_t avail = s->len - s->pos;
+    if (len > avail)
+        len = avail;
+    memcpy(buf, s->data + s->pos, len);
+    s->pos += len;
+
+    if (s->pos == s->len) {
+        pthread_mutex_lock(&r->lock);
+        s->state = RANGE_FREE;
+        r->consume++;
+        pthread_cond_broadcast(&r->cv);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    return (ssize_t)len;
+}
+
+void net_reader_close(NetReader *r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cv);
+    pthread_mutex_unlock(&r->lock);
+
+    /* Shutting the sockets down wakes fetchers blocked on the network */
+    for (int i = 0; i < r->nfetchers; i++)
+        shutdown(r->fetchers[i].fd, SHUT_RDWR);
+    for (int i = 0; i < r->nfetchers; i++) {
+        if (r->fetchers[i].started)
+            pthread_join(r->fetchers[i].thread, NULL);
+        close(r->fetchers[i].fd);
+    }
+
+    if (r->slots) {
+        for (int i = 0; i < r->nslots; i++)
+            free(r->slots[i].data);
+        free(r->slots);
+    }
+    pthread_cond_destroy(&r->cv);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
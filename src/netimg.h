@@ -0,0 +1,152 @@
+#ifndef NETIMG_H
+#define NETIMG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Images over TCP, to and from an imprint-serve receiver.
+ *
+ * `imprintb --target tcp://<host>[:<port>]/<name>` cuts the compressed
+ * stream into blocks of up to NET_BLOCK_SIZE and sends them over
+ * net_streams connections at once, each block with its offset and a
+ * CRC-32C.  The receiver writes every block where it belongs in
+ * <dir>/<name>.img.<ext> (or its chunk files, for --chunk), so the
+ * connections never wait for one another.  The checksum, index and
+ * metadata follow on the first connection, then an END that the
+ * receiver only acknowledges once everything is on disk.  A backup
+ * that does not get that far leaves nothing behind on the server.
+ *
+ * `imprintr --image tcp://<host>[:<port>]/<name>.img.<ext>` fetches the
+ * metadata and reads the image in blocks over net_streams connections
+ * ahead of the restore, checking every block's CRC.
+ *
+ * There is no authentication or encryption: use it on a trusted
+ * network, or through an SSH tunnel.
+ *
+ * Every message is a 24-byte header and a payload:
+ *
+ *   magic "IMPN", type, offset (u64), payload length, CRC-32C of the
+ *   payload (all little-endian)
+ *
+ *   HELLO    "PUT <session> <stream> <streams> <chunk_mb> <name>" or
+ *            "GET <name>"; answered by OK (GET: "<image size>") or ERR
+ *   DATA     image bytes at offset
+ *   DONE     no more DATA on this connection; answered by OK
+ *   FILE     "<suffix>\0<bytes>" at offset of <name><suffix>
+ *   END      PUT complete, offset = image size; answered by OK or ERR
+ *   READ     offset = where, payload = u32 length; answered by DATA
+ *   GETFILE  "<suffix>"; answered by FILE pieces and OK, or ERR
+ */
+
+#define NET_PREFIX            "tcp://"
+#define NET_DEFAULT_PORT      "7493"
+#define NET_DEFAULT_STREAMS   4
+#define NET_MAX_STREAMS       16
+#define NET_BLOCK_SIZE        (4u * 1024 * 1024)
+#define NET_TIMEOUT_SEC       120
+
+enum {
+    NET_HELLO = 1,
+    NET_OK,
+    NET_ERR,
+    NET_DATA,
+    NET_DONE,
+    NET_FILE,
+    NET_END,
+    NET_READ,
+    NET_GETFILE
+};
+
+typedef struct {
+    char host[256];
+    char port[16];
+    char name[1024];
+} NetTarget;
+
+typedef struct {
+    uint32_t type;
+    uint64_t offset;
+    uint32_t len;
+} NetMsg;
+
+/*
+ * Parse "tcp://<host>[:<port>]/<name>" ([v6 address] in brackets).
+ * False if url is not a tcp:// URL or the name is not acceptable.
+ */
+bool net_parse_url(const char *url, NetTarget *out);
+
+/* A relative name without "..", safe to use below the server directory */
+bool net_name_ok(const char *name);
+
+/* Sidecar suffixes FILE may carry */
+bool net_suffix_ok(const char *suffix);
+
+/* CRC-32C; pass the previous result as crc to continue one */
+uint32_t net_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Timeouts and buffers for a connected socket */
+void net_tune_socket(int fd);
+
+/* Connect, printing why not.  -1 on failure. */
+int net_connect(const NetTarget *t);
+
+/*
+ * Send one message.  payload may be split in two (hdr_part first, e.g.
+ * a FILE suffix), both covered by the CRC.
+ */
+bool net_send(int fd, uint32_t type, uint64_t offset,
+              const void *hdr_part, size_t hdr_len,
+              const void *payload, size_t len);
+
+/*
+ * Receive one message into buf (cap bytes); false on a broken
+ * connection, a bad header, a payload larger than cap or a CRC
+ * mismatch.  The payload is NUL-terminated if it fits.
+ */
+bool net_recv(int fd, NetMsg *msg, void *buf, size_t cap);
+
+/*
+ * Image size on the server, -1 if it has no such image, -2 if the
+ * server cannot be reached (with a message).
+ */
+long long net_image_size(const NetTarget *t);
+
+/* Fetch <name><suffix> into path; missing_ok: quietly false if absent. */
+bool net_get_file(const NetTarget *t, const char *suffix, const char *path, bool missing_ok);
+
+typedef struct NetWriter NetWriter;
+
+/* Start sending <name> over `streams` connections (0 = default). */
+NetWriter *net_writer_open(const NetTarget *t, int streams, int chunk_mb);
+
+bool net_writer_write(NetWriter *w, const void *buf, size_t len);
+
+/*
+ * End of the image data: flush and wait until the receiver has every
+ * block.  bytes (may be NULL) receives the image size.
+ */
+bool net_writer_finish(NetWriter *w, bool success, uint64_t *bytes);
+
+/* Send the local file path as <name><suffix> (after finish). */
+bool net_writer_put_file(NetWriter *w, const char *suffix, const char *path);
+
+/*
+ * With success, ask the receiver to complete the image and wait for
+ * it; otherwise just hang up, and the receiver discards it.
+ */
+bool net_writer_close(NetWriter *w, bool success);
+
+typedef struct NetReader NetReader;
+
+/* Read <name> over `streams` connections ahead, within mem_mb. */
+NetReader *net_reader_open(const NetTarget *t, int streams, int mem_mb);
+
+/* Same contract as image_reader_read() (see prefetch.h). */
+ssize_t net_reader_read(NetReader *r, void *buf, size_t len);
+
+void net_reader_close(NetReader *r);
+
+#endif /* NETIMG_H */
@@ -0,0 +1,643 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ntfs.h"
+#include "pcimage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define NTFS_OEM_ID              "NTFS    "
+
+#define NTFS_MFT_RECORD_MFT      0
+#define NTFS_MFT_RECORD_LOGFILE  2
+#define NTFS_MFT_RECORD_VOLUME   3
+#define NTFS_MFT_RECORD_ROOT     5
+#define NTFS_MFT_RECORD_BITMAP   6
+
+#define NTFS_AT_VOLUME_INFO      0x70
+#define NTFS_AT_DATA             0x80
+#define NTFS_AT_INDEX_ROOT       0x90
+#define NTFS_AT_INDEX_ALLOC      0xA0
+#define NTFS_AT_END              0xFFFFFFFFu
+
+#define NTFS_VOLUME_IS_DIRTY     0x0001
+#define NTFS_RESTART_CLEAN       0x0002
+#define NTFS_LOGFILE_NO_CLIENT   0xFFFF
+
+#define NTFS_INDEX_ENTRY_LAST    0x0002
+
+/* Directory index blocks scanned for hiberfil.sys before giving up */
+#define NTFS_MAX_INDEX_BLOCKS    4096
+
+typedef struct {
+    uint64_t vcn;
+    int64_t  lcn;                /* -1 = sparse */
+    uint64_t len;
+} NtfsRun;
+
+typedef struct {
+    NtfsRun *runs;
+    size_t count;
+    uint64_t size;               /* data size in bytes */
+} NtfsStream;
+
+typedef struct {
+    int fd;
+    uint32_t sector_size;
+    uint32_t cluster_size;
+    uint32_t record_size;
+    NtfsStream mft;
+    char *err;
+    size_t err_len;
+} NtfsVolume;
+
+static uint16_t get_le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static bool read_exact(int fd, void *buf, size_t len, uint64_t off)
+{
+    unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (n == 0)
+            return false;
+        p += n;
+        off += (uint64_t)n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Multi-sector protection: verify and undo the update sequence
+ * ------------------------------------------------------------- */
+static bool apply_fixups(unsigned char *rec, size_t len, uint32_t sector_size)
+{
+    uint16_t usa_ofs = get_le16(rec + 4);
+    uint16_t usa_count = get_le16(rec + 6);
+
+    if (usa_count == 0 || usa_ofs + (size_t)usa_count * 2 > len ||
+        (size_t)(usa_count - 1) * sector_size > len)
+        return false;
+
+    const unsigned char *usa = rec + usa_ofs;
+
+    for (uint16_t i = 1; i < usa_count; i++) {
+        unsigned char *tail = rec + (size_t)i * sector_size - 2;
+        if (memcmp(tail, usa, 2) != 0)
+            return false;
+        memcpy(tail, usa + (size_t)i * 2, 2);
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Runlists
+ * ------------------------------------------------------------- */
+static bool decode_runlist(const unsigned char *p, const unsigned char *end,
+                           NtfsStream *s)
+{
+    uint64_t vcn = 0;
+    int64_t lcn = 0;
+    size_t cap = 0;
+
+    s->runs = NULL;
+    s->count = 0;
+
+    while (p < end && *p != 0) {
+        unsigned len_bytes = *p & 0x0F;
+        unsigned off_bytes = *p >> 4;
+        p++;
+
+        if (len_bytes == 0 || len_bytes > 8 || off_bytes > 8 ||
+            p + len_bytes + off_bytes > end)
+            return false;
+
+        uint64_t len = 0;
+        for (unsigned i = 0; i < len_bytes; i++)
+            len |= (uint64_t)p[i] << (8 * i);
+        p += len_bytes;
+
+        int64_t lcn_now = -1;
+        if (off_bytes > 0) {
+            int64_t delta = 0;
+            for (unsigned i = 0; i < off_bytes; i++)
+                delta |= (int64_t)((uint64_t)p[i] << (8 * i));
+            if (p[off_bytes - 1] & 0x80 && off_bytes < 8)
+                delta |= (int64_t)(~0ULL << (8 * off_bytes));
+            p += off_bytes;
+
+            lcn += delta;
+            if (lcn < 0)
+                return false;
+            lcn_now = lcn;
+        }
+
+        if (s->count == cap) {
+            cap = cap ? cap * 2 : 16;
+            NtfsRun *grown = realloc(s->runs, cap * sizeof(*grown));
+            if (!grown)
+                return false;
+            s->runs = grown;
+        }
+
+        s->runs[s->count++] = (NtfsRun){ vcn, lcn_now, len };
+        vcn += len;
+    }
+
+    return true;
+}
+
+/* Read len bytes at byte offset off of a non-resident stream */
+static bool stream_read(NtfsVolume *v, const NtfsStream *s,
+                        void *buf, size_t len, uint64_t off)
+{
+    unsigned char *p = buf;
+    uint64_t cs = v->cluster_size;
+
+    while (len > 0) {
+        uint64_t vcn = off / cs;
+        const NtfsRun *r = NULL;
+
+        for (size_t i = 0; i < s->count; i++) {
+            if (vcn >= s->runs[i].vcn && vcn < s->runs[i].vcn + s->runs[i].len) {
+                r = &s->runs[i];
+                break;
+            }
+        }
+        if (!r)
+            return false;
+
+        uint64_t run_end = (r->vcn + r->len) * cs;
+        size_t n = len;
+        if (run_end - off < n)
+            n = (size_t)(run_end - off);
+
+        if (r->lcn < 0) {
+            memset(p, 0, n);
+        } else {
+            uint64_t dev_off = (uint64_t)r->lcn * cs + (off - r->vcn * cs);
+            if (!read_exact(v->fd, p, n, dev_off))
+                return false;
+        }
+
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * MFT records and attributes
+ * ------------------------------------------------------------- */
+static bool read_record(NtfsVolume *v, uint64_t number, unsigned char *rec)
+{
+    if (!stream_read(v, &v->mft, rec, v->record_size, number * v->record_size)) {
+        snprintf(v->err, v->err_len, "cannot read MFT record %llu",
+                 (unsigned long long)number);
+        return false;
+    }
+
+    if (memcmp(rec, "FILE", 4) != 0 || !apply_fixups(rec, v->record_size, v->sector_size)) {
+        snprintf(v->err, v->err_len, "MFT record %llu is damaged",
+                 (unsigned long long)number);
+        return false;
+    }
+    return true;
+}
+
+/* First attribute of `type` with no name (or any name if !unnamed) */
+static const unsigned char *find_attr(const unsigned char *rec, uint32_t rec_size,
+                                      uint32_t type, bool unnamed)
+{
+    uint32_t off = get_le16(rec + 0x14);
+
+    while (off + 16 <= rec_size) {
+        const unsigned char *a = rec + off;
+        uint32_t t = get_le32(a);
+        uint32_t len = get_le32(a + 4);
+
+        if (t == NTFS_AT_END || len < 16 || off + len > rec_size)
+            return NULL;
+        if (t == type && (!unnamed || a[9] == 0))
+            return a;
+        off += len;
+    }
+    return NULL;
+}
+
+static bool attr_stream(const unsigned char *a, NtfsStream *s)
+{
+    if (a[8] == 0)
+        return false;              /* resident */
+
+    uint32_t len = get_le32(a + 4);
+    uint16_t runs = get_le16(a + 0x20);
+    if (runs >= len)
+        return false;
+
+    if (!decode_runlist(a + runs, a + len, s))
+        return false;
+
+    s->size = get_le64(a + 0x30);
+    return true;
+}
+
+static bool resident_value(const unsigned char *a, const unsigned char **val, uint32_t *val_len)
+{
+    if (a[8] != 0)
+        return false;
+
+    uint32_t len = get_le32(a + 4);
+    *val_len = get_le32(a + 0x10);
+    uint16_t off = get_le16(a + 0x14);
+    if (off + (uint64_t)*val_len > len)
+        return false;
+
+    *val = a + off;
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Consistency checks (anything doubtful goes to partclone)
+ * ------------------------------------------------------------- */
+static bool volume_is_dirty(NtfsVolume *v, unsigned char *rec, bool *dirty)
+{
+    if (!read_record(v, NTFS_MFT_RECORD_VOLUME, rec))
+        return false;
+
+    const unsigned char *a = find_attr(rec, v->record_size, NTFS_AT_VOLUME_INFO, false);
+    const unsigned char *val;
+    uint32_t val_len;
+
+    if (!a || !resident_value(a, &val, &val_len) || val_len < 12) {
+        snprintf(v->err, v->err_len, "cannot read the volume information");
+        return false;
+    }
+
+    *dirty = (get_le16(val + 0x0A) & NTFS_VOLUME_IS_DIRTY) != 0;
+    return true;
+}
+
+static bool logfile_is_clean(NtfsVolume *v, unsigned char *rec, bool *clean)
+{
+    if (!read_record(v, NTFS_MFT_RECORD_LOGFILE, rec))
+        return false;
+
+    NtfsStream s = { 0 };
+    const unsigned char *a = find_attr(rec, v->record_size, NTFS_AT_DATA, true);
+    if (!a || !attr_stream(a, &s)) {
+        free(s.runs);
+        snprintf(v->err, v->err_len, "cannot locate $LogFile");
+        return false;
+    }
+
+    unsigned char page[4096];
+    bool ok = s.size >= sizeof(page) && stream_read(v, &s, page, sizeof(page), 0);
+    free(s.runs);
+
+    if (!ok) {
+        snprintf(v->err, v->err_len, "cannot read $LogFile");
+        return false;
+    }
+
+    /* Emptied by ntfsfix / ntfs-3g: nothing to replay */
+    bool all_ff = true;
+    for (size_t i = 0; i < sizeof(page) && all_ff; i++)
+        all_ff = page[i] == 0xFF;
+    if (all_ff) {
+        *clean = true;
+        return true;
+    }
+
+    if (memcmp(page, "RSTR", 4) != 0) {
+        *clean = false;
+        return true;
+    }
+
+    uint32_t page_size = get_le32(page + 0x10);
+    if (page_size != sizeof(page) || !apply_fixups(page, page_size, 512)) {
+        snprintf(v->err, v->err_len, "unrecognized $LogFile restart page");
+        return false;
+    }
+
+    uint16_t ra = get_le16(page + 0x18);
+    if (ra + 16u > page_size) {
+        snprintf(v->err, v->err_len, "unrecognized $LogFile restart area");
+        return false;
+    }
+
+    uint16_t in_use = get_le16(page + ra + 0x0C);
+    uint16_t flags = get_le16(page + ra + 0x0E);
+
+    *clean = in_use == NTFS_LOGFILE_NO_CLIENT || (flags & NTFS_RESTART_CLEAN);
+    return true;
+}
+
+/* Scan index entries for hiberfil.sys; returns its MFT record or 0 */
+static uint64_t scan_entries(const unsigned char *hdr, size_t avail)
+{
+    if (avail < 16)
+        return 0;
+
+    uint32_t off = get_le32(hdr);
+    uint32_t end = get_le32(hdr + 4);
+    if (end > avail)
+        end = (uint32_t)avail;
+
+    static const char name[] = "hiberfil.sys";
+
+    while (off + 16 <= end) {
+        const unsigned char *e = hdr + off;
+        uint16_t len = get_le16(e + 8);
+        uint16_t key_len = get_le16(e + 10);
+        uint16_t flags = get_le16(e + 12);
+
+        if (flags & NTFS_INDEX_ENTRY_LAST || len < 16 || off + len > end)
+            break;
+
+        if (key_len >= 0x42 && 16 + (size_t)key_len <= len) {
+            const unsigned char *fn = e + 16;
+            unsigned nlen = fn[0x40];
+
+            if (nlen == sizeof(name) - 1 && 0x42 + nlen * 2u <= key_len) {
+                bool match = true;
+                for (unsigned i = 0; i < nlen && match; i++) {
+                    uint16_t c = get_le16(fn + 0x42 + i * 2);
+                    match = c < 128 && (char)(c | 0x20) == name[i];
+                }
+                if (match)
+                    return get_le64(e) & 0x0000FFFFFFFFFFFFULL;
+            }
+        }
+        off += len;
+    }
+    return 0;
+}
+
+static bool is_hibernated(NtfsVolume *v, unsigned char *rec, bool *hibernated)
+{
+    *hibernated = false;
+
+    if (!read_record(v, NTFS_MFT_RECORD_ROOT, rec))
+        return false;
+
+    const unsigned char *root = find_attr(rec, v->record_size, NTFS_AT_INDEX_ROOT, false);
+    const unsigned char *val;
+    uint32_t val_len;
+
+    if (!root || !resident_value(root, &val, &val_len) || val_len < 32) {
+        snprintf(v->err, v->err_len, "cannot read the root directory index");
+        return false;
+    }
+
+    uint32_t block_size = get_le32(val + 8);
+    uint64_t ref = scan_entries(val + 16, val_len - 16);
+
+    /* Larger directories keep their entries in INDX blocks */
+    const unsigned char *alloc = find_attr(rec, v->record_size, NTFS_AT_INDEX_ALLOC, false);
+    if (ref == 0 && alloc) {
+        NtfsStream s = { 0 };
+        unsigned char *blk = NULL;
+
+        if (block_size < 512 || block_size > 65536 || !attr_stream(alloc, &s) ||
+            !(blk = malloc(block_size))) {
+            free(s.runs);
+            snprintf(v->err, v->err_len, "cannot read the root directory index");
+            return false;
+        }
+
+        uint64_t blocks = s.size / block_size;
+        if (blocks > NTFS_MAX_INDEX_BLOCKS)
+            blocks = NTFS_MAX_INDEX_BLOCKS;
+
+        for (uint64_t i = 0; i < blocks && ref == 0; i++) {
+            if (!stream_read(v, &s, blk, block_size, i * block_size))
+                break;
+            /* Unused blocks of the allocation are not valid INDX */
+            if (memcmp(blk, "INDX", 4) != 0 || !apply_fixups(blk, block_size, v->sector_size))
+                continue;
+            ref = scan_entries(blk + 0x18, block_size - 0x18);
+        }
+
+        free(blk);
+        free(s.runs);
+    }
+
+    if (ref == 0)
+        return true;
+
+    /* A hibernation image starts with "hibr"; "wake" means resumed */
+    if (!read_record(v, ref, rec))
+        return false;
+
+    const unsigned char *data = find_attr(rec, v->record_size, NTFS_AT_DATA, true);
+    if (!data || data[8] == 0)
+        return true;
+
+    NtfsStream s = { 0 };
+    unsigned char magic[4];
+    bool ok = attr_stream(data, &s) &&
+              (s.size < sizeof(magic) || stream_read(v, &s, magic, sizeof(magic), 0));
+    uint64_t size = s.size;
+    free(s.runs);
+
+    if (!ok) {
+        snprintf(v->err, v->err_len, "cannot read hiberfil.sys");
+        return false;
+    }
+
+    *hibernated = size >= sizeof(magic) && strncasecmp((const char *)magic, "hibr", 4) == 0;
+    return true;
+}
+
+/* ------------------------------------------------------------- */
+
+bool ntfs_read_bitmap(int fd, NtfsBitmap *out, bool *unsupported,
+                      char *err, size_t err_len)
+{
+    memset(out, 0, sizeof(*out));
+    *unsupported = false;
+
+    unsigned char boot[512];
+    if (!read_exact(fd, boot, sizeof(boot), 0)) {
+        snprintf(err, err_len, "cannot read the boot sector");
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 1. Boot sector geometry
+     * --------------------------------------------------------- */
+    *unsupported = true;
+
+    if (memcmp(boot + 3, NTFS_OEM_ID, 8) != 0) {
+        snprintf(err, err_len, "no NTFS boot sector");
+        return false;
+    }
+
+    uint32_t sector_size = get_le16(boot + 0x0B);
+    uint32_t spc = boot[0x0D];
+    if (spc > 0x80)
+        spc = 1u << (256 - spc);       /* 64 KiB+ clusters, Windows 10 */
+
+    uint64_t total_sectors = get_le64(boot + 0x28);
+    uint64_t mft_lcn = get_le64(boot + 0x30);
+    int8_t cpr = (int8_t)boot[0x40];
+
+    if (sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) ||
+        spc == 0 || (spc & (spc - 1)) || total_sectors < spc) {
+        snprintf(err, err_len, "implausible NTFS geometry");
+        return false;
+    }
+
+    NtfsVolume v;
+    memset(&v, 0, sizeof(v));
+    v.fd = fd;
+    v.sector_size = sector_size;
+    v.cluster_size = sector_size * spc;
+    v.record_size = cpr < 0 ? 1u << -cpr : (uint32_t)cpr * v.cluster_size;
+    v.err = err;
+    v.err_len = err_len;
+
+    uint64_t clusters = total_sectors / spc;
+
+    if (v.cluster_size > 2u * 1024 * 1024 || v.record_size < 512 ||
+        v.record_size > 65536 || mft_lcn >= clusters) {
+        snprintf(err, err_len, "implausible NTFS geometry");
+        return false;
+    }
+
+    /* From here on anything unexpected, even a read error, is left
+     * to partclone.ntfs, which knows every NTFS corner case. */
+    unsigned char *rec = malloc(v.record_size);
+    unsigned char *bitmap = NULL;
+    NtfsStream bm = { 0 };
+    bool ok = false;
+
+    if (!rec) {
+        *unsupported = false;
+        snprintf(err, err_len, "out of memory");
+        goto out;
+    }
+
+    /* ---------------------------------------------------------
+     * 2. $MFT itself: bootstrap from its first record
+     * --------------------------------------------------------- */
+    NtfsRun first = { 0, (int64_t)mft_lcn, (v.record_size + v.cluster_size - 1) / v.cluster_size };
+    v.mft.runs = &first;
+    v.mft.count = 1;
+    v.mft.size = v.record_size;
+
+    if (!read_record(&v, NTFS_MFT_RECORD_MFT, rec))
+        goto out_mft;
+
+    v.mft.runs = NULL;
+    const unsigned char *a = find_attr(rec, v.record_size, NTFS_AT_DATA, true);
+    if (!a || !attr_stream(a, &v.mft)) {
+        snprintf(err, err_len, "$MFT data is not in its base record");
+        goto out_mft;
+    }
+
+    /* ---------------------------------------------------------
+     * 3. Refuse volumes Windows left in use
+     * --------------------------------------------------------- */
+    bool flag = false;
+
+    if (!volume_is_dirty(&v, rec, &flag))
+        goto out_mft;
+    if (flag) {
+        snprintf(err, err_len, "volume is marked dirty (run chkdsk in Windows)");
+        goto out_mft;
+    }
+
+    if (!logfile_is_clean(&v, rec, &flag))
+        goto out_mft;
+    if (!flag) {
+        snprintf(err, err_len, "$LogFile is unclean (Windows fast startup or a crash)");
+        goto out_mft;
+    }
+
+    if (!is_hibernated(&v, rec, &flag))
+        goto out_mft;
+    if (flag) {
+        snprintf(err, err_len, "Windows is hibernated on this volume");
+        goto out_mft;
+    }
+
+    /* ---------------------------------------------------------
+     * 4. $Bitmap
+     * --------------------------------------------------------- */
+    if (!read_record(&v, NTFS_MFT_RECORD_BITMAP, rec))
+        goto out_mft;
+
+    a = find_attr(rec, v.record_size, NTFS_AT_DATA, true);
+    if (!a || !attr_stream(a, &bm)) {
+        snprintf(err, err_len, "$Bitmap data is not in its base record");
+        goto out_mft;
+    }
+
+    uint64_t bm_bytes = pc_bitmap_bytes(clusters);
+    if (bm.size < bm_bytes) {
+        snprintf(err, err_len, "$Bitmap is smaller than the volume");
+        goto out_mft;
+    }
+
+    bitmap = malloc(bm_bytes);
+    if (!bitmap) {
+        *unsupported = false;
+        snprintf(err, err_len, "out of memory");
+        goto out_mft;
+    }
+
+    if (!stream_read(&v, &bm, bitmap, bm_bytes, 0)) {
+        snprintf(err, err_len, "cannot read $Bitmap");
+        goto out_mft;
+    }
+
+    /* Bits past the last cluster are padding */
+    if (clusters % 8)
+        bitmap[bm_bytes - 1] &= (unsigned char)((1u << (clusters % 8)) - 1);
+
+    out->block_size = v.cluster_size;
+    out->total_blocks = clusters;
+    out->used_blocks = pc_bitmap_count(bitmap, clusters);
+    out->device_size = total_sectors * sector_size;
+    out->bitmap = bitmap;
+    bitmap = NULL;
+    ok = true;
+
+out_mft:
+    if (v.mft.runs != &first)
+        free(v.mft.runs);
+out:
+    free(bm.runs);
+    free(bitmap);
+    free(rec);
+    return ok;
+}
@@ -0,0 +1,34 @@
+#ifndef NTFS_H
+#define NTFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Native NTFS used-cluster reader.
+ *
+ * Locates $MFT from the boot sector, reads the unnamed $DATA stream
+ * of $Bitmap (MFT record 6) and returns it as a partclone-order
+ * bitmap with one bit per cluster.
+ *
+ * Volumes that Windows did not leave consistent are reported as
+ * unsupported so the caller can use partclone.ntfs instead: the dirty
+ * flag in $Volume, an unclean $LogFile (fast startup, crashes) and a
+ * hiberfil.sys holding a hibernation image.  So are layouts the reader
+ * does not follow (e.g. $Bitmap spread through an attribute list).
+ */
+
+typedef struct {
+    uint32_t block_size;         /* cluster size */
+    uint64_t total_blocks;       /* clusters */
+    uint64_t used_blocks;
+    uint64_t device_size;        /* bytes covered by the boot sector */
+    unsigned char *bitmap;       /* caller frees */
+} NtfsBitmap;
+
+/* Same contract as extfs_read_bitmap() (see extfs.h). */
+bool ntfs_read_bitmap(int fd, NtfsBitmap *out, bool *unsupported,
+                      char *err, size_t err_len);
+
+#endif /* NTFS_H */
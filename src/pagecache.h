@@ -0,0 +1,82 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+/*
+ * Keeping bulk I/O out of the page cache (cache_neutral in config).
+ *
+ * A backup streams far more data than the machine has memory.  Left to
+ * the page cache, the image pushes out everything the applications on
+ * a live server had cached, and they pay for it long after the backup.
+ *
+ * A CacheWindow follows a file or device written front to back: every
+ * CACHE_WINDOW bytes it starts writeback of the newest window, waits
+ * for the window before it and drops that one, so no more than two
+ * windows of the file are ever resident.  Reads are dropped right
+ * after they have been copied out.  Every call is advisory: where a
+ * filesystem ignores it, the data is written the same way.
+ *
+ * Needs _GNU_SOURCE (sync_file_range) before the first #include.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CACHE_WINDOW   (16 * 1024 * 1024)
+
+typedef struct {
+    int fd;
+    off_t flushing;         /* writeback started up to here */
+    off_t dropped;          /* out of the cache up to here */
+    off_t end;              /* highest byte written + 1 */
+} CacheWindow;
+
+static inline void cache_window_init(CacheWindow *c, int fd, off_t at)
+{
+    c->fd = fd;
+    c->flushing = at;
+    c->dropped = at;
+    c->end = at;
+}
+
+/* Everything below end has been written (offsets only move forward) */
+static inline void cache_window_wrote(CacheWindow *c, off_t end)
+{
+    if (end > c->end)
+        c->end = end;
+    if (c->end - c->flushing < CACHE_WINDOW)
+        return;
+
+    if (c->flushing > c->dropped) {
+        sync_file_range(c->fd, c->dropped, c->flushing - c->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(c->fd, c->dropped, c->flushing - c->dropped, POSIX_FADV_DONTNEED);
+        c->dropped = c->flushing;
+    }
+
+    sync_file_range(c->fd, c->flushing, c->end - c->flushing, SYNC_FILE_RANGE_WRITE);
+    c->flushing = c->end;
+}
+
+/* Write out and drop what is left, before the fd is synced or closed */
+static inline void cache_window_finish(CacheWindow *c)
+{
+    if (c->end <= c->dropped)
+        return;
+
+    sync_file_range(c->fd, c->dropped, c->end - c->dropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(c->fd, c->dropped, c->end - c->dropped, POSIX_FADV_DONTNEED);
+    c->flushing = c->end;
+    c->dropped = c->end;
+}
+
+/* Bytes that have been read and will not be read again */
+static inline void cache_drop_read(int fd, off_t off, off_t len)
+{
+    posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+}
+
+#endif /* PAGECACHE_H */
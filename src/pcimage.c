@@ -0,0 +1,315 @@
+#include "pcimage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------
+ * Little-endian field access (the descriptor is a packed struct)
+ * ------------------------------------------------------------- */
+static uint16_t get_le16(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] |
+           ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) |
+           ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+/* Descriptor field offsets (image_desc_v2) */
+enum {
+    OFF_MAGIC         = 0,
+    OFF_PTC_VERSION   = 16,
+    OFF_VERSION       = 30,
+    OFF_ENDIAN        = 34,
+    OFF_FS            = 36,
+    OFF_DEVICE_SIZE   = 52,
+    OFF_TOTAL_BLOCKS  = 60,
+    OFF_USED_BLOCKS   = 68,
+    OFF_USED_BITMAP   = 76,
+    OFF_BLOCK_SIZE    = 84,
+    OFF_FEATURE_SIZE  = 88,
+    OFF_IMAGE_VERSION = 92,
+    OFF_CPU_BITS      = 94,
+    OFF_CSUM_MODE     = 96,
+    OFF_CSUM_SIZE     = 98,
+    OFF_BLOCKS_PER_CS = 100,
+    OFF_RESEED        = 104,
+    OFF_BITMAP_MODE   = 105,
+    OFF_CRC           = 106
+};
+
+/* -------------------------------------------------------------
+ * CRC32
+ * ------------------------------------------------------------- */
+static uint32_t crc_table[256];
+static bool crc_table_ready = false;
+
+static void crc_init_table(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        crc_table[i] = c;
+    }
+    crc_table_ready = true;
+}
+
+uint32_t pc_crc32(uint32_t seed, const void *buf, size_t len)
+{
+    if (!crc_table_ready)
+        crc_init_table();
+
+    const unsigned char *p = buf;
+    uint32_t crc = seed;
+
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xFF];
+
+    return crc;
+}
+
+/* -------------------------------------------------------------
+ * Descriptor parse / build
+ * ------------------------------------------------------------- */
+bool pc_parse_header(const unsigned char *raw, PcHeader *out,
+                     char *err, size_t err_len)
+{
+    memset(out, 0, sizeof(*out));
+
+    if (memcmp(raw + OFF_MAGIC, PC_IMAGE_MAGIC, PC_IMAGE_MAGIC_SIZE) != 0) {
+        snprintf(err, err_len, "not a partclone image");
+        return false;
+    }
+
+    if (memcmp(raw + OFF_VERSION, PC_IMAGE_VERSION_V2, 4) != 0) {
+        snprintf(err, err_len, "partclone image version %.4s is not supported natively",
+                 (const char *)raw + OFF_VERSION);
+        return false;
+    }
+
+    if (get_le16(raw + OFF_ENDIAN) != PC_ENDIAN_MAGIC) {
+        snprintf(err, err_len, "image was written on a big-endian machine");
+        return false;
+    }
+
+    uint32_t crc = pc_crc32(0, raw, OFF_CRC);
+    if (crc != get_le32(raw + OFF_CRC)) {
+        snprintf(err, err_len, "image header checksum mismatch");
+        return false;
+    }
+
+    memcpy(out->fs, raw + OFF_FS, 15);
+    memcpy(out->ptc_version, raw + OFF_PTC_VERSION, 14);
+
+    out->device_size         = get_le64(raw + OFF_DEVICE_SIZE);
+    out->total_blocks        = get_le64(raw + OFF_TOTAL_BLOCKS);
+    out->used_blocks         = get_le64(raw + OFF_USED_BLOCKS);
+    out->used_bitmap         = get_le64(raw + OFF_USED_BITMAP);
+    out->block_size          = get_le32(raw + OFF_BLOCK_SIZE);
+    out->checksum_mode       = get_le16(raw + OFF_CSUM_MODE);
+    out->checksum_size       = get_le16(raw + OFF_CSUM_SIZE);
+    out->blocks_per_checksum = get_le32(raw + OFF_BLOCKS_PER_CS);
+    out->reseed_checksum     = raw[OFF_RESEED] != 0;
+    out->bitmap_mode         = raw[OFF_BITMAP_MODE];
+
+    if (out->block_size == 0 || out->total_blocks == 0 ||
+        out->used_blocks > out->total_blocks) {
+        snprintf(err, err_len, "image header has implausible geometry");
+        return false;
+    }
+
+    if (out->bitmap_mode != PC_BM_BIT) {
+        snprintf(err, err_len, "bitmap mode %u is not supported natively",
+                 (unsigned)out->bitmap_mode);
+        return false;
+    }
+
+    if (out->checksum_mode != PC_CSM_NONE &&
+        !(out->checksum_mode == PC_CSM_CRC32 && out->checksum_size == 4)) {
+        snprintf(err, err_len, "checksum mode 0x%x is not supported natively",
+                 (unsigned)out->checksum_mode);
+        return false;
+    }
+
+    return true;
+}
+
+void pc_build_header(const PcHeader *h, unsigned char *raw)
+{
+    memset(raw, 0, PC_HEADER_SIZE);
+
+    memcpy(raw + OFF_MAGIC, PC_IMAGE_MAGIC, PC_IMAGE_MAGIC_SIZE);
+    memcpy(raw + OFF_PTC_VERSION, h->ptc_version, strnlen(h->ptc_version, 14));
+    memcpy(raw + OFF_VERSION, PC_IMAGE_VERSION_V2, 4);
+    put_le16(raw + OFF_ENDIAN, PC_ENDIAN_MAGIC);
+
+    memcpy(raw + OFF_FS, h->fs, strnlen(h->fs, 15));
+    put_le64(raw + OFF_DEVICE_SIZE, h->device_size);
+    put_le64(raw + OFF_TOTAL_BLOCKS, h->total_blocks);
+    put_le64(raw + OFF_USED_BLOCKS, h->used_blocks);
+    put_le64(raw + OFF_USED_BITMAP, h->used_bitmap);
+    put_le32(raw + OFF_BLOCK_SIZE, h->block_size);
+
+    put_le32(raw + OFF_FEATURE_SIZE, OFF_CRC - OFF_FEATURE_SIZE);
+    put_le16(raw + OFF_IMAGE_VERSION, 0x0002);
+    put_le16(raw + OFF_CPU_BITS, 64);
+    put_le16(raw + OFF_CSUM_MODE, h->checksum_mode);
+    put_le16(raw + OFF_CSUM_SIZE, h->checksum_size);
+    put_le32(raw + OFF_BLOCKS_PER_CS, h->blocks_per_checksum);
+    raw[OFF_RESEED] = h->reseed_checksum ? 1 : 0;
+    raw[OFF_BITMAP_MODE] = h->bitmap_mode;
+
+    put_le32(raw + OFF_CRC, pc_crc32(0, raw, OFF_CRC));
+}
+
+/* -------------------------------------------------------------
+ * Layout helpers
+ * ------------------------------------------------------------- */
+uint64_t pc_bitmap_count(const unsigned char *bitmap, uint64_t nbits)
+{
+    uint64_t count = 0;
+    uint64_t full = nbits / 8;
+
+    for (uint64_t i = 0; i < full; i++)
+        count += (uint64_t)__builtin_popcount(bitmap[i]);
+
+    for (uint64_t b = full * 8; b < nbits; b++)
+        count += pc_test_bit(bitmap, b);
+
+    return count;
+}
+
+uint64_t pc_data_offset(const PcHeader *h)
+{
+    return PC_HEADER_SIZE + pc_bitmap_bytes(h->total_blocks) + 4;
+}
+
+uint32_t pc_group_blocks(const PcHeader *h)
+{
+    if (h->checksum_mode == PC_CSM_NONE || h->checksum_size == 0)
+        return 0;
+    return h->blocks_per_checksum;
+}
+
+/* -------------------------------------------------------------
+ * Random-access layout
+ * ------------------------------------------------------------- */
+bool pc_layout_load(PcLayout *l, PcReadFn read_at, void *ctx,
+                    char *err, size_t err_len)
+{
+    memset(l, 0, sizeof(*l));
+
+    unsigned char raw[PC_HEADER_SIZE];
+    if (!read_at(ctx, raw, sizeof(raw), 0)) {
+        snprintf(err, err_len, "cannot read image header");
+        return false;
+    }
+
+    if (!pc_parse_header(raw, &l->h, err, err_len))
+        return false;
+
+    uint64_t bm_len = pc_bitmap_bytes(l->h.total_blocks);
+    uint64_t nrank = l->h.total_blocks / PC_RANK_BLOCKS + 1;
+
+    l->bitmap = malloc(bm_len);
+    l->rank = malloc(nrank * sizeof(uint64_t));
+    if (!l->bitmap || !l->rank) {
+        snprintf(err, err_len, "out of memory for block bitmap");
+        pc_layout_free(l);
+        return false;
+    }
+
+    unsigned char crc_raw[4];
+    if (!read_at(ctx, l->bitmap, bm_len, PC_HEADER_SIZE) ||
+        !read_at(ctx, crc_raw, 4, PC_HEADER_SIZE + bm_len)) {
+        snprintf(err, err_len, "cannot read block bitmap");
+        pc_layout_free(l);
+        return false;
+    }
+
+    if (pc_crc32(0, l->bitmap, bm_len) != get_le32(crc_raw)) {
+        snprintf(err, err_len, "bitmap checksum mismatch");
+        pc_layout_free(l);
+        return false;
+    }
+
+    /* PC_RANK_BLOCKS is a multiple of 8, so ranks fall on byte edges */
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < nrank; i++) {
+        l->rank[i] = count;
+
+        uint64_t first = i * (PC_RANK_BLOCKS / 8);
+        uint64_t last = first + PC_RANK_BLOCKS / 8;
+        if (last > bm_len)
+            last = bm_len;
+
+        for (uint64_t b = first; b < last; b++)
+            count += (uint64_t)__builtin_popcount(l->bitmap[b]);
+    }
+
+    l->group = pc_group_blocks(&l->h);
+    return true;
+}
+
+void pc_layout_free(PcLayout *l)
+{
+    free(l->bitmap);
+    free(l->rank);
+    l->bitmap = NULL;
+    l->rank = NULL;
+}
+
+uint64_t pc_layout_rank(const PcLayout *l, uint64_t block)
+{
+    uint64_t r = l->rank[block / PC_RANK_BLOCKS];
+    uint64_t first = (block / PC_RANK_BLOCKS) * PC_RANK_BLOCKS;
+
+    for (uint64_t b = first / 8; b < block / 8; b++)
+        r += (uint64_t)__builtin_popcount(l->bitmap[b]);
+
+    for (uint64_t b = block & ~7ULL; b < block; b++)
+        r += pc_test_bit(l->bitmap, b);
+
+    return r;
+}
+
+uint64_t pc_layout_offset(const PcLayout *l, uint64_t block)
+{
+    uint64_t k = pc_layout_rank(l, block);
+    uint64_t off = pc_data_offset(&l->h) + k * l->h.block_size;
+
+    /* A checksum follows every complete group before this block */
+    if (l->group)
+        off += (k / l->group) * l->h.checksum_size;
+
+    return off;
+}
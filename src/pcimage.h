@@ -0,0 +1,127 @@
+#ifndef PCIMAGE_H
+#define PCIMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Partclone image format (version 0002) helpers.
+ *
+ * A partclone stream is laid out as:
+ *
+ *   image_desc_v2 (110 bytes, CRC32 protected)
+ *   bitmap        (1 bit per filesystem block) + CRC32
+ *   used blocks   (block_size bytes each, in block order), with a
+ *                 checksum after every blocks_per_checksum blocks and
+ *                 a final checksum for a trailing partial group
+ *
+ * Imprint only needs to read and write this layout; it never
+ * interprets filesystem contents.
+ */
+
+#define PC_IMAGE_MAGIC        "partclone-image"
+#define PC_IMAGE_MAGIC_SIZE   15
+#define PC_IMAGE_VERSION_V2   "0002"
+#define PC_ENDIAN_MAGIC       0xC0DE
+#define PC_HEADER_SIZE        110
+
+#define PC_CSM_NONE           0x00
+#define PC_CSM_CRC32          0x20
+
+#define PC_BM_NONE            0x00
+#define PC_BM_BIT             0x01
+
+typedef struct {
+    char     fs[16];
+    char     ptc_version[16];
+    uint64_t device_size;
+    uint64_t total_blocks;
+    uint64_t used_blocks;
+    uint64_t used_bitmap;
+    uint32_t block_size;
+
+    uint16_t checksum_mode;
+    uint16_t checksum_size;
+    uint32_t blocks_per_checksum;
+    bool     reseed_checksum;
+    uint8_t  bitmap_mode;
+} PcHeader;
+
+/* CRC32 as used by partclone (reflected 0xEDB88320, no final xor). */
+uint32_t pc_crc32(uint32_t seed, const void *buf, size_t len);
+
+/* Seed for per-block data checksums. */
+#define PC_DATA_CRC_SEED 0xFFFFFFFFu
+
+/*
+ * Parse and validate a raw 110-byte image descriptor.
+ * Returns false (with a reason in err) if this is not a v2 image that
+ * Imprint can handle natively.
+ */
+bool pc_parse_header(const unsigned char *raw, PcHeader *out,
+                     char *err, size_t err_len);
+
+/* Build a raw 110-byte descriptor (including its CRC) from a header. */
+void pc_build_header(const PcHeader *h, unsigned char *raw);
+
+/* Bitmap helpers */
+static inline bool pc_test_bit(const unsigned char *bitmap, uint64_t block)
+{
+    return (bitmap[block >> 3] >> (block & 7)) & 1;
+}
+
+static inline void pc_set_bit(unsigned char *bitmap, uint64_t block)
+{
+    bitmap[block >> 3] |= (unsigned char)(1u << (block & 7));
+}
+
+static inline uint64_t pc_bitmap_bytes(uint64_t total_blocks)
+{
+    return (total_blocks + 7) / 8;
+}
+
+/* Count set bits in the first nbits of the bitmap. */
+uint64_t pc_bitmap_count(const unsigned char *bitmap, uint64_t nbits);
+
+/* Stream offset where block data starts (after header + bitmap + CRC). */
+uint64_t pc_data_offset(const PcHeader *h);
+
+/* Effective number of blocks covered by one checksum (0 = none). */
+uint32_t pc_group_blocks(const PcHeader *h);
+
+/*
+ * Random-access layout.
+ *
+ * Maps a filesystem block to the offset of its data in the
+ * uncompressed stream, using a rank table (used blocks before every
+ * PC_RANK_BLOCKS-block boundary) so lookups never scan the bitmap.
+ */
+#define PC_RANK_BLOCKS 512
+
+typedef struct {
+    PcHeader h;
+    unsigned char *bitmap;
+    uint64_t *rank;
+    uint32_t group;
+} PcLayout;
+
+/* Read callback: fill dst with len bytes at stream offset off. */
+typedef bool (*PcReadFn)(void *ctx, void *dst, size_t len, uint64_t off);
+
+/*
+ * Read the descriptor and bitmap through `read_at` and build the rank
+ * table.  Returns false with a reason in err.
+ */
+bool pc_layout_load(PcLayout *l, PcReadFn read_at, void *ctx,
+                    char *err, size_t err_len);
+
+void pc_layout_free(PcLayout *l);
+
+/* Number of used blocks before `block`. */
+uint64_t pc_layout_rank(const PcLayout *l, uint64_t block);
+
+/* Stream offset of the data for a used block. */
+uint64_t pc_layout_offset(const PcLayout *l, uint64_t block);
+
+#endif /* PCIMAGE_H */
@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+
+#include "pcsource.h"
+#include "pcimage.h"
+#include "pagecache.h"
+#include "extfs.h"
+#include "ntfs.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/*
+ * A checksum group is up to 64 blocks and at most 256 KiB; a segment
+ * is about 4 MiB of whole groups (one group for huge NTFS clusters).
+ */
+#define PC_SOURCE_GROUP_BLOCKS 64
+#define PC_SOURCE_GROUP_BYTES  (256u * 1024)
+#define PC_SOURCE_SEG_BYTES    (4u * 1024 * 1024)
+#define PC_SOURCE_MAX_GROUPS   (PC_SOURCE_SEG_BYTES / 512 / PC_SOURCE_GROUP_BLOCKS)
+#define PC_SOURCE_MAX_THREADS  64
+#define PC_SOURCE_ALIGN        4096
+
+/*
+ * Free runs up to this size between used blocks are read through
+ * and dropped, so fragmented bitmaps still become large requests.
+ */
+#define PC_SOURCE_GAP_BYTES    (64u * 1024)
+#define PC_SOURCE_SPAN_BYTES   (2u * 1024 * 1024)
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, RED "\nERROR:" WHITE " writing the image stream failed: %s\n" RESET,
+                    strerror(errno));
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Segments: runs of seg_blocks used blocks, read by any thread
+ * and handed to the writer through a ring of slots.
+ * ------------------------------------------------------------- */
+enum { SLOT_FREE, SLOT_READING, SLOT_FULL };
+
+typedef struct {
+    int state;
+    uint64_t seg;
+    uint32_t nblocks;
+    unsigned char *data;         /* direct I/O buffer, seg_blocks * bs */
+    unsigned char *span;         /* direct I/O buffer for gap-bridged reads */
+    unsigned char (*crc)[4];     /* one per checksum group */
+} SegSlot;
+
+typedef struct {
+    int fd;
+    const char *device;
+    const PcSource *src;
+
+    uint32_t group;
+    uint32_t seg_blocks;
+    uint32_t gap_blocks;
+    uint32_t span_blocks;
+    uint64_t nsegs;
+    uint64_t *seg_start;         /* first bitmap position of each segment */
+    uint64_t used;
+
+    SegSlot *slots;
+    int nslots;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_seg;
+    bool failed;
+    bool stop;
+} PcReader;
+
+static bool read_run(PcReader *r, unsigned char *buf, size_t len, uint64_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(r->fd, buf + done, len - done, (off_t)(off + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Some files and filesystems refuse O_DIRECT; drop it and retry */
+            if (errno == EINVAL && (fcntl(r->fd, F_GETFL) & O_DIRECT)) {
+                fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+
+            fprintf(stderr, RED "\nERROR:" WHITE " read error on %s at offset %llu: %s\n" RESET,
+                    r->device, (unsigned long long)(off + done), strerror(errno));
+            return false;
+        }
+        if (n == 0) {
+            fprintf(stderr, RED "\nERROR:" WHITE " %s ended early at offset %llu\n" RESET,
+                    r->device, (unsigned long long)(off + done));
+            return false;
+        }
+        done += (size_t)n;
+    }
+
+    /* Read through the cache after all: forget it, as O_DIRECT would */
+    if (!(fcntl(r->fd, F_GETFL) & O_DIRECT))
+        cache_drop_read(r->fd, (off_t)off, (off_t)len);
+    return true;
+}
+
+/*
+ * Read one segment.  Used blocks separated by short free runs are
+ * fetched with one pread into the span buffer and compacted;
+ * contiguous runs are read straight into place.
+ */
+static bool fill_segment(PcReader *r, SegSlot *s)
+{
+    const PcSource *src = r->src;
+    uint32_t bs = src->block_size;
+    uint64_t first_used = s->seg * r->seg_blocks;
+    uint32_t want = r->seg_blocks;
+
+    if (r->used - first_used < want)
+        want = (uint32_t)(r->used - first_used);
+
+    uint64_t b = r->seg_start[s->seg];
+    uint32_t got = 0;
+
+    while (got < want) {
+        while (!pc_test_bit(src->bitmap, b))
+            b++;
+
+        /* Grow the span while gaps stay short and it fits the buffer */
+        uint64_t span_first = b;
+        uint64_t span_end = b;
+        uint32_t in_span = 0;
+
+        for (uint64_t x = b;
+             got + in_span < want && x < src->total_blocks &&
+             x - span_first < r->span_blocks && x - span_end <= r->gap_blocks;
+             x++) {
+            if (pc_test_bit(src->bitmap, x)) {
+                in_span++;
+                span_end = x + 1;
+            }
+        }
+
+        uint64_t span_len = span_end - span_first;
+
+        if (span_len == in_span) {
+            if (!read_run(r, s->data + (size_t)got * bs, (size_t)span_len * bs, span_first * bs))
+                return false;
+        } else {
+            if (!read_run(r, s->span, (size_t)span_len * bs, span_first * bs))
+                return false;
+
+            uint32_t at = got;
+            for (uint64_t x = span_first; x < span_end; x++) {
+                if (!pc_test_bit(src->bitmap, x))
+                    continue;
+                uint64_t run = 1;
+                while (x + run < span_end && pc_test_bit(src->bitmap, x + run))
+                    run++;
+                memcpy(s->data + (size_t)at * bs,
+                       s->span + (size_t)(x - span_first) * bs, (size_t)run * bs);
+                at += (uint32_t)run;
+                x += run - 1;
+            }
+        }
+
+        got += in_span;
+        b = span_end;
+    }
+
+    s->nblocks = want;
+
+    uint32_t groups = (want + r->group - 1) / r->group;
+    for (uint32_t g = 0; g < groups; g++) {
+        uint32_t n = want - g * r->group;
+        if (n > r->group)
+            n = r->group;
+        put_le32(s->crc[g], pc_crc32(PC_DATA_CRC_SEED,
+                                     s->data + (size_t)g * r->group * bs,
+                                     (size_t)n * bs));
+    }
+    return true;
+}
+
+static void *pc_reader_main(void *arg)
+{
+    PcReader *r = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->stop && !r->failed && r->next_seg < r->nsegs &&
+               r->slots[r->next_seg % r->nslots].state != SLOT_FREE)
+            pthread_cond_wait(&r->cond, &r->lock);
+
+        if (r->stop || r->failed || r->next_seg >= r->nsegs) {
+            pthread_mutex_unlock(&r->lock);
+            return NULL;
+        }
+
+        SegSlot *s = &r->slots[r->next_seg % r->nslots];
+        s->seg = r->next_seg++;
+        s->state = SLOT_READING;
+        pthread_mutex_unlock(&r->lock);
+
+        bool ok = fill_segment(r, s);
+
+        pthread_mutex_lock(&r->lock);
+        if (ok)
+            s->state = SLOT_FULL;
+        else
+            r->failed = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* Bitmap position of every seg_blocks-th used block */
+static uint64_t *segment_starts(const PcSource *src, uint64_t used,
+                                uint32_t seg_blocks, uint64_t *nsegs)
+{
+    *nsegs = (used + seg_blocks - 1) / seg_blocks;
+
+    uint64_t *starts = malloc((*nsegs ? *nsegs : 1) * sizeof(*starts));
+    if (!starts)
+        return NULL;
+
+    uint64_t seen = 0;
+    uint64_t seg = 0;
+
+    for (uint64_t b = 0; b < src->total_blocks && seg < *nsegs; b++) {
+        /* Skip empty bytes quickly; most of a sparse bitmap is zero */
+        if ((b & 7) == 0 && src->bitmap[b >> 3] == 0 && b + 8 <= src->total_blocks) {
+            b += 7;
+            continue;
+        }
+        if (!pc_test_bit(src->bitmap, b))
+            continue;
+        if (seen % seg_blocks == 0)
+            starts[seg++] = b;
+        seen++;
+    }
+
+    return starts;
+}
+
+bool pc_source_stream(const char *device, const PcSource *src, int out_fd)
+{
+    uint32_t bs = src->block_size;
+    int threads = src->threads > 0 ? src->threads : PC_SOURCE_DEFAULT_THREADS;
+    if (threads > PC_SOURCE_MAX_THREADS)
+        threads = PC_SOURCE_MAX_THREADS;
+
+    PcReader r;
+    memset(&r, 0, sizeof(r));
+    r.device = device;
+    r.src = src;
+    r.used = pc_bitmap_count(src->bitmap, src->total_blocks);
+    r.group = PC_SOURCE_GROUP_BYTES / bs;
+    if (r.group > PC_SOURCE_GROUP_BLOCKS)
+        r.group = PC_SOURCE_GROUP_BLOCKS;
+    if (r.group == 0)
+        r.group = 1;
+    r.seg_blocks = PC_SOURCE_SEG_BYTES / bs / r.group * r.group;
+    if (r.seg_blocks == 0)
+        r.seg_blocks = r.group;
+    r.gap_blocks = PC_SOURCE_GAP_BYTES / bs;
+    r.span_blocks = PC_SOURCE_SPAN_BYTES / bs;
+    if (r.span_blocks == 0)
+        r.span_blocks = 1;
+    r.nslots = threads * 2;
+
+    r.fd = open(device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (r.fd < 0)
+        r.fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (r.fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open %s: %s\n" RESET, device, strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    r.seg_start = segment_starts(src, r.used, r.seg_blocks, &r.nsegs);
+    r.slots = calloc((size_t)r.nslots, sizeof(*r.slots));
+    if (!r.seg_start || !r.slots)
+        ok = false;
+
+    for (int i = 0; ok && i < r.nslots; i++) {
+        if (posix_memalign((void **)&r.slots[i].data, PC_SOURCE_ALIGN,
+                           (size_t)r.seg_blocks * bs) != 0) {
+            r.slots[i].data = NULL;
+            ok = false;
+            break;
+        }
+        if (posix_memalign((void **)&r.slots[i].span, PC_SOURCE_ALIGN,
+                           (size_t)r.span_blocks * bs) != 0) {
+            r.slots[i].span = NULL;
+            ok = false;
+            break;
+        }
+        r.slots[i].crc = calloc(r.seg_blocks / r.group, sizeof(*r.slots[i].crc));
+        if (!r.slots[i].crc)
+            ok = false;
+    }
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " out of memory\n" RESET);
+        goto out_free;
+    }
+
+    fprintf(stderr,
+            YELLOW "Native %s reader on %s: %.2f GB used of %.2f GB, %d reader threads\n" RESET,
+            src->fs, device,
+            (double)r.used * bs / 1e9, (double)src->device_size / 1e9, threads);
+
+    /* ---------------------------------------------------------
+     * Header, bitmap and bitmap checksum
+     * --------------------------------------------------------- */
+    PcHeader h;
+    memset(&h, 0, sizeof(h));
+    snprintf(h.fs, sizeof(h.fs), "%s", src->fs);
+    snprintf(h.ptc_version, sizeof(h.ptc_version), "imprint");
+    h.device_size = src->device_size;
+    h.total_blocks = src->total_blocks;
+    h.used_blocks = r.used;
+    h.used_bitmap = r.used;
+    h.block_size = bs;
+    h.checksum_mode = PC_CSM_CRC32;
+    h.checksum_size = 4;
+    h.blocks_per_checksum = r.group;
+    h.reseed_checksum = true;
+    h.bitmap_mode = PC_BM_BIT;
+
+    unsigned char header[PC_HEADER_SIZE];
+    pc_build_header(&h, header);
+
+    size_t bm_len = pc_bitmap_bytes(src->total_blocks);
+    unsigned char bm_crc[4];
+    put_le32(bm_crc, pc_crc32(0, src->bitmap, bm_len));
+
+    if (!write_all(out_fd, header, sizeof(header)) ||
+        !write_all(out_fd, src->bitmap, bm_len) ||
+        !write_all(out_fd, bm_crc, sizeof(bm_crc))) {
+        ok = false;
+        goto out_free;
+    }
+
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+
+    pthread_t tids[PC_SOURCE_MAX_THREADS];
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, pc_reader_main, &r) != 0)
+            break;
+    }
+    if (started == 0) {
+        ok = false;
+        goto out_sync;
+    }
+
+    /* ---------------------------------------------------------
+     * Emit segments in order: each group's data then its CRC
+     * --------------------------------------------------------- */
+    double t_start = now_sec();
+    double t_report = 0.0;
+    uint64_t written = 0;
+
+    for (uint64_t seg = 0; ok && seg < r.nsegs; seg++) {
+        SegSlot *s = &r.slots[seg % r.nslots];
+
+        pthread_mutex_lock(&r.lock);
+        while (!(s->state == SLOT_FULL && s->seg == seg) && !r.failed)
+            pthread_cond_wait(&r.cond, &r.lock);
+        if (r.failed)
+            ok = false;
+        pthread_mutex_unlock(&r.lock);
+
+        if (!ok)
+            break;
+
+        struct iovec iov[PC_SOURCE_MAX_GROUPS * 2];
+        int niov = 0;
+        uint32_t groups = (s->nblocks + r.group - 1) / r.group;
+
+        for (uint32_t g = 0; g < groups; g++) {
+            uint32_t n = s->nblocks - g * r.group;
+            if (n > r.group)
+                n = r.group;
+            iov[niov].iov_base = s->data + (size_t)g * r.group * bs;
+            iov[niov].iov_len = (size_t)n * bs;
+            niov++;
+            iov[niov].iov_base = s->crc[g];
+            iov[niov].iov_len = 4;
+            niov++;
+        }
+
+        /* writev may stop short on a pipe; finish piece by piece */
+        ssize_t n = writev(out_fd, iov, niov);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, RED "\nERROR:" WHITE " writing the image stream failed: %s\n" RESET,
+                    strerror(errno));
+            ok = false;
+        }
+        size_t done = n > 0 ? (size_t)n : 0;
+        for (int i = 0; ok && i < niov; i++) {
+            if (done >= iov[i].iov_len) {
+                done -= iov[i].iov_len;
+                continue;
+            }
+            ok = write_all(out_fd, (unsigned char *)iov[i].iov_base + done,
+                           iov[i].iov_len - done);
+            done = 0;
+        }
+
+        written += s->nblocks;
+
+        pthread_mutex_lock(&r.lock);
+        s->state = SLOT_FREE;
+        pthread_cond_broadcast(&r.cond);
+        pthread_mutex_unlock(&r.lock);
+
+        double t = now_sec();
+        if (t - t_report >= 1.0 || written >= r.used) {
+            double elapsed = t - t_start;
+            fprintf(stderr, WHITE "\rRead %.1f%%  (%.2f MB/s) " RESET,
+                    r.used ? 100.0 * (double)written / (double)r.used : 100.0,
+                    elapsed > 0.0 ? (double)written * bs / (1024.0 * 1024.0) / elapsed : 0.0);
+            t_report = t;
+        }
+    }
+
+    fprintf(stderr, "\n");
+
+    pthread_mutex_lock(&r.lock);
+    r.stop = true;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    if (ok)
+        fprintf(stderr, GREEN "Native image: %.2f MB of used blocks streamed\n" RESET,
+                (double)written * bs / (1024.0 * 1024.0));
+
+out_sync:
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.lock);
+
+out_free:
+    if (r.slots) {
+        for (int i = 0; i < r.nslots; i++) {
+            free(r.slots[i].data);
+            free(r.slots[i].span);
+            free(r.slots[i].crc);
+        }
+    }
+    free(r.slots);
+    free(r.seg_start);
+    close(r.fd);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Used-block bitmap from a native reader
+ * ------------------------------------------------------------- */
+bool pc_source_bitmap(const char *fs, const char *device, PcSource *src,
+                      bool *unsupported, char *why, size_t why_len)
+{
+    bool is_ntfs = strcmp(fs, "ntfs") == 0;
+
+    *unsupported = false;
+    if (!is_ntfs && strcmp(fs, "extfs") != 0) {
+        *unsupported = true;
+        snprintf(why, why_len, "no native reader for '%s'", fs);
+        return false;
+    }
+
+    int fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(why, why_len, "cannot open: %s", strerror(errno));
+        return false;
+    }
+
+    bool ok;
+    if (is_ntfs) {
+        NtfsBitmap bm;
+        ok = ntfs_read_bitmap(fd, &bm, unsupported, why, why_len);
+        if (ok) {
+            src->fs = "NTFS";
+            src->block_size = bm.block_size;
+            src->total_blocks = bm.total_blocks;
+            src->device_size = bm.device_size;
+            src->bitmap = bm.bitmap;
+        }
+    } else {
+        ExtBitmap bm;
+        ok = extfs_read_bitmap(fd, &bm, unsupported, why, why_len);
+        if (ok) {
+            src->fs = "EXTFS";
+            src->block_size = bm.block_size;
+            src->total_blocks = bm.total_blocks;
+            src->device_size = bm.total_blocks * bm.block_size;
+            src->bitmap = bm.bitmap;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * imprintb --native-stream <fs> <device> [threads]
+ * ------------------------------------------------------------- */
+int pc_source_main(const char *fs, const char *device, int threads)
+{
+    bool is_ntfs = strcmp(fs, "ntfs") == 0;
+
+    if (!is_ntfs && strcmp(fs, "extfs") != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " no native reader for '%s'\n" RESET, fs);
+        return EXIT_FAILURE;
+    }
+
+    const char *backend = is_ntfs ? "partclone.ntfs" : "partclone.extfs";
+
+    PcSource src = { .threads = threads };
+    bool unsupported = false;
+    char why[256] = "";
+
+    if (!pc_source_bitmap(fs, device, &src, &unsupported, why, sizeof(why))) {
+        if (!unsupported) {
+            fprintf(stderr, RED "ERROR:" WHITE " %s: %s\n" RESET, device, why);
+            return EXIT_FAILURE;
+        }
+
+        /* Nothing written yet: let partclone produce the image */
+        fprintf(stderr, YELLOW "Native reader not used on %s: %s; using %s.\n" RESET,
+                device, why, backend);
+        fflush(stderr);
+        execlp(backend, backend, "-c", "-s", device, (char *)NULL);
+        fprintf(stderr, RED "ERROR:" WHITE " cannot run %s: %s\n" RESET, backend, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool ok = pc_source_stream(device, &src, STDOUT_FILENO);
+    free((void *)src.bitmap);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
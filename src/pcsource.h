@@ -0,0 +1,54 @@
+#ifndef PCSOURCE_H
+#define PCSOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Partclone-compatible image source.
+ *
+ * Given a filesystem's used-block bitmap (built by one of Imprint's
+ * native readers, e.g. extfs.c), reads the used blocks straight from
+ * the device and writes a partclone v2 stream: header, bitmap and
+ * CRC32-checked data.  The result restores with partclone as well as
+ * with Imprint's native applier.
+ *
+ * Used blocks are cut into segments that several threads read at
+ * once with direct I/O, so fast devices see many requests in flight;
+ * short free gaps are read through so fragmented bitmaps still turn
+ * into large requests.  Segments are written out strictly in order.
+ */
+
+#define PC_SOURCE_DEFAULT_THREADS 8
+
+typedef struct {
+    const char *fs;               /* partclone fs name: "EXTFS", "NTFS" */
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t device_size;
+    const unsigned char *bitmap;  /* 1 bit per block, partclone order */
+    int threads;                  /* reader threads (0 = default) */
+} PcSource;
+
+bool pc_source_stream(const char *device, const PcSource *src, int out_fd);
+
+/*
+ * Fill src with the used-block bitmap of <device> from the native
+ * reader for <fs> ("extfs" or "ntfs"); the caller frees src->bitmap.
+ * On false, why holds the reason and *unsupported tells whether
+ * partclone could still handle the filesystem.
+ */
+bool pc_source_bitmap(const char *fs, const char *device, PcSource *src,
+                      bool *unsupported, char *why, size_t why_len);
+
+/*
+ * Entry point for `imprintb --native-stream <fs> <device> [threads]`:
+ * stream <device> with the native reader for <fs> ("extfs" or "ntfs").  If the
+ * filesystem uses anything the reader does not understand, the
+ * process becomes the matching partclone backend instead (nothing has
+ * been written by then), so the pipeline always gets an image.
+ */
+int pc_source_main(const char *fs, const char *device, int threads);
+
+#endif /* PCSOURCE_H */
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "pipeimg.h"
+#include "netimg.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <openssl/sha.h>
+
+#define PIPE_MAGIC        "IMPRSTRM"
+#define PIPE_MAGIC_LEN    8
+#define PIPE_RECORD_HDR   12
+
+/* The real stdout (imprintb) or stdin (imprintr), once claimed */
+static int pipe_fd = -1;
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* Bytes read; less than len only at end of stream.  -1 on error. */
+static ssize_t read_full(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+/* -------------------------------------------------------------
+ * Claiming stdin / stdout
+ * ------------------------------------------------------------- */
+bool pipe_claim_stdout(void)
+{
+    if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " --target - writes the image to stdout, which is a terminal;\n"
+                "       pipe it into another command or redirect it to a file.\n" RESET);
+        return false;
+    }
+
+    pipe_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (pipe_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("dup (stdout)");
+        return false;
+    }
+
+    /* Keep what goes to stdout in order with stderr */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    return true;
+}
+
+bool pipe_claim_stdin(void)
+{
+    if (isatty(STDIN_FILENO)) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " --image - reads the image from stdin, which is a terminal;\n"
+                "       pipe the output of imprintb --target - into it.\n" RESET);
+        return false;
+    }
+
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    pipe_fd = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+    if (null_fd < 0 || pipe_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0) {
+        perror("dup (stdin)");
+        if (null_fd >= 0)
+            close(null_fd);
+        return false;
+    }
+    close(null_fd);
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Writer
+ * ------------------------------------------------------------- */
+struct PipeWriter {
+    int fd;
+    SHA256_CTX sha;
+    uint64_t bytes;
+};
+
+static bool send_record(int fd, uint32_t type, const void *payload, size_t len)
+{
+    unsigned char hdr[PIPE_RECORD_HDR];
+
+    put_le32(hdr, type);
+    put_le32(hdr + 4, (uint32_t)len);
+    put_le32(hdr + 8, net_crc32c(0, payload, len));
+
+    return write_full(fd, hdr, sizeof(hdr)) && write_full(fd, payload, len);
+}
+
+/* A metadata file as one record */
+static bool send_file_record(int fd, uint32_t type, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read %s\n" RESET, path);
+        return false;
+    }
+
+    char *buf = malloc(PIPE_RECORD_MAX);
+    size_t n = buf ? fread(buf, 1, PIPE_RECORD_MAX, fp) : 0;
+    bool ok = buf && !ferror(fp) && feof(fp) && n > 0;
+
+    fclose(fp);
+
+    if (!ok)
+        fprintf(stderr, RED "ERROR:" WHITE " cannot put %s into the stream\n" RESET, path);
+    else
+        ok = send_record(fd, type, buf, n);
+
+    free(buf);
+    return ok;
+}
+
+PipeWriter *pipe_writer_open(const char *header_path)
+{
+    if (pipe_fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " stdout was not set aside for the image.\n" RESET);
+        return NULL;
+    }
+
+    PipeWriter *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->fd = pipe_fd;
+    SHA256_Init(&w->sha);
+
+    unsigned char start[PIPE_MAGIC_LEN + 4];
+    memcpy(start, PIPE_MAGIC, PIPE_MAGIC_LEN);
+    put_le32(start + PIPE_MAGIC_LEN, PIPE_VERSION);
+
+    if (!write_full(w->fd, start, sizeof(start)) ||
+        !send_file_record(w->fd, PIPE_HEAD, header_path)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot write to stdout: %s\n" RESET, strerror(errno));
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+bool pipe_writer_write(PipeWriter *w, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        size_t n = len < PIPE_RECORD_MAX ? len : PIPE_RECORD_MAX;
+
+        if (!send_record(w->fd, PIPE_DATA, p, n)) {
+            fprintf(stderr, RED "\nERROR:" WHITE " cannot write to stdout: %s\n" RESET,
+                    strerror(errno));
+            return false;
+        }
+
+        SHA256_Update(&w->sha, p, n);
+        w->bytes += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool pipe_writer_close(PipeWriter *w, const char *meta_path)
+{
+    if (!w)
+        return false;
+
+    bool ok = false;
+
+    if (meta_path) {
+        unsigned char end[SHA256_DIGEST_LENGTH + 8];
+        SHA256_Final(end, &w->sha);
+        put_le32(end + SHA256_DIGEST_LENGTH, (uint32_t)w->bytes);
+        put_le32(end + SHA256_DIGEST_LENGTH + 4, (uint32_t)(w->bytes >> 32));
+
+        ok = send_file_record(w->fd, PIPE_META, meta_path) &&
+             send_record(w->fd, PIPE_END, end, sizeof(end));
+    }
+
+    /* The reader sees EOF: the end of the stream, or a broken one */
+    close(w->fd);
+    pipe_fd = -1;
+    free(w);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Reader
+ * ------------------------------------------------------------- */
+struct PipeReader {
+    int fd;
+    SHA256_CTX sha;
+    uint64_t bytes;
+
+    unsigned char *rec;     /* current record's payload */
+    size_t rec_len;
+    size_t rec_pos;
+
+    char *header;
+    size_t header_len;
+
+    bool done;              /* END checked */
+    bool failed;
+};
+
+/*
+ * Next record into r->rec.  False, with a message, on a short or
+ * damaged stream.
+ */
+static bool next_record(PipeReader *r, uint32_t *type)
+{
+    unsigned char hdr[PIPE_RECORD_HDR];
+    ssize_t n = read_full(r->fd, hdr, sizeof(hdr));
+
+    if (n == 0) {
+        fprintf(stderr,
+                RED "\nERROR:" WHITE " the stream on stdin ended before the image was complete;\n"
+                "       the backup on the other end failed or was interrupted.\n" RESET);
+        return false;
+    }
+    if (n != (ssize_t)sizeof(hdr)) {
+        fprintf(stderr, RED "\nERROR:" WHITE " cannot read stdin: %s\n" RESET,
+                n < 0 ? strerror(errno) : "stream cut short");
+        return false;
+    }
+
+    *type = get_le32(hdr);
+    uint32_t len = get_le32(hdr + 4);
+
+    if (*type < PIPE_HEAD || *type > PIPE_END || len > PIPE_RECORD_MAX) {
+        fprintf(stderr, RED "\nERROR:" WHITE " the stream on stdin is damaged (bad record header).\n" RESET);
+        return false;
+    }
+
+    n = read_full(r->fd, r->rec, len);
+    if (n != (ssize_t)len) {
+        fprintf(stderr, RED "\nERROR:" WHITE " cannot read stdin: %s\n" RESET,
+                n < 0 ? strerror(errno) : "stream cut short");
+        return false;
+    }
+
+    if (net_crc32c(0, r->rec, len) != get_le32(hdr + 8)) {
+        fprintf(stderr, RED "\nERROR:" WHITE " the stream on stdin is damaged (CRC mismatch).\n" RESET);
+        return false;
+    }
+
+    r->rec_len = len;
+    r->rec_pos = 0;
+    return true;
+}
+
+PipeReader *pipe_reader_open(void)
+{
+    if (pipe_fd < 0)
+        return NULL;
+
+    PipeReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->fd = pipe_fd;
+    r->rec = malloc(PIPE_RECORD_MAX);
+    SHA256_Init(&r->sha);
+
+    unsigned char start[PIPE_MAGIC_LEN + 4];
+    ssize_t n = r->rec ? read_full(r->fd, start, sizeof(start)) : -1;
+    uint32_t type = 0;
+
+    if (n == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " stdin is empty; there is no image to restore.\n" RESET);
+    } else if (n != (ssize_t)sizeof(start) || memcmp(start, PIPE_MAGIC, PIPE_MAGIC_LEN) != 0) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " stdin does not carry an image stream from imprintb --target -.\n" RESET);
+    } else if (get_le32(start + PIPE_MAGIC_LEN) != PIPE_VERSION) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " the stream on stdin has version %u; this imprintr reads version %d.\n" RESET,
+                get_le32(start + PIPE_MAGIC_LEN), PIPE_VERSION);
+    } else if (next_record(r, &type)) {
+        if (type == PIPE_HEAD && r->rec_len > 0 && r->rec[0] == '{') {
+            r->header = malloc(r->rec_len + 1);
+            if (r->header) {
+                memcpy(r->header, r->rec, r->rec_len);
+                r->header[r->rec_len] = '\0';
+                r->header_len = r->rec_len;
+                r->rec_len = 0;
+                return r;
+            }
+        } else {
+            fprintf(stderr, RED "ERROR:" WHITE " the stream on stdin does not start with its metadata.\n" RESET);
+        }
+    }
+
+    pipe_reader_close(r);
+    return NULL;
+}
+
+const char *pipe_reader_header(const PipeReader *r, size_t *len)
+{
+    *len = r->header_len;
+    return r->header;
+}
+
+/* The trailer: same size, same SHA-256 */
+static bool check_end(PipeReader *r)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &r->sha);
+
+    if (r->rec_len != SHA256_DIGEST_LENGTH + 8) {
+        fprintf(stderr, RED "\nERROR:" WHITE " the stream on stdin is damaged (bad trailer).\n" RESET);
+        return false;
+    }
+
+    uint64_t size = (uint64_t)get_le32(r->rec + SHA256_DIGEST_LENGTH) |
+                    (uint64_t)get_le32(r->rec + SHA256_DIGEST_LENGTH + 4) << 32;
+
+    if (size != r->bytes || memcmp(digest, r->rec, SHA256_DIGEST_LENGTH) != 0) {
+        fprintf(stderr,
+                RED "\nERROR:" WHITE " the image read from stdin does not match its checksum.\n" RESET);
+        return false;
+    }
+    return true;
+}
+
+ssize_t pipe_reader_read(PipeReader *r, void *buf, size_t len)
+{
+    if (r->failed)
+        return -1;
+
+    while (r->rec_pos == r->rec_len) {
+        if (r->done)
+            return 0;
+
+        uint32_t type;
+        if (!next_record(r, &type)) {
+            r->failed = true;
+            return -1;
+        }
+
+        if (type == PIPE_DATA) {
+            SHA256_Update(&r->sha, r->rec, r->rec_len);
+            r->bytes += r->rec_len;
+        } else if (type == PIPE_END) {
+            if (!check_end(r)) {
+                r->failed = true;
+                return -1;
+            }
+            r->done = true;
+            r->rec_len = r->rec_pos = 0;
+        } else if (type == PIPE_META) {
+            /* Only for tools that keep the stream as files */
+            r->rec_len = r->rec_pos = 0;
+        } else {
+            fprintf(stderr, RED "\nERROR:" WHITE " the stream on stdin is damaged (second header).\n" RESET);
+            r->failed = true;
+            return -1;
+        }
+    }
+
+    size_t n = r->rec_len - r->rec_pos;
+    if (n > len)
+        n = len;
+
+    memcpy(buf, r->rec + r->rec_pos, n);
+    r->rec_pos += n;
+    return (ssize_t)n;
+}
+
+void pipe_reader_close(PipeReader *r)
+{
+    if (!r)
+        return;
+
+    free(r->rec);
+    free(r->header);
+    free(r);
+}
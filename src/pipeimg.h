@@ -0,0 +1,84 @@
+#ifndef PIPEIMG_H
+#define PIPEIMG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Images through a pipe, for transports Imprint knows nothing about
+ * (ssh, mbuffer, socat, a tape wrapper).
+ *
+ * `imprintb --target -` writes one self-describing stream to stdout:
+ * a header with the metadata known before the backup, the compressed
+ * image, and a trailer with the final metadata and the checksum.
+ * `imprintr --image -` reads it from stdin, checks the header before
+ * anything touches the target, and fails the restore if the image does
+ * not match the trailer's SHA-256.
+ *
+ * The stream is the magic "IMPRSTRM" and a version (u32), then records
+ * of a 12-byte header and a payload:
+ *
+ *   type, payload length, CRC-32C of the payload (little-endian u32)
+ *
+ *   HEAD   metadata JSON, checksum empty; always the first record
+ *   DATA   up to PIPE_RECORD_MAX bytes of the compressed image
+ *   META   metadata JSON as written next to a file image
+ *   END    SHA-256 of the image (32 bytes), image size (u64); last
+ *
+ * A stream that stops before END is a backup that did not complete.
+ */
+
+#define PIPE_TARGET        "-"
+#define PIPE_VERSION       1
+#define PIPE_RECORD_MAX    (1024 * 1024)
+
+enum {
+    PIPE_HEAD = 1,
+    PIPE_DATA,
+    PIPE_META,
+    PIPE_END
+};
+
+/*
+ * Take stdout for the stream: it moves to a private descriptor and
+ * fd 1 becomes a copy of stderr, so nothing printed can end up in the
+ * image.  False (printed) if stdout is a terminal.
+ */
+bool pipe_claim_stdout(void);
+
+/* Same for stdin, which becomes /dev/null. */
+bool pipe_claim_stdin(void);
+
+typedef struct PipeWriter PipeWriter;
+
+/* Start the stream on the claimed stdout, with header_path as HEAD. */
+PipeWriter *pipe_writer_open(const char *header_path);
+
+/* Append image bytes; false once the reading end has gone. */
+bool pipe_writer_write(PipeWriter *w, const void *buf, size_t len);
+
+/*
+ * Send meta_path as META and the END record, then free w.  meta_path
+ * NULL abandons the stream: the reader sees it end early.
+ */
+bool pipe_writer_close(PipeWriter *w, const char *meta_path);
+
+typedef struct PipeReader PipeReader;
+
+/* Read and check the start of the stream on the claimed stdin. */
+PipeReader *pipe_reader_open(void);
+
+/* The HEAD metadata (NUL-terminated) and its length. */
+const char *pipe_reader_header(const PipeReader *r, size_t *len);
+
+/*
+ * Same contract as image_reader_read() (see prefetch.h); 0 only after
+ * an END whose size and SHA-256 match what was read.
+ */
+ssize_t pipe_reader_read(PipeReader *r, void *buf, size_t len);
+
+void pipe_reader_close(PipeReader *r);
+
+#endif /* PIPEIMG_H */
@@ -0,0 +1,630 @@
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+#include "stripe.h"
+#include "pagecache.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Size of one read request / ring buffer slot */
+#define SEGMENT_SIZE  (4u * 1024 * 1024)
+
+/* Upper bound on parallel reader threads */
+#define MAX_WORKERS   8
+
+/* -------------------------------------------------------------
+ * Internal state
+ * ------------------------------------------------------------- */
+typedef enum {
+    FILE_OPEN,
+    FILE_END,      /* past the last chunk of the set */
+    FILE_ERROR
+} FileState;
+
+typedef struct {
+    int fd;
+    off_t size;
+    FileState state;
+} ChunkFile;
+
+typedef enum {
+    SLOT_FREE,
+    SLOT_FILLING,
+    SLOT_READY
+} SlotState;
+
+typedef struct {
+    unsigned char *buf;
+    size_t len;
+    size_t pos;          /* consumer position inside buf */
+    int chunk;
+    bool last_in_chunk;
+    bool failed;
+    SlotState state;
+} Segment;
+
+/*
+ * A lane claims the segments of every nlanes-th chunk, in stream order,
+ * into its own share of the ring.  A plain chunk set has one lane; a
+ * striped set has one per stripe directory, so the workers read ahead
+ * into the next chunk on every stripe at once instead of only the
+ * stripe the consumer is on.
+ */
+typedef struct {
+    Segment *slots;
+    int nslots;
+
+    /* Producer cursor */
+    unsigned long long next_seq;
+    int claim_chunk;
+    off_t claim_off;
+
+    /* Consumer cursor */
+    unsigned long long consume_seq;
+} Lane;
+
+struct ImageReader {
+    char base[1024];
+    bool chunked;
+    int chunk_count;             /* from the metadata, 0 = unknown */
+    StripeDirs stripes;          /* striped chunk set (see stripe.h) */
+    int depth;
+    bool drop_cache;             /* forget segments once they are copied */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Chunk files resolved by the opener thread */
+    ChunkFile *files;
+    int files_cap;
+    int files_known;
+    int end_chunk;               /* -1 while the end is unknown */
+
+    /* Ring buffer of segments, split between the lanes */
+    Segment *slots;
+    int nslots;
+    Lane lanes[STRIPE_MAX_DIRS];
+    int nlanes;
+
+    /* Chunk being consumed */
+    int consume_chunk;
+
+    bool stop;
+    bool error;
+
+    pthread_t opener;
+    pthread_t workers[MAX_WORKERS];
+    int nworkers;
+
+    unsigned long long position;
+};
+
+static void chunk_path(const ImageReader *r, int idx, char *out, size_t out_len)
+{
+    if (r->chunked)
+        stripe_chunk_path(&r->stripes, r->base, (unsigned)idx, out, out_len);
+    else
+        snprintf(out, out_len, "%s", r->base);
+}
+
+/* "chunk_count" in <image_base>.json, 0 if there is none */
+static int metadata_chunk_count(const char *image_base)
+{
+    char meta_path[1100];
+    snprintf(meta_path, sizeof(meta_path), "%s.json", image_base);
+
+    FILE *fp = fopen(meta_path, "r");
+    if (!fp)
+        return 0;
+
+    char line[4096];
+    int count = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "\"chunk_count\"");
+        if (!p)
+            continue;
+
+        p = strchr(p, ':');
+        if (p)
+            count = atoi(p + 1);
+        break;
+    }
+
+    fclose(fp);
+    return count > 0 ? count : 0;
+}
+
+static bool read_fully(int fd, unsigned char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (n == 0) {
+            errno = EIO;   /* file shrank underneath us */
+            return false;
+        }
+        done += (size_t)n;
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Opener thread: keeps up to `depth` chunks open ahead of the
+ * consumer and hints the kernel to start reading them.
+ * ------------------------------------------------------------- */
+static void *opener_main(void *arg)
+{
+    ImageReader *r = arg;
+    off_t window = (off_t)r->lanes[0].nslots * SEGMENT_SIZE;
+    int ahead = r->depth + r->nlanes - 1;   /* every lane's next chunk */
+
+    pthread_mutex_lock(&r->lock);
+
+    for (;;) {
+        while (!r->stop && r->end_chunk < 0 &&
+               r->files_known > r->consume_chunk + ahead)
+            pthread_cond_wait(&r->cond, &r->lock);
+
+        if (r->stop || r->end_chunk >= 0)
+            break;
+
+        int idx = r->files_known;
+        pthread_mutex_unlock(&r->lock);
+
+        ChunkFile cf = { -1, 0, FILE_END };
+
+        /* Without metadata, the first missing chunk ends the set */
+        bool in_set = r->chunked ? (r->chunk_count == 0 || idx < r->chunk_count)
+                                 : idx == 0;
+
+        if (in_set) {
+            char path[2200];
+            chunk_path(r, idx, path, sizeof(path));
+
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                if (!(errno == ENOENT && r->chunked && r->chunk_count == 0 && idx > 0)) {
+                    fprintf(stderr,
+                            RED "ERROR:" WHITE " cannot open image file %s: %s\n" RESET,
+                            path, strerror(errno));
+                    cf.state = FILE_ERROR;
+                }
+            } else {
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                    fprintf(stderr,
+                            RED "ERROR:" WHITE " cannot stat image file %s: %s\n" RESET,
+                            path, strerror(errno));
+                    close(fd);
+                    cf.state = FILE_ERROR;
+                } else {
+                    cf.fd = fd;
+                    cf.size = st.st_size;
+                    cf.state = FILE_OPEN;
+
+                    /* Start the transfer before any worker asks for it */
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                    posix_fadvise(fd, 0, st.st_size < window ? st.st_size : window,
+                                  POSIX_FADV_WILLNEED);
+                }
+            }
+        }
+
+        pthread_mutex_lock(&r->lock);
+
+        if (idx >= r->files_cap) {
+            int cap = r->files_cap ? r->files_cap * 2 : 16;
+            ChunkFile *nf = realloc(r->files, (size_t)cap * sizeof(*nf));
+            if (!nf) {
+                if (cf.fd >= 0)
+                    close(cf.fd);
+                cf.state = FILE_ERROR;
+            } else {
+                r->files = nf;
+                r->files_cap = cap;
+            }
+        }
+
+        if (idx < r->files_cap)
+            r->files[idx] = cf;
+
+        r->files_known = idx + 1;
+
+        if (cf.state != FILE_OPEN)
+            r->end_chunk = idx;
+        if (cf.state == FILE_ERROR)
+            r->error = true;
+
+        pthread_cond_broadcast(&r->cond);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/*
+ * Decide whether a worker can claim a segment of lane l (called with
+ * lock held).  Returns 1 = claim available, 0 = wait, -1 = nothing
+ * left to read.
+ */
+static int lane_claim_state(ImageReader *r, Lane *l)
+{
+    for (;;) {
+        if (r->stop || r->error)
+            return -1;
+
+        if (l->claim_chunk >= r->files_known)
+            return (r->end_chunk >= 0) ? -1 : 0;
+
+        ChunkFile *f = &r->files[l->claim_chunk];
+        if (f->state != FILE_OPEN)
+            return -1;
+
+        if (l->claim_off < f->size)
+            return (l->next_seq < l->consume_seq + (unsigned long long)l->nslots) ? 1 : 0;
+
+        /* Empty chunk: nothing will ever be consumed from it */
+        close(f->fd);
+        f->fd = -1;
+        l->claim_chunk += r->nlanes;
+        l->claim_off = 0;
+    }
+}
+
+/*
+ * Pick the lane to claim from (called with lock held): the claimable
+ * lane nearest the consumer.  Returns 1 = *out set, 0 = wait,
+ * -1 = nothing left to read in any lane.
+ */
+static int claim_state(ImageReader *r, Lane **out)
+{
+    int state = -1;
+
+    *out = NULL;
+    for (int i = 0; i < r->nlanes; i++) {
+        Lane *l = &r->lanes[i];
+        int st = lane_claim_state(r, l);
+
+        if (st == 1 && (!*out || l->claim_chunk < (*out)->claim_chunk))
+            *out = l;
+        if (st > state)
+            state = st;
+    }
+
+    return state;
+}
+
+/* -------------------------------------------------------------
+ * Worker threads: claim the next segment of a lane in stream order
+ * and fill its ring slot with a positional read.
+ * ------------------------------------------------------------- */
+static void *worker_main(void *arg)
+{
+    ImageReader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    for (;;) {
+        Lane *l;
+        int st;
+        while ((st = claim_state(r, &l)) == 0)
+            pthread_cond_wait(&r->cond, &r->lock);
+
+        if (st < 0)
+            break;
+
+        unsigned long long seq = l->next_seq++;
+        Segment *s = &l->slots[seq % (unsigned long long)l->nslots];
+        ChunkFile *f = &r->files[l->claim_chunk];
+
+        int chunk = l->claim_chunk;
+        int fd = f->fd;
+        off_t off = l->claim_off;
+        size_t len = SEGMENT_SIZE;
+        if ((off_t)len > f->size - off)
+            len = (size_t)(f->size - off);
+
+        l->claim_off += (off_t)len;
+        bool last = (l->claim_off >= f->size);
+        if (last) {
+            l->claim_chunk += r->nlanes;
+            l->claim_off = 0;
+        }
+
+        s->state = SLOT_FILLING;
+        s->chunk = chunk;
+        s->len = len;
+        s->pos = 0;
+        s->last_in_chunk = last;
+        s->failed = false;
+
+        pthread_mutex_unlock(&r->lock);
+
+        bool ok = true;
+        if (!s->buf)
+            s->buf = malloc(SEGMENT_SIZE);
+
+        if (!s->buf) {
+            ok = false;
+            errno = ENOMEM;
+        } else {
+            ok = read_fully(fd, s->buf, len, off);
+            if (ok && r->drop_cache)
+                cache_drop_read(fd, off, (off_t)len);
+        }
+
+        if (!ok) {
+            char path[2200];
+            chunk_path(r, chunk, path, sizeof(path));
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " read error on %s at offset %lld: %s\n" RESET,
+                    path, (long long)off, strerror(errno));
+        }
+
+        pthread_mutex_lock(&r->lock);
+        s->failed = !ok;
+        s->state = SLOT_READY;
+        pthread_cond_broadcast(&r->cond);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/* -------------------------------------------------------------
+ * Public API
+ * ------------------------------------------------------------- */
+ImageReader *image_reader_open(const char *image_base,
+                               bool chunked,
+                               int depth,
+                               int mem_mb,
+                               bool drop_cache)
+{
+    return image_reader_open_at(image_base, chunked, depth, mem_mb, drop_cache, 0, 0);
+}
+
+ImageReader *image_reader_open_at(const char *image_base,
+                                  bool chunked,
+                                  int depth,
+                                  int mem_mb,
+                                  bool drop_cache,
+                                  int first_chunk,
+                                  off_t first_off)
+{
+    if (!image_base || first_chunk < 0 || first_off < 0 || (!chunked && first_chunk > 0))
+        return NULL;
+
+    if (depth < 0)
+        depth = 0;
+    if (mem_mb <= 0)
+        mem_mb = PREFETCH_DEFAULT_MEM_MB;
+
+    ImageReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    snprintf(r->base, sizeof(r->base), "%s", image_base);
+    r->chunked = chunked;
+    if (chunked) {
+        stripe_dirs_load(r->base, &r->stripes);
+        r->chunk_count = metadata_chunk_count(r->base);
+    }
+    r->depth = depth;
+    r->drop_cache = drop_cache;
+    r->end_chunk = -1;
+
+    r->nlanes = (depth > 0 && r->stripes.count > 1) ? r->stripes.count : 1;
+
+    r->nworkers = depth > r->nlanes ? depth : r->nlanes;
+    if (r->nworkers > MAX_WORKERS)
+        r->nworkers = MAX_WORKERS;
+
+    r->nslots = (int)(((unsigned long long)mem_mb * 1024 * 1024) / SEGMENT_SIZE);
+    if (depth == 0)
+        r->nslots = 1;   /* strictly sequential: one read at a time */
+    else if (r->nslots < r->nworkers + 1)
+        r->nslots = r->nworkers + 1;
+    if (r->nslots < 2 * r->nlanes)
+        r->nslots = 2 * r->nlanes;
+
+    r->slots = calloc((size_t)r->nslots, sizeof(*r->slots));
+    if (!r->slots) {
+        free(r);
+        return NULL;
+    }
+
+    /* Chunks before the first one are never opened */
+    if (first_chunk > 0) {
+        r->files_cap = first_chunk + 16;
+        r->files = malloc((size_t)r->files_cap * sizeof(*r->files));
+        if (!r->files) {
+            free(r->slots);
+            free(r);
+            return NULL;
+        }
+        for (int i = 0; i < first_chunk; i++)
+            r->files[i] = (ChunkFile){ -1, 0, FILE_END };
+    }
+    r->files_known = first_chunk;
+    r->consume_chunk = first_chunk;
+
+    /* Lane i starts at the first chunk from first_chunk on that it owns */
+    int per_lane = r->nslots / r->nlanes;
+    for (int i = 0; i < r->nlanes; i++) {
+        Lane *l = &r->lanes[(first_chunk + i) % r->nlanes];
+
+        l->slots = r->slots + i * per_lane;
+        l->nslots = per_lane;
+        l->claim_chunk = first_chunk + i;
+        l->claim_off = i == 0 ? first_off : 0;
+    }
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (pthread_create(&r->opener, NULL, opener_main, r) != 0) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r->slots);
+        free(r);
+        return NULL;
+    }
+
+    int started = 0;
+    for (int i = 0; i < r->nworkers; i++) {
+        if (pthread_create(&r->workers[i], NULL, worker_main, r) != 0)
+            break;
+        started++;
+    }
+    r->nworkers = started;
+
+    if (started == 0) {
+        image_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+ssize_t image_reader_read(ImageReader *r, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (done < len) {
+        int chunk = r->consume_chunk;
+        Lane *l = &r->lanes[chunk % r->nlanes];
+        Segment *s = &l->slots[l->consume_seq % (unsigned long long)l->nslots];
+
+        if (l->consume_seq < l->next_seq) {
+            /* The lane skipped this chunk: it was empty */
+            if (s->chunk != chunk) {
+                r->consume_chunk = chunk + 1;
+                pthread_cond_broadcast(&r->cond);
+                continue;
+            }
+
+            while (s->state != SLOT_READY && !r->stop)
+                pthread_cond_wait(&r->cond, &r->lock);
+
+            if (r->stop)
+                break;
+
+            if (s->failed) {
+                r->error = true;
+                pthread_cond_broadcast(&r->cond);
+                pthread_mutex_unlock(&r->lock);
+                return -1;
+            }
+
+            /* The slot belongs to the consumer until it is freed. */
+            size_t n = s->len - s->pos;
+            if (n > len - done)
+                n = len - done;
+
+            pthread_mutex_unlock(&r->lock);
+            memcpy((unsigned char *)buf + done, s->buf + s->pos, n);
+            pthread_mutex_lock(&r->lock);
+
+            s->pos += n;
+            done += n;
+
+            if (s->pos == s->len) {
+                if (s->last_in_chunk) {
+                    close(r->files[s->chunk].fd);
+                    r->files[s->chunk].fd = -1;
+                    r->consume_chunk = s->chunk + 1;
+                }
+                s->state = SLOT_FREE;
+                l->consume_seq++;
+                pthread_cond_broadcast(&r->cond);
+            }
+            continue;
+        }
+
+        if (r->error) {
+            pthread_mutex_unlock(&r->lock);
+            return -1;
+        }
+
+        /* All segments claimed and consumed: end of image */
+        if (r->end_chunk >= 0 && chunk >= r->end_chunk)
+            break;
+
+        /* Empty chunk, already skipped by its lane */
+        if (l->claim_chunk > chunk) {
+            r->consume_chunk = chunk + 1;
+            pthread_cond_broadcast(&r->cond);
+            continue;
+        }
+
+        /* Hand back what we have rather than stalling the caller */
+        if (done > 0)
+            break;
+
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+
+    r->position += done;
+    pthread_mutex_unlock(&r->lock);
+
+    return (ssize_t)done;
+}
+
+unsigned long long image_reader_position(ImageReader *r)
+{
+    if (!r)
+        return 0;
+
+    pthread_mutex_lock(&r->lock);
+    unsigned long long pos = r->position;
+    pthread_mutex_unlock(&r->lock);
+    return pos;
+}
+
+void image_reader_close(ImageReader *r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->opener, NULL);
+    for (int i = 0; i < r->nworkers; i++)
+        pthread_join(r->workers[i], NULL);
+
+    for (int i = 0; i < r->files_known && i < r->files_cap; i++) {
+        if (r->files[i].fd >= 0)
+            close(r->files[i].fd);
+    }
+
+    for (int i = 0; i < r->nslots; i++)
+        free(r->slots[i].buf);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+
+    free(r->slots);
+    free(r->files);
+    free(r);
+}
@@ -0,0 +1,74 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Prefetching image reader.
+ *
+ * Presents a single-file image or a chunk set (base.000, base.001, ...)
+ * as one continuous byte stream, while worker threads open the next
+ * chunks ahead of time and read segments into a bounded ring buffer.
+ * This hides per-file open latency and keeps several reads in flight
+ * on high-latency media (SMB, NFS, USB).
+ *
+ * A striped chunk set (see stripe.h) is read with one claim cursor per
+ * stripe directory, each with its share of the ring, so every stripe
+ * is read ahead at once.
+ *
+ * Tunables:
+ *   depth  = how many chunk files may be opened ahead of the one
+ *            currently being consumed (0 = no read-ahead)
+ *   mem_mb = memory cap for the ring buffer of in-flight segments
+ */
+
+typedef struct ImageReader ImageReader;
+
+/* Default tunables (overridable via config or CLI). */
+#define PREFETCH_DEFAULT_DEPTH   4
+#define PREFETCH_DEFAULT_MEM_MB  256
+
+/*
+ * Open an image for streaming.
+ *   image_base = full image filename (single file) or chunk base
+ *                (without the .NNN suffix) when chunked is true;
+ *                a chunk set ends at the chunk_count recorded in
+ *                <image_base>.json, and a chunk missing before it is
+ *                a read error
+ *   drop_cache = drop what has been read from the page cache
+ *                (see pagecache.h)
+ * Returns NULL on failure (error already printed).
+ */
+ImageReader *image_reader_open(const char *image_base,
+                               bool chunked,
+                               int depth,
+                               int mem_mb,
+                               bool drop_cache);
+
+/*
+ * Same, but the stream starts first_off bytes into chunk first_chunk
+ * (or into the single file) instead of at the start of the image.
+ */
+ImageReader *image_reader_open_at(const char *image_base,
+                                  bool chunked,
+                                  int depth,
+                                  int mem_mb,
+                                  bool drop_cache,
+                                  int first_chunk,
+                                  off_t first_off);
+
+/*
+ * Read up to len bytes of the continuous stream.
+ * Returns number of bytes read, 0 at end of image, -1 on error.
+ */
+ssize_t image_reader_read(ImageReader *r, void *buf, size_t len);
+
+/* Total bytes handed to the caller so far. */
+unsigned long long image_reader_position(ImageReader *r);
+
+/* Stop all workers, close files and free the reader. */
+void image_reader_close(ImageReader *r);
+
+#endif /* PREFETCH_H */
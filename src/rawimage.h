@@ -0,0 +1,91 @@
+#ifndef RAWIMAGE_H
+#define RAWIMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Native raw images.
+ *
+ * Used for partitions partclone cannot image: swap, unknown
+ * filesystems, locked LUKS volumes.  The device is read with large
+ * direct I/O and only blocks that are not entirely zero are stored,
+ * so an empty or freshly provisioned partition images at read speed
+ * into a tiny file.
+ *
+ * Stream layout (all integers little endian):
+ *
+ *   header   RAW_HEADER_SIZE bytes: magic, version, block size,
+ *            device size, CRC32 of the preceding bytes
+ *   extents  one record per run of non-zero blocks:
+ *              tag "DATA", block count, first block (16 bytes),
+ *              block data, CRC32 of the data
+ *   trailer  tag "END ", extent count, data block count (16 bytes),
+ *            CRC32 of those 16 bytes
+ *
+ * Blocks not covered by an extent are zero on the source; restore
+ * recreates them by zeroing (which unmaps where the device supports
+ * it) or by punching holes in a file target.
+ *
+ * Version 2 adds a flags word at offset 32.  RAW_FLAG_DELTA marks an
+ * incremental image (see cbt.h): its extents are the blocks that
+ * changed since the parent image and every other block is left alone
+ * on restore.  Images without flags are still written as version 1.
+ */
+
+#define RAW_BACKEND          "imprint.raw"
+
+#define RAW_MAGIC            "imprint-raw"
+#define RAW_MAGIC_SIZE       12
+#define RAW_VERSION          1
+#define RAW_VERSION_FLAGS    2
+#define RAW_HEADER_SIZE      64
+#define RAW_RECORD_SIZE      16
+
+#define RAW_TAG_DATA         0x41544144u   /* "DATA" */
+#define RAW_TAG_END          0x20444E45u   /* "END " */
+
+#define RAW_FLAG_DELTA       0x1u
+
+/* Largest extent stored in one record */
+#define RAW_MAX_EXTENT_BYTES (4u * 1024 * 1024)
+
+typedef struct {
+    uint32_t block_size;
+    uint64_t device_size;
+    uint64_t total_blocks;
+    uint32_t flags;
+    uint32_t header_crc;
+} RawHeader;
+
+/* A byte range of the source device */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} RawRange;
+
+/* Validate a RAW_HEADER_SIZE-byte header; false with a reason in err. */
+bool raw_parse_header(const unsigned char *raw, RawHeader *out,
+                      char *err, size_t err_len);
+
+/* True if len bytes at buf are all zero (SSE4.1). */
+bool raw_is_zero(const void *buf, size_t len);
+
+/*
+ * Read `device` and write its raw image stream to out_fd.
+ * This is what `imprintb --raw-stream <device>` runs, so the stream
+ * can take partclone's place in the backup pipeline.
+ */
+bool raw_stream_device(const char *device, int out_fd);
+
+/*
+ * Image only the given ranges of `device`; the rest is treated as
+ * zero.  With RAW_FLAG_DELTA in flags the result is a delta image
+ * holding every block of the ranges, zeros included.  Ranges must be
+ * sorted and must not overlap.
+ */
+bool raw_stream_ranges(const char *device, const RawRange *ranges,
+                       size_t count, uint32_t flags, int out_fd);
+
+#endif /* RAWIMAGE_H */
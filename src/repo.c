@@ -0,0 +1,868 @@
+#define _GNU_SOURCE
+
+#include "repo.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zstd.h>
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+
+#define MAX_WORKERS      16
+#define ZSTD_LEVEL       6       /* same as framed images */
+#define BATCH_BYTES      (16u * 1024 * 1024)
+
+/* FastCDC normalized chunking: harder before the average, easier after */
+#define MASK_S           (~0ull << (64 - 18))
+#define MASK_L           (~0ull << (64 - 14))
+
+#define MARKER_LINE      "imprint-repo 1\n"
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void put_le64(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static int worker_count(int threads)
+{
+    if (threads <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = n > 0 ? (int)n : 1;
+    }
+    return threads > MAX_WORKERS ? MAX_WORKERS : threads;
+}
+
+static void chunk_path(const char *dir, const unsigned char hash[SHA256_DIGEST_LENGTH],
+                       char *out, size_t len)
+{
+    char hex[2 * SHA256_DIGEST_LENGTH + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+
+    snprintf(out, len, "%s/chunks/%.2s/%s", dir, hex, hex);
+}
+
+/* -------------------------------------------------------------
+ * Targets and layout
+ * ------------------------------------------------------------- */
+bool repo_parse_target(const char *target, char *dir, size_t dir_len,
+                       char *name, size_t name_len)
+{
+    size_t plen = strlen(REPO_PREFIX);
+    if (!target || strncmp(target, REPO_PREFIX, plen) != 0)
+        return false;
+
+    const char *path = target + plen;
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path || slash[1] == '\0')
+        return false;
+
+    size_t dlen = (size_t)(slash - path);
+    if (dlen >= dir_len || strlen(slash + 1) >= name_len)
+        return false;
+
+    memcpy(dir, path, dlen);
+    dir[dlen] = '\0';
+    snprintf(name, name_len, "%s", slash + 1);
+    return true;
+}
+
+bool repo_init(const char *dir)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/imprint-repo", dir);
+
+    struct stat st;
+    if (stat(path, &st) == 0)
+        return true;
+
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create repository %s: %s\n" RESET,
+                dir, strerror(errno));
+        return false;
+    }
+
+    char sub[PATH_MAX];
+    snprintf(sub, sizeof(sub), "%s/images", dir);
+    bool ok = mkdir(sub, 0755) == 0 || errno == EEXIST;
+
+    snprintf(sub, sizeof(sub), "%s/chunks", dir);
+    ok = ok && (mkdir(sub, 0755) == 0 || errno == EEXIST);
+
+    for (int i = 0; ok && i < 256; i++) {
+        snprintf(sub, sizeof(sub), "%s/chunks/%02x", dir, i);
+        ok = mkdir(sub, 0755) == 0 || errno == EEXIST;
+    }
+
+    /* The marker last: a half-made layout is simply completed next time */
+    FILE *fp = ok ? fopen(path, "w") : NULL;
+    if (fp) {
+        fputs(MARKER_LINE, fp);
+        ok = fclose(fp) == 0;
+    }
+
+    if (!ok || !fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot set up repository %s: %s\n" RESET,
+                dir, strerror(errno));
+        return false;
+    }
+
+    fprintf(stderr, YELLOW "Created image repository %s\n" RESET, dir);
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Content-defined chunking
+ * ------------------------------------------------------------- */
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The table is part of the repository format: other values move every
+ * chunk boundary and nothing would deduplicate against older images.
+ */
+static void gear_init(void)
+{
+    uint64_t x = 0x696d7072696e7421ull;   /* "imprint!" */
+
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/* Length of the chunk starting at p (n bytes available) */
+static size_t cdc_cut(const unsigned char *p, size_t n)
+{
+    if (n <= REPO_MIN_CHUNK)
+        return n;
+
+    size_t normal = n < REPO_AVG_CHUNK ? n : REPO_AVG_CHUNK;
+    size_t max = n < REPO_MAX_CHUNK ? n : REPO_MAX_CHUNK;
+    uint64_t h = 0;
+    size_t i = REPO_MIN_CHUNK;
+
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & MASK_S))
+            return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & MASK_L))
+            return i + 1;
+    }
+    return max;
+}
+
+/* -------------------------------------------------------------
+ * Writer
+ * ------------------------------------------------------------- */
+typedef struct {
+    size_t off;
+    uint32_t len;
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+} ChunkRef;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+
+    ChunkRef *chunks;
+    size_t count;
+    size_t cap;
+
+    /* Progress, under the writer lock */
+    size_t next;
+    size_t finished;
+    bool failed;
+} Batch;
+
+struct RepoWriter {
+    char dir[PATH_MAX];
+    char recipe[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    int fd;
+
+    pthread_t workers[MAX_WORKERS];
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    bool stop;
+    unsigned long tmp_seq;
+
+    Batch batches[2];
+    Batch *filling;
+    Batch *inflight;
+
+    SHA256_CTX sha;
+    RepoStats stats;
+    bool failed;
+};
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* Hash one chunk and store it unless the repository has it */
+static bool store_chunk(RepoWriter *w, const unsigned char *data, ChunkRef *c,
+                        ZSTD_CCtx *zctx, unsigned char *zbuf, size_t zcap)
+{
+    SHA256(data, c->len, c->hash);
+
+    char path[PATH_MAX + 80];
+    chunk_path(w->dir, c->hash, path, sizeof(path));
+
+    if (access(path, F_OK) == 0)
+        return true;
+
+    size_t n = ZSTD_compress2(zctx, zbuf, zcap, data, c->len);
+    if (ZSTD_isError(n)) {
+        fprintf(stderr, RED "\nERROR:" WHITE " compressing a chunk failed: %s\n" RESET,
+                ZSTD_getErrorName(n));
+        return false;
+    }
+
+    /* Write beside it, then link: concurrent writers of one chunk are fine */
+    char tmp[PATH_MAX + 128];
+    snprintf(tmp, sizeof(tmp), "%s.tmp%d.%lu", path, (int)getpid(),
+             __atomic_add_fetch(&w->tmp_seq, 1, __ATOMIC_RELAXED));
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && write_full(fd, zbuf, n);
+    if (fd >= 0 && close(fd) != 0)
+        ok = false;
+
+    bool added = false;
+    if (ok) {
+        if (link(tmp, path) == 0)
+            added = true;
+        else if (errno != EEXIST)
+            ok = false;
+    }
+
+    if (!ok)
+        fprintf(stderr, RED "\nERROR:" WHITE " cannot store chunk %s: %s\n" RESET,
+                path, strerror(errno));
+    if (fd >= 0)
+        unlink(tmp);
+
+    if (added) {
+        pthread_mutex_lock(&w->lock);
+        w->stats.new_chunks++;
+        w->stats.new_bytes += n;
+        pthread_mutex_unlock(&w->lock);
+    }
+    return ok;
+}
+
+static void *writer_worker(void *arg)
+{
+    RepoWriter *w = arg;
+    ZSTD_CCtx *zctx = ZSTD_createCCtx();
+    size_t zcap = ZSTD_compressBound(REPO_MAX_CHUNK);
+    unsigned char *zbuf = malloc(zcap);
+
+    if (zctx) {
+        ZSTD_CCtx_setParameter(zctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+        ZSTD_CCtx_setParameter(zctx, ZSTD_c_checksumFlag, 1);
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        Batch *b = w->inflight;
+
+        if (!b || b->next >= b->count) {
+            if (w->stop)
+                break;
+            pthread_cond_wait(&w->work_cv, &w->lock);
+            continue;
+        }
+
+        ChunkRef *c = &b->chunks[b->next++];
+        pthread_mutex_unlock(&w->lock);
+
+        bool ok = zctx && zbuf && store_chunk(w, b->data + c->off, c, zctx, zbuf, zcap);
+
+        pthread_mutex_lock(&w->lock);
+        if (!ok)
+            b->failed = true;
+        if (++b->finished == b->count)
+            pthread_cond_broadcast(&w->done_cv);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    ZSTD_freeCCtx(zctx);
+    free(zbuf);
+    return NULL;
+}
+
+/* Wait for the batch in flight and append it to the recipe */
+static bool finish_inflight(RepoWriter *w)
+{
+    pthread_mutex_lock(&w->lock);
+    Batch *b = w->inflight;
+    while (b && b->finished < b->count)
+        pthread_cond_wait(&w->done_cv, &w->lock);
+    w->inflight = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    if (!b)
+        return true;
+    if (b->failed)
+        return false;
+
+    for (size_t i = 0; i < b->count; i++) {
+        unsigned char e[REPO_RECIPE_ENTRY];
+        memcpy(e, b->chunks[i].hash, SHA256_DIGEST_LENGTH);
+        put_le32(e + SHA256_DIGEST_LENGTH, b->chunks[i].len);
+
+        if (!write_full(w->fd, e, sizeof(e))) {
+            fprintf(stderr, RED "\nERROR:" WHITE " writing %s failed: %s\n" RESET,
+                    w->tmp, strerror(errno));
+            return false;
+        }
+    }
+
+    w->stats.chunks += b->count;
+    return true;
+}
+
+/*
+ * Cut the filling batch into chunks (all of it when final, otherwise
+ * up to the last full-size window), hand it to the workers and carry
+ * the uncut tail over into the other batch.
+ */
+static bool dispatch(RepoWriter *w, bool final)
+{
+    if (!finish_inflight(w))
+        return false;
+
+    Batch *b = w->filling;
+    Batch *next = (b == &w->batches[0]) ? &w->batches[1] : &w->batches[0];
+    size_t pos = 0;
+
+    b->count = 0;
+    while (pos < b->len && (final || b->len - pos >= REPO_MAX_CHUNK)) {
+        if (b->count == b->cap) {
+            size_t cap = b->cap ? b->cap * 2 : 512;
+            ChunkRef *grown = realloc(b->chunks, cap * sizeof(*grown));
+            if (!grown)
+                return false;
+            b->chunks = grown;
+            b->cap = cap;
+        }
+
+        size_t n = cdc_cut(b->data + pos, b->len - pos);
+        b->chunks[b->count].off = pos;
+        b->chunks[b->count].len = (uint32_t)n;
+        b->count++;
+        pos += n;
+    }
+
+    memcpy(next->data, b->data + pos, b->len - pos);
+    next->len = b->len - pos;
+    w->filling = next;
+
+    if (b->count == 0)
+        return true;
+
+    pthread_mutex_lock(&w->lock);
+    b->next = 0;
+    b->finished = 0;
+    b->failed = false;
+    w->inflight = b;
+    pthread_cond_broadcast(&w->work_cv);
+    pthread_mutex_unlock(&w->lock);
+    return true;
+}
+
+RepoWriter *repo_writer_open(const char *dir, const char *name, int threads)
+{
+    pthread_once(&gear_once, gear_init);
+
+    RepoWriter *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    snprintf(w->recipe, sizeof(w->recipe), "%s/images/%s", dir, name);
+    snprintf(w->tmp, sizeof(w->tmp), "%s.tmp", w->recipe);
+
+    for (int i = 0; i < 2; i++) {
+        w->batches[i].data = malloc(BATCH_BYTES + REPO_MAX_CHUNK);
+        if (!w->batches[i].data)
+            goto fail;
+    }
+    w->filling = &w->batches[0];
+
+    w->fd = open(w->tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s: %s\n" RESET,
+                w->tmp, strerror(errno));
+        goto fail;
+    }
+
+    /* The header is filled in on close */
+    unsigned char header[REPO_RECIPE_HEADER] = { 0 };
+    if (!write_full(w->fd, header, sizeof(header)))
+        goto fail_fd;
+
+    SHA256_Init(&w->sha);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work_cv, NULL);
+    pthread_cond_init(&w->done_cv, NULL);
+
+    int want = worker_count(threads);
+    for (int i = 0; i < want; i++) {
+        if (pthread_create(&w->workers[i], NULL, writer_worker, w) != 0)
+            break;
+        w->nworkers++;
+    }
+
+    if (w->nworkers == 0) {
+        pthread_cond_destroy(&w->done_cv);
+        pthread_cond_destroy(&w->work_cv);
+        pthread_mutex_destroy(&w->lock);
+        goto fail_fd;
+    }
+
+    return w;
+
+fail_fd:
+    close(w->fd);
+    unlink(w->tmp);
+fail:
+    free(w->batches[0].data);
+    free(w->batches[1].data);
+    free(w);
+    return NULL;
+}
+
+bool repo_writer_write(RepoWriter *w, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    if (w->failed)
+        return false;
+
+    SHA256_Update(&w->sha, p, len);
+    w->stats.raw_bytes += len;
+
+    while (len > 0) {
+        Batch *b = w->filling;
+        size_t room = BATCH_BYTES + REPO_MAX_CHUNK - b->len;
+        size_t take = len < room ? len : room;
+
+        memcpy(b->data + b->len, p, take);
+        b->len += take;
+        p += take;
+        len -= take;
+
+        if (b->len == BATCH_BYTES + REPO_MAX_CHUNK && !dispatch(w, false)) {
+            w->failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool repo_writer_close(RepoWriter *w, bool success, RepoStats *stats)
+{
+    bool ok = success && !w->failed;
+
+    if (ok)
+        ok = dispatch(w, true);
+
+    /* Always drain the workers before stopping them */
+    bool drained = finish_inflight(w);
+    ok = ok && drained;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_broadcast(&w->work_cv);
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->nworkers; i++)
+        pthread_join(w->workers[i], NULL);
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &w->sha);
+
+    if (ok) {
+        unsigned char h[REPO_RECIPE_HEADER] = { 0 };
+        memcpy(h, REPO_RECIPE_MAGIC, strlen(REPO_RECIPE_MAGIC));
+        put_le32(h + 16, REPO_RECIPE_VERSION);
+        put_le32(h + 20, REPO_RECIPE_ENTRY);
+        put_le64(h + 24, w->stats.chunks);
+        put_le64(h + 32, w->stats.raw_bytes);
+        memcpy(h + 40, digest, SHA256_DIGEST_LENGTH);
+
+        ok = pwrite(w->fd, h, sizeof(h), 0) == (ssize_t)sizeof(h) && fsync(w->fd) == 0;
+    }
+
+    if (close(w->fd) != 0)
+        ok = false;
+
+    if (ok && rename(w->tmp, w->recipe) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s: %s\n" RESET,
+                w->recipe, strerror(errno));
+        ok = false;
+    }
+
+    /* sha256sum format, read back by write_metadata_ex() */
+    if (ok) {
+        char sha_path[PATH_MAX + 8];
+        snprintf(sha_path, sizeof(sha_path), "%s.sha256", w->recipe);
+
+        const char *base = strrchr(w->recipe, '/');
+        FILE *fp = fopen(sha_path, "w");
+        if (fp) {
+            for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+                fprintf(fp, "%02x", digest[i]);
+            fprintf(fp, "  %s\n", base ? base + 1 : w->recipe);
+            ok = fclose(fp) == 0;
+        } else {
+            ok = false;
+        }
+    }
+
+    if (!ok)
+        unlink(w->tmp);
+
+    if (stats)
+        *stats = w->stats;
+
+    pthread_cond_destroy(&w->done_cv);
+    pthread_cond_destroy(&w->work_cv);
+    pthread_mutex_destroy(&w->lock);
+    for (int i = 0; i < 2; i++) {
+        free(w->batches[i].data);
+        free(w->batches[i].chunks);
+    }
+    free(w);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Reader
+ * ------------------------------------------------------------- */
+enum { FETCH_EMPTY, FETCH_READY, FETCH_FAILED };
+
+typedef struct {
+    int state;
+    unsigned char *data;
+    uint32_t len;
+} FetchSlot;
+
+struct RepoReader {
+    char dir[PATH_MAX];
+
+    const unsigned char *map;    /* the recipe */
+    size_t map_len;
+    uint64_t count;
+    uint64_t total;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+
+    pthread_t workers[MAX_WORKERS];
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bool stop;
+
+    /* Chunk i is fetched into slot i % nslots */
+    FetchSlot *slots;
+    uint64_t nslots;
+    uint64_t next_fetch;
+    uint64_t cur;                /* chunk being consumed */
+    size_t cur_off;
+
+    SHA256_CTX sha;
+    bool failed;
+};
+
+static const unsigned char *recipe_entry(const RepoReader *r, uint64_t i)
+{
+    return r->map + REPO_RECIPE_HEADER + i * REPO_RECIPE_ENTRY;
+}
+
+/* Read, decompress and check chunk i */
+static unsigned char *fetch_chunk(RepoReader *r, uint64_t i, uint32_t *len)
+{
+    const unsigned char *e = recipe_entry(r, i);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    *len = get_le32(e + SHA256_DIGEST_LENGTH);
+
+    char path[PATH_MAX + 80];
+    chunk_path(r->dir, e, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, RED "\nERROR:" WHITE " missing chunk %s: %s\n" RESET, path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    unsigned char *comp = malloc((size_t)st.st_size ? (size_t)st.st_size : 1);
+    unsigned char *data = malloc(*len ? *len : 1);
+    bool ok = comp && data && read(fd, comp, (size_t)st.st_size) == st.st_size;
+    close(fd);
+
+    if (ok) {
+        size_t n = ZSTD_decompress(data, *len, comp, (size_t)st.st_size);
+        ok = !ZSTD_isError(n) && n == *len;
+    }
+
+    if (ok) {
+        SHA256(data, *len, hash);
+        ok = memcmp(hash, e, SHA256_DIGEST_LENGTH) == 0;
+    }
+
+    free(comp);
+    if (!ok) {
+        fprintf(stderr, RED "\nERROR:" WHITE " chunk %s is damaged.\n" RESET, path);
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static void *reader_worker(void *arg)
+{
+    RepoReader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    for (;;) {
+        if (r->stop || r->next_fetch >= r->count)
+            break;
+
+        /* Stay within the window of slots the consumer has freed */
+        if (r->next_fetch >= r->cur + r->nslots) {
+            pthread_cond_wait(&r->cv, &r->lock);
+            continue;
+        }
+
+        uint64_t i = r->next_fetch++;
+        pthread_mutex_unlock(&r->lock);
+
+        uint32_t len;
+        unsigned char *data = fetch_chunk(r, i, &len);
+
+        pthread_mutex_lock(&r->lock);
+        FetchSlot *s = &r->slots[i % r->nslots];
+        s->data = data;
+        s->len = len;
+        s->state = data ? FETCH_READY : FETCH_FAILED;
+        pthread_cond_broadcast(&r->cv);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+RepoReader *repo_reader_open(const char *recipe, int threads, int mem_mb)
+{
+    RepoReader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    /* <dir>/images/<name> */
+    snprintf(r->dir, sizeof(r->dir), "%s", recipe);
+    for (int up = 0; up < 2; up++) {
+        char *slash = strrchr(r->dir, '/');
+        if (slash)
+            *slash = '\0';
+        else
+            snprintf(r->dir, sizeof(r->dir), "%s", up ? "." : "..");
+    }
+
+    int fd = open(recipe, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < REPO_RECIPE_HEADER) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read recipe %s\n" RESET, recipe);
+        if (fd >= 0)
+            close(fd);
+        free(r);
+        return NULL;
+    }
+
+    r->map_len = (size_t)st.st_size;
+    void *map = mmap(NULL, r->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot map %s: %s\n" RESET, recipe, strerror(errno));
+        free(r);
+        return NULL;
+    }
+    r->map = map;
+
+    const unsigned char *h = r->map;
+    r->count = get_le64(h + 24);
+    r->total = get_le64(h + 32);
+    memcpy(r->digest, h + 40, SHA256_DIGEST_LENGTH);
+
+    if (memcmp(h, REPO_RECIPE_MAGIC, strlen(REPO_RECIPE_MAGIC)) != 0 ||
+        get_le32(h + 16) != REPO_RECIPE_VERSION || get_le32(h + 20) != REPO_RECIPE_ENTRY ||
+        r->count > (r->map_len - REPO_RECIPE_HEADER) / REPO_RECIPE_ENTRY) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s is not a valid image recipe.\n" RESET, recipe);
+        munmap(map, r->map_len);
+        free(r);
+        return NULL;
+    }
+
+    uint64_t slots = (uint64_t)(mem_mb > 0 ? mem_mb : 64) * 1024 * 1024 / REPO_MAX_CHUNK;
+    int nworkers = worker_count(threads);
+    if (slots < (uint64_t)nworkers * 2)
+        slots = (uint64_t)nworkers * 2;
+    r->nslots = slots;
+    r->slots = calloc(slots, sizeof(*r->slots));
+    if (!r->slots) {
+        munmap(map, r->map_len);
+        free(r);
+        return NULL;
+    }
+
+    SHA256_Init(&r->sha);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cv, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&r->workers[i], NULL, reader_worker, r) != 0)
+            break;
+        r->nworkers++;
+    }
+
+    if (r->nworkers == 0) {
+        repo_reader_close(r);
+        return NULL;
+    }
+
+    fprintf(stderr, YELLOW "Repository image: %llu chunks, %.2f MB, fetched on %d threads\n" RESET,
+            (unsigned long long)r->count, r->total / (1024.0 * 1024.0), r->nworkers);
+    return r;
+}
+
+ssize_t repo_reader_read(RepoReader *r, void *buf, size_t len)
+{
+    unsigned char *out = buf;
+    size_t done = 0;
+
+    if (r->failed)
+        return -1;
+
+    while (done < len && r->cur < r->count) {
+        FetchSlot *s = &r->slots[r->cur % r->nslots];
+
+        pthread_mutex_lock(&r->lock);
+        while (s->state == FETCH_EMPTY)
+            pthread_cond_wait(&r->cv, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+
+        if (s->state == FETCH_FAILED) {
+            r->failed = true;
+            return -1;
+        }
+
+        size_t take = s->len - r->cur_off;
+        if (take > len - done)
+            take = len - done;
+
+        memcpy(out + done, s->data + r->cur_off, take);
+        SHA256_Update(&r->sha, s->data + r->cur_off, take);
+        done += take;
+        r->cur_off += take;
+
+        if (r->cur_off == s->len) {
+            pthread_mutex_lock(&r->lock);
+            free(s->data);
+            s->data = NULL;
+            s->state = FETCH_EMPTY;
+            r->cur++;
+            r->cur_off = 0;
+            pthread_cond_broadcast(&r->cv);
+            pthread_mutex_unlock(&r->lock);
+
+            /* The whole stream must match what was backed up */
+            if (r->cur == r->count) {
+                unsigned char digest[SHA256_DIGEST_LENGTH];
+                SHA256_Final(digest, &r->sha);
+                if (memcmp(digest, r->digest, SHA256_DIGEST_LENGTH) != 0) {
+                    fprintf(stderr, RED "\nERROR:" WHITE " the restored stream does not match its recipe checksum.\n" RESET);
+                    r->failed = true;
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return (ssize_t)done;
+}
+
+void repo_reader_close(RepoReader *r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cv);
+    pthread_mutex_unlock(&r->lock);
+
+    for (int i = 0; i < r->nworkers; i++)
+        pthread_join(r->workers[i], NULL);
+
+    for (uint64_t i = 0; i < r->nslots; i++)
+        free(r->slots[i].data);
+
+    pthread_cond_destroy(&r->cv);
+    pthread_mutex_destroy(&r->lock);
+    free(r->slots);
+    munmap((void *)r->map, r->map_len);
+    free(r);
+}
@@ -0,0 +1,101 @@
+#ifndef REPO_H
+#define REPO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Deduplicating image repository.
+ *
+ * `imprintb --target repo://<dir>/<name>` stores the image stream in a
+ * repository shared by any number of images and machines instead of a
+ * compressed file of its own.  The stream is cut into variable-size
+ * chunks at content-defined boundaries (FastCDC: a Gear rolling hash
+ * with normalized chunking), so data that moved or was reimaged still
+ * falls into identical chunks.  Worker threads hash the chunks
+ * (SHA-256) and compress and store the ones the repository does not
+ * have yet; every chunk is stored once.
+ *
+ * Layout:
+ *
+ *   <dir>/imprint-repo            marker
+ *   <dir>/chunks/xx/<sha256>      one zstd frame per unique chunk,
+ *                                 xx = first byte of the hash
+ *   <dir>/images/<name>           recipe: the image as a chunk list
+ *   <dir>/images/<name>.json      metadata, "compression": "repo"
+ *   <dir>/images/<name>.sha256    SHA-256 of the uncompressed stream
+ *
+ * Recipe (integers little endian): REPO_RECIPE_HEADER bytes of magic,
+ * version, entry size, chunk count, stream length and stream SHA-256,
+ * then one entry per chunk: SHA-256 and uncompressed length (u32).
+ *
+ * imprintr restores a recipe by fetching and decompressing chunks on
+ * several threads ahead of the applier, checking every chunk and the
+ * whole stream against their hashes.
+ *
+ * Chunks are never removed; there is no pruning of images yet.
+ */
+
+#define REPO_PREFIX         "repo://"
+
+/* "compression" recorded in the metadata of repository images */
+#define REPO_COMPRESSION    "repo"
+
+#define REPO_MIN_CHUNK      (16u * 1024)
+#define REPO_AVG_CHUNK      (64u * 1024)
+#define REPO_MAX_CHUNK      (256u * 1024)
+
+#define REPO_RECIPE_MAGIC   "imprint-recipe"
+#define REPO_RECIPE_VERSION 1
+#define REPO_RECIPE_HEADER  72
+#define REPO_RECIPE_ENTRY   36
+
+/*
+ * Split "repo://<dir>/<name>" into its parts.  False if `target` is
+ * not a repository target (or has no image name).
+ */
+bool repo_parse_target(const char *target, char *dir, size_t dir_len,
+                       char *name, size_t name_len);
+
+/* Create the repository layout in `dir` unless it exists. */
+bool repo_init(const char *dir);
+
+typedef struct RepoWriter RepoWriter;
+
+typedef struct {
+    uint64_t raw_bytes;          /* image stream length */
+    uint64_t chunks;
+    uint64_t new_chunks;         /* chunks the repository did not have */
+    uint64_t new_bytes;          /* their compressed size */
+} RepoStats;
+
+/*
+ * Start image `name` in the repository at `dir`.
+ * threads = hashing/compression workers (0 = one per CPU, capped)
+ */
+RepoWriter *repo_writer_open(const char *dir, const char *name, int threads);
+
+bool repo_writer_write(RepoWriter *w, const void *buf, size_t len);
+
+/*
+ * Finish the image: the recipe and checksum appear only on success.
+ * Chunks already stored stay in the repository either way.
+ */
+bool repo_writer_close(RepoWriter *w, bool success, RepoStats *stats);
+
+typedef struct RepoReader RepoReader;
+
+/*
+ * Open the recipe <dir>/images/<name> for streaming.  threads fetch
+ * chunks ahead within mem_mb of buffers.  NULL on failure (printed).
+ */
+RepoReader *repo_reader_open(const char *recipe, int threads, int mem_mb);
+
+/* Same contract as image_reader_read() (see prefetch.h). */
+ssize_t repo_reader_read(RepoReader *r, void *buf, size_t len);
+
+void repo_reader_close(RepoReader *r);
+
+#endif /* REPO_H */
@@ -0,0 +1,717 @@
+#define _GNU_SOURCE
+
+#include "rescue.h"
+#include "pcsource.h"
+#include "pcimage.h"
+#include "rawimage.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#define RESCUE_READ_SIZE   (1u << 20)
+#define RESCUE_TRIM_SIZE   (64u << 10)
+#define RESCUE_MAX_SKIP    (1ull << 30)
+#define RESCUE_EDGE_BYTES  (1ull << 20)
+#define RESCUE_MFT_DEFAULT (16ull << 20)
+#define RESCUE_ALIGN       4096
+
+/* -------------------------------------------------------------
+ * Range lists
+ * ------------------------------------------------------------- */
+typedef struct {
+    RawRange *r;
+    size_t count;
+    size_t cap;
+} RangeList;
+
+static bool list_add(RangeList *l, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return true;
+
+    if (l->count > 0) {
+        RawRange *last = &l->r[l->count - 1];
+        if (last->offset + last->length == offset) {
+            last->length += length;
+            return true;
+        }
+    }
+
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 256;
+        RawRange *grown = realloc(l->r, cap * sizeof(*grown));
+        if (!grown)
+            return false;
+        l->r = grown;
+        l->cap = cap;
+    }
+
+    l->r[l->count++] = (RawRange){ offset, length };
+    return true;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+    const RawRange *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/* Sort and merge overlapping or touching ranges in place */
+static void list_normalize(RangeList *l)
+{
+    if (l->count < 2)
+        return;
+
+    qsort(l->r, l->count, sizeof(*l->r), range_cmp);
+
+    size_t out = 0;
+    for (size_t i = 1; i < l->count; i++) {
+        RawRange *last = &l->r[out];
+        uint64_t last_end = last->offset + last->length;
+
+        if (l->r[i].offset <= last_end) {
+            uint64_t end = l->r[i].offset + l->r[i].length;
+            if (end > last_end)
+                last->length = end - last->offset;
+        } else {
+            l->r[++out] = l->r[i];
+        }
+    }
+    l->count = out + 1;
+}
+
+/* Widen every range to whole units within [0, size), then normalize */
+static void list_round_out(RangeList *l, uint32_t unit, uint64_t size)
+{
+    for (size_t i = 0; i < l->count; i++) {
+        uint64_t end = l->r[i].offset + l->r[i].length;
+        l->r[i].offset -= l->r[i].offset % unit;
+        end = (end + unit - 1) / unit * unit;
+        l->r[i].length = (end > size ? size : end) - l->r[i].offset;
+    }
+    list_normalize(l);
+}
+
+static uint64_t list_bytes(const RangeList *l)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < l->count; i++)
+        total += l->r[i].length;
+    return total;
+}
+
+/* out = a minus b; both normalized */
+static bool list_subtract(const RangeList *a, const RangeList *b, RangeList *out)
+{
+    size_t j = 0;
+
+    for (size_t i = 0; i < a->count; i++) {
+        uint64_t off = a->r[i].offset;
+        uint64_t end = off + a->r[i].length;
+
+        while (j < b->count && b->r[j].offset + b->r[j].length <= off)
+            j++;
+
+        for (size_t k = j; k < b->count && b->r[k].offset < end && off < end; k++) {
+            if (b->r[k].offset > off && !list_add(out, off, b->r[k].offset - off))
+                return false;
+            uint64_t bend = b->r[k].offset + b->r[k].length;
+            if (bend > off)
+                off = bend;
+        }
+
+        if (off < end && !list_add(out, off, end - off))
+            return false;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Metadata first: where the filesystem keeps its structure
+ * ------------------------------------------------------------- */
+static uint16_t le16(const unsigned char *p) { return (uint16_t)(p[0] | p[1] << 8); }
+static uint32_t le32(const unsigned char *p) { return le16(p) | (uint32_t)le16(p + 2) << 16; }
+static uint64_t le64(const unsigned char *p) { return le32(p) | (uint64_t)le32(p + 4) << 32; }
+
+static bool pread_exact(int fd, void *buf, size_t len, uint64_t off)
+{
+    return pread(fd, buf, len, (off_t)off) == (ssize_t)len;
+}
+
+/* ext2/3/4: descriptor table, block and inode bitmaps, used inode tables */
+static void ext_metadata(int fd, uint64_t size, RangeList *meta)
+{
+    unsigned char sb[1024];
+    if (!pread_exact(fd, sb, sizeof(sb), 1024) || le16(sb + 0x38) != 0xEF53)
+        return;
+
+    uint32_t log_bs = le32(sb + 0x18);
+    if (log_bs > 6)
+        return;
+
+    uint64_t bs = 1024ull << log_bs;
+    uint64_t blocks = le32(sb + 0x04);
+    uint32_t first_data = le32(sb + 0x14);
+    uint32_t per_group = le32(sb + 0x20);
+    uint32_t inodes_per_group = le32(sb + 0x28);
+    uint32_t inode_size = le16(sb + 0x58);
+    bool is64 = (le32(sb + 0x60) & 0x80) != 0;
+    uint32_t desc_size = is64 ? le16(sb + 0xFE) : 32;
+
+    if (is64)
+        blocks |= (uint64_t)le32(sb + 0x150) << 32;
+    if (per_group == 0 || desc_size < 32 || inode_size == 0)
+        return;
+
+    uint64_t groups = (blocks - first_data + per_group - 1) / per_group;
+    uint64_t gdt_off = (first_data + 1) * bs;
+    uint64_t gdt_len = groups * desc_size;
+
+    if (gdt_off + gdt_len > size || gdt_len > (64u << 20))
+        return;
+
+    list_add(meta, 0, gdt_off + gdt_len);
+
+    unsigned char *gdt = malloc(gdt_len);
+    if (!gdt || !pread_exact(fd, gdt, gdt_len, gdt_off)) {
+        free(gdt);
+        return;
+    }
+
+    for (uint64_t g = 0; g < groups; g++) {
+        const unsigned char *d = gdt + g * desc_size;
+        uint64_t bbm = le32(d + 0x00), ibm = le32(d + 0x04), itab = le32(d + 0x08);
+        uint64_t unused = le16(d + 0x1C);
+
+        if (desc_size >= 64) {
+            bbm |= (uint64_t)le32(d + 0x20) << 32;
+            ibm |= (uint64_t)le32(d + 0x24) << 32;
+            itab |= (uint64_t)le32(d + 0x28) << 32;
+            unused |= (uint64_t)le16(d + 0x32) << 16;
+        }
+
+        /* Only the part of the inode table that holds inodes */
+        uint64_t used = unused < inodes_per_group ? inodes_per_group - unused : 0;
+        uint64_t itab_len = (used * inode_size + bs - 1) / bs * bs;
+
+        if ((bbm + 1) * bs <= size)
+            list_add(meta, bbm * bs, bs);
+        if ((ibm + 1) * bs <= size)
+            list_add(meta, ibm * bs, bs);
+        if (itab * bs + itab_len <= size)
+            list_add(meta, itab * bs, itab_len);
+    }
+    free(gdt);
+}
+
+/* NTFS: the extents of $MFT (from its own record) and $MFTMirr */
+static void ntfs_metadata(int fd, uint64_t size, RangeList *meta)
+{
+    unsigned char boot[512];
+    if (!pread_exact(fd, boot, sizeof(boot), 0) || memcmp(boot + 3, "NTFS    ", 8) != 0)
+        return;
+
+    uint64_t sector = le16(boot + 0x0B);
+    uint8_t spc = boot[0x0D];
+    uint64_t cluster = sector * (spc > 0x80 ? 1u << (256 - spc) : spc);
+    int8_t rec = (int8_t)boot[0x40];
+    uint64_t rec_size = rec < 0 ? 1ull << -rec : (uint64_t)rec * cluster;
+
+    if (cluster == 0 || rec_size < 512 || rec_size > 4096)
+        return;
+
+    uint64_t mft = le64(boot + 0x30) * cluster;
+    uint64_t mirr = le64(boot + 0x38) * cluster;
+
+    if (mirr + cluster <= size)
+        list_add(meta, mirr, cluster);
+
+    unsigned char r[4096];
+    if (mft + rec_size > size || !pread_exact(fd, r, rec_size, mft) || memcmp(r, "FILE", 4) != 0)
+        goto fallback;
+
+    /* Undo the update sequence so the attributes read correctly */
+    uint16_t usa = le16(r + 4), usa_count = le16(r + 6);
+    if (usa + usa_count * 2u > rec_size || (usa_count - 1u) * 512u > rec_size)
+        goto fallback;
+    for (uint16_t i = 1; i < usa_count; i++)
+        memcpy(r + i * 512 - 2, r + usa + i * 2, 2);
+
+    size_t before = meta->count;
+    uint32_t a = le16(r + 0x14);
+
+    while (a + 16 <= rec_size) {
+        uint32_t type = le32(r + a), len = le32(r + a + 4);
+        if (type == 0xFFFFFFFFu || len < 16 || a + len > rec_size)
+            break;
+
+        /* Unnamed, non-resident $DATA */
+        if (type == 0x80 && r[a + 8] == 1 && r[a + 9] == 0) {
+            uint32_t p = a + le16(r + a + 0x20);
+            int64_t lcn = 0;
+
+            while (p < a + len && r[p] != 0) {
+                unsigned ls = r[p] & 0xF, os = r[p] >> 4;
+                if (ls == 0 || ls > 8 || os > 8 || p + 1 + ls + os > a + len)
+                    break;
+
+                uint64_t run = 0;
+                for (unsigned k = 0; k < ls; k++)
+                    run |= (uint64_t)r[p + 1 + k] << (8 * k);
+
+                if (os) {
+                    int64_t delta = 0;
+                    for (unsigned k = 0; k < os; k++)
+                        delta |= (int64_t)r[p + 1 + ls + k] << (8 * k);
+                    if (r[p + ls + os] & 0x80)
+                        delta -= (int64_t)1 << (8 * os);
+                    lcn += delta;
+
+                    if (lcn >= 0 && ((uint64_t)lcn + run) * cluster <= size)
+                        list_add(meta, (uint64_t)lcn * cluster, run * cluster);
+                }
+                p += 1 + ls + os;
+            }
+            break;
+        }
+        a += len;
+    }
+
+    if (meta->count > before)
+        return;
+
+fallback:
+    if (mft < size)
+        list_add(meta, mft, size - mft < RESCUE_MFT_DEFAULT ? size - mft : RESCUE_MFT_DEFAULT);
+}
+
+/* -------------------------------------------------------------
+ * Reading
+ * ------------------------------------------------------------- */
+typedef struct {
+    const char *device;
+    int fd;
+    int out;                /* staging file */
+    uint64_t size;
+    uint32_t unit;          /* smallest read */
+    unsigned char *buf;
+    double slow_sec;
+    bool gone;              /* the disk stopped answering altogether */
+
+    RangeList pending;      /* skipped or unreadable */
+    uint64_t rescued;
+    uint64_t total;
+    const char *phase;
+    double t_report;
+} Rescue;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(Rescue *R, bool force)
+{
+    double t = now_sec();
+    if (!force && t - R->t_report < 1.0)
+        return;
+
+    fprintf(stderr, WHITE "\r%s: rescued %.1f of %.1f MB, %.1f MB pending " RESET,
+            R->phase, R->rescued / (1024.0 * 1024.0), R->total / (1024.0 * 1024.0),
+            list_bytes(&R->pending) / (1024.0 * 1024.0));
+    R->t_report = t;
+}
+
+/* Bytes read from `off` before the first error; *slow if it dragged */
+static size_t read_span(Rescue *R, uint64_t off, size_t len, bool *slow)
+{
+    size_t done = 0;
+    double t0 = now_sec();
+
+    while (done < len) {
+        ssize_t n = pread(R->fd, R->buf + done, len - done, (off_t)(off + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EINVAL && (fcntl(R->fd, F_GETFL) & O_DIRECT)) {
+                fcntl(R->fd, F_SETFL, fcntl(R->fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+            if (errno == ENODEV || errno == ENXIO || errno == ENOMEDIUM) {
+                if (!R->gone)
+                    fprintf(stderr, RED "\nERROR:" WHITE " %s stopped responding: %s\n" RESET,
+                            R->device, strerror(errno));
+                R->gone = true;
+            }
+            break;
+        }
+        if (n == 0)
+            break;
+        done += (size_t)n;
+    }
+
+    *slow = now_sec() - t0 > R->slow_sec;
+    return done / R->unit * R->unit;
+}
+
+static bool store(Rescue *R, uint64_t off, size_t len)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pwrite(R->out, R->buf + done, len - done, (off_t)(off + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, RED "\nERROR:" WHITE " writing the rescue staging file failed: %s\n" RESET,
+                    strerror(errno));
+            return false;
+        }
+        done += (size_t)n;
+    }
+
+    R->rescued += len;
+    return true;
+}
+
+/* Pass 1: everything in plan order, skipping ahead past trouble */
+static bool copy_pass(Rescue *R, const RangeList *plan)
+{
+    for (size_t i = 0; i < plan->count; i++) {
+        uint64_t off = plan->r[i].offset;
+        uint64_t end = off + plan->r[i].length;
+        uint64_t stride = 0;
+
+        while (off < end && !R->gone) {
+            size_t want = end - off < RESCUE_READ_SIZE ? (size_t)(end - off) : RESCUE_READ_SIZE;
+            bool slow;
+            size_t got = read_span(R, off, want, &slow);
+
+            if (got && !store(R, off, got))
+                return false;
+            off += got;
+
+            if (got == want && !slow) {
+                stride = 0;
+                report(R, false);
+                continue;
+            }
+
+            /* Bad or slow area: note a growing stretch and move on */
+            stride = stride ? stride * 2 : RESCUE_READ_SIZE;
+            if (stride > RESCUE_MAX_SKIP)
+                stride = RESCUE_MAX_SKIP;
+
+            uint64_t skip = end - off < stride ? end - off : stride;
+            if (!list_add(&R->pending, off, skip))
+                return false;
+            off += skip;
+            report(R, false);
+        }
+
+        /* The disk is gone: the rest of the plan stays unread */
+        if (R->gone && off < end && !list_add(&R->pending, off, end - off))
+            return false;
+    }
+    return true;
+}
+
+/* Later passes: pending ranges in small reads, single blocks at errors */
+static bool retry_pass(Rescue *R)
+{
+    RangeList left = { 0 };
+    list_normalize(&R->pending);
+
+    for (size_t i = 0; i < R->pending.count; i++) {
+        uint64_t off = R->pending.r[i].offset;
+        uint64_t end = off + R->pending.r[i].length;
+
+        while (off < end) {
+            size_t want = end - off < RESCUE_TRIM_SIZE ? (size_t)(end - off) : RESCUE_TRIM_SIZE;
+            bool slow;
+            size_t got = R->gone ? 0 : read_span(R, off, want, &slow);
+
+            if (got && !store(R, off, got))
+                goto fail;
+
+            for (uint64_t u = off + got; u < off + want; u += R->unit) {
+                size_t n = R->gone ? 0 : read_span(R, u, R->unit, &slow);
+                if (n && !store(R, u, n))
+                    goto fail;
+                if (!n && !list_add(&left, u, R->unit))
+                    goto fail;
+            }
+
+            off += want;
+            R->pending.r[i].offset = off;
+            R->pending.r[i].length = end - off;
+            report(R, false);
+        }
+    }
+
+    free(R->pending.r);
+    R->pending = left;
+    return true;
+
+fail:
+    free(left.r);
+    return false;
+}
+
+/* -------------------------------------------------------------
+ * imprintb --rescue-stream <device> <fs> <work> <slow ms> <retries>
+ * ------------------------------------------------------------- */
+static bool write_map(const char *work, const RangeList *bad)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.map", work);
+
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "# imprint rescue map: unrecovered byte ranges (offset length)\n");
+    for (size_t i = 0; i < bad->count; i++)
+        fprintf(fp, "%llu %llu\n",
+                (unsigned long long)bad->r[i].offset, (unsigned long long)bad->r[i].length);
+
+    return fclose(fp) == 0;
+}
+
+int rescue_stream_main(const char *device, const char *fs, const char *work,
+                       int slow_ms, int retries)
+{
+    Rescue R;
+    memset(&R, 0, sizeof(R));
+    R.device = device;
+    R.slow_sec = (slow_ms > 0 ? slow_ms : RESCUE_DEFAULT_SLOW_MS) / 1000.0;
+
+    R.fd = open(device, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (R.fd < 0)
+        R.fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (R.fd < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot open %s: %s\n" RESET, device, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct stat st;
+    if (fstat(R.fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        if (ioctl(R.fd, BLKGETSIZE64, &R.size) != 0)
+            R.size = 0;
+    } else if (fstat(R.fd, &st) == 0) {
+        R.size = (uint64_t)st.st_size;
+    }
+
+    if (R.size == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot determine the size of %s\n" RESET, device);
+        close(R.fd);
+        return EXIT_FAILURE;
+    }
+
+    R.unit = (R.size % 4096 == 0) ? 4096 : 512;
+
+    /* ---------------------------------------------------------
+     * Plan: metadata regions, then the used blocks
+     * --------------------------------------------------------- */
+    RangeList used = { 0 }, meta = { 0 }, data = { 0 }, plan = { 0 }, keep = { 0 };
+    bool ok = true;
+
+    PcSource src = { 0 };
+    bool unsupported = true;
+    char why[256] = "";
+
+    if (strcmp(fs, "-") != 0 && pc_source_bitmap(fs, device, &src, &unsupported, why, sizeof(why))) {
+        uint64_t bs = src.block_size;
+
+        for (uint64_t b = 0; ok && b < src.total_blocks; b++) {
+            if ((b & 7) == 0 && src.bitmap[b >> 3] == 0 && b + 8 <= src.total_blocks) {
+                b += 7;
+                continue;
+            }
+            if (pc_test_bit(src.bitmap, b) && (b + 1) * bs <= R.size)
+                ok = list_add(&used, b * bs, bs);
+        }
+        free((void *)src.bitmap);
+    } else {
+        if (strcmp(fs, "-") != 0)
+            fprintf(stderr, YELLOW "No used-block map for %s (%s); rescuing the whole device.\n" RESET,
+                    device, why);
+        ok = list_add(&used, 0, R.size);
+    }
+
+    int meta_fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (meta_fd >= 0) {
+        if (strcmp(fs, "ntfs") == 0)
+            ntfs_metadata(meta_fd, R.size, &meta);
+        else
+            ext_metadata(meta_fd, R.size, &meta);
+        close(meta_fd);
+    }
+
+    uint64_t edge = R.size < 2 * RESCUE_EDGE_BYTES ? R.size : RESCUE_EDGE_BYTES;
+    ok = ok && list_add(&meta, 0, edge) && list_add(&meta, R.size - edge, edge);
+
+    /* Filesystem blocks may be smaller than a read unit */
+    list_round_out(&used, R.unit, R.size);
+    list_round_out(&meta, R.unit, R.size);
+
+    ok = ok && list_subtract(&used, &meta, &data);
+    for (size_t i = 0; ok && i < meta.count; i++)
+        ok = list_add(&plan, meta.r[i].offset, meta.r[i].length);
+    for (size_t i = 0; ok && i < data.count; i++)
+        ok = list_add(&plan, data.r[i].offset, data.r[i].length);
+    R.total = list_bytes(&plan);
+
+    if (ok && posix_memalign((void **)&R.buf, RESCUE_ALIGN, RESCUE_READ_SIZE) != 0) {
+        R.buf = NULL;
+        ok = false;
+    }
+
+    if (!ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " out of memory\n" RESET);
+        goto out;
+    }
+
+    R.out = open(work, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (R.out < 0 || ftruncate(R.out, (off_t)R.size) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s: %s\n" RESET, work, strerror(errno));
+        ok = false;
+        goto out;
+    }
+
+    fprintf(stderr,
+            YELLOW "Rescue imaging %s: %.2f MB to read, %.2f MB of it filesystem metadata\n" RESET,
+            device, R.total / (1024.0 * 1024.0), list_bytes(&meta) / (1024.0 * 1024.0));
+
+    /* ---------------------------------------------------------
+     * Copy the easy parts, then go back for the rest
+     * --------------------------------------------------------- */
+    R.phase = "Copying";
+    ok = copy_pass(&R, &plan);
+
+    for (int pass = 1; ok && pass <= retries && R.pending.count > 0 && !R.gone; pass++) {
+        report(&R, true);
+        fprintf(stderr, "\n");
+        char phase[32];
+        snprintf(phase, sizeof(phase), "Retry %d/%d", pass, retries);
+        R.phase = phase;
+        ok = retry_pass(&R);
+        R.phase = "Retried";
+    }
+
+    if (!ok)
+        goto out;
+
+    report(&R, true);
+    fprintf(stderr, "\n");
+
+    list_normalize(&R.pending);
+    uint64_t lost = list_bytes(&R.pending);
+
+    if (!write_map(work, &R.pending)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot write %s.map\n" RESET, work);
+        ok = false;
+        goto out;
+    }
+
+    if (lost)
+        fprintf(stderr,
+                YELLOW "%.2f MB in %zu ranges could not be read; they are recorded in the metadata.\n" RESET,
+                lost / (1024.0 * 1024.0), R.pending.count);
+    else
+        fprintf(stderr, GREEN "Everything was read.\n" RESET);
+
+    /* ---------------------------------------------------------
+     * Stream what was recovered as a raw image
+     * --------------------------------------------------------- */
+    list_normalize(&plan);
+    ok = list_subtract(&plan, &R.pending, &keep);
+    if (ok && fdatasync(R.out) != 0)
+        ok = false;
+    if (ok)
+        ok = raw_stream_ranges(work, keep.r, keep.count, 0, STDOUT_FILENO);
+
+out:
+    if (R.out > 0)
+        close(R.out);
+    close(R.fd);
+    free(R.buf);
+    free(used.r);
+    free(meta.r);
+    free(data.r);
+    free(plan.r);
+    free(keep.r);
+    free(R.pending.r);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* -------------------------------------------------------------
+ * Map and staging cleanup (imprintb side)
+ * ------------------------------------------------------------- */
+bool rescue_read_map(const char *work, uint64_t **pairs, size_t *count,
+                     uint64_t *bytes)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.map", work);
+
+    *pairs = NULL;
+    *count = 0;
+    *bytes = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    size_t cap = 0;
+    char line[128];
+    bool ok = true;
+
+    while (ok && fgets(line, sizeof(line), fp)) {
+        unsigned long long off, len;
+        if (line[0] == '#' || sscanf(line, "%llu %llu", &off, &len) != 2)
+            continue;
+
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 64;
+            uint64_t *grown = realloc(*pairs, cap * 2 * sizeof(*grown));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            *pairs = grown;
+        }
+
+        (*pairs)[2 * *count] = off;
+        (*pairs)[2 * *count + 1] = len;
+        (*count)++;
+        *bytes += len;
+    }
+
+    fclose(fp);
+    if (!ok) {
+        free(*pairs);
+        *pairs = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+void rescue_cleanup(const char *work)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.map", work);
+
+    unlink(work);
+    unlink(path);
+}
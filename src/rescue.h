@@ -0,0 +1,63 @@
+#ifndef RESCUE_H
+#define RESCUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Rescue imaging of failing disks (`imprintb --rescue`).
+ *
+ * partclone stops for every bad sector and retries it, so a dying disk
+ * can take hours to give up its first few unreadable spots while the
+ * readable data sits there.  Rescue mode reads in the order ddrescue
+ * does:
+ *
+ *   1. Filesystem metadata first (head and tail of the partition, the
+ *      ext group descriptors, bitmaps and used inode tables, the NTFS
+ *      $MFT), then the used blocks, in 1 MiB reads.  A read that fails
+ *      or takes longer than rescue_slow_ms skips ahead by a stride that
+ *      doubles with every further bad read (up to 1 GiB) and resets
+ *      on the first good one; the skipped ranges are noted.
+ *   2. The noted ranges are retried rescue_retries times with small
+ *      reads: 64 KiB, then single blocks around the errors.
+ *
+ * Recovered data goes to a sparse staging file, <image>.rescue, next
+ * to the image; it needs as much space as the used data.  Once the
+ * disk has been read, the staging file is streamed as an ordinary raw
+ * image, and the ranges that could not be read are listed in
+ * <image>.rescue.map and end up in the image metadata.  They restore
+ * as zeros.
+ *
+ * If the disk disappears entirely, whatever was read up to then is
+ * still imaged.
+ */
+
+/* Pipeline backend; metadata records RAW_BACKEND */
+#define RESCUE_BACKEND          "imprint.rescue"
+
+#define RESCUE_DEFAULT_SLOW_MS  2000
+#define RESCUE_DEFAULT_RETRIES  2
+
+/*
+ * Entry point for
+ * `imprintb --rescue-stream <device> <fs> <staging file> <slow ms> <retries>`:
+ * rescue <device> as above and write the raw image to stdout.  <fs>
+ * names the native reader for the used-block map ("extfs", "ntfs");
+ * with "-" or if the map cannot be read, the whole device is rescued.
+ */
+int rescue_stream_main(const char *device, const char *fs, const char *work,
+                       int slow_ms, int retries);
+
+/*
+ * Unrecovered ranges recorded by a rescue run for staging file
+ * `work`, as offset/length pairs (caller frees *pairs).  False if the
+ * run left no map.
+ */
+bool rescue_read_map(const char *work, uint64_t **pairs, size_t *count,
+                     uint64_t *bytes);
+
+/* Remove the staging file and map of `work`. */
+void rescue_cleanup(const char *work);
+
+#endif /* RESCUE_H */
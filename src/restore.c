@@ -2,6 +2,20 @@
 #include "utils.h"
 #include "ui.h"
 #include "colors.h"
+#include "config.h"
+#include "prefetch.h"
+#include "apply.h"
+#include "journal.h"
+#include "frameidx.h"
+#include "instant.h"
+#include "diskset.h"
+#include "rawimage.h"
+#include "repo.h"
+#include "stripe.h"
+#include "s3.h"
+#include "netimg.h"
+#include "cast.h"
+#include "pipeimg.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,7 +23,12 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 /* -------------------------------------------------------------
  * Metadata structure
@@ -21,8 +40,17 @@ typedef struct {
     bool chunked;
     int chunk_count;
     int chunk_size_mb;   // ← add this
+    long long cbt_era;            /* -1: source had no changed-block tracking */
+    long long thin_dev_id;        /* -1: source was not a thin LV */
+    char parent_image[1024];      /* set for incremental (delta) images */
+    long long parent_cbt_era;
+    long long parent_thin_dev_id;
+    long long unrecovered_bytes;  /* rescue images: source bytes never read */
 } MetadataInfo;
 
+/* Longest chain of incremental images restored on top of a full one */
+#define RESTORE_MAX_CHAIN 64
+
 
 /* -------------------------------------------------------------
  * Detect chunk suffix ".000".."999" and compute base path
@@ -68,12 +96,14 @@ static bool validate_chunk_set(const char *base, int chunk_count)
     if (chunk_count <= 1) {
         return true;   // single-file image
     }
-        char prefix[2048];
-    snprintf(prefix, sizeof(prefix), "%s.", base);
+
+    /* Chunks of a striped image are spread over several directories */
+    StripeDirs stripes;
+    stripe_dirs_load(base, &stripes);
 
     for (int i = 0; i < chunk_count; i++) {
         char path[4096];
-        snprintf(path, sizeof(path), "%s%03d", prefix, i);
+        stripe_chunk_path(&stripes, base, (unsigned)i, path, sizeof(path));
 
         struct stat st;
         if (stat(path, &st) != 0) {
@@ -112,8 +142,12 @@ load_metadata_or_exit(const char *image_base, MetadataInfo *meta)
     }
 
     memset(meta, 0, sizeof(*meta));
+    meta->cbt_era = -1;
+    meta->thin_dev_id = -1;
+    meta->parent_cbt_era = -1;
+    meta->parent_thin_dev_id = -1;
 
-    char line[512];
+    char line[2048];
 
     while (fgets(line, sizeof(line), fp)) {
 
@@ -196,6 +230,64 @@ load_metadata_or_exit(const char *image_base, MetadataInfo *meta)
             if (p) meta->chunk_count = atoi(p + 1);
             continue;
         }
+
+        /* cbt_era / parent_cbt_era (changed-block tracking) */
+        p = strstr(line, "\"cbt_era\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (p) meta->cbt_era = atoll(p + 1);
+            continue;
+        }
+
+        p = strstr(line, "\"parent_cbt_era\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (p) meta->parent_cbt_era = atoll(p + 1);
+            continue;
+        }
+
+        /* thin_dev_id / parent_thin_dev_id (thin LV sources) */
+        p = strstr(line, "\"thin_dev_id\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (p) meta->thin_dev_id = atoll(p + 1);
+            continue;
+        }
+
+        p = strstr(line, "\"parent_thin_dev_id\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (p) meta->parent_thin_dev_id = atoll(p + 1);
+            continue;
+        }
+
+        p = strstr(line, "\"unrecovered_bytes\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (p) meta->unrecovered_bytes = atoll(p + 1);
+            continue;
+        }
+
+        /* parent_image */
+        p = strstr(line, "\"parent_image\"");
+        if (p) {
+            p = strchr(p, ':');
+            if (!p) continue;
+            p = strchr(p, '"');
+            if (!p) continue;
+            p++;
+
+            char *end = strchr(p, '"');
+            if (!end) continue;
+
+            size_t len = (size_t)(end - p);
+            if (len >= sizeof(meta->parent_image))
+                len = sizeof(meta->parent_image) - 1;
+
+            memcpy(meta->parent_image, p, len);
+            meta->parent_image[len] = '\0';
+            continue;
+        }
     }
 
     fclose(fp);
@@ -211,6 +303,12 @@ load_metadata_or_exit(const char *image_base, MetadataInfo *meta)
         if (!meta->chunked && meta->chunk_count < 1)
             meta->chunk_count = 1;
 
+        if (meta->unrecovered_bytes > 0)
+            fprintf(stderr,
+                    YELLOW "NOTE:" WHITE " this image was rescued from a failing disk; %.2f MB could not\n"
+                    "      be read and restore as zeros (see unrecovered_ranges in the metadata).\n" RESET,
+                    meta->unrecovered_bytes / (1024.0 * 1024.0));
+
         return true;
     }
 
@@ -248,6 +346,13 @@ restore_run_interactive(void)
     if (!load_metadata_or_exit(base_image, &meta))
         return false;
 
+    if (meta.parent_image[0] != '\0') {
+        ui_error("This is an incremental image.\n\n"
+                 "Incremental images are restored together with the images they\n"
+                 "build on; use imprintr --image <image> --target <device>.");
+        return false;
+    }
+
     /* 2a. Validate chunk set using normalized base path */
     if (!validate_chunk_set(base_image, meta.chunk_count)) {
         ui_error("Missing chunk(s). Restore aborted.");
@@ -299,7 +404,8 @@ restore_run_interactive(void)
         base_image,
         device,
         meta.compression,
-        meta.chunked
+        meta.chunked,
+        false
     );
 
     free(device);
@@ -307,12 +413,472 @@ restore_run_interactive(void)
     return ok;
 }
 
+/* -------------------------------------------------------------
+ * Write a whole buffer to a pipe, retrying on short writes
+ * ------------------------------------------------------------- */
+static bool write_all_fd(int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Image source: the image files through the prefetching reader,
+ * a repository recipe (see repo.h), whose chunks come out
+ * already decompressed, an S3 object (see s3.h), an image on
+ * imprint-serve (see netimg.h), a multicast stream (see cast.h) or
+ * a stream on stdin (see pipeimg.h).
+ * ------------------------------------------------------------- */
+typedef struct {
+    ImageReader *files;
+    RepoReader *repo;
+    S3Reader *s3;
+    NetReader *net;
+    CastReader *cast;
+    PipeReader *pipe;
+} ImageSource;
+
+/* Set while an s3://, tcp:// or mcast:// image is restored; only its metadata is local */
+static const S3Object *s3_source;
+static const NetTarget *net_source;
+
+/* These streams can be read once: restore_run_cast() / restore_run_pipe() own them */
+static CastReader *cast_source;
+static PipeReader *pipe_source;
+
+static bool image_source_open(ImageSource *src, const char *image_base,
+                              bool chunked, bool repo)
+{
+    src->files = NULL;
+    src->repo = NULL;
+    src->s3 = NULL;
+    src->net = NULL;
+    src->cast = NULL;
+    src->pipe = NULL;
+
+    if (cast_source)
+        src->cast = cast_source;
+    else if (pipe_source)
+        src->pipe = pipe_source;
+    else if (s3_source)
+        src->s3 = s3_reader_open(s3_source, gx_config.s3_parallel, gx_config.prefetch_mem_mb);
+    else if (net_source)
+        src->net = net_reader_open(net_source, gx_config.net_streams, gx_config.prefetch_mem_mb);
+    else if (repo)
+        src->repo = repo_reader_open(image_base, 0, gx_config.prefetch_mem_mb);
+    else
+        src->files = image_reader_open(image_base,
+                                       chunked,
+                                       gx_config.prefetch_depth,
+                                       gx_config.prefetch_mem_mb,
+                                       gx_config.cache_neutral);
+
+    if (!src->files && !src->repo && !src->s3 && !src->net && !src->cast && !src->pipe) {
+        fprintf(stderr, RED "ERROR:" WHITE " failed to open image for reading.\n" RESET);
+        return false;
+    }
+    return true;
+}
+
+static ssize_t image_source_read(ImageSource *src, void *buf, size_t len)
+{
+    if (src->s3)
+        return s3_reader_read(src->s3, buf, len);
+    if (src->net)
+        return net_reader_read(src->net, buf, len);
+    if (src->cast)
+        return cast_reader_read(src->cast, buf, len);
+    if (src->pipe)
+        return pipe_reader_read(src->pipe, buf, len);
+
+    return src->repo ? repo_reader_read(src->repo, buf, len)
+                     : image_reader_read(src->files, buf, len);
+}
+
+static void image_source_close(ImageSource *src)
+{
+    if (src->cast || src->pipe)
+        return;
+    if (src->s3)
+        s3_reader_close(src->s3);
+    else if (src->net)
+        net_reader_close(src->net);
+    else if (src->repo)
+        repo_reader_close(src->repo);
+    else
+        image_reader_close(src->files);
+}
+
+/* -------------------------------------------------------------
+ * Feed the image (single file or chunk set) into the stdin of a
+ * shell command via the prefetching reader.
+ * Returns the command's wait status, or -1 on a local error.
+ * ------------------------------------------------------------- */
+static int stream_image_into_command(const char *image_base,
+                                     bool chunked,
+                                     bool repo,
+                                     const char *cmd)
+{
+    ImageSource reader;
+    if (!image_source_open(&reader, image_base, chunked, repo))
+        return -1;
+
+    size_t buf_size = 1024 * 1024;
+    unsigned char *buf = malloc(buf_size);
+    if (!buf) {
+        image_source_close(&reader);
+        return -1;
+    }
+
+    FILE *pipe = popen(cmd, "w");
+    if (!pipe) {
+        perror("popen (restore pipeline)");
+        free(buf);
+        image_source_close(&reader);
+        return -1;
+    }
+
+    /* If the restore backend exits early we want EPIPE, not a signal */
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    int out_fd = fileno(pipe);
+    bool ok = true;
+
+    for (;;) {
+        ssize_t n = image_source_read(&reader, buf, buf_size);
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        if (!write_all_fd(out_fd, buf, (size_t)n)) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " restore pipeline stopped accepting data: %s\n" RESET,
+                    strerror(errno));
+            ok = false;
+            break;
+        }
+    }
+
+    image_source_close(&reader);
+    free(buf);
+
+    int rc = pclose(pipe);
+    signal(SIGPIPE, old_sigpipe);
+
+    if (!ok)
+        return -1;
+
+    return rc;
+}
+
+/* -------------------------------------------------------------
+ * Native restore
+ *
+ * The decompressor still runs as a separate process, but Imprint
+ * sits on both ends of it: a feeder thread pushes the image into
+ * its stdin and the native applier consumes its stdout:
+ *
+ *   [reader] -> decomp -> [apply_partclone_stream] -> device
+ *
+ * Repository images need no decompressor; the feeder writes into a
+ * plain pipe instead.  This is what makes journaling and --resume
+ * possible.  A resumed framed image is read again only from the frame
+ * holding the resume point (native_seek).
+ * ------------------------------------------------------------- */
+typedef struct {
+    ImageSource reader;
+    int out_fd;
+    unsigned long long fed;     /* compressed bytes handed to decomp */
+    bool ok;
+} ImageFeeder;
+
+static void *image_feeder_main(void *arg)
+{
+    ImageFeeder *f = arg;
+    size_t buf_size = 1024 * 1024;
+    unsigned char *buf = malloc(buf_size);
+
+    f->ok = (buf != NULL);
+
+    while (f->ok) {
+        ssize_t n = image_source_read(&f->reader, buf, buf_size);
+        if (n < 0) {
+            f->ok = false;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        /* EPIPE here just means the applier stopped early */
+        if (!write_all_fd(f->out_fd, buf, (size_t)n)) {
+            f->ok = false;
+            break;
+        }
+
+        __atomic_add_fetch(&f->fed, (unsigned long long)n, __ATOMIC_RELAXED);
+    }
+
+    close(f->out_fd);
+    free(buf);
+    return NULL;
+}
+
+/* A decompressor (or plain pipe) with its feeder thread */
+typedef struct {
+    ImageFeeder feeder;
+    pthread_t tid;
+    pid_t pid;
+    int from_decomp;
+} NativeFeed;
+
+/* Push src, from compressed offset `fed` on, through decomp; takes over src */
+static bool native_feed_start(NativeFeed *nf, const ImageSource *src,
+                              const char *decomp, unsigned long long fed)
+{
+    int to_decomp = -1;
+
+    memset(nf, 0, sizeof(*nf));
+    nf->feeder.reader = *src;
+    nf->feeder.fed = fed;
+    nf->pid = -1;
+
+    if (decomp) {
+        /* exec: the pid is the decompressor's own, not a shell's */
+        char cmd[256];
+        snprintf(cmd, sizeof(cmd), "exec %s", decomp);
+
+        nf->pid = spawn_filter(cmd, &to_decomp, &nf->from_decomp);
+        if (nf->pid < 0) {
+            image_source_close(&nf->feeder.reader);
+            return false;
+        }
+    } else {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            image_source_close(&nf->feeder.reader);
+            return false;
+        }
+        nf->from_decomp = fds[0];
+        to_decomp = fds[1];
+    }
+
+    nf->feeder.out_fd = to_decomp;
+
+    if (pthread_create(&nf->tid, NULL, image_feeder_main, &nf->feeder) != 0) {
+        close(to_decomp);
+        close(nf->from_decomp);
+        if (nf->pid > 0)
+            waitpid(nf->pid, NULL, 0);
+        image_source_close(&nf->feeder.reader);
+        return false;
+    }
+
+    return true;
+}
+
+/* Stop the feed; true if the feeder and decompressor both finished cleanly */
+static bool native_feed_stop(NativeFeed *nf)
+{
+    /* Closing our end stops the decompressor, which stops the feeder */
+    close(nf->from_decomp);
+    pthread_join(nf->tid, NULL);
+    image_source_close(&nf->feeder.reader);
+
+    int status = 0;
+    if (nf->pid > 0)
+        waitpid(nf->pid, &status, 0);
+
+    return nf->feeder.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+typedef struct {
+    NativeFeed feeds[2];        /* the running feed, and its replacement after a seek */
+    int cur;
+    const char *image_base;
+    bool chunked;
+    const char *decomp;
+} NativePipeline;
+
+static unsigned long long image_feeder_position(void *ctx)
+{
+    NativePipeline *p = ctx;
+    return __atomic_load_n(&p->feeds[p->cur].feeder.fed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Resume from the frame holding `offset` (see ApplyOptions.seek): a
+ * new feed starts at that frame's compressed offset, in whichever
+ * chunk file holds it, and the part of the frame before `offset` is
+ * decoded and dropped.  Only local image files with a frame index can
+ * be read from the middle.
+ */
+static bool native_seek(void *ctx, uint64_t offset, int *fd)
+{
+    NativePipeline *p = ctx;
+    NativeFeed *old = &p->feeds[p->cur];
+    NativeFeed *nf = &p->feeds[!p->cur];
+
+    if (!old->feeder.reader.files || !p->decomp)
+        return false;
+
+    char idx_path[1100];
+    frame_index_path_for(p->image_base, idx_path, sizeof(idx_path));
+
+    FrameIndex idx;
+    if (!frame_index_load(idx_path, &idx))
+        return false;
+
+    int64_t f = frame_index_find(&idx, offset);
+    if (f < 0) {
+        frame_index_free(&idx);
+        return false;
+    }
+
+    uint64_t comp_off = idx.frames[f].comp_off;
+    uint64_t skip = offset - idx.frames[f].raw_off;
+    int chunk = 0;
+    off_t chunk_off = (off_t)comp_off;
+
+    if (idx.chunk_bytes > 0) {
+        chunk = (int)(comp_off / idx.chunk_bytes);
+        chunk_off = (off_t)(comp_off % idx.chunk_bytes);
+    }
+    frame_index_free(&idx);
+
+    if (!p->chunked && chunk > 0)
+        return false;
+
+    ImageSource src;
+    memset(&src, 0, sizeof(src));
+    src.files = image_reader_open_at(p->image_base,
+                                     p->chunked,
+                                     gx_config.prefetch_depth,
+                                     gx_config.prefetch_mem_mb,
+                                     gx_config.cache_neutral,
+                                     chunk,
+                                     chunk_off);
+    if (!src.files || !native_feed_start(nf, &src, p->decomp, comp_off))
+        return false;
+
+    /* The frame starts before the checksum group */
+    unsigned char buf[64 * 1024];
+
+    while (skip > 0) {
+        ssize_t n = read(nf->from_decomp, buf, skip < sizeof(buf) ? (size_t)skip : sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            native_feed_stop(nf);
+            return false;
+        }
+        skip -= (uint64_t)n;
+    }
+
+    /* What the old feed still had in flight is not needed; a signal
+     * stops its decompressor without a write error on the way out */
+    if (old->pid > 0)
+        kill(old->pid, SIGTERM);
+    native_feed_stop(old);
+    p->cur = !p->cur;
+    *fd = nf->from_decomp;
+    return true;
+}
+
+static ApplyResult run_native_restore(const char *image_base,
+                                      bool chunked,
+                                      bool repo,
+                                      const char *decomp,
+                                      const char *device,
+                                      bool resume,
+                                      bool raw)
+{
+    char journal_path[1100];
+    journal_path_for(image_base, journal_path, sizeof(journal_path));
+
+    RestoreJournal journal;
+    bool have_journal = journal_load(journal_path, &journal);
+
+    if (resume && !have_journal) {
+        fprintf(stderr,
+                YELLOW "No restore journal found (%s); restoring from the beginning.\n" RESET,
+                journal_path);
+    } else if (resume && strcmp(journal.device, device) != 0) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " the restore journal belongs to %s, not %s.\n"
+                "       Remove %s to start over.\n" RESET,
+                journal.device, device, journal_path);
+        return APPLY_FAILED;
+    } else if (!resume && have_journal) {
+        fprintf(stderr,
+                YELLOW "Found an interrupted restore journal; starting over.\n"
+                "Use --resume to continue the previous restore instead.\n" RESET);
+    }
+
+    ImageSource src;
+    if (!image_source_open(&src, image_base, chunked, repo))
+        return APPLY_FAILED;
+
+    NativePipeline pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.image_base = image_base;
+    pl.chunked = chunked;
+    pl.decomp = decomp;
+
+    /* If the decompressor exits early we want EPIPE, not a signal */
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    if (!native_feed_start(&pl.feeds[0], &src, decomp, 0)) {
+        signal(SIGPIPE, old_sigpipe);
+        return APPLY_FAILED;
+    }
+
+    ApplyOptions opt = {
+        .device = device,
+        .journal_path = journal_path,
+        .resume = (resume && have_journal) ? &journal : NULL,
+        .image_position = image_feeder_position,
+        .image_ctx = &pl,
+        .drop_cache = gx_config.cache_neutral != 0,
+        .seek = native_seek,
+        .seek_ctx = &pl
+    };
+
+    int from_decomp = pl.feeds[0].from_decomp;
+    ApplyResult result = raw ? apply_raw_stream(from_decomp, &opt)
+                             : apply_partclone_stream(from_decomp, &opt);
+
+    bool fed_ok = native_feed_stop(&pl.feeds[pl.cur]);
+    signal(SIGPIPE, old_sigpipe);
+
+    if (result == APPLY_OK && !fed_ok) {
+        fprintf(stderr, RED "ERROR:" WHITE " %s reported an error.\n" RESET,
+                decomp ? "decompressor" : "repository reader");
+        result = APPLY_FAILED;
+    }
+
+    return result;
+}
+
 bool
 run_restore_pipeline(const char *backend,
                      const char *image_base,
                      const char *device,
                      const char *compression,
-                     bool chunked)
+                     bool chunked,
+                     bool resume)
 {
     if (!backend || !image_base || !device)
         return false;
@@ -321,69 +887,47 @@ run_restore_pipeline(const char *backend,
      * 1. Select decompressor
      * --------------------------------------------------------- */
     const char *decomp = NULL;
+    bool repo = compression && strcmp(compression, REPO_COMPRESSION) == 0;
 
-    if (compression && strcmp(compression, "gzip") == 0)
+    if (repo)
+        decomp = NULL;      /* chunks are decompressed in-process */
+    else if (compression && strcmp(compression, "gzip") == 0)
         decomp = "gzip -dc";
     else if (compression && strcmp(compression, "zstd") == 0)
         decomp = "zstd -dc";
     else
         decomp = "lz4 -dc";
 
-    fprintf(stderr, YELLOW "Using decompressor: %s\n" RESET, decomp);
+    if (decomp)
+        fprintf(stderr, YELLOW "Using decompressor: %s\n" RESET, decomp);
 
     /* ---------------------------------------------------------
-     * 2. Prepare image path for restore
+     * 2. Build restore command
      *
-     * IMPORTANT:
-     *   - For chunked images: DO NOT strip compression extension.
-     *     The chunk files are named:
-     *         base.ext.000
-     *         base.ext.001
-     *         ...
+     * The image itself is NOT part of the shell command anymore.
+     * Imprint streams it into the decompressor's stdin through the
+     * prefetching reader, which opens and reads chunks ahead:
      *
-     *   - For single-file images: use the full filename exactly
-     *     as provided (with .zst/.lz4/.gz).
+     *   [reader: base.ext.000, .001, ...] | decomp | backend -r -s - -o device
      *
-     *   Metadata lookup ALWAYS uses the full filename.
-     * --------------------------------------------------------- */
-    char img_for_restore[1024];
-    strncpy(img_for_restore, image_base, sizeof(img_for_restore));
-    img_for_restore[sizeof(img_for_restore) - 1] = '\0';
-
-    /* ---------------------------------------------------------
-     * 3. Build restore command
+     * Example:
+     *   [reader] | zstd -dc | partclone.extfs -r -s - -o /dev/sda1
+     *
+     * For single-file images the reader simply streams the one file.
      * --------------------------------------------------------- */
     char cmd[3072];
 
-    if (chunked) {
-        /*
-         * Chunked restore:
-         *   cat base.ext.??? | decomp | backend -r -s - -o device
-         *
-         * Example:
-         *   cat nvme.img.zst.??? | zstd -dc | partclone.extfs -r -s - -o /dev/sda1
-         */
+    if (decomp)
         snprintf(cmd, sizeof(cmd),
-                 "cat '%s'.??? | %s | %s -r -s - -o '%s'",
-                 img_for_restore,
+                 "%s | %s -r -s - -o '%s'",
                  decomp,
                  backend,
                  device);
-    } else {
-        /*
-         * Single-file restore:
-         *   decomp base.ext | backend -r -s - -o device
-         *
-         * Example:
-         *   zstd -dc nvme.img.zst | partclone.extfs -r -s - -o /dev/sda1
-         */
+    else
         snprintf(cmd, sizeof(cmd),
-                 "%s '%s' | %s -r -s - -o '%s'",
-                 decomp,
-                 image_base,
+                 "%s -r -s - -o '%s'",
                  backend,
                  device);
-    }
 
     /* ---------------------------------------------------------
      * 4. pkexec wrapper
@@ -433,17 +977,59 @@ run_restore_pipeline(const char *backend,
         }
     }
 
-    fprintf(stderr,
-            YELLOW "Running elevated restore command:\n" RESET
-            GREEN "  %s\n\n" RESET,
-            pk_cmd);
+    if (!repo)
+        fprintf(stderr,
+                YELLOW "Reading %s image with prefetch depth %d (%d MB buffer)\n" RESET,
+                chunked ? "chunked" : "single-file",
+                gx_config.prefetch_depth,
+                gx_config.prefetch_mem_mb);
 
-    int rc = system(pk_cmd);
-    if (rc != 0) {
+    /* ---------------------------------------------------------
+     * 5. Native restore when already running as root; partclone
+     *    takes over for anything the native applier cannot handle.
+     * --------------------------------------------------------- */
+    ApplyResult native = APPLY_FALLBACK;
+    bool raw = (strcmp(backend, RAW_BACKEND) == 0);
+
+    /* Raw images have no partclone equivalent to fall back to */
+    if (raw && euid != 0) {
+        ui_error("Raw images can only be restored by imprintr running as root (sudo).");
+        return false;
+    }
+
+    if (euid == 0)
+        native = run_native_restore(image_base, chunked, repo, decomp, device, resume, raw);
+
+    if (native == APPLY_FAILED) {
         ui_error("Restore failed. Please check the terminal output for details.");
         return false;
     }
 
+    /* A multicast stream or stdin cannot be read again from the start */
+    if (native == APPLY_FALLBACK && euid == 0 && (cast_source || pipe_source)) {
+        ui_error("This image cannot be restored natively, and a multicast stream or stdin cannot be "
+                 "restarted for partclone; restore it from a file or imprint-serve instead.");
+        return false;
+    }
+
+    if (native == APPLY_FALLBACK) {
+        if (resume)
+            fprintf(stderr,
+                    YELLOW "Resume is only possible with the native restore path; "
+                    "restoring from the beginning.\n" RESET);
+
+        fprintf(stderr,
+                YELLOW "Running elevated restore command:\n" RESET
+                GREEN "  %s\n\n" RESET,
+                pk_cmd);
+
+        int rc = stream_image_into_command(image_base, chunked, repo, pk_cmd);
+        if (rc != 0) {
+            ui_error("Restore failed. Please check the terminal output for details.");
+            return false;
+        }
+    }
+
     fprintf(stderr,
             WHITE "\n----------------------------------------\n" RESET);
     fprintf(stderr,
@@ -503,6 +1089,65 @@ bool parse_restore_cli_args(int argc, char **argv, RestoreCLIArgs *out)
             continue;
         }
 
+        if (strcmp(arg, "--instant") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 < argc) {
+                out->instant_nbd = argv[++i];
+                continue;
+            }
+            fprintf(stderr, RED "ERROR:" WHITE " --instant requires an NBD device (e.g. /dev/nbd0)\n");
+            out->parse_error = true;
+            return true;
+        }
+
+        if (strcmp(arg, "--resume") == 0) {
+            saw_cli_flag = true;
+            out->resume = true;
+            continue;
+        }
+
+        if (strcmp(arg, "--prefetch") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 < argc) {
+                out->prefetch_depth = atoi(argv[++i]);
+                out->prefetch_depth_set = true;
+
+                if (out->prefetch_depth < 0) {
+                    fprintf(stderr, RED "ERROR:" WHITE " invalid prefetch depth (must be >= 0)\n");
+                    out->parse_error = true;
+                    return true;
+                }
+                continue;
+            }
+            fprintf(stderr, RED "ERROR:" WHITE " --prefetch requires a value\n");
+            out->parse_error = true;
+            return true;
+        }
+
+        if (strcmp(arg, "--prefetch-mem") == 0) {
+            saw_cli_flag = true;
+            if (i + 1 < argc) {
+                out->prefetch_mem_mb = atoi(argv[++i]);
+                out->prefetch_mem_set = true;
+
+                if (out->prefetch_mem_mb <= 0) {
+                    fprintf(stderr, RED "ERROR:" WHITE " invalid prefetch memory cap (must be > 0 MB)\n");
+                    out->parse_error = true;
+                    return true;
+                }
+                continue;
+            }
+            fprintf(stderr, RED "ERROR:" WHITE " --prefetch-mem requires a value\n");
+            out->parse_error = true;
+            return true;
+        }
+
+        if (strcmp(arg, "--cache-neutral") == 0) {
+            saw_cli_flag = true;
+            out->cache_neutral = true;
+            continue;
+        }
+
         /* Positional arguments */
         if (arg[0] != '-') {
             if (positional_count == 0)
@@ -556,17 +1201,18 @@ bool parse_restore_cli_args(int argc, char **argv, RestoreCLIArgs *out)
     return false;
 }
 
-bool restore_run_cli(const char *image_path,
-                     const char *target_device,
-                     bool force)
+/* -------------------------------------------------------------
+ * CLI checks shared by single-image and whole-disk restores:
+ * image + metadata + chunk set present, target large enough.
+ * ------------------------------------------------------------- */
+static bool prepare_cli_restore(const char *image_path,
+                                const char *target_device,
+                                char *base_image,
+                                size_t base_len,
+                                MetadataInfo *meta)
 {
-    if (!image_path || !target_device) {
-        fprintf(stderr, RED "ERROR:" WHITE " missing required arguments.\n");
-        return false;
-    }
-
     /* Check image file existence */
-    if (access(image_path, F_OK) != 0) {
+    if (!s3_source && !net_source && !cast_source && !pipe_source && access(image_path, F_OK) != 0) {
         fprintf(stderr,
                 RED "ERROR:" WHITE " image file does not exist: %s\n",
                 image_path);
@@ -576,26 +1222,25 @@ bool restore_run_cli(const char *image_path,
     /* ---------------------------------------------------------
      * 1. Normalize image base path (strip .000 if chunked)
      * --------------------------------------------------------- */
-    char base_image[1024] = {0};
     bool chunked_by_name = false;
 
     get_image_base_and_chunked(image_path,
                                base_image,
-                               sizeof(base_image),
+                               base_len,
                                &chunked_by_name);
 
     /* ---------------------------------------------------------
      * 2. Load metadata (authoritative)
      * --------------------------------------------------------- */
-    MetadataInfo meta;
-    if (!load_metadata_or_exit(base_image, &meta)) {
+    if (!load_metadata_or_exit(base_image, meta)) {
         return false;
     }
 
     /* ---------------------------------------------------------
      * 2a. Validate chunk set using normalized base path
      * --------------------------------------------------------- */
-    if (!validate_chunk_set(base_image, meta.chunk_count))
+    if (!net_source && !cast_source && !pipe_source &&
+        !validate_chunk_set(base_image, meta->chunk_count))
         return false;
 
     /* ---------------------------------------------------------
@@ -617,18 +1262,456 @@ bool restore_run_cli(const char *image_path,
         return false;
     }
 
-    if (tgt_bytes < meta.partition_size_bytes) {
+    if (tgt_bytes < meta->partition_size_bytes) {
         fprintf(stderr,
                 RED "ERROR:" WHITE " Target partition is smaller than the original.\n"
                 "       Original: %.2f GB\n"
                 "       Target:   %.2f GB\n"
                 YELLOW "       This is a hard limitation of partclone and cannot be overridden.\n" RESET,
-                meta.partition_size_bytes / 1e9,
+                meta->partition_size_bytes / 1e9,
                 tgt_bytes / 1e9);
         return false;
     }
 
-    /* ---------------------------------------------------------
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Incremental images (see cbt.h): each delta names its parent, down
+ * to a full image.  They are restored oldest first onto the target.
+ * ------------------------------------------------------------- */
+
+/* Find the parent image: where it was written, else next to the child */
+static bool locate_parent_image(const char *child_base, const char *parent,
+                                char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s", parent);
+    if (access(out, F_OK) == 0)
+        return true;
+
+    snprintf(out, out_len, "%s.000", parent);
+    if (access(out, F_OK) == 0)
+        return true;
+
+    const char *name = strrchr(parent, '/');
+    name = name ? name + 1 : parent;
+
+    const char *slash = strrchr(child_base, '/');
+    int dir_len = slash ? (int)(slash - child_base) : 1;
+    const char *dir = slash ? child_base : ".";
+
+    snprintf(out, out_len, "%.*s/%s", dir_len, dir, name);
+    if (access(out, F_OK) == 0)
+        return true;
+
+    snprintf(out, out_len, "%.*s/%s.000", dir_len, dir, name);
+    if (access(out, F_OK) == 0)
+        return true;
+
+    fprintf(stderr, RED "ERROR:" WHITE " parent image not found: %s\n" RESET, parent);
+    return false;
+}
+
+static bool restore_image_chain(const char *base_image,
+                                const MetadataInfo *meta,
+                                const char *target_device,
+                                bool force)
+{
+    char (*bases)[1024] = calloc(RESTORE_MAX_CHAIN, sizeof(*bases));
+    MetadataInfo *metas = calloc(RESTORE_MAX_CHAIN, sizeof(*metas));
+    bool ok = (bases && metas);
+    int count = 0;
+
+    if (ok) {
+        snprintf(bases[0], sizeof(bases[0]), "%s", base_image);
+        metas[0] = *meta;
+        count = 1;
+    }
+
+    /* bases[0] is the newest delta, bases[count - 1] the full image */
+    while (ok && metas[count - 1].parent_image[0] != '\0') {
+        const MetadataInfo *child = &metas[count - 1];
+
+        if (count == RESTORE_MAX_CHAIN) {
+            fprintf(stderr, RED "ERROR:" WHITE " more than %d images in the incremental chain.\n" RESET,
+                    RESTORE_MAX_CHAIN);
+            ok = false;
+            break;
+        }
+
+        char parent_path[1100];
+        if (!locate_parent_image(bases[count - 1], child->parent_image,
+                                 parent_path, sizeof(parent_path)) ||
+            !prepare_cli_restore(parent_path, target_device,
+                                 bases[count], sizeof(bases[count]), &metas[count])) {
+            ok = false;
+            break;
+        }
+
+        /* A delta continues from an era (dm-era) or a thin device */
+        bool by_era = child->parent_cbt_era >= 0;
+        long long want = by_era ? child->parent_cbt_era : child->parent_thin_dev_id;
+        long long have = by_era ? metas[count].cbt_era : metas[count].thin_dev_id;
+
+        if (want < 0 || have != want) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " %s does not continue from %s\n"
+                    "       (parent %s %lld, expected %lld).\n" RESET,
+                    bases[count - 1], bases[count],
+                    by_era ? "era" : "thin device", have, want);
+            ok = false;
+            break;
+        }
+
+        count++;
+    }
+
+    if (ok && !force) {
+        fprintf(stderr,
+                RED "WARNING:\n"
+                WHITE "You are about to overwrite the partition:" YELLOW "  %s\n" WHITE
+                "with a full image and %d incremental image(s).\n\n"
+                "All data on this partition will be permanently lost.\n"
+                "This action cannot be undone.\n\n"
+                "Proceed? [y/N]: " RESET,
+                target_device, count - 1);
+
+        fflush(stderr);
+
+        char buf[16] = {0};
+        if (!fgets(buf, sizeof(buf), stdin) || (buf[0] != 'y' && buf[0] != 'Y')) {
+            fprintf(stderr, YELLOW "\nRestore cancelled.\n");
+            ok = false;
+        }
+    }
+
+    for (int i = count - 1; ok && i >= 0; i--) {
+        fprintf(stderr, YELLOW "\nRestoring image %d of %d: %s\n" RESET,
+                count - i, count, bases[i]);
+
+        ok = run_restore_pipeline(metas[i].backend,
+                                  bases[i],
+                                  target_device,
+                                  metas[i].compression,
+                                  metas[i].chunked,
+                                  false);
+    }
+
+    free(bases);
+    free(metas);
+    return ok;
+}
+
+static bool restore_run_disk(const char *manifest_path,
+                             const char *target_disk,
+                             bool force,
+                             bool resume);
+
+/*
+ * s3://<bucket>/<key>: fetch <key>.json into a staging directory and
+ * restore as usual, with the image itself read by ranged GETs.
+ */
+static bool restore_run_s3(const char *image_path,
+                           const char *target_device,
+                           bool force,
+                           bool resume,
+                           const char *instant_nbd)
+{
+    S3Object image;
+
+    if (!s3_parse_url(image_path, &image)) {
+        fprintf(stderr, RED "ERROR:" WHITE " an S3 image must look like s3://<bucket>/<key>\n");
+        return false;
+    }
+    if (!s3_check_credentials())
+        return false;
+    if (instant_nbd) {
+        fprintf(stderr, RED "ERROR:" WHITE " --instant needs a local image.\n");
+        return false;
+    }
+
+    char staging[] = "/tmp/imprint-s3-XXXXXX";
+    if (!mkdtemp(staging)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create a staging directory in /tmp.\n");
+        return false;
+    }
+
+    const char *name = strrchr(image.key, '/');
+    name = name ? name + 1 : image.key;
+
+    char staged[PATH_MAX], meta_path[PATH_MAX + 8];
+    snprintf(staged, sizeof(staged), "%s/%s", staging, name);
+    snprintf(meta_path, sizeof(meta_path), "%s.json", staged);
+
+    /* s3_parse_url() leaves room for the suffix */
+    S3Object meta = image;
+    int klen = snprintf(meta.key, sizeof(meta.key), "%s.json", image.key);
+
+    bool ok = false;
+
+    if (klen > 0 && s3_get_file(&meta, meta_path, true)) {
+        s3_source = &image;
+        ok = restore_run_cli(staged, target_device, force, resume, NULL);
+        s3_source = NULL;
+    } else {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " no metadata at %s.json; the image is missing or incomplete.\n" RESET,
+                image_path);
+    }
+
+    unlink(meta_path);
+    rmdir(staging);
+    return ok;
+}
+
+/*
+ * tcp://<host>[:<port>]/<name>: fetch <name>.json from imprint-serve and
+ * restore as usual, with the image read over net_streams connections.
+ */
+static bool restore_run_net(const char *image_path,
+                            const char *target_device,
+                            bool force,
+                            bool resume,
+                            const char *instant_nbd)
+{
+    NetTarget image;
+
+    if (!net_parse_url(image_path, &image)) {
+        fprintf(stderr, RED "ERROR:" WHITE " a network image must look like tcp://<host>[:<port>]/<name>\n");
+        return false;
+    }
+    if (instant_nbd) {
+        fprintf(stderr, RED "ERROR:" WHITE " --instant needs a local image.\n");
+        return false;
+    }
+
+    char staging[] = "/tmp/imprint-net-XXXXXX";
+    if (!mkdtemp(staging)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create a staging directory in /tmp.\n");
+        return false;
+    }
+
+    const char *name = strrchr(image.name, '/');
+    name = name ? name + 1 : image.name;
+
+    char staged[PATH_MAX], meta_path[PATH_MAX + 8];
+    snprintf(staged, sizeof(staged), "%s/%s", staging, name);
+    snprintf(meta_path, sizeof(meta_path), "%s.json", staged);
+
+    bool ok = false;
+
+    if (net_get_file(&image, ".json", meta_path, false)) {
+        net_source = &image;
+        ok = restore_run_cli(staged, target_device, force, resume, NULL);
+        net_source = NULL;
+    }
+
+    unlink(meta_path);
+    rmdir(staging);
+    return ok;
+}
+
+/*
+ * mcast://<group>[:<port>]: join an imprint-cast transfer, write the
+ * metadata that comes first into a staging directory and restore as
+ * usual from the rest of the stream.
+ */
+static bool restore_run_cast(const char *image_path,
+                             const char *target_device,
+                             bool force,
+                             bool resume,
+                             const char *instant_nbd)
+{
+    CastGroup group;
+
+    if (!cast_parse_url(image_path, &group)) {
+        fprintf(stderr, RED "ERROR:" WHITE " a multicast image must look like mcast://<group>[:<port>]\n");
+        return false;
+    }
+    if (instant_nbd || resume) {
+        fprintf(stderr, RED "ERROR:" WHITE " --instant and --resume do not apply to a multicast restore.\n");
+        return false;
+    }
+
+    char staging[] = "/tmp/imprint-cast-XXXXXX";
+    if (!mkdtemp(staging)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create a staging directory in /tmp.\n");
+        return false;
+    }
+
+    char staged[PATH_MAX], meta_path[PATH_MAX + 8];
+    snprintf(staged, sizeof(staged), "%s/multicast.img", staging);
+    snprintf(meta_path, sizeof(meta_path), "%s.json", staged);
+
+    bool ok = false;
+    CastReader *cast = cast_reader_open(&group, gx_config.cast_interface);
+
+    if (cast) {
+        uint64_t left = cast_reader_meta_size(cast);
+        FILE *fp = fopen(meta_path, "wb");
+        bool have_meta = fp != NULL;
+
+        while (have_meta && left > 0) {
+            char buf[4096];
+            ssize_t n = cast_reader_read(cast, buf, left < sizeof(buf) ? (size_t)left : sizeof(buf));
+            if (n <= 0 || fwrite(buf, 1, (size_t)n, fp) != (size_t)n)
+                have_meta = false;
+            else
+                left -= (uint64_t)n;
+        }
+        if (fp && fclose(fp) != 0)
+            have_meta = false;
+
+        if (have_meta) {
+            cast_source = cast;
+            ok = restore_run_cli(staged, target_device, force, false, NULL);
+            cast_source = NULL;
+        } else {
+            fprintf(stderr, RED "ERROR:" WHITE " cannot stage the metadata in %s\n", staging);
+        }
+
+        cast_reader_close(cast);
+    }
+
+    unlink(meta_path);
+    rmdir(staging);
+    return ok;
+}
+
+/*
+ * -: the stream of imprintb --target - on stdin.  Its header is staged
+ * as the metadata and checked like any other before the target is
+ * touched; the trailer's checksum is checked as the image is read.
+ */
+static bool restore_run_pipe(const char *target_device,
+                             bool force,
+                             bool resume,
+                             const char *instant_nbd)
+{
+    if (instant_nbd || resume) {
+        fprintf(stderr, RED "ERROR:" WHITE " --instant and --resume do not apply to a restore from stdin.\n");
+        return false;
+    }
+    if (!force) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " with --image - stdin carries the image, so the overwrite cannot be\n"
+                "       confirmed; add --force.\n");
+        return false;
+    }
+
+    PipeReader *pipe = pipe_reader_open();
+    if (!pipe)
+        return false;
+
+    char staging[] = "/tmp/imprint-pipe-XXXXXX";
+    if (!mkdtemp(staging)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create a staging directory in /tmp.\n");
+        pipe_reader_close(pipe);
+        return false;
+    }
+
+    char staged[PATH_MAX], meta_path[PATH_MAX + 8];
+    snprintf(staged, sizeof(staged), "%s/stdin.img", staging);
+    snprintf(meta_path, sizeof(meta_path), "%s.json", staged);
+
+    size_t len;
+    const char *header = pipe_reader_header(pipe, &len);
+    FILE *fp = fopen(meta_path, "wb");
+    bool have_meta = fp && fwrite(header, 1, len, fp) == len;
+    bool ok = false;
+
+    if (fp && fclose(fp) != 0)
+        have_meta = false;
+
+    if (have_meta) {
+        pipe_source = pipe;
+        ok = restore_run_cli(staged, target_device, true, false, NULL);
+        pipe_source = NULL;
+    } else {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot stage the metadata in %s\n", staging);
+    }
+
+    pipe_reader_close(pipe);
+    unlink(meta_path);
+    rmdir(staging);
+    return ok;
+}
+
+bool restore_run_cli(const char *image_path,
+                     const char *target_device,
+                     bool force,
+                     bool resume,
+                     const char *instant_nbd)
+{
+    if (!image_path || !target_device) {
+        fprintf(stderr, RED "ERROR:" WHITE " missing required arguments.\n");
+        return false;
+    }
+
+    if (strncmp(image_path, S3_PREFIX, strlen(S3_PREFIX)) == 0)
+        return restore_run_s3(image_path, target_device, force, resume, instant_nbd);
+
+    if (strncmp(image_path, NET_PREFIX, strlen(NET_PREFIX)) == 0)
+        return restore_run_net(image_path, target_device, force, resume, instant_nbd);
+
+    if (strncmp(image_path, CAST_PREFIX, strlen(CAST_PREFIX)) == 0)
+        return restore_run_cast(image_path, target_device, force, resume, instant_nbd);
+
+    if (strcmp(image_path, PIPE_TARGET) == 0)
+        return restore_run_pipe(target_device, force, resume, instant_nbd);
+
+    /* Whole-disk image set: the manifest written by imprintb --disk */
+    size_t ilen = strlen(image_path);
+    if (ilen > 10 && strcmp(image_path + ilen - 10, ".disk.json") == 0) {
+        if (instant_nbd) {
+            fprintf(stderr, RED "ERROR:" WHITE " --instant restores a single partition image.\n");
+            return false;
+        }
+        return restore_run_disk(image_path, target_device, force, resume);
+    }
+
+    /* repo://<dir>/<name> names the recipe <dir>/images/<name> */
+    char repo_dir[PATH_MAX], repo_name[256], recipe[PATH_MAX + 300];
+
+    if (repo_parse_target(image_path, repo_dir, sizeof(repo_dir),
+                          repo_name, sizeof(repo_name))) {
+        snprintf(recipe, sizeof(recipe), "%s/images/%s", repo_dir, repo_name);
+        image_path = recipe;
+    }
+
+    char base_image[1024] = {0};
+    MetadataInfo meta;
+
+    if (!prepare_cli_restore(image_path, target_device,
+                             base_image, sizeof(base_image), &meta))
+        return false;
+
+    if (instant_nbd && strcmp(meta.compression, REPO_COMPRESSION) == 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " --instant does not support repository images.\n");
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 4a. Incremental image: restore its chain, full image first
+     * --------------------------------------------------------- */
+    if (meta.parent_image[0] != '\0') {
+        if (s3_source || net_source || cast_source || pipe_source) {
+            fprintf(stderr, RED "ERROR:" WHITE " incremental images cannot be restored from S3, imprint-serve, multicast or stdin yet.\n");
+            return false;
+        }
+        if (instant_nbd || resume) {
+            fprintf(stderr, RED "ERROR:" WHITE " --instant and --resume do not apply to incremental images.\n");
+            return false;
+        }
+
+        if (!restore_image_chain(base_image, &meta, target_device, force)) {
+            fprintf(stderr, "Restore failed.\n");
+            return false;
+        }
+        return true;
+    }
+
+    /* ---------------------------------------------------------
      * 4b. CLI confirmation (unless --force)
      * --------------------------------------------------------- */
     if (!force) {
@@ -654,6 +1737,27 @@ bool restore_run_cli(const char *image_path,
         }
     }
 
+    /* ---------------------------------------------------------
+     * 4c. Instant restore: serve the target through NBD while the
+     *     image is copied in the background
+     * --------------------------------------------------------- */
+    if (instant_nbd) {
+        if (geteuid() != 0) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " This operation requires root privileges.\n"
+                    "       Please run imprintr with sudo.\n\n");
+            return false;
+        }
+
+        if (!instant_restore_run(base_image, target_device, instant_nbd)) {
+            fprintf(stderr, "Restore failed.\n");
+            return false;
+        }
+
+        fprintf(stderr, GREEN "Restore completed successfully.\n" RESET);
+        return true;
+    }
+
     /* ---------------------------------------------------------
      * 5. Run restore pipeline
      * --------------------------------------------------------- */
@@ -662,7 +1766,8 @@ bool restore_run_cli(const char *image_path,
         base_image,
         target_device,
         meta.compression,
-        meta.chunked
+        meta.chunked,
+        resume
     );
 
     if (!ok) {
@@ -674,6 +1779,279 @@ bool restore_run_cli(const char *image_path,
 }
 
 
+/* -------------------------------------------------------------
+ * Whole-disk restore
+ * ------------------------------------------------------------- */
+
+/* Partition restores running at the same time */
+#define DISK_RESTORE_JOBS 4
+
+typedef struct {
+    const DiskSet *set;
+    const char *dir;
+    const char *target_disk;
+    bool resume;
+
+    pthread_mutex_t lock;
+    int next;               /* next partition to hand out */
+    bool *done;             /* per partition: restored successfully */
+} DiskRestoreJob;
+
+/* Image path for a manifest entry: <dir>/<image>, or its .000 chunk */
+static void disk_image_path(const char *dir, const DiskPart *part,
+                            char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s/%s", dir, part->image);
+
+    if (access(out, F_OK) != 0)
+        snprintf(out, out_len, "%s/%s.000", dir, part->image);
+}
+
+static void *disk_restore_worker(void *arg)
+{
+    DiskRestoreJob *job = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int i = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (i >= job->set->count)
+            break;
+
+        const DiskPart *part = &job->set->parts[i];
+        if (part->image[0] == '\0') {
+            job->done[i] = true;
+            continue;
+        }
+
+        char image_path[2048];
+        disk_image_path(job->dir, part, image_path, sizeof(image_path));
+
+        char device[300];
+        diskset_partition_device(job->target_disk, part->number, device, sizeof(device));
+
+        fprintf(stderr, YELLOW "\nRestoring %s to %s\n" RESET, image_path, device);
+
+        char base_image[1024] = {0};
+        MetadataInfo meta;
+
+        job->done[i] = prepare_cli_restore(image_path, device,
+                                           base_image, sizeof(base_image), &meta) &&
+                       run_restore_pipeline(meta.backend,
+                                            base_image,
+                                            device,
+                                            meta.compression,
+                                            meta.chunked,
+                                            job->resume);
+    }
+
+    return NULL;
+}
+
+static bool restore_run_disk(const char *manifest_path,
+                             const char *target_disk,
+                             bool force,
+                             bool resume)
+{
+    if (geteuid() != 0) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " This operation requires root privileges.\n"
+                "       Please run imprintr with sudo.\n\n");
+        return false;
+    }
+
+    if (!is_program_available("sfdisk")) {
+        fprintf(stderr, RED "ERROR:" WHITE " whole-disk restores require sfdisk (util-linux).\n");
+        return false;
+    }
+
+    DiskSet *set = calloc(1, sizeof(*set));
+    if (!set || !diskset_load_manifest(manifest_path, set)) {
+        free(set);
+        return false;
+    }
+
+    /* Images are referenced relative to the manifest */
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", manifest_path);
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    struct stat st;
+    if (stat(target_disk, &st) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " target device does not exist: %s\n", target_disk);
+        free(set);
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 1. Check the whole set before touching the target
+     * --------------------------------------------------------- */
+    bool ok = true;
+
+    fprintf(stderr, YELLOW "\nImage set of %s (%s):\n" RESET, set->disk, set->label);
+
+    for (int i = 0; i < set->count; i++) {
+        const DiskPart *part = &set->parts[i];
+
+        if (part->image[0] == '\0') {
+            fprintf(stderr, WHITE "    partition %-3d %-10s (not imaged, left empty)\n" RESET,
+                    part->number, part->fs_type[0] ? part->fs_type : "-");
+            continue;
+        }
+
+        fprintf(stderr, WHITE "    partition %-3d %-10s %s\n" RESET,
+                part->number, part->fs_type, part->image);
+
+        char image_path[2048];
+        disk_image_path(dir, part, image_path, sizeof(image_path));
+
+        char base_image[1024];
+        bool chunked_by_name = false;
+        get_image_base_and_chunked(image_path, base_image, sizeof(base_image), &chunked_by_name);
+
+        MetadataInfo meta;
+        if (access(image_path, F_OK) != 0) {
+            fprintf(stderr, RED "ERROR:" WHITE " image file does not exist: %s\n", image_path);
+            ok = false;
+        } else if (!load_metadata_or_exit(base_image, &meta) ||
+                   !validate_chunk_set(base_image, meta.chunk_count)) {
+            ok = false;
+        }
+    }
+
+    /* Nothing on the target may be in use */
+    if (gx_is_partition_mounted(target_disk))
+        ok = false;
+
+    for (int n = 1; n <= DISKSET_MAX_PARTS; n++) {
+        char part[300];
+        diskset_partition_device(target_disk, n, part, sizeof(part));
+
+        if (gx_is_partition_mounted(part)) {
+            fprintf(stderr, RED "ERROR:" WHITE " %s is mounted.\n", part);
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, RED "Restore aborted.\n" RESET);
+        free(set);
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 2. One confirmation for the whole disk
+     * --------------------------------------------------------- */
+    if (!force) {
+        fprintf(stderr,
+                RED "\nWARNING:\n"
+                WHITE "You are about to replace the partition table and all partitions of:"
+                YELLOW "  %s\n\n" WHITE
+                "All data on this disk will be permanently lost.\n"
+                "This action cannot be undone.\n\n"
+                "Proceed? [y/N]: " RESET,
+                target_disk);
+
+        fflush(stderr);
+
+        char buf[16] = {0};
+        if (!fgets(buf, sizeof(buf), stdin) || (buf[0] != 'y' && buf[0] != 'Y')) {
+            fprintf(stderr, YELLOW "\nRestore cancelled.\n");
+            free(set);
+            return false;
+        }
+    }
+
+    /* ---------------------------------------------------------
+     * 3. Partition table + boot area (kept as is when resuming)
+     * --------------------------------------------------------- */
+    if (resume) {
+        fprintf(stderr, YELLOW "Resuming: keeping the partition table already on %s\n" RESET,
+                target_disk);
+    } else if (!diskset_apply_table(set, dir, target_disk)) {
+        free(set);
+        return false;
+    }
+
+    /* ---------------------------------------------------------
+     * 4. Restore the partitions in parallel
+     *
+     * SIGPIPE is ignored for the whole run: the per-restore
+     * save/restore of the handler is not safe across threads.
+     * --------------------------------------------------------- */
+    DiskRestoreJob job = {
+        .set = set,
+        .dir = dir,
+        .target_disk = target_disk,
+        .resume = resume,
+        .next = 0,
+        .done = calloc((size_t)set->count, sizeof(bool)),
+    };
+    pthread_mutex_init(&job.lock, NULL);
+
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    int workers = set->count < DISK_RESTORE_JOBS ? set->count : DISK_RESTORE_JOBS;
+    pthread_t threads[DISK_RESTORE_JOBS];
+    int started = 0;
+
+    for (int i = 0; job.done && i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, disk_restore_worker, &job) == 0)
+            started++;
+    }
+
+    /* No thread could be started: restore in this one */
+    if (job.done && started == 0)
+        disk_restore_worker(&job);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    signal(SIGPIPE, old_sigpipe);
+    pthread_mutex_destroy(&job.lock);
+
+    /* ---------------------------------------------------------
+     * 5. Summary
+     * --------------------------------------------------------- */
+    ok = (job.done != NULL);
+
+    fprintf(stderr, WHITE "\n----------------------------------------\n" RESET);
+
+    for (int i = 0; job.done && i < set->count; i++) {
+        const DiskPart *part = &set->parts[i];
+        if (part->image[0] == '\0')
+            continue;
+
+        char device[300];
+        diskset_partition_device(target_disk, part->number, device, sizeof(device));
+
+        fprintf(stderr, "%s%-24s" WHITE " %s\n" RESET,
+                job.done[i] ? GREEN : RED,
+                device,
+                job.done[i] ? "restored" : "FAILED");
+
+        if (!job.done[i])
+            ok = false;
+    }
+
+    fprintf(stderr, WHITE "----------------------------------------\n" RESET);
+
+    if (ok)
+        fprintf(stderr, GREEN "Disk restore completed successfully.\n" RESET);
+    else
+        fprintf(stderr, RED "Disk restore failed." WHITE
+                " Re-run with --resume to continue the failed partitions.\n" RESET);
+
+    free(job.done);
+    free(set);
+    return ok;
+}
+
 bool print_restore_usage(struct parse_output *out)
 {
     fprintf(stderr,
@@ -681,8 +2059,23 @@ bool print_restore_usage(struct parse_output *out)
             "       imprintr <image> <device>\n\n"
             YELLOW "Options:\n" WHITE
             "        --image <image file>      Path and filename of backup image (.img.zst, .img.lz4, .000, etc.)\n"
+            "                                  or a whole-disk manifest (<disk>.disk.json) with a disk as --target,\n"
+            "                                  or repo://<dir>/<name> for an image in a repository,\n"
+            "                                  or s3://<bucket>/<key> for an image in S3 (see s3_* in config),\n"
+            "                                  or tcp://<host>[:<port>]/<name> for one on imprint-serve,\n"
+            "                                  or mcast://<group>[:<port>] to receive one from imprint-cast,\n"
+            "                                  or - to read the stream of imprintb --target - from stdin\n"
             "        --target <device>         Destination block device (e.g. /dev/nvme0n1p3)\n"
             "        --force                   Skip confirmation prompts when overwriting partitions\n"
+            "        --resume                  Continue an interrupted restore from its journal\n"
+            "        --instant <nbd device>    Serve the target through NBD (e.g. /dev/nbd0) right away\n"
+            "                                  while the image is restored in the background; the blocks\n"
+            "                                  it serves are not checked against the image checksums\n"
+            "        --prefetch <N>            Open and read up to N chunk files ahead (0 = sequential, default 4)\n"
+            "        --prefetch-mem <MB>       Memory cap for read-ahead buffers (default 256; repository\n"
+            "                                  images fetch chunks ahead within it)\n"
+            "        --cache-neutral           Keep the image and the target out of the page cache, for\n"
+            "                                  restores on a running system (see cache_neutral in config)\n"
             "        --help                    Show this help message\n"
             RESET
     );
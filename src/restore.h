@@ -37,7 +37,8 @@ bool run_restore_pipeline(const char *backend,
                           const char *image_base,
                           const char *device,
                           const char *compression,
-                          bool chunked);
+                          bool chunked,
+                          bool resume);
 
 /* ---------------------------------------------------------
  * CLI argument structure
@@ -50,6 +51,14 @@ typedef struct {
     const char *target;  /* --target <device> or positional #2 */
 
     bool force;          /* --force flag */
+    bool resume;         /* --resume: continue from <image>.journal */
+    const char *instant_nbd;  /* --instant <nbd device> */
+
+    int  prefetch_depth;      /* --prefetch <chunks> */
+    bool prefetch_depth_set;
+    int  prefetch_mem_mb;     /* --prefetch-mem <MB> */
+    bool prefetch_mem_set;
+    bool cache_neutral;       /* --cache-neutral: image and target out of the page cache */
 } RestoreCLIArgs;
 
 /* ---------------------------------------------------------
@@ -62,6 +71,8 @@ bool parse_restore_cli_args(int argc, char **argv, RestoreCLIArgs *out);
  * --------------------------------------------------------- */
 bool restore_run_cli(const char *image,
                      const char *target,
-                     bool force);
+                     bool force,
+                     bool resume,
+                     const char *instant_nbd);
 
 #endif /* RESTORE_H */
@@ -0,0 +1,996 @@
+#define _GNU_SOURCE
+
+#include "s3.h"
+#include "config.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* Attempts per request; network errors and 5xx are retried */
+#define S3_TRIES        3
+
+/* Ranged GET size of the reader */
+#define S3_RANGE_SIZE   (8u * 1024 * 1024)
+
+/* Multipart uploads: at most 10000 parts, each at least 5 MiB */
+#define S3_MAX_PARTS    10000
+#define S3_MIN_PART_MB  5
+
+/* Kept free at the end of a parsed key */
+#define S3_KEY_SUFFIX_ROOM 32
+
+/* -------------------------------------------------------------
+ * Addressing
+ * ------------------------------------------------------------- */
+bool s3_parse_url(const char *url, S3Object *out)
+{
+    size_t plen = strlen(S3_PREFIX);
+
+    if (!url || strncmp(url, S3_PREFIX, plen) != 0)
+        return false;
+
+    const char *bucket = url + plen;
+    const char *slash = strchr(bucket, '/');
+    if (!slash || slash == bucket || slash[1] == '\0')
+        return false;
+
+    size_t blen = (size_t)(slash - bucket);
+    /* Room for suffixes: .img.<ext>, .sha256, .json */
+    if (blen >= sizeof(out->bucket) || strlen(slash + 1) + S3_KEY_SUFFIX_ROOM >= sizeof(out->key))
+        return false;
+
+    memcpy(out->bucket, bucket, blen);
+    out->bucket[blen] = '\0';
+    snprintf(out->key, sizeof(out->key), "%s", slash + 1);
+
+    const char *region = gx_config.s3_region;
+    if (region[0] == '\0')
+        region = getenv("AWS_REGION");
+    if (!region || region[0] == '\0')
+        region = getenv("AWS_DEFAULT_REGION");
+    if (!region || region[0] == '\0')
+        region = S3_DEFAULT_REGION;
+    snprintf(out->region, sizeof(out->region), "%s", region);
+
+    const char *endpoint = gx_config.s3_endpoint;
+    if (endpoint[0] == '\0')
+        endpoint = getenv("AWS_ENDPOINT_URL");
+
+    if (endpoint && endpoint[0] != '\0')
+        snprintf(out->endpoint, sizeof(out->endpoint), "%s", endpoint);
+    else
+        snprintf(out->endpoint, sizeof(out->endpoint),
+                 "https://s3.%s.amazonaws.com", out->region);
+
+    size_t elen = strlen(out->endpoint);
+    while (elen > 0 && out->endpoint[elen - 1] == '/')
+        out->endpoint[--elen] = '\0';
+
+    return true;
+}
+
+bool s3_check_credentials(void)
+{
+    const char *id = getenv("AWS_ACCESS_KEY_ID");
+    const char *secret = getenv("AWS_SECRET_ACCESS_KEY");
+
+    if (id && id[0] != '\0' && secret && secret[0] != '\0')
+        return true;
+
+    fprintf(stderr,
+            RED "ERROR:" WHITE " S3 needs AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY in the environment\n"
+            "       (run with sudo -E to keep them).\n" RESET);
+    return false;
+}
+
+/* Percent-encode everything but unreserved characters (and '/' if keep_slash) */
+static void url_encode(const char *in, bool keep_slash, char *out, size_t out_len)
+{
+    size_t o = 0;
+
+    for (; *in && o + 4 < out_len; in++) {
+        unsigned char c = (unsigned char)*in;
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' ||
+            (keep_slash && c == '/'))
+            out[o++] = (char)c;
+        else
+            o += (size_t)snprintf(out + o, out_len - o, "%%%02X", c);
+    }
+
+    out[o] = '\0';
+}
+
+static void object_url(const S3Object *o, const char *query, char *out, size_t out_len)
+{
+    char key[3200];
+    url_encode(o->key, true, key, sizeof(key));
+
+    snprintf(out, out_len, "%s/%s/%s%s%s",
+             o->endpoint, o->bucket, key,
+             query ? "?" : "", query ? query : "");
+}
+
+/* -------------------------------------------------------------
+ * Requests: one curl process each
+ * ------------------------------------------------------------- */
+typedef struct {
+    int status;              /* HTTP status, 0 = no response */
+    unsigned char *data;     /* whole output: headers, then body */
+    size_t len;
+    size_t body_off;
+    char etag[160];
+} S3Response;
+
+static void response_free(S3Response *r)
+{
+    free(r->data);
+    r->data = NULL;
+}
+
+/* curl config string: quotes and backslashes escaped */
+static void config_line(char *out, size_t out_len, const char *name, const char *value)
+{
+    size_t o = (size_t)snprintf(out, out_len, "%s = \"", name);
+
+    for (; *value && o + 3 < out_len; value++) {
+        if (*value == '"' || *value == '\\')
+            out[o++] = '\\';
+        out[o++] = *value;
+    }
+
+    snprintf(out + o, out_len - o, "\"\n");
+}
+
+static bool write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+
+    return true;
+}
+
+/* Status, ETag and body offset out of curl's -D - output */
+static void parse_response(S3Response *r)
+{
+    size_t pos = 0;
+
+    /* Skip interim 1xx responses */
+    for (;;) {
+        unsigned char *end = memmem(r->data + pos, r->len - pos, "\r\n\r\n", 4);
+        if (!end || r->len - pos < 12 || memcmp(r->data + pos, "HTTP/", 5) != 0)
+            return;
+
+        const char *sp = memchr(r->data + pos, ' ', 12);
+        int status = sp ? atoi(sp + 1) : 0;
+        size_t next = (size_t)(end - r->data) + 4;
+
+        if (status >= 100 && status < 200) {
+            pos = next;
+            continue;
+        }
+
+        r->status = status;
+        r->body_off = next;
+        break;
+    }
+
+    /* Headers of the final response */
+    char *line = (char *)r->data + pos;
+    char *stop = (char *)r->data + r->body_off;
+
+    while (line < stop) {
+        char *eol = memchr(line, '\n', (size_t)(stop - line));
+        if (!eol)
+            break;
+
+        if (strncasecmp(line, "etag:", 5) == 0) {
+            char *v = line + 5;
+            while (*v == ' ')
+                v++;
+            size_t n = (size_t)(eol - v);
+            while (n > 0 && (v[n - 1] == '\r' || v[n - 1] == ' '))
+                n--;
+            if (n >= sizeof(r->etag))
+                n = sizeof(r->etag) - 1;
+            memcpy(r->etag, v, n);
+            r->etag[n] = '\0';
+        }
+
+        line = eol + 1;
+    }
+}
+
+/* Give a pipe end its place in the child (fds are close-on-exec) */
+static void child_fd(int fd, int target)
+{
+    if (fd == target)
+        fcntl(fd, F_SETFD, 0);
+    else
+        dup2(fd, target);
+}
+
+static bool run_curl_once(const S3Object *o, const char *method, const char *query,
+                          const char *range, const void *body, size_t body_len,
+                          S3Response *resp)
+{
+    memset(resp, 0, sizeof(*resp));
+
+    char url[4600];
+    object_url(o, query, url, sizeof(url));
+
+    char range_arg[64];
+    const char *argv[32];
+    int argc = 0;
+
+    argv[argc++] = "curl";
+    argv[argc++] = "-sS";
+    argv[argc++] = "--config";
+    argv[argc++] = "/dev/fd/3";
+    argv[argc++] = "-D";
+    argv[argc++] = "-";
+    argv[argc++] = "-o";
+    argv[argc++] = "-";
+    argv[argc++] = "--connect-timeout";
+    argv[argc++] = "30";
+    /* A transfer that stops moving counts as a network error */
+    argv[argc++] = "--speed-limit";
+    argv[argc++] = "1";
+    argv[argc++] = "--speed-time";
+    argv[argc++] = "120";
+    argv[argc++] = "-H";
+    argv[argc++] = "Expect:";
+
+    if (strcmp(method, "HEAD") == 0) {
+        argv[argc++] = "-I";
+    } else {
+        argv[argc++] = "-X";
+        argv[argc++] = method;
+    }
+
+    if (body) {
+        argv[argc++] = "-H";
+        argv[argc++] = "Content-Type: application/octet-stream";
+        argv[argc++] = "--data-binary";
+        argv[argc++] = "@-";
+    }
+
+    if (range) {
+        snprintf(range_arg, sizeof(range_arg), "%s", range);
+        argv[argc++] = "-r";
+        argv[argc++] = range_arg;
+    }
+
+    argv[argc++] = url;
+    argv[argc] = NULL;
+
+    /* Credentials travel through fd 3, not the command line */
+    char config[2048], line[1024];
+    char user[600];
+    snprintf(user, sizeof(user), "%s:%s",
+             getenv("AWS_ACCESS_KEY_ID"), getenv("AWS_SECRET_ACCESS_KEY"));
+    config_line(config, sizeof(config), "user", user);
+
+    char sigv4[128];
+    snprintf(sigv4, sizeof(sigv4), "aws:amz:%s:s3", o->region);
+    config_line(line, sizeof(line), "aws-sigv4", sigv4);
+    strncat(config, line, sizeof(config) - strlen(config) - 1);
+
+    const char *token = getenv("AWS_SESSION_TOKEN");
+    if (token && token[0] != '\0') {
+        char header[1024];
+        snprintf(header, sizeof(header), "x-amz-security-token: %s", token);
+        config_line(line, sizeof(line), "header", header);
+        strncat(config, line, sizeof(config) - strlen(config) - 1);
+    }
+
+    int in_pipe[2], out_pipe[2], cfg_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) != 0)
+        return false;
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        return false;
+    }
+    if (pipe2(cfg_pipe, O_CLOEXEC) != 0) {
+        close(in_pipe[0]);
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Out of the way first, so no target fd is overwritten early */
+        int in_fd = fcntl(in_pipe[0], F_DUPFD_CLOEXEC, 10);
+        int out_fd = fcntl(out_pipe[1], F_DUPFD_CLOEXEC, 10);
+        int cfg_fd = fcntl(cfg_pipe[0], F_DUPFD_CLOEXEC, 10);
+        child_fd(in_fd, STDIN_FILENO);
+        child_fd(out_fd, STDOUT_FILENO);
+        child_fd(cfg_fd, 3);
+        execvp("curl", (char *const *)argv);
+        _exit(127);
+    }
+
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    close(cfg_pipe[0]);
+
+    if (pid < 0) {
+        close(in_pipe[1]);
+        close(out_pipe[0]);
+        close(cfg_pipe[1]);
+        return false;
+    }
+
+    /* curl reads its config and all of stdin before it sends anything */
+    write_all(cfg_pipe[1], config, strlen(config));
+    close(cfg_pipe[1]);
+    memset(config, 0, sizeof(config));
+    memset(user, 0, sizeof(user));
+
+    if (body_len > 0)
+        write_all(in_pipe[1], body, body_len);
+    close(in_pipe[1]);
+
+    size_t cap = 0;
+    for (;;) {
+        if (resp->len == cap) {
+            size_t ncap = cap ? cap * 2 : 64 * 1024;
+            unsigned char *nd = realloc(resp->data, ncap + 1);
+            if (!nd)
+                break;
+            resp->data = nd;
+            cap = ncap;
+        }
+
+        ssize_t n = read(out_pipe[0], resp->data + resp->len, cap - resp->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        resp->len += (size_t)n;
+    }
+    close(out_pipe[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    if (!resp->data)
+        return false;
+    resp->data[resp->len] = '\0';
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        fprintf(stderr, RED "ERROR:" WHITE " curl is needed for S3 targets but could not be run.\n" RESET);
+        return false;
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+        parse_response(resp);
+
+    return true;
+}
+
+/* XML element text of the response body ("" if absent) */
+static void xml_value(const S3Response *r, const char *tag, char *out, size_t out_len)
+{
+    out[0] = '\0';
+    if (!r->data)
+        return;
+
+    char open_tag[64];
+    snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
+
+    const char *p = strstr((const char *)r->data + r->body_off, open_tag);
+    if (!p)
+        return;
+    p += strlen(open_tag);
+
+    const char *end = strchr(p, '<');
+    if (!end)
+        return;
+
+    size_t n = (size_t)(end - p);
+    if (n >= out_len)
+        n = out_len - 1;
+    memcpy(out, p, n);
+    out[n] = '\0';
+}
+
+/*
+ * One request with retries.  True for a 2xx response; otherwise the
+ * response (if any) is still returned for the caller to inspect.
+ */
+static bool s3_request(const S3Object *o, const char *method, const char *query,
+                       const char *range, const void *body, size_t body_len,
+                       bool quiet_404, S3Response *resp)
+{
+    for (int attempt = 0; attempt < S3_TRIES; attempt++) {
+        if (attempt > 0) {
+            response_free(resp);
+            sleep(1u << attempt);
+        }
+
+        if (!run_curl_once(o, method, query, range, body, body_len, resp))
+            return false;
+
+        if (resp->status >= 200 && resp->status < 300)
+            return true;
+
+        /* Client errors will not go away by asking again */
+        if (resp->status >= 400 && resp->status < 500)
+            break;
+    }
+
+    if (quiet_404 && resp->status == 404)
+        return false;
+
+    char code[128], message[512];
+    xml_value(resp, "Code", code, sizeof(code));
+    xml_value(resp, "Message", message, sizeof(message));
+
+    if (resp->status == 0)
+        fprintf(stderr, RED "ERROR:" WHITE " S3 %s s3://%s/%s: no response from %s\n" RESET,
+                method, o->bucket, o->key, o->endpoint);
+    else
+        fprintf(stderr, RED "ERROR:" WHITE " S3 %s s3://%s/%s: HTTP %d %s%s%s\n" RESET,
+                method, o->bucket, o->key, resp->status, code,
+                message[0] ? ": " : "", message);
+    return false;
+}
+
+long long s3_object_size(const S3Object *o)
+{
+    S3Response r;
+    long long size = -1;
+
+    if (s3_request(o, "HEAD", NULL, NULL, NULL, 0, true, &r)) {
+        const char *p = strcasestr((const char *)r.data, "\ncontent-length:");
+        if (p)
+            size = atoll(p + 16);
+    }
+
+    response_free(&r);
+    return size;
+}
+
+bool s3_put_file(const S3Object *o, const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read %s: %s\n" RESET, path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    unsigned char *data = NULL;
+    bool ok = fstat(fileno(fp), &st) == 0 &&
+              (data = malloc((size_t)st.st_size + 1)) != NULL &&
+              fread(data, 1, (size_t)st.st_size, fp) == (size_t)st.st_size;
+    fclose(fp);
+
+    S3Response r = { 0 };
+    if (ok)
+        ok = s3_request(o, "PUT", NULL, NULL, data, (size_t)st.st_size, false, &r);
+
+    response_free(&r);
+    free(data);
+    return ok;
+}
+
+bool s3_get_file(const S3Object *o, const char *path, bool missing_ok)
+{
+    S3Response r;
+    bool ok = s3_request(o, "GET", NULL, NULL, NULL, 0, missing_ok, &r);
+
+    if (ok) {
+        FILE *fp = fopen(path, "wb");
+        size_t n = r.len - r.body_off;
+        ok = fp && fwrite(r.data + r.body_off, 1, n, fp) == n;
+        if (fp && fclose(fp) != 0)
+            ok = false;
+        if (!ok)
+            fprintf(stderr, RED "ERROR:" WHITE " cannot write %s\n" RESET, path);
+    }
+
+    response_free(&r);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Multipart upload
+ * ------------------------------------------------------------- */
+typedef enum {
+    PART_FREE,
+    PART_FILLING,
+    PART_QUEUED,
+    PART_UPLOADING
+} PartState;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    int number;              /* 1-based part number */
+    PartState state;
+} S3Part;
+
+struct S3Writer {
+    S3Object obj;
+    char upload_id[512];     /* URL-encoded */
+    size_t part_size;
+
+    S3Part *parts;
+    int nparts;
+    S3Part *filling;
+    int next_number;
+
+    char (*etags)[160];      /* by part number - 1 */
+    uint64_t bytes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_t workers[S3_MAX_PARALLEL];
+    int nworkers;
+    bool stop;
+    bool failed;
+};
+
+static void *upload_main(void *arg)
+{
+    S3Writer *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+
+    for (;;) {
+        S3Part *p = NULL;
+        while (!w->stop) {
+            for (int i = 0; i < w->nparts && !p; i++)
+                if (w->parts[i].state == PART_QUEUED)
+                    p = &w->parts[i];
+            if (p)
+                break;
+            pthread_cond_wait(&w->cv, &w->lock);
+        }
+        if (!p)
+            break;
+
+        p->state = PART_UPLOADING;
+        pthread_mutex_unlock(&w->lock);
+
+        char query[640];
+        snprintf(query, sizeof(query), "partNumber=%d&uploadId=%s", p->number, w->upload_id);
+
+        S3Response r = { 0 };
+        bool ok = !w->failed &&
+                  s3_request(&w->obj, "PUT", query, NULL, p->data, p->len, false, &r) &&
+                  r.etag[0] != '\0';
+
+        pthread_mutex_lock(&w->lock);
+        if (ok)
+            snprintf(w->etags[p->number - 1], sizeof(w->etags[0]), "%s", r.etag);
+        else
+            w->failed = true;
+        response_free(&r);
+
+        p->state = PART_FREE;
+        p->len = 0;
+        pthread_cond_broadcast(&w->cv);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+S3Writer *s3_writer_open(const S3Object *o, int part_mb, int parallel)
+{
+    if (part_mb < S3_MIN_PART_MB)
+        part_mb = part_mb > 0 ? S3_MIN_PART_MB : S3_DEFAULT_PART_MB;
+    if (parallel <= 0)
+        parallel = S3_DEFAULT_PARALLEL;
+    if (parallel > S3_MAX_PARALLEL)
+        parallel = S3_MAX_PARALLEL;
+
+    S3Writer *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->obj = *o;
+    w->part_size = (size_t)part_mb * 1024 * 1024;
+    w->nparts = parallel + 1;
+    w->next_number = 1;
+    w->parts = calloc((size_t)w->nparts, sizeof(S3Part));
+    if (!w->parts)
+        w->nparts = 0;
+    w->etags = calloc(S3_MAX_PARTS, sizeof(w->etags[0]));
+
+    bool ok = w->parts && w->etags;
+    for (int i = 0; ok && i < w->nparts; i++)
+        ok = (w->parts[i].data = malloc(w->part_size)) != NULL;
+
+    S3Response r = { 0 };
+    if (ok)
+        ok = s3_request(o, "POST", "uploads=", NULL, "", 0, false, &r);
+
+    if (ok) {
+        char id[400];
+        xml_value(&r, "UploadId", id, sizeof(id));
+        url_encode(id, false, w->upload_id, sizeof(w->upload_id));
+        ok = id[0] != '\0';
+        if (!ok)
+            fprintf(stderr, RED "ERROR:" WHITE " S3 did not start an upload of s3://%s/%s\n" RESET,
+                    o->bucket, o->key);
+    }
+    response_free(&r);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cv, NULL);
+
+    for (int i = 0; ok && i < parallel; i++) {
+        if (pthread_create(&w->workers[i], NULL, upload_main, w) != 0)
+            ok = false;
+        else
+            w->nworkers++;
+    }
+
+    if (!ok) {
+        s3_writer_close(w, false, NULL);
+        return NULL;
+    }
+
+    return w;
+}
+
+/* Hand the filling part to the uploaders (lock held) */
+static bool queue_filling(S3Writer *w)
+{
+    if (w->next_number > S3_MAX_PARTS) {
+        fprintf(stderr, RED "\nERROR:" WHITE " the image needs more than %d parts; raise s3_part_mb.\n" RESET,
+                S3_MAX_PARTS);
+        w->failed = true;
+        return false;
+    }
+
+    w->filling->number = w->next_number++;
+    w->filling->state = PART_QUEUED;
+    w->filling = NULL;
+    pthread_cond_broadcast(&w->cv);
+    return true;
+}
+
+bool s3_writer_write(S3Writer *w, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (len > 0 && !w->failed) {
+        if (!w->filling) {
+            for (int i = 0; i < w->nparts && !w->filling; i++)
+                if (w->parts[i].state == PART_FREE)
+                    w->filling = &w->parts[i];
+            if (!w->filling) {
+                pthread_cond_wait(&w->cv, &w->lock);
+                continue;
+            }
+            w->filling->state = PART_FILLING;
+            w->filling->len = 0;
+        }
+
+        S3Part *f = w->filling;
+        size_t take = w->part_size - f->len;
+        if (take > len)
+            take = len;
+
+        /* The part is ours while it is filling */
+        pthread_mutex_unlock(&w->lock);
+        memcpy(f->data + f->len, p, take);
+        pthread_mutex_lock(&w->lock);
+
+        f->len += take;
+        w->bytes += take;
+        p += take;
+        len -= take;
+
+        if (f->len == w->part_size)
+            queue_filling(w);
+    }
+
+    bool ok = !w->failed;
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+bool s3_writer_close(S3Writer *w, bool success, uint64_t *bytes)
+{
+    if (!w)
+        return false;
+
+    pthread_mutex_lock(&w->lock);
+
+    /* Last part; an empty object is one empty part */
+    if (success && !w->failed && (w->filling || w->next_number == 1)) {
+        if (!w->filling) {
+            w->filling = &w->parts[0];
+            w->filling->len = 0;
+        }
+        queue_filling(w);
+    }
+
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < w->nparts; i++)
+            if (w->parts[i].state == PART_QUEUED || w->parts[i].state == PART_UPLOADING)
+                busy = true;
+        if (!busy)
+            break;
+        pthread_cond_wait(&w->cv, &w->lock);
+    }
+
+    w->stop = true;
+    pthread_cond_broadcast(&w->cv);
+    bool ok = success && !w->failed && w->upload_id[0] != '\0';
+    pthread_mutex_unlock(&w->lock);
+
+    for (int i = 0; i < w->nworkers; i++)
+        pthread_join(w->workers[i], NULL);
+
+    char query[600];
+    snprintf(query, sizeof(query), "uploadId=%s", w->upload_id);
+
+    if (ok) {
+        int count = w->next_number - 1;
+        size_t cap = 128 + (size_t)count * 256;
+        char *xml = malloc(cap);
+        ok = (xml != NULL);
+
+        if (ok) {
+            size_t o = (size_t)snprintf(xml, cap, "<CompleteMultipartUpload>");
+            for (int i = 0; i < count; i++)
+                o += (size_t)snprintf(xml + o, cap - o,
+                                      "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>",
+                                      i + 1, w->etags[i]);
+            snprintf(xml + o, cap - o, "</CompleteMultipartUpload>");
+
+            /* Completion can fail with 200 and an <Error> body */
+            S3Response r;
+            ok = s3_request(&w->obj, "POST", query, NULL, xml, strlen(xml), false, &r) &&
+                 !strstr((const char *)r.data + r.body_off, "<Error>");
+            if (!ok && r.status >= 200 && r.status < 300)
+                fprintf(stderr, RED "ERROR:" WHITE " S3 could not complete s3://%s/%s\n" RESET,
+                        w->obj.bucket, w->obj.key);
+            response_free(&r);
+            free(xml);
+        }
+    }
+
+    /* Leave no orphaned parts behind (they are billed) */
+    if (!ok && w->upload_id[0] != '\0') {
+        S3Response r;
+        s3_request(&w->obj, "DELETE", query, NULL, NULL, 0, false, &r);
+        response_free(&r);
+    }
+
+    if (bytes)
+        *bytes = w->bytes;
+
+    if (w->parts) {
+        for (int i = 0; i < w->nparts; i++)
+            free(w->parts[i].data);
+        free(w->parts);
+    }
+    free(w->etags);
+    pthread_cond_destroy(&w->cv);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Ranged reads
+ * ------------------------------------------------------------- */
+typedef enum {
+    RANGE_FREE,
+    RANGE_FETCHING,
+    RANGE_READY,
+    RANGE_FAILED
+} RangeState;
+
+typedef struct {
+    S3Response resp;         /* body is the range */
+    uint64_t seq;
+    size_t pos;
+    RangeState state;
+} S3Range;
+
+struct S3Reader {
+    S3Object obj;
+    uint64_t size;
+    uint64_t nranges;
+
+    S3Range *slots;
+    int nslots;
+
+    uint64_t next_fetch;
+    uint64_t consume;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    pthread_t workers[S3_MAX_PARALLEL];
+    int nworkers;
+    bool stop;
+};
+
+static void *fetch_main(void *arg)
+{
+    S3Reader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    for (;;) {
+        /* Range seq goes into slot seq % nslots once it is free */
+        while (!r->stop && r->next_fetch < r->nranges &&
+               r->slots[r->next_fetch % (uint64_t)r->nslots].state != RANGE_FREE)
+            pthread_cond_wait(&r->cv, &r->lock);
+
+        if (r->stop || r->next_fetch >= r->nranges)
+            break;
+
+        uint64_t seq = r->next_fetch++;
+        S3Range *s = &r->slots[seq % (uint64_t)r->nslots];
+        s->seq = seq;
+        s->pos = 0;
+        s->state = RANGE_FETCHING;
+        pthread_mutex_unlock(&r->lock);
+
+        uint64_t start = seq * S3_RANGE_SIZE;
+        uint64_t end = start + S3_RANGE_SIZE;
+        if (end > r->size)
+            end = r->size;
+
+        char range[64];
+        snprintf(range, sizeof(range), "%llu-%llu",
+                 (unsigned long long)start, (unsigned long long)(end - 1));
+
+        S3Response resp;
+        bool ok = s3_request(&r->obj, "GET", NULL, range, NULL, 0, false, &resp) &&
+                  resp.len - resp.body_off == end - start;
+        if (!ok && resp.status >= 200 && resp.status < 300)
+            fprintf(stderr, RED "ERROR:" WHITE " S3 returned a short range of s3://%s/%s\n" RESET,
+                    r->obj.bucket, r->obj.key);
+
+        pthread_mutex_lock(&r->lock);
+        s->resp = resp;
+        s->state = ok ? RANGE_READY : RANGE_FAILED;
+        pthread_cond_broadcast(&r->cv);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+S3Reader *s3_reader_open(const S3Object *o, int parallel, int mem_mb)
+{
+    long long size = s3_object_size(o);
+    if (size < 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read s3://%s/%s\n" RESET, o->bucket, o->key);
+        return NULL;
+    }
+
+    if (parallel <= 0)
+        parallel = S3_DEFAULT_PARALLEL;
+    if (parallel > S3_MAX_PARALLEL)
+        parallel = S3_MAX_PARALLEL;
+
+    S3Reader *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->obj = *o;
+    r->size = (uint64_t)size;
+    r->nranges = (r->size + S3_RANGE_SIZE - 1) / S3_RANGE_SIZE;
+
+    /* Every fetcher busy plus one range being consumed, within mem_mb */
+    r->nslots = (int)(((uint64_t)(mem_mb > 0 ? mem_mb : 256) * 1024 * 1024) / S3_RANGE_SIZE);
+    if (r->nslots < parallel + 1)
+        r->nslots = parallel + 1;
+
+    r->slots = calloc((size_t)r->nslots, sizeof(S3Range));
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cv, NULL);
+
+    bool ok = (r->slots != NULL);
+    for (int i = 0; ok && i < parallel; i++) {
+        if (pthread_create(&r->workers[i], NULL, fetch_main, r) != 0)
+            ok = false;
+        else
+            r->nworkers++;
+    }
+
+    if (!ok) {
+        s3_reader_close(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+ssize_t s3_reader_read(S3Reader *r, void *buf, size_t len)
+{
+    pthread_mutex_lock(&r->lock);
+
+    if (r->consume >= r->nranges) {
+        pthread_mutex_unlock(&r->lock);
+        return 0;
+    }
+
+    S3Range *s = &r->slots[r->consume % (uint64_t)r->nslots];
+    while (!(s->seq == r->consume && (s->state == RANGE_READY || s->state == RANGE_FAILED)))
+        pthread_cond_wait(&r->cv, &r->lock);
+
+    if (s->state == RANGE_FAILED) {
+        pthread_mutex_unlock(&r->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    size_t avail = s->resp.len - s->resp.body_off - s->pos;
+    if (len > avail)
+        len = avail;
+    memcpy(buf, s->resp.data + s->resp.body_off + s->pos, len);
+    s->pos += len;
+
+    if (s->pos == s->resp.len - s->resp.body_off) {
+        pthread_mutex_lock(&r->lock);
+        response_free(&s->resp);
+        s->state = RANGE_FREE;
+        r->consume++;
+        pthread_cond_broadcast(&r->cv);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    return (ssize_t)len;
+}
+
+void s3_reader_close(S3Reader *r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = true;
+    pthread_cond_broadcast(&r->cv);
+    pthread_mutex_unlock(&r->lock);
+
+    for (int i = 0; i < r->nworkers; i++)
+        pthread_join(r->workers[i], NULL);
+
+    if (r->slots) {
+        for (int i = 0; i < r->nslots; i++)
+            response_free(&r->slots[i].resp);
+        free(r->slots);
+    }
+    pthread_cond_destroy(&r->cv);
+    pthread_mutex_destroy(&r->lock);
+    free(r);
+}
@@ -0,0 +1,90 @@
+#ifndef S3_H
+#define S3_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * S3-compatible object storage (AWS S3, MinIO, Ceph RGW, ...).
+ *
+ * `imprintb --target s3://<bucket>/<prefix>` uploads the compressed
+ * image while it is produced: the stream is cut into parts of
+ * s3_part_mb that s3_parallel threads upload at the same time (a
+ * multipart upload), so memory stays at about s3_parallel + 1 parts.
+ * The checksum, frame index and metadata follow as small objects
+ * <key>.sha256, <key>.idx and <key>.json once the image is complete;
+ * a failed backup aborts the upload.
+ *
+ * `imprintr --image s3://<bucket>/<key>` reads the image with ranged
+ * GETs on several threads ahead of the restore.
+ *
+ * Requests are made by curl(1), 7.75 or newer for --aws-sigv4, which
+ * also handles TLS.  Credentials come from AWS_ACCESS_KEY_ID,
+ * AWS_SECRET_ACCESS_KEY and, if set, AWS_SESSION_TOKEN; they reach
+ * curl through a pipe, never its command line.  The endpoint is
+ * s3_endpoint from the config, else AWS_ENDPOINT_URL, else AWS for
+ * s3_region.  Buckets are addressed path-style, which AWS and MinIO
+ * both accept (e.g. s3_endpoint=http://localhost:9000 for MinIO).
+ */
+
+#define S3_PREFIX            "s3://"
+
+#define S3_DEFAULT_REGION    "us-east-1"
+#define S3_DEFAULT_PART_MB   32
+#define S3_DEFAULT_PARALLEL  4
+#define S3_MAX_PARALLEL      32
+
+typedef struct {
+    char endpoint[256];      /* scheme://host[:port] */
+    char region[64];
+    char bucket[256];
+    char key[1024];          /* no leading slash */
+} S3Object;
+
+/*
+ * Parse "s3://<bucket>/<key>" and fill in endpoint and region.  False
+ * if `url` is not an S3 URL or has no key.
+ */
+bool s3_parse_url(const char *url, S3Object *out);
+
+/* False, with a message, unless credentials are in the environment. */
+bool s3_check_credentials(void);
+
+/* Object size, -1 if it does not exist or cannot be reached. */
+long long s3_object_size(const S3Object *o);
+
+/* Upload a (small) local file as the object. */
+bool s3_put_file(const S3Object *o, const char *path);
+
+/*
+ * Download the object into a local file.  A missing object is an
+ * error unless missing_ok (then false without a message).
+ */
+bool s3_get_file(const S3Object *o, const char *path, bool missing_ok);
+
+typedef struct S3Writer S3Writer;
+
+/* Start a multipart upload of the object (0 = defaults). */
+S3Writer *s3_writer_open(const S3Object *o, int part_mb, int parallel);
+
+bool s3_writer_write(S3Writer *w, const void *buf, size_t len);
+
+/*
+ * Complete the upload on success, abort it otherwise.  bytes (may be
+ * NULL) receives the object size.
+ */
+bool s3_writer_close(S3Writer *w, bool success, uint64_t *bytes);
+
+typedef struct S3Reader S3Reader;
+
+/* Read the object with `parallel` ranged GETs ahead, within mem_mb. */
+S3Reader *s3_reader_open(const S3Object *o, int parallel, int mem_mb);
+
+/* Same contract as image_reader_read() (see prefetch.h). */
+ssize_t s3_reader_read(S3Reader *r, void *buf, size_t len);
+
+void s3_reader_close(S3Reader *r);
+
+#endif /* S3_H */
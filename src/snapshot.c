@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+
+#include "snapshot.h"
+#include "cbt.h"
+#include "config.h"
+#include "utils.h"
+#include "colors.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/wait.h>
+
+/* -------------------------------------------------------------
+ * Command helpers
+ * ------------------------------------------------------------- */
+static bool run_quiet(const char *cmd)
+{
+    int rc = system(cmd);
+    return rc != -1 && WIFEXITED(rc) && WEXITSTATUS(rc) == 0;
+}
+
+static bool run_logged(const char *cmd)
+{
+    if (run_quiet(cmd))
+        return true;
+
+    fprintf(stderr, RED "ERROR:" WHITE " command failed: %s\n" RESET, cmd);
+    return false;
+}
+
+/* First line of a command's output, trimmed */
+static bool capture_line(const char *cmd, char *out, size_t out_len)
+{
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return false;
+
+    bool ok = fgets(out, (int)out_len, fp) != NULL;
+    int rc = pclose(fp);
+
+    if (!ok || rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0)
+        return false;
+
+    char *p = out;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    memmove(out, p, strlen(p) + 1);
+    out[strcspn(out, "\n")] = '\0';
+    return out[0] != '\0';
+}
+
+/* Whole output of a command (caller frees) */
+static char *capture_all(const char *cmd)
+{
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return NULL;
+
+    size_t len = 0, cap = 4096;
+    char *buf = malloc(cap);
+    size_t n;
+
+    while (buf && (n = fread(buf + len, 1, cap - len - 1, fp)) > 0) {
+        len += n;
+        if (cap - len < 1024) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+
+    int rc = pclose(fp);
+    if (!buf || rc == -1 || !WIFEXITED(rc) || WEXITSTATUS(rc) != 0 || len == 0) {
+        free(buf);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+    return buf;
+}
+
+/* Feed `input` to a command's stdin (keeps keys off the command line) */
+static bool run_with_input(const char *cmd, const char *input)
+{
+    FILE *fp = popen(cmd, "w");
+    if (!fp)
+        return false;
+
+    fputs(input, fp);
+    int rc = pclose(fp);
+    return rc != -1 && WIFEXITED(rc) && WEXITSTATUS(rc) == 0;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint64_t cow_size_for(uint64_t source_bytes)
+{
+    uint64_t cow = source_bytes / 100 * (uint64_t)gx_config.snapshot_cow_percent;
+    uint64_t min = (uint64_t)SNAPSHOT_MIN_COW_MB << 20;
+
+    if (cow < min)
+        cow = min;
+    return cow & ~((4ull << 20) - 1);
+}
+
+/* -------------------------------------------------------------
+ * LVM
+ * ------------------------------------------------------------- */
+static bool lvm_snapshot(const char *origin, Snapshot *s)
+{
+    char cmd[1024], line[512];
+
+    snprintf(cmd, sizeof(cmd),
+             "lvs --noheadings --nosuffix --units b --separator '|' "
+             "-o vg_name,lv_name,segtype,lv_size '%s' 2>/dev/null", origin);
+    if (!is_program_available("lvs") || !capture_line(cmd, line, sizeof(line)))
+        return false;
+
+    char vg[128], lv[128], segtype[32];
+    unsigned long long lv_size;
+    if (sscanf(line, "%127[^|]|%127[^|]|%31[^|]|%llu", vg, lv, segtype, &lv_size) != 4)
+        return false;
+
+    snprintf(s->vg, sizeof(s->vg), "%s", vg);
+    snprintf(s->lv, sizeof(s->lv), SNAPSHOT_PREFIX "%.100s", lv);
+    snprintf(s->device, sizeof(s->device), "/dev/%s/%s", s->vg, s->lv);
+
+    double t0 = now_ms();
+
+    if (strcmp(segtype, "thin") == 0) {
+        s->kind = SNAP_LVM_THIN;
+
+        snprintf(cmd, sizeof(cmd), "lvcreate -q -s -n '%s' '%s/%s'", s->lv, vg, lv);
+        if (!run_logged(cmd))
+            return false;
+    } else {
+        s->kind = SNAP_LVM;
+
+        snprintf(cmd, sizeof(cmd),
+                 "vgs --noheadings --nosuffix --units b -o vg_free '%s' 2>/dev/null", vg);
+        unsigned long long vg_free = 0;
+        if (capture_line(cmd, line, sizeof(line)))
+            vg_free = strtoull(line, NULL, 10);
+
+        s->cow_bytes = cow_size_for(lv_size);
+        if (s->cow_bytes > vg_free)
+            s->cow_bytes = vg_free & ~((4ull << 20) - 1);
+
+        if (s->cow_bytes < ((uint64_t)SNAPSHOT_MIN_COW_MB << 20)) {
+            fprintf(stderr,
+                    RED "ERROR:" WHITE " volume group %s has %.0f MB free; a snapshot needs at least %d MB.\n" RESET,
+                    vg, vg_free / (1024.0 * 1024.0), SNAPSHOT_MIN_COW_MB);
+            return false;
+        }
+
+        snprintf(cmd, sizeof(cmd), "lvcreate -q -s -L %llub -n '%s' '%s/%s'",
+                 (unsigned long long)s->cow_bytes, s->lv, vg, lv);
+        if (!run_logged(cmd))
+            return false;
+    }
+
+    fprintf(stderr, YELLOW "LVM snapshot %s/%s created in %.0f ms\n" RESET,
+            vg, s->lv, now_ms() - t0);
+
+    if (s->kind == SNAP_LVM_THIN) {
+        /* Thin snapshots skip activation by default */
+        snprintf(cmd, sizeof(cmd), "lvchange -q -ay -Ky '%s/%s'", vg, s->lv);
+        if (!run_logged(cmd)) {
+            snapshot_remove(s);
+            return false;
+        }
+
+        ThinDevice thin;
+        if (thin_probe(s->device, &thin))
+            snprintf(s->watch_dev, sizeof(s->watch_dev), "%s", thin.pool_dev);
+    } else {
+        snprintf(s->watch_dev, sizeof(s->watch_dev), "%s", s->device);
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Plain device-mapper: snapshot-origin switch
+ * ------------------------------------------------------------- */
+static void dm_cleanup(Snapshot *s, bool base_created)
+{
+    char cmd[512];
+
+    if (base_created) {
+        snprintf(cmd, sizeof(cmd), "dmsetup remove '%s'", s->base_name);
+        run_logged(cmd);
+    }
+    if (s->cow_loop[0]) {
+        snprintf(cmd, sizeof(cmd), "losetup -d '%s'", s->cow_loop);
+        run_logged(cmd);
+        s->cow_loop[0] = '\0';
+    }
+    if (s->cow_file[0]) {
+        unlink(s->cow_file);
+        s->cow_file[0] = '\0';
+    }
+    free(s->origin_table);
+    s->origin_table = NULL;
+}
+
+static bool dm_snapshot(const char *origin, const char *cow_dir, Snapshot *s)
+{
+    char cmd[1280], name[128];
+
+    snprintf(cmd, sizeof(cmd), "dmsetup info -c --noheadings -o name '%s' 2>/dev/null", origin);
+    if (!is_program_available("dmsetup") || !capture_line(cmd, name, sizeof(name)))
+        return false;
+
+    if (!is_program_available("losetup")) {
+        fprintf(stderr, RED "ERROR:" WHITE " losetup is needed for device-mapper snapshots.\n" RESET);
+        return false;
+    }
+
+    s->kind = SNAP_DM;
+
+    /* The COW file must not sit on the filesystem being snapshotted */
+    struct stat dst, ost;
+    if (stat(cow_dir, &dst) != 0 || stat(origin, &ost) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot stat %s or %s\n" RESET, cow_dir, origin);
+        return false;
+    }
+    if (dst.st_dev == ost.st_rdev) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " the backup directory is on %s itself; the snapshot's\n"
+                "       copy-on-write file has to live on another filesystem.\n" RESET, origin);
+        return false;
+    }
+
+    long long size = get_partition_size_bytes(origin);
+    struct statvfs vfs;
+    if (size <= 0 || statvfs(cow_dir, &vfs) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot size the snapshot of %s\n" RESET, origin);
+        return false;
+    }
+
+    uint64_t sectors = (uint64_t)size / 512;
+    uint64_t avail = (uint64_t)vfs.f_bavail * vfs.f_frsize / 10 * 9;
+
+    s->cow_bytes = cow_size_for((uint64_t)size);
+    if (s->cow_bytes > avail)
+        s->cow_bytes = avail & ~((4ull << 20) - 1);
+
+    if (s->cow_bytes < ((uint64_t)SNAPSHOT_MIN_COW_MB << 20)) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " %s has %.0f MB free; a snapshot needs at least %d MB.\n" RESET,
+                cow_dir, avail / (1024.0 * 1024.0), SNAPSHOT_MIN_COW_MB);
+        return false;
+    }
+
+    snprintf(cmd, sizeof(cmd), "dmsetup table --showkeys '%s'", origin);
+    s->origin_table = capture_all(cmd);
+    if (!s->origin_table) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot read the table of %s\n" RESET, origin);
+        return false;
+    }
+
+    snprintf(s->base_name, sizeof(s->base_name), "imprint-base-%.100s", name);
+    snprintf(s->snap_name, sizeof(s->snap_name), SNAPSHOT_PREFIX "%.100s", name);
+    snprintf(s->device, sizeof(s->device), "/dev/mapper/%s", s->snap_name);
+    snprintf(s->watch_dev, sizeof(s->watch_dev), "%s", s->device);
+
+    /* Sparse COW file on a loop device */
+    snprintf(s->cow_file, sizeof(s->cow_file), "%s/.%s.cow", cow_dir, s->snap_name);
+    int fd = open(s->cow_file, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)s->cow_bytes) != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s: %s\n" RESET, s->cow_file, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        else
+            s->cow_file[0] = '\0';   /* not ours: leave it */
+        dm_cleanup(s, false);
+        return false;
+    }
+    close(fd);
+
+    snprintf(cmd, sizeof(cmd), "losetup -f --show '%s'", s->cow_file);
+    if (!capture_line(cmd, s->cow_loop, sizeof(s->cow_loop))) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot attach %s to a loop device\n" RESET, s->cow_file);
+        s->cow_loop[0] = '\0';
+        dm_cleanup(s, false);
+        return false;
+    }
+
+    /* A second mapping identical to the origin's becomes the snapshot base */
+    snprintf(cmd, sizeof(cmd), "dmsetup create '%s'", s->base_name);
+    if (!run_with_input(cmd, s->origin_table)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot create %s\n" RESET, s->base_name);
+        dm_cleanup(s, false);
+        return false;
+    }
+
+    /*
+     * Frozen window: suspend (which freezes the mounted filesystem),
+     * create the snapshot, redirect the origin through
+     * snapshot-origin, resume.
+     */
+    double t0 = now_ms();
+
+    snprintf(cmd, sizeof(cmd), "dmsetup suspend '%s'", origin);
+    if (!run_logged(cmd)) {
+        dm_cleanup(s, true);
+        return false;
+    }
+
+    char snap_cmd[1024], load_cmd[1024];
+    snprintf(snap_cmd, sizeof(snap_cmd),
+             "dmsetup create '%s' --table '0 %llu snapshot /dev/mapper/%s %s N 8'",
+             s->snap_name, (unsigned long long)sectors, s->base_name, s->cow_loop);
+    snprintf(load_cmd, sizeof(load_cmd),
+             "dmsetup load '%s' --table '0 %llu snapshot-origin /dev/mapper/%s'",
+             origin, (unsigned long long)sectors, s->base_name);
+
+    bool snap_ok = run_logged(snap_cmd);
+    bool load_ok = snap_ok && run_logged(load_cmd);
+
+    if (!load_ok) {
+        snprintf(cmd, sizeof(cmd), "dmsetup clear '%s'", origin);
+        run_quiet(cmd);
+    }
+
+    snprintf(cmd, sizeof(cmd), "dmsetup resume '%s'", origin);
+    bool resumed = run_logged(cmd);
+    double frozen = now_ms() - t0;
+
+    if (!resumed) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " %s could not be resumed.  Run 'dmsetup resume %s' now;\n"
+                "       the filesystem on it is frozen.\n" RESET, origin, origin);
+        return false;
+    }
+
+    if (!load_ok) {
+        if (snap_ok) {
+            snprintf(cmd, sizeof(cmd), "dmsetup remove '%s'", s->snap_name);
+            run_logged(cmd);
+        }
+        dm_cleanup(s, true);
+        return false;
+    }
+
+    fprintf(stderr,
+            YELLOW "Device-mapper snapshot %s created; %s was frozen for %.1f ms\n" RESET,
+            s->snap_name, origin, frozen);
+    return true;
+}
+
+/* -------------------------------------------------------------
+ * Public API
+ * ------------------------------------------------------------- */
+bool snapshot_create(const char *origin, const char *cow_dir, Snapshot *s)
+{
+    memset(s, 0, sizeof(*s));
+    snprintf(s->origin, sizeof(s->origin), "%s", origin);
+
+    if (geteuid() != 0) {
+        fprintf(stderr, RED "ERROR:" WHITE " --snapshot requires root privileges.\n" RESET);
+        return false;
+    }
+
+    bool ok = lvm_snapshot(origin, s);
+    if (!ok && s->lv[0] == '\0')
+        ok = dm_snapshot(origin, cow_dir, s);
+
+    if (!ok && s->lv[0] == '\0' && s->kind != SNAP_DM)
+        fprintf(stderr,
+                RED "ERROR:" WHITE " --snapshot needs an LVM logical volume or another\n"
+                "       device-mapper device (e.g. /dev/mapper/cryptroot); %s is neither.\n" RESET,
+                origin);
+
+    if (ok && s->cow_bytes)
+        fprintf(stderr, YELLOW "Snapshot copy-on-write space: %.0f MB (%d%% of the source)\n" RESET,
+                s->cow_bytes / (1024.0 * 1024.0), gx_config.snapshot_cow_percent);
+
+    return ok;
+}
+
+bool snapshot_remove(Snapshot *s)
+{
+    char cmd[1024];
+    bool ok = true;
+
+    if (s->kind == SNAP_LVM || s->kind == SNAP_LVM_THIN) {
+        if (s->lv[0] == '\0')
+            return true;
+        snprintf(cmd, sizeof(cmd), "lvremove -q -f '%s/%s'", s->vg, s->lv);
+        ok = run_logged(cmd);
+        s->lv[0] = '\0';
+        return ok;
+    }
+
+    if (!s->origin_table)
+        return true;
+
+    /* Put the original mapping back, then drop the snapshot */
+    snprintf(cmd, sizeof(cmd), "dmsetup suspend '%s'", s->origin);
+    ok = run_logged(cmd);
+
+    snprintf(cmd, sizeof(cmd), "dmsetup load '%s'", s->origin);
+    if (ok && !run_with_input(cmd, s->origin_table)) {
+        fprintf(stderr, RED "ERROR:" WHITE " cannot restore the table of %s\n" RESET, s->origin);
+        ok = false;
+    }
+
+    snprintf(cmd, sizeof(cmd), "dmsetup resume '%s'", s->origin);
+    if (!run_logged(cmd))
+        ok = false;
+
+    if (!ok) {
+        fprintf(stderr,
+                RED "ERROR:" WHITE " %s still runs through the snapshot; %s and %s\n"
+                "       are left in place.  Do not reboot before restoring its table.\n" RESET,
+                s->origin, s->snap_name, s->base_name);
+        return false;
+    }
+
+    snprintf(cmd, sizeof(cmd), "dmsetup remove '%s'", s->snap_name);
+    ok = run_logged(cmd);
+    dm_cleanup(s, true);
+    return ok;
+}
+
+/* -------------------------------------------------------------
+ * Overflow monitor
+ * ------------------------------------------------------------- */
+
+/* Fill level in percent, -1 if unknown; *overflow on an invalid snapshot */
+static int snapshot_usage(const Snapshot *s, bool *overflow)
+{
+    char cmd[512], line[512];
+    snprintf(cmd, sizeof(cmd), "dmsetup status '%s' 2>/dev/null", s->watch_dev);
+
+    *overflow = false;
+    if (!capture_line(cmd, line, sizeof(line)))
+        return -1;
+
+    char target[32];
+    if (sscanf(line, "%*u %*u %31s", target) != 1)
+        return -1;
+
+    unsigned long long used = 0, total = 0;
+
+    if (strcmp(target, "snapshot") == 0) {
+        if (strstr(line, "Invalid") || strstr(line, "Overflow")) {
+            *overflow = true;
+            return 100;
+        }
+        if (sscanf(line, "%*u %*u %*s %llu/%llu", &used, &total) != 2)
+            return -1;
+    } else if (strcmp(target, "thin-pool") == 0) {
+        if (strstr(line, "out_of_data_space") || strstr(line, "Fail")) {
+            *overflow = true;
+            return 100;
+        }
+        if (sscanf(line, "%*u %*u %*s %*u %*s %llu/%llu", &used, &total) != 2)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    return total ? (int)(used * 100 / total) : 0;
+}
+
+static void *monitor_main(void *arg)
+{
+    Snapshot *s = arg;
+    int warned = 0;
+
+    while (!s->stop) {
+        bool overflow;
+        int pct = snapshot_usage(s, &overflow);
+
+        if (pct > s->peak_percent)
+            s->peak_percent = pct;
+
+        if (overflow && !s->overflow) {
+            s->overflow = true;
+            fprintf(stderr,
+                    RED "\nERROR:" WHITE " the snapshot of %s ran out of copy-on-write space.\n" RESET,
+                    s->origin);
+        } else if (pct >= 50 && pct / 10 > warned) {
+            warned = pct / 10;
+            fprintf(stderr, YELLOW "\nSnapshot %s %d%% full\n" RESET,
+                    s->kind == SNAP_LVM_THIN ? "pool" : "copy-on-write space", pct);
+        }
+
+        for (int i = 0; i < 5 && !s->stop; i++)
+            usleep(100 * 1000);
+    }
+    return NULL;
+}
+
+void snapshot_monitor_start(Snapshot *s)
+{
+    s->stop = false;
+    s->overflow = false;
+    s->peak_percent = 0;
+    s->monitoring = s->watch_dev[0] != '\0' &&
+                    pthread_create(&s->monitor, NULL, monitor_main, s) == 0;
+}
+
+bool snapshot_monitor_stop(Snapshot *s)
+{
+    if (s->monitoring) {
+        s->stop = true;
+        pthread_join(s->monitor, NULL);
+        s->monitoring = false;
+    }
+
+    /* A last look: the snapshot may have filled up since the last poll */
+    bool overflow = false;
+    int pct = s->watch_dev[0] ? snapshot_usage(s, &overflow) : -1;
+    if (pct > s->peak_percent)
+        s->peak_percent = pct;
+    if (overflow)
+        s->overflow = true;
+
+    if (s->peak_percent >= 0 && s->watch_dev[0])
+        fprintf(stderr, WHITE "Snapshot %s peaked at %d%%\n" RESET,
+                s->kind == SNAP_LVM_THIN ? "pool usage" : "copy-on-write usage",
+                s->peak_percent);
+
+    return !s->overflow;
+}
@@ -0,0 +1,86 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Short-lived snapshots for live backups (`imprintb --snapshot`).
+ *
+ * A mounted source is backed up from a point-in-time snapshot that is
+ * removed again afterwards:
+ *
+ *   - thick LVM LVs: `lvcreate -s` with a COW area of
+ *     snapshot_cow_percent of the LV (at least SNAPSHOT_MIN_COW_MB,
+ *     at most the free space of the VG)
+ *   - thin LVM LVs: a thin snapshot; writes draw on the pool
+ *   - other device-mapper devices (e.g. dm-crypt): the device is
+ *     switched to a snapshot-origin target and a dm snapshot is
+ *     created with its COW on a sparse loop file in the backup
+ *     directory
+ *
+ * The filesystem is frozen only while the origin is suspended:
+ * device-mapper suspend freezes a mounted filesystem exactly like
+ * fsfreeze, for the few milliseconds the table switch takes.  Calling
+ * fsfreeze around lvcreate is avoided on purpose; lvcreate writes to
+ * /etc/lvm, which may live on the frozen filesystem.
+ *
+ * While the backup runs a monitor thread watches the COW area (or the
+ * thin pool) and reports its fill level; an overflowed snapshot makes
+ * the backup fail.
+ */
+
+#define SNAPSHOT_DEFAULT_COW_PERCENT 10
+#define SNAPSHOT_MIN_COW_MB          256
+
+#define SNAPSHOT_PREFIX "imprint-snap-"
+
+typedef enum {
+    SNAP_LVM,
+    SNAP_LVM_THIN,
+    SNAP_DM
+} SnapshotKind;
+
+typedef struct {
+    SnapshotKind kind;
+    char origin[256];           /* the mounted source */
+    char device[272];           /* snapshot to read */
+    uint64_t cow_bytes;         /* 0 for thin snapshots */
+
+    /* LVM */
+    char vg[128];
+    char lv[128];               /* snapshot LV name */
+
+    /* Plain device-mapper */
+    char *origin_table;         /* original table, restored on removal */
+    char base_name[160];        /* copy of the original mapping */
+    char snap_name[160];
+    char cow_file[1200];
+    char cow_loop[64];
+
+    /* Monitor */
+    char watch_dev[272];        /* dm device whose status shows usage */
+    pthread_t monitor;
+    bool monitoring;
+    volatile bool stop;
+    volatile bool overflow;
+    volatile int peak_percent;
+} Snapshot;
+
+/*
+ * Create a snapshot of the mounted dm/LVM device `origin`.  cow_dir
+ * holds the COW file of plain dm snapshots and must not be on the
+ * filesystem being snapshotted.
+ */
+bool snapshot_create(const char *origin, const char *cow_dir, Snapshot *s);
+
+void snapshot_monitor_start(Snapshot *s);
+
+/* Stop monitoring; false if the snapshot overflowed. */
+bool snapshot_monitor_stop(Snapshot *s);
+
+/* Remove the snapshot and restore the origin's mapping. */
+bool snapshot_remove(Snapshot *s);
+
+#endif /* SNAPSHOT_H */
@@ -1,4 +1,5 @@
 #include "sniffer.h"
+#include "rawimage.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -302,6 +303,17 @@ sniff_image(const char *path, SniffResult *out)
                 return false;
             }
 
+            /* Imprint raw image: block size and device size are in the header */
+            if (memcmp(headerbuf, RAW_MAGIC, RAW_MAGIC_SIZE) == 0) {
+                strcpy(out->backend, RAW_BACKEND);
+                memcpy(&out->block_size, headerbuf + 16, sizeof(out->block_size));
+                memcpy(&out->fs_bytes, headerbuf + 24, sizeof(out->fs_bytes));
+                out->used_bytes = 0;
+                out->valid   = true;
+                out->chunked = infer_chunked_from_path(path);
+                return true;
+            }
+
             if (memcmp(headerbuf, "partclone-image", 15) != 0) {
                 strcpy(out->backend, "unknown");
                 out->valid   = true;
@@ -0,0 +1,75 @@
+#include "stripe.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+void stripe_dirs_load(const char *image_base, StripeDirs *out)
+{
+    out->count = 0;
+
+    char meta_path[1100];
+    snprintf(meta_path, sizeof(meta_path), "%s.json", image_base);
+
+    FILE *fp = fopen(meta_path, "r");
+    if (!fp)
+        return;
+
+    /* "stripe_dirs": ["/mnt/a", "/mnt/b"], on one line */
+    char line[STRIPE_MAX_DIRS * 1100];
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strstr(line, "\"stripe_dirs\"");
+        if (!p)
+            continue;
+
+        p = strchr(p, '[');
+        while (p && out->count < STRIPE_MAX_DIRS) {
+            char *start = strchr(p, '"');
+            if (!start)
+                break;
+            start++;
+
+            char *end = strchr(start, '"');
+            if (!end)
+                break;
+
+            size_t len = (size_t)(end - start);
+            if (len >= sizeof(out->dirs[0]))
+                len = sizeof(out->dirs[0]) - 1;
+
+            memcpy(out->dirs[out->count], start, len);
+            out->dirs[out->count][len] = '\0';
+            out->count++;
+            p = end + 1;
+        }
+        break;
+    }
+
+    fclose(fp);
+}
+
+void stripe_chunk_path(const StripeDirs *s, const char *image_base,
+                       unsigned idx, char *out, size_t out_len)
+{
+    snprintf(out, out_len, "%s.%03u", image_base, idx);
+
+    if (!s || s->count == 0 || access(out, F_OK) == 0)
+        return;
+
+    const char *name = strrchr(image_base, '/');
+    name = name ? name + 1 : image_base;
+
+    /* Where round-robin put it, then anywhere else */
+    for (int i = 0; i < s->count; i++) {
+        int d = (int)((idx + (unsigned)i) % (unsigned)s->count);
+        char path[2200];
+        snprintf(path, sizeof(path), "%s/%s.%03u", s->dirs[d], name, idx);
+        if (access(path, F_OK) == 0) {
+            snprintf(out, out_len, "%s", path);
+            return;
+        }
+    }
+
+    snprintf(out, out_len, "%s.%03u", image_base, idx);
+}
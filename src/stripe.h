@@ -0,0 +1,41 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Striped chunk sets.
+ *
+ * `imprintb --stripe <dir>` spreads the chunk files of an image over
+ * the --target directory and the stripe directories, round-robin:
+ * chunk i is <stripe_dirs[i % n]>/<image name>.NNN, and each directory
+ * is written by a thread of its own.  The .json, .sha256 and .idx stay
+ * next to chunk 0; the metadata lists the directories in order
+ * ("stripe_dirs", the target directory first) and the stripe of each
+ * chunk ("chunk_stripes").
+ *
+ * Readers look for a chunk next to the image first and then in each
+ * stripe directory, so a striped image still restores after its
+ * chunks were gathered into one place.
+ */
+
+#define STRIPE_MAX_DIRS 8
+
+typedef struct {
+    int count;                       /* 0 = not striped */
+    char dirs[STRIPE_MAX_DIRS][1024];
+} StripeDirs;
+
+/* Stripe directories recorded in <image_base>.json (count 0 if none). */
+void stripe_dirs_load(const char *image_base, StripeDirs *out);
+
+/*
+ * Path of chunk idx of a chunk set: <image_base>.NNN if it exists,
+ * else the first stripe directory that holds it, else
+ * <image_base>.NNN (for the error message).
+ */
+void stripe_chunk_path(const StripeDirs *s, const char *image_base,
+                       unsigned idx, char *out, size_t out_len);
+
+#endif /* STRIPE_H */
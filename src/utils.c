@@ -17,6 +17,8 @@
 #include <openssl/sha.h>
 #include <sys/statfs.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 
 bool gx_no_gui = false;
 
@@ -284,6 +286,19 @@ bool write_metadata(const char *image_path,
                     int effective_chunk_mb,
                     int chunk_count)
 
+{
+    return write_metadata_ex(image_path, device, fs_type, backend, compression,
+                             effective_chunk_mb, chunk_count, NULL);
+}
+
+bool write_metadata_ex(const char *image_path,
+                       const char *device,
+                       const char *fs_type,
+                       const char *backend,
+                       const char *compression,
+                       int effective_chunk_mb,
+                       int chunk_count,
+                       const MetadataExtra *extra)
 {
     if (!image_path || !device || !fs_type || !backend)
         return false;
@@ -304,8 +319,12 @@ bool write_metadata(const char *image_path,
     char checksum[65] = {0};
     bool have_checksum = false;
 
-    FILE *cfp = fopen(checksum_file, "r");
-    if (cfp) {
+    FILE *cfp = NULL;
+
+    if (extra && extra->checksum) {
+        snprintf(checksum, sizeof(checksum), "%s", extra->checksum);
+        have_checksum = true;
+    } else if ((cfp = fopen(checksum_file, "r")) != NULL) {
         if (fscanf(cfp, "%64s", checksum) == 1) {
             have_checksum = true;
         }
@@ -332,7 +351,14 @@ bool write_metadata(const char *image_path,
     bool chunked = (effective_chunk_mb > 0);
     int  chunk_size_mb = effective_chunk_mb;
 
-    FILE *fp = fopen(meta_path, "w");
+    /*
+     * The metadata marks a complete image: it is written last, and a
+     * crash leaves either the old file or the whole new one.
+     */
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", meta_path);
+
+    FILE *fp = fopen(tmp_path, "w");
     if (!fp)
         return false;
 
@@ -344,17 +370,66 @@ bool write_metadata(const char *image_path,
     fprintf(fp, "  \"backend\": \"%s\",\n", backend);
     fprintf(fp, "  \"compression\": \"%s\",\n", compression);
     fprintf(fp, "  \"partition_size_bytes\": %lld,\n", part_size);
-    fprintf(fp, "  \"image_filename\": \"%s\",\n", image_path);
+    fprintf(fp, "  \"image_filename\": \"%s\",\n",
+            extra && extra->location ? extra->location : image_path);
     fprintf(fp, "  \"image_checksum_sha256\": \"%s\",\n", checksum);
     fprintf(fp, "  \"chunked\": %s,\n", chunked ? "true" : "false");
     fprintf(fp, "  \"chunk_size_mb\": %d,\n", chunk_size_mb);
     fprintf(fp, "  \"chunk_count\": %d,\n", chunk_count);
     fprintf(fp, "  \"source_disk\": \"%s\",\n", parent_disk);
     fprintf(fp, "  \"source_partition_layout\": %s,\n", layout_json);
+    if (extra && extra->cbt_era >= 0)
+        fprintf(fp, "  \"cbt_era\": %lld,\n", extra->cbt_era);
+    if (extra && extra->thin_pool) {
+        fprintf(fp, "  \"thin_pool\": \"%s\",\n", extra->thin_pool);
+        fprintf(fp, "  \"thin_dev_id\": %lld,\n", extra->thin_dev_id);
+    }
+    if (extra && extra->parent_image) {
+        fprintf(fp, "  \"parent_image\": \"%s\",\n", extra->parent_image);
+        if (extra->parent_cbt_era >= 0)
+            fprintf(fp, "  \"parent_cbt_era\": %lld,\n", extra->parent_cbt_era);
+        if (extra->parent_thin_dev_id >= 0)
+            fprintf(fp, "  \"parent_thin_dev_id\": %lld,\n", extra->parent_thin_dev_id);
+    }
+    if (extra && extra->rescue) {
+        fprintf(fp, "  \"unrecovered_bytes\": %llu,\n",
+                (unsigned long long)extra->unrecovered_bytes);
+        fprintf(fp, "  \"unrecovered_ranges\": [");
+        for (size_t i = 0; i < extra->unrecovered_count; i++)
+            fprintf(fp, "%s\n    [%llu, %llu]", i ? "," : "",
+                    (unsigned long long)extra->unrecovered[2 * i],
+                    (unsigned long long)extra->unrecovered[2 * i + 1]);
+        fprintf(fp, "%s],\n", extra->unrecovered_count ? "\n  " : "");
+    }
+    if (extra && extra->copy_count > 0) {
+        fprintf(fp, "  \"copies\": [");
+        for (int i = 0; i < extra->copy_count; i++)
+            fprintf(fp, "%s\n    { \"path\": \"%s\", \"complete\": %s }", i ? "," : "",
+                    extra->copies[i], extra->copy_ok[i] ? "true" : "false");
+        fprintf(fp, "\n  ],\n");
+    }
+    if (extra && extra->stripe_count > 0) {
+        /* One line each: stripe_dirs_load() reads it back */
+        fprintf(fp, "  \"stripe_dirs\": [");
+        for (int i = 0; i < extra->stripe_count; i++)
+            fprintf(fp, "%s\"%s\"", i ? ", " : "", extra->stripe_dirs[i]);
+        fprintf(fp, "],\n");
+        fprintf(fp, "  \"chunk_stripes\": [");
+        for (int i = 0; i < chunk_count; i++)
+            fprintf(fp, "%s%d", i ? ", " : "", i % extra->stripe_count);
+        fprintf(fp, "],\n");
+    }
     fprintf(fp, "  \"notes\": \"\"\n");
     fprintf(fp, "}\n");
 
-    fclose(fp);
+    bool ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, meta_path) != 0) {
+        unlink(tmp_path);
+        return false;
+    }
+    gx_fsync_parent(meta_path);
 
     // printf(YELLOW "\nMetadata written successfully.\n" RESET);
     return true;
@@ -390,6 +465,72 @@ int run_command(char *const argv[])
     return -1;
 }
 
+/* ---------------------------------------------------------
+ * Start `sh -c cmd` with pipes on its stdin and stdout.
+ * Either pipe can be skipped by passing NULL.  The parent's
+ * ends are close-on-exec so later children do not inherit
+ * them (a stray copy would keep the pipe from ever closing).
+ * --------------------------------------------------------- */
+pid_t spawn_filter(const char *cmd, int *to_child, int *from_child)
+{
+    int in_pipe[2] = { -1, -1 };
+    int out_pipe[2] = { -1, -1 };
+
+    if (to_child && pipe(in_pipe) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    if (from_child && pipe(out_pipe) != 0) {
+        perror("pipe");
+        if (to_child) {
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+        }
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        for (int i = 0; i < 2; i++) {
+            if (in_pipe[i] >= 0)
+                close(in_pipe[i]);
+            if (out_pipe[i] >= 0)
+                close(out_pipe[i]);
+        }
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (to_child) {
+            dup2(in_pipe[0], STDIN_FILENO);
+            close(in_pipe[0]);
+            close(in_pipe[1]);
+        }
+        if (from_child) {
+            dup2(out_pipe[1], STDOUT_FILENO);
+            close(out_pipe[0]);
+            close(out_pipe[1]);
+        }
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    if (to_child) {
+        close(in_pipe[0]);
+        fcntl(in_pipe[1], F_SETFD, FD_CLOEXEC);
+        *to_child = in_pipe[1];
+    }
+    if (from_child) {
+        close(out_pipe[1]);
+        fcntl(out_pipe[0], F_SETFD, FD_CLOEXEC);
+        *from_child = out_pipe[0];
+    }
+
+    return pid;
+}
+
 /* ---------------------------------------------------------
  * Dependency checks
  * --------------------------------------------------------- */
@@ -535,6 +676,35 @@ bool get_fs_type(const char *device, char *fs_type, int fs_type_len)
 }
 
 
+bool gx_fsync_path(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+
+bool gx_fsync_parent(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+
+    char *slash = strrchr(dir, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir)
+        dir[1] = '\0';
+    else
+        *slash = '\0';
+
+    return gx_fsync_path(dir);
+}
+
 bool gx_test_fifo_capability(const char *dir)
 {
     if (!dir)
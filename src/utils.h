@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /*
  * Basic command execution utilities and dependency checks.
@@ -12,6 +14,10 @@
 /* Run a command and return its exit status (0 = success). */
 int run_command(char *const argv[]);
 
+/* Start `sh -c cmd` with optional pipes to its stdin / from its stdout.
+ * Returns the child's pid, or -1 on failure. */
+pid_t spawn_filter(const char *cmd, int *to_child, int *from_child);
+
 /* Check if a program exists in PATH (using `which`). */
 bool is_program_available(const char *name);
 
@@ -39,8 +45,58 @@ bool write_metadata(const char *image_path,
                     int effective_chunk_mb,
                     int chunk_count);
 
+/*
+ * Changed-block tracking fields (see cbt.h).  cbt_era < 0 means the
+ * source was not an era device, thin_pool == NULL that it was not a
+ * thin LV; parent_image == NULL means a full image.  For rescue
+ * backups, unrecovered lists the offset/length pairs that could not be
+ * read (see rescue.h).  copies lists every destination of a mirrored
+ * backup with copy_ok telling which of them completed.  stripe_dirs
+ * lists the directories of a striped chunk set (see stripe.h).
+ * location, if set, is recorded as the image filename instead of
+ * image_path (an image stored elsewhere, e.g. s3://).  checksum, if
+ * set, is recorded instead of reading <image>.sha256 (the header of a
+ * --target - stream is written before the checksum is known).
+ */
+typedef struct {
+    long long cbt_era;           /* first era NOT contained in this image */
+    const char *parent_image;    /* image this delta applies on top of */
+    long long parent_cbt_era;
+    const char *thin_pool;
+    long long thin_dev_id;
+    long long parent_thin_dev_id;
+    bool rescue;
+    const uint64_t *unrecovered;
+    size_t unrecovered_count;
+    uint64_t unrecovered_bytes;
+    const char *const *copies;
+    const bool *copy_ok;
+    int copy_count;
+    const char *const *stripe_dirs;
+    int stripe_count;
+    const char *location;
+    const char *checksum;
+} MetadataExtra;
+
+bool write_metadata_ex(const char *image_path,
+                       const char *device,
+                       const char *fs_type,
+                       const char *backend,
+                       const char *compression,
+                       int effective_chunk_mb,
+                       int chunk_count,
+                       const MetadataExtra *extra);
+
 bool compute_sha256(const char *filepath, char *out, size_t out_len);
 
+/*
+ * fsync a file or directory by name, or the directory holding path, so
+ * that files created or renamed there survive a crash.  False (errno
+ * set) if it fails.
+ */
+bool gx_fsync_path(const char *path);
+bool gx_fsync_parent(const char *path);
+
 long long get_partition_size_bytes(const char *device);
 
 void gx_ensure_terminal(int argc, char **argv);
@@ -7,18 +7,43 @@
 #   • a single Imprint image file (e.g., image.zst, image.lz4)
 #   • a chunked Imprint image (image.000, image.001, ...)
 #
+# or, with --round-trip, backs up a test partition, restores it to a
+# scratch device and checks that both hold the same files.
+#
 # Usage:
 #     verify_img <imagefile or chunk>
+#     verify_img --round-trip <source> <scratch> <workdir> [check ...]
 #
 # Examples:
 #     verify_img backup-2025-01-10.zst
 #     verify_img backup-2025-01-10.img.zst.000
+#     sudo verify_img --round-trip /dev/loop0 /dev/loop1 /tmp/rt native
 #
 # The script automatically:
 #   • detects chunked vs non-chunked images
-#   • reconstructs chunked streams in correct order
+#   • reconstructs chunked streams in correct order, also from stripe dirs
 #   • uses pv for progress when available
 #   • falls back to sha256sum without progress
+#
+# Round-trip checks (all of them when none is named):
+#   native          restore with imprintr's own applier; partclone must not run
+#   framed          zstd and lz4, single-file and chunked, each with its .idx
+#   mirror          two --target copies, byte-identical and both marked complete
+#   stripe          chunks spread over --stripe directories, restored from --target
+#   repo            two backups into one repo://, the second adding no chunks
+#   s3              a backup to s3://$S3_BUCKET/..., and an interrupted one that
+#                   leaves no metadata object; skipped without AWS_ENDPOINT_URL,
+#                   AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and S3_BUCKET
+#   tcp             a backup to imprint-serve on 127.0.0.1:$TCP_PORT (default 17493)
+#   mcast           imprint-cast to $MCAST_RECEIVERS (default 3) imprintr receivers,
+#                   each restoring to a sparse file on a loop device
+#   pipe            imprintb --target - | imprintr --image -; a damaged stream must fail
+#   verify-writes   a chunked backup read back with --verify-writes, then restored
+#
+# The round trip runs as root on an unmounted source partition, and
+# the scratch device is overwritten.  imprintb, imprintr, imprint-serve
+# and imprint-cast are taken from the script's directory unless
+# IMPRINTB / IMPRINTR / IMPRINT_SERVE / IMPRINT_CAST are set.
 # ------------------------------------------------------------
 
 # --- Colors ---------------------------------------------------------------
@@ -34,84 +59,505 @@ RESET="\e[0m"
 if [ -z "$1" ]; then
     echo
     echo -e "${YELLOW}Usage:${RESET} $0 <imagefile or chunk>"
+    echo -e "       $0 --round-trip <source> <scratch> <workdir> [check ...]"
     echo
     echo "Examples:"
     echo "  $0 myimage.zst"
     echo "  $0 myimage.img.zst.000"
+    echo "  $0 --round-trip /dev/loop0 /dev/loop1 /tmp/rt native"
     exit 1
 fi
 
-input="$1"
+# --- Checksum verification ------------------------------------------------
 
-# Strip trailing .000 if user passed a chunk filename
-base="${input%.000}"
+# Chunk files of a chunk set in order, also from the stripe directories
+# listed in its metadata; a chunk next to the image wins, as in imprintr
+list_chunks() {
+    local base="$1" name dir
 
-# --- Check for checksum file ---------------------------------------------
+    name=$(basename "$base")
+    {
+        ls "${base}".[0-9][0-9][0-9] 2>/dev/null
+        grep -o '"stripe_dirs": \[[^]]*\]' "$base.json" 2>/dev/null |
+            grep -o '"[^"]*"' | sed '1d; s/"//g' |
+            while read -r dir; do
+                ls "$dir/$name".[0-9][0-9][0-9] 2>/dev/null
+            done
+    } | awk '{ n = $0; sub(/.*\./, "", n); if (!seen[n]++) print n "\t" $0 }' |
+        sort -n -k1,1 | cut -f2-
+}
 
-if [ ! -f "$base.sha256" ]; then
-    echo -e "${RED}Error:${RESET} Expected checksum file '$base.sha256' not found."
-    exit 1
-fi
+verify_checksum() {
+    local input="$1"
 
-expected=$(cut -d' ' -f1 "$base.sha256")
+    # Strip trailing .000 if user passed a chunk filename
+    local base="${input%.000}"
 
-# --- Detect chunked vs single-file ---------------------------------------
+    # --- Check for checksum file ---
 
-chunks=$(ls "${base}".[0-9][0-9][0-9] 2>/dev/null | sort -V)
+    if [ ! -f "$base.sha256" ]; then
+        echo -e "${RED}Error:${RESET} Expected checksum file '$base.sha256' not found."
+        return 1
+    fi
 
-if [ -n "$chunks" ]; then
-    mode="chunked"
-else
-    mode="single"
-fi
+    local expected
+    expected=$(cut -d' ' -f1 "$base.sha256")
 
-# --- Verification ---------------------------------------------------------
+    # --- Detect chunked vs single-file ---
 
-if [ "$mode" = "chunked" ]; then
-    echo
-    echo -e "${BLUE}Verifying chunked image:${RESET} $base"
-    echo
-    echo -e "${YELLOW}Found chunks:${RESET}"
-    echo "$chunks"
-    echo
+    local chunks mode computed
+    chunks=$(list_chunks "$base")
 
-    if command -v pv >/dev/null 2>&1; then
-        total_size=$(du -cb $chunks | awk 'END{print $1}')
-        computed=$(cat $chunks | pv -s "$total_size" | sha256sum | cut -d' ' -f1)
+    if [ -n "$chunks" ]; then
+        mode="chunked"
     else
-        computed=$(cat $chunks | sha256sum | cut -d' ' -f1)
+        mode="single"
     fi
 
-else
-    image="$base"
+    # --- Verification ---
 
-    if [ ! -f "$image" ]; then
-        echo -e "${RED}Error:${RESET} Image file not found: $image"
-        exit 1
+    if [ "$mode" = "chunked" ]; then
+        echo
+        echo -e "${BLUE}Verifying chunked image:${RESET} $base"
+        echo
+        echo -e "${YELLOW}Found chunks:${RESET}"
+        echo "$chunks"
+        echo
+
+        if command -v pv >/dev/null 2>&1; then
+            local total_size
+            total_size=$(du -cb $chunks | awk 'END{print $1}')
+            computed=$(cat $chunks | pv -s "$total_size" | sha256sum | cut -d' ' -f1)
+        else
+            computed=$(cat $chunks | sha256sum | cut -d' ' -f1)
+        fi
+
+    else
+        local image="$base"
+
+        if [ ! -f "$image" ]; then
+            echo -e "${RED}Error:${RESET} Image file not found: $image"
+            return 1
+        fi
+
+        echo -e "${BLUE}Verifying single image:${RESET} $image"
+        echo
+
+        if command -v pv >/dev/null 2>&1; then
+            local size
+            size=$(stat -c%s "$image")
+            computed=$(pv -s "$size" "$image" | sha256sum | cut -d' ' -f1)
+        else
+            computed=$(sha256sum "$image" | cut -d' ' -f1)
+        fi
     fi
 
-    echo -e "${BLUE}Verifying single image:${RESET} $image"
+    # --- Compare ---
+
+    echo
+    echo "Expected: $expected"
+    echo "Computed: $computed"
     echo
 
-    if command -v pv >/dev/null 2>&1; then
-        size=$(stat -c%s "$image")
-        computed=$(pv -s "$size" "$image" | sha256sum | cut -d' ' -f1)
+    if [ "$expected" = "$computed" ]; then
+        echo -e "${GREEN}✔ Verification successful — image matches original${RESET}"
+        return 0
     else
-        computed=$(sha256sum "$image" | cut -d' ' -f1)
+        echo -e "${RED}❌ Verification failed — checksum mismatch${RESET}"
+        return 1
     fi
-fi
+}
 
-# --- Compare --------------------------------------------------------------
+# --- Round trip -----------------------------------------------------------
 
-echo
-echo "Expected: $expected"
-echo "Computed: $computed"
-echo
+round_trip_checks="native framed mirror stripe repo s3 tcp mcast pipe verify-writes"
 
-if [ "$expected" = "$computed" ]; then
-    echo -e "${GREEN}✔ Verification successful — image matches original${RESET}"
-    exit 0
-else
-    echo -e "${RED}❌ Verification failed — checksum mismatch${RESET}"
-    exit 1
+script_dir=$(dirname "$(readlink -f "$0")")
+IMPRINTB="${IMPRINTB:-$script_dir/imprintb}"
+IMPRINTR="${IMPRINTR:-$script_dir/imprintr}"
+IMPRINT_SERVE="${IMPRINT_SERVE:-$script_dir/imprint-serve}"
+IMPRINT_CAST="${IMPRINT_CAST:-$script_dir/imprint-cast}"
+
+fail() {
+    echo -e "${RED}Error:${RESET} $*"
+    return 1
+}
+
+# Zero the scratch device, so that a restore that writes nothing cannot pass
+wipe_scratch() {
+    blkdiscard -f -z "$scratch" 2>/dev/null ||
+        dd if=/dev/zero of="$scratch" bs=4M oflag=direct status=none 2>/dev/null
+    return 0
+}
+
+# Mount source and scratch read-only and compare every file
+same_files() {
+    local a="$work/mnt-source" b="$work/mnt-scratch" rc
+
+    mkdir -p "$a" "$b"
+    mount -o ro "$source" "$a" || return 1
+    if ! mount -o ro "$scratch" "$b"; then
+        umount "$a"
+        return 1
+    fi
+
+    diff -r --no-dereference "$a" "$b"
+    rc=$?
+
+    umount "$b"
+    umount "$a"
+    return $rc
+}
+
+# Restore an image to the scratch device and compare it with the source
+restore_and_compare() {
+    "$IMPRINTR" --image "$1" --target "$scratch" --force ||
+        fail "imprintr could not restore $1" || return 1
+    same_files ||
+        fail "$scratch does not hold the same files as $source"
+}
+
+# native: partclone stubs that fail make a fallback to partclone fail the check
+check_native() {
+    local stub="$work/no-partclone" name
+
+    mkdir -p "$stub"
+    for name in extfs ntfs btrfs xfs fat exfat f2fs hfsp dd; do
+        printf '#!/bin/sh\necho "partclone.%s must not run in this check" >&2\nexit 1\n' \
+            "$name" > "$stub/partclone.$name"
+        chmod +x "$stub/partclone.$name"
+    done
+
+    "$IMPRINTB" --source "$source" --target "$work/native" --compress lz4 --force ||
+        fail "imprintb could not back up $source" || return 1
+    verify_checksum "$work/native.img.lz4" || return 1
+
+    PATH="$stub:$PATH" restore_and_compare "$work/native.img.lz4"
+}
+
+# framed: every framed layout has a frame index and restores to the same files
+check_framed() {
+    local comp ext chunk image
+
+    for comp in zstd lz4; do
+        ext="$comp"
+        [ "$comp" = "zstd" ] && ext="zst"
+
+        for chunk in 0 64; do
+            "$IMPRINTB" --source "$source" --target "$work/framed-$comp-$chunk" \
+                --compress "$comp" --chunk "$chunk" --force ||
+                fail "imprintb could not back up $source" || return 1
+
+            image="$work/framed-$comp-$chunk.img.$ext"
+            [ -s "$image.idx" ] || fail "no frame index $image.idx" || return 1
+            [ "$chunk" -eq 0 ] || image="$image.000"
+
+            verify_checksum "$image" || return 1
+            wipe_scratch
+            restore_and_compare "$image" || return 1
+            rm -f "$work/framed-$comp-$chunk".*
+        done
+    done
+}
+
+# mirror: every copy holds the same bytes and is listed as complete
+check_mirror() {
+    local a="$work/mirror-a" b="$work/mirror-b" file name complete
+
+    rm -rf "$a" "$b"
+    mkdir -p "$a" "$b"
+    "$IMPRINTB" --source "$source" --target "$a/mirror" --target "$b/mirror" \
+        --compress lz4 --chunk 64 --force ||
+        fail "imprintb could not back up $source to two copies" || return 1
+
+    for file in "$a"/mirror.img.lz4.[0-9][0-9][0-9] "$a/mirror.img.lz4.idx" \
+                "$a/mirror.img.lz4.sha256"; do
+        name=$(basename "$file")
+        [ -f "$file" ] || fail "the first copy has no $name" || return 1
+        cmp -s "$file" "$b/$name" || fail "the copies of $name differ" || return 1
+    done
+
+    for file in "$a/mirror.img.lz4.json" "$b/mirror.img.lz4.json"; do
+        complete=$(grep -c '"complete": true' "$file")
+        [ "$complete" -eq 2 ] && ! grep -q '"complete": false' "$file" ||
+            fail "$file does not list both copies as complete" || return 1
+    done
+
+    verify_checksum "$b/mirror.img.lz4.000" || return 1
+    restore_and_compare "$b/mirror.img.lz4.000" || return 1
+    rm -rf "$a" "$b"
+}
+
+# stripe: the chunks land in every stripe directory and restore from the target
+check_stripe() {
+    local dir i image="$work/stripe-0/stripe.img.lz4.000"
+
+    rm -rf "$work"/stripe-[0-2]
+    mkdir -p "$work"/stripe-{0,1,2}
+    "$IMPRINTB" --source "$source" --target "$work/stripe-0/stripe" \
+        --stripe "$work/stripe-1" --stripe "$work/stripe-2" \
+        --compress lz4 --chunk 64 --force ||
+        fail "imprintb could not back up $source over three stripes" || return 1
+
+    for i in 0 1 2; do
+        dir="$work/stripe-$i"
+        ls "$dir"/stripe.img.lz4.[0-9][0-9][0-9] >/dev/null 2>&1 ||
+            fail "no chunk was written to $dir" || return 1
+    done
+
+    verify_checksum "$image" || return 1
+    restore_and_compare "$image" || return 1
+    rm -rf "$work"/stripe-[0-2]
+}
+
+# repo: a second backup of the same source is all duplicates
+check_repo() {
+    local repo="$work/repo" before after
+
+    rm -rf "$repo"
+    "$IMPRINTB" --source "$source" --target "repo://$repo/first" --force ||
+        fail "imprintb could not back up $source" || return 1
+    before=$(find "$repo/chunks" -type f | wc -l)
+
+    "$IMPRINTB" --source "$source" --target "repo://$repo/second" --force ||
+        fail "imprintb could not back up $source" || return 1
+    after=$(find "$repo/chunks" -type f | wc -l)
+
+    [ "$before" -gt 0 ] || fail "the repository holds no chunks" || return 1
+    [ "$after" -eq "$before" ] ||
+        fail "the second backup added $((after - before)) chunks" || return 1
+
+    restore_and_compare "repo://$repo/second" || return 1
+    rm -rf "$repo"
+}
+
+# HTTP status of a signed request for an object of $S3_BUCKET
+s3_status() {
+    local method="$1" key="$2" region="${AWS_REGION:-${AWS_DEFAULT_REGION:-us-east-1}}"
+
+    curl -s -o /dev/null -w '%{http_code}' -X "$method" \
+        --aws-sigv4 "aws:amz:$region:s3" \
+        --user "$AWS_ACCESS_KEY_ID:$AWS_SECRET_ACCESS_KEY" \
+        ${AWS_SESSION_TOKEN:+-H "x-amz-security-token: $AWS_SESSION_TOKEN"} \
+        "${AWS_ENDPOINT_URL%/}/$S3_BUCKET/$key"
+}
+
+# s3: the image restores from the bucket, and a failed backup publishes no metadata
+check_s3() {
+    local prefix="imprint-verify-$$" pid suffix
+
+    if [ -z "$AWS_ENDPOINT_URL" ] || [ -z "$AWS_ACCESS_KEY_ID" ] ||
+       [ -z "$AWS_SECRET_ACCESS_KEY" ] || [ -z "$S3_BUCKET" ]; then
+        echo -e "${YELLOW}Skipped:${RESET} s3 needs AWS_ENDPOINT_URL, AWS_ACCESS_KEY_ID," \
+            "AWS_SECRET_ACCESS_KEY and S3_BUCKET"
+        return 2
+    fi
+
+    "$IMPRINTB" --source "$source" --target "s3://$S3_BUCKET/$prefix/full" \
+        --compress lz4 --force ||
+        fail "imprintb could not back up $source to s3://$S3_BUCKET/$prefix" || return 1
+    restore_and_compare "s3://$S3_BUCKET/$prefix/full.img.lz4" || return 1
+
+    # Interrupted once the upload is under way: nothing may look complete
+    "$IMPRINTB" --source "$source" --target "s3://$S3_BUCKET/$prefix/failed" \
+        --compress lz4 --force &
+    pid=$!
+    sleep 1
+    kill -TERM "$pid" 2>/dev/null
+    if wait "$pid"; then
+        fail "the backup finished before it could be interrupted; use a larger source"
+        return 1
+    fi
+    [ "$(s3_status HEAD "$prefix/failed.img.lz4.json")" = "404" ] ||
+        fail "a failed backup left s3://$S3_BUCKET/$prefix/failed.img.lz4.json" || return 1
+
+    for suffix in "" .sha256 .idx .json; do
+        s3_status DELETE "$prefix/full.img.lz4$suffix" > /dev/null
+        s3_status DELETE "$prefix/failed.img.lz4$suffix" > /dev/null
+    done
+}
+
+# tcp: the image goes to imprint-serve and restores from it
+check_tcp() {
+    local port="${TCP_PORT:-17493}" srv="$work/srv" pid i rc
+
+    rm -rf "$srv"
+    mkdir -p "$srv"
+    "$IMPRINT_SERVE" --dir "$srv" --listen "127.0.0.1:$port" > "$work/serve.log" 2>&1 &
+    pid=$!
+
+    for i in $(seq 50); do
+        (exec 3<>"/dev/tcp/127.0.0.1/$port") 2>/dev/null && break
+        kill -0 "$pid" 2>/dev/null || break
+        sleep 0.1
+    done
+
+    if ! kill -0 "$pid" 2>/dev/null; then
+        cat "$work/serve.log"
+        fail "imprint-serve did not start on 127.0.0.1:$port"
+        return 1
+    fi
+
+    "$IMPRINTB" --source "$source" --target "tcp://127.0.0.1:$port/tcp" \
+        --compress lz4 --force &&
+        restore_and_compare "tcp://127.0.0.1:$port/tcp.img.lz4"
+    rc=$?
+    if [ "$rc" -ne 0 ]; then
+        fail "the image did not make the round trip through imprint-serve"
+        rc=1
+    fi
+
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    [ "$rc" -eq 0 ] && rm -rf "$srv" "$work/serve.log"
+    return $rc
+}
+
+# mcast: one send restores every receiver, each to its own loop device
+check_mcast() {
+    local count="${MCAST_RECEIVERS:-3}" group="239.255.74.93:17494"
+    local image="$work/mcast.img.lz4" size i rc=0
+    local -a devs=() pids=()
+
+    "$IMPRINTB" --source "$source" --target "$work/mcast" --compress lz4 --force ||
+        fail "imprintb could not back up $source" || return 1
+    size=$(blockdev --getsize64 "$source")
+
+    for i in $(seq "$count"); do
+        truncate -s "$size" "$work/mcast-$i.bin"
+        devs[i]=$(losetup -f --show "$work/mcast-$i.bin") ||
+            { fail "no free loop device for receiver $i"; rc=1; break; }
+        # imprintr wants the terminal on stdout; errors go to a log each
+        "$IMPRINTR" --image "mcast://$group" --target "${devs[i]}" --force \
+            2> "$work/mcast-$i.log" &
+        pids[i]=$!
+    done
+
+    if [ "$rc" -eq 0 ]; then
+        timeout 600 "$IMPRINT_CAST" --image "$image" --group "$group" --receivers "$count" ||
+            { fail "imprint-cast did not reach every receiver"; rc=1; }
+    fi
+
+    for i in "${!pids[@]}"; do
+        if ! wait "${pids[i]}"; then
+            cat "$work/mcast-$i.log"
+            fail "receiver $i could not restore from mcast://$group"
+            rc=1
+        elif ! scratch="${devs[i]}" same_files; then
+            fail "receiver $i does not hold the same files as $source"
+            rc=1
+        fi
+    done
+
+    for i in "${!devs[@]}"; do
+        losetup -d "${devs[i]}"
+    done
+    rm -f "$work"/mcast-*.bin "$work"/mcast-*.log "$work"/mcast.*
+    return $rc
+}
+
+# pipe: the stream restores through a pipe, and a flipped byte is caught
+check_pipe() {
+    local stream="$work/pipe.stream" status size off byte
+
+    "$IMPRINTB" --source "$source" --target - --compress lz4 --force |
+        "$IMPRINTR" --image - --target "$scratch" --force
+    status="${PIPESTATUS[0]}${PIPESTATUS[1]}"
+    [ "$status" = "00" ] ||
+        fail "the stream did not restore through a pipe" || return 1
+    same_files ||
+        fail "$scratch does not hold the same files as $source" || return 1
+
+    "$IMPRINTB" --source "$source" --target - --compress lz4 --force > "$stream" ||
+        fail "imprintb could not write the stream" || return 1
+
+    size=$(stat -c%s "$stream")
+    off=$((size / 2))
+    byte=$(od -An -tu1 -j "$off" -N1 "$stream" | tr -d ' ')
+    printf "\\$(printf '%03o' $((255 - byte)))" |
+        dd of="$stream" bs=1 seek="$off" conv=notrunc status=none
+
+    wipe_scratch
+    if "$IMPRINTR" --image - --target "$scratch" --force < "$stream"; then
+        fail "a damaged stream was restored without an error"
+        return 1
+    fi
+    rm -f "$stream"
+}
+
+# verify-writes: chunks read back during the backup restore as written
+check_verify_writes() {
+    local image="$work/verify-writes.img.lz4.000"
+
+    "$IMPRINTB" --source "$source" --target "$work/verify-writes" \
+        --compress lz4 --chunk 64 --verify-writes --force ||
+        fail "imprintb --verify-writes failed on $source" || return 1
+
+    verify_checksum "$image" || return 1
+    restore_and_compare "$image" || return 1
+    rm -f "$work/verify-writes".*
+}
+
+round_trip() {
+    source="$1"
+    scratch="$2"
+    work="$3"
+
+    if [ -z "$work" ]; then
+        echo -e "${YELLOW}Usage:${RESET} $0 --round-trip <source> <scratch> <workdir> [check ...]"
+        exit 1
+    fi
+    shift 3
+
+    [ "$(id -u)" -eq 0 ] || { fail "the round trip needs root"; exit 1; }
+    [ -b "$source" ] || { fail "$source is not a block device"; exit 1; }
+    [ -b "$scratch" ] || { fail "$scratch is not a block device"; exit 1; }
+    [ "$(readlink -f "$source")" != "$(readlink -f "$scratch")" ] ||
+        { fail "source and scratch are the same device"; exit 1; }
+    mkdir -p "$work" || exit 1
+
+    local checks="$*" check failed="" skipped=""
+    [ -n "$checks" ] || checks="$round_trip_checks"
+
+    for check in $checks; do
+        case " $round_trip_checks " in
+            *" $check "*) ;;
+            *) fail "unknown check '$check' (one of: $round_trip_checks)"; exit 1 ;;
+        esac
+    done
+
+    for check in $checks; do
+        echo
+        echo -e "${BLUE}Round trip:${RESET} $check"
+        wipe_scratch
+
+        "check_${check//-/_}"
+        case $? in
+            0) echo -e "${GREEN}✔ $check${RESET}" ;;
+            2) echo -e "${YELLOW}– $check skipped${RESET}"
+               skipped="$skipped $check" ;;
+            *) echo -e "${RED}❌ $check${RESET}"
+               failed="$failed $check" ;;
+        esac
+    done
+
+    echo
+    if [ -n "$failed" ]; then
+        echo -e "${RED}❌ Round trip failed:${RESET}$failed"
+        return 1
+    fi
+    echo -e "${GREEN}✔ Round trip successful — every restore matches $source${RESET}"
+    [ -z "$skipped" ] || echo -e "${YELLOW}Skipped:${RESET}$skipped"
+    return 0
+}
+
+# --- Main -----------------------------------------------------------------
+
+if [ "$1" = "--round-trip" ]; then
+    shift
+    round_trip "$@"
+    exit $?
 fi
+
+verify_checksum "$1"
+exit $?